@@ -0,0 +1,265 @@
+#ifndef KDD_SCPPS_ACCEPT_LIMITER_HPP
+#define KDD_SCPPS_ACCEPT_LIMITER_HPP
+
+#include <boost/asio/ip/address.hpp>
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+namespace kdd::scpps
+{
+    struct accept_limits
+    {
+        std::uint32_t max_connections_per_window = 50;
+        std::chrono::milliseconds window{1000};
+        std::uint32_t max_concurrent_connections = 32;
+    }; // struct accept_limits
+
+    // Per-source connection limits, checked right after accept() and before the
+    // parent forks a child for the connection.
+    //
+    // Connection rates are estimated with a count-min sketch, which needs a
+    // fixed amount of memory no matter how many sources connect. Sketch
+    // estimates can only be too high, so an innocent source that collides with
+    // a busy one must not be rejected on the sketch alone. A source whose
+    // estimate passes half the limit is therefore promoted to a small exact table
+    // of heavy hitters, and only the exact count is used to reject it. When the
+    // table is full, promoting a source evicts the lightest entry. An evicted
+    // source that is promoted again continues from its sketch estimate.
+    //
+    // Concurrent connections are tracked exactly. Their number is bounded by the
+    // number of live children, so the table stays small.
+    //
+    // All state is owned by the parent's accept loop, which runs on a single
+    // thread, so none of it needs a lock.
+    class accept_limiter
+    {
+    public:
+        enum class verdict
+        {
+            accept,
+            reject_rate,
+            reject_concurrency
+        }; // enum class verdict
+
+        explicit accept_limiter(accept_limits _limits = {})
+            : limits_{_limits}
+            , sketch_(sketch_depth * sketch_width)
+            , heavy_hitters_(heavy_hitter_slots)
+            , window_start_{clock::now()}
+        {
+        } // accept_limiter (constructor)
+
+        // Decides whether a new connection from _source may be served. An
+        // accepted connection counts against the source's concurrency limit until
+        // release() is called for it.
+        verdict admit(const boost::asio::ip::address& _source)
+        {
+            roll_window();
+
+            const auto key = make_key(_source);
+            const auto estimate = bump_sketch(key);
+
+            // A heavy hitter is counted exactly from the moment it is promoted,
+            // which happens once its estimate reaches half the limit. It is
+            // therefore allowed the other half before it is rejected.
+            const auto promote_at = limits_.max_connections_per_window / 2;
+
+            if (estimate > promote_at) {
+                auto& entry = heavy_hitter(key, estimate - promote_at - 1);
+
+                if (++entry.count > limits_.max_connections_per_window - promote_at) {
+                    ++rejected_;
+                    return verdict::reject_rate;
+                }
+            }
+
+            auto& active = active_[key];
+            if (active >= limits_.max_concurrent_connections) {
+                ++rejected_;
+                return verdict::reject_concurrency;
+            }
+
+            ++active;
+
+            return verdict::accept;
+        } // admit
+
+        // Associates the child serving an admitted connection with its source.
+        void track(pid_t _child, const boost::asio::ip::address& _source)
+        {
+            children_[_child] = make_key(_source);
+        } // track
+
+        // Called when a reaped child has finished serving its connection.
+        void release(pid_t _child)
+        {
+            const auto child = children_.find(_child);
+            if (child == std::end(children_)) {
+                return;
+            }
+
+            if (const auto iter = active_.find(child->second); iter != std::end(active_)) {
+                if (--iter->second == 0) {
+                    active_.erase(iter);
+                }
+            }
+
+            children_.erase(child);
+        } // release
+
+        // Undoes admit() for a connection that was not handed to a child.
+        void release(const boost::asio::ip::address& _source)
+        {
+            if (const auto iter = active_.find(make_key(_source)); iter != std::end(active_)) {
+                if (--iter->second == 0) {
+                    active_.erase(iter);
+                }
+            }
+        } // release
+
+        std::uint64_t rejected() const noexcept
+        {
+            return rejected_;
+        } // rejected
+
+    private:
+        using clock = std::chrono::steady_clock;
+        using key_type = std::array<std::uint8_t, 16>;
+
+        static constexpr std::size_t sketch_depth = 4;
+        static constexpr std::size_t sketch_width = 4096;
+        static constexpr std::size_t heavy_hitter_slots = 256;
+
+        struct key_hash
+        {
+            std::size_t operator()(const key_type& _key) const noexcept
+            {
+                return hash(_key, 0);
+            }
+        }; // struct key_hash
+
+        struct heavy_hitter_entry
+        {
+            key_type key{};
+            std::uint32_t count = 0;
+            bool used = false;
+        }; // struct heavy_hitter_entry
+
+        static key_type make_key(const boost::asio::ip::address& _source)
+        {
+            // IPv4 addresses are stored as IPv4-mapped IPv6 addresses so both
+            // families share one key type.
+            const auto v6 = _source.is_v4()
+                ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, _source.to_v4())
+                : _source.to_v6();
+
+            const auto bytes = v6.to_bytes();
+            key_type key;
+            std::memcpy(key.data(), bytes.data(), key.size());
+
+            return key;
+        } // make_key
+
+        static std::size_t hash(const key_type& _key, std::uint64_t _seed) noexcept
+        {
+            std::uint64_t h = 14695981039346656037ull ^ (_seed * 0x9e3779b97f4a7c15ull);
+
+            for (const auto b : _key) {
+                h ^= b;
+                h *= 1099511628211ull;
+            }
+
+            return static_cast<std::size_t>(h ^ (h >> 29));
+        } // hash
+
+        // Starts a new window once the current one has expired. Counts from the
+        // previous window are discarded rather than decayed. This is coarse but
+        // costs nothing per connection.
+        void roll_window()
+        {
+            const auto now = clock::now();
+
+            if (now - window_start_ < limits_.window) {
+                return;
+            }
+
+            std::fill(std::begin(sketch_), std::end(sketch_), 0);
+
+            for (auto& entry : heavy_hitters_) {
+                entry = {};
+            }
+
+            window_start_ = now;
+        } // roll_window
+
+        // Increments the sketch for _key and returns the new estimate.
+        std::uint32_t bump_sketch(const key_type& _key)
+        {
+            std::uint32_t estimate = ~std::uint32_t{0};
+
+            for (std::size_t row = 0; row < sketch_depth; ++row) {
+                auto& counter = sketch_[row * sketch_width + hash(_key, row + 1) % sketch_width];
+                estimate = std::min(estimate, ++counter);
+            }
+
+            return estimate;
+        } // bump_sketch
+
+        // Returns the entry of _key, promoting it with _count connections if it
+        // has none. The caller passes what the sketch estimates for the source
+        // beyond the promotion threshold. A first promotion starts at zero, but a
+        // source that was evicted and comes back keeps (an over-estimate of) what
+        // it had. Otherwise more heavy hitters than there are slots would take
+        // turns evicting each other and never be rejected.
+        heavy_hitter_entry& heavy_hitter(const key_type& _key, std::uint32_t _count)
+        {
+            const auto start = hash(_key, 0);
+            heavy_hitter_entry* victim = nullptr;
+
+            for (std::size_t i = 0; i < heavy_hitter_slots; ++i) {
+                auto& entry = heavy_hitters_[(start + i) % heavy_hitter_slots];
+
+                if (!entry.used) {
+                    entry.key = _key;
+                    entry.count = _count;
+                    entry.used = true;
+                    return entry;
+                }
+
+                if (entry.key == _key) {
+                    return entry;
+                }
+
+                if (!victim || entry.count < victim->count) {
+                    victim = &entry;
+                }
+            }
+
+            // The table is full. Replace the lightest hitter, which is the entry
+            // least likely to be rejected anyway.
+            victim->key = _key;
+            victim->count = _count;
+            victim->used = true;
+
+            return *victim;
+        } // heavy_hitter
+
+        accept_limits limits_;
+        std::vector<std::uint32_t> sketch_;
+        std::vector<heavy_hitter_entry> heavy_hitters_;
+        std::unordered_map<key_type, std::uint32_t, key_hash> active_;
+        std::unordered_map<pid_t, key_type> children_;
+        clock::time_point window_start_;
+        std::uint64_t rejected_ = 0;
+    }; // class accept_limiter
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_ACCEPT_LIMITER_HPP
@@ -0,0 +1,289 @@
+#ifndef KDD_SCPPS_AUTHENTICATOR_HPP
+#define KDD_SCPPS_AUTHENTICATOR_HPP
+
+#include "crypto_workers.hpp"
+#include "lock_profiler.hpp"
+
+#include <boost/asio/io_service.hpp>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // What an auth provider knows about a user.
+    struct principal
+    {
+        std::string name;
+        unsigned iterations = 0;                // PBKDF2-HMAC-SHA256 iterations.
+        std::vector<unsigned char> salt;
+        std::vector<unsigned char> key;         // The derived key of the user's credential.
+        std::vector<std::string> may_proxy_for; // Users this one may act for. "*" means anyone.
+    }; // struct principal
+
+    // The source of principals (a file, a directory service, ...).
+    //
+    // lookup() may block. It is only ever called on the authenticator's
+    // threads, never on an io_service thread.
+    class auth_provider
+    {
+    public:
+        virtual ~auth_provider() = default;
+
+        // Returns std::nullopt if the principal does not exist.
+        virtual std::optional<principal> lookup(const std::string& _name) = 0;
+    }; // class auth_provider
+
+    // Reads principals from a text file with one line per user:
+    //
+    //   <name>:<iterations>:<salt (hex)>:<derived key (hex)>:<user>,<user>,...
+    //
+    // Empty lines and lines starting with '#' are ignored. The file is read
+    // again whenever its modification time changes.
+    class file_auth_provider : public auth_provider
+    {
+    public:
+        explicit file_auth_provider(std::string _path)
+            : path_{std::move(_path)}
+        {
+        } // file_auth_provider (constructor)
+
+        std::optional<principal> lookup(const std::string& _name) override
+        {
+            std::lock_guard lock{mutex_};
+
+            reload();
+
+            if (const auto iter = principals_.find(_name); iter != std::end(principals_)) {
+                return iter->second;
+            }
+
+            return std::nullopt;
+        } // lookup
+
+    private:
+        void reload()
+        {
+            struct stat st;
+            if (::stat(path_.c_str(), &st) == -1) {
+                syslog(LOG_ERR | LOG_USER, "Could not stat user file %s: %m", path_.c_str());
+                principals_.clear();
+                return;
+            }
+
+            if (st.st_mtim.tv_sec == mtime_.tv_sec && st.st_mtim.tv_nsec == mtime_.tv_nsec) {
+                return;
+            }
+
+            mtime_ = st.st_mtim;
+            principals_.clear();
+
+            std::ifstream in{path_};
+            int line_number = 0;
+
+            for (std::string line; std::getline(in, line);) {
+                ++line_number;
+
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+
+                if (auto p = parse(line); p) {
+                    principals_[p->name] = std::move(*p);
+                }
+                else {
+                    syslog(LOG_ERR | LOG_USER, "Ignoring malformed entry in user file [path:%s, line:%d]", path_.c_str(), line_number);
+                }
+            }
+        } // reload
+
+        static std::optional<principal> parse(const std::string& _line)
+        {
+            std::vector<std::string> fields;
+            std::istringstream in{_line};
+
+            for (std::string field; std::getline(in, field, ':');) {
+                fields.push_back(std::move(field));
+            }
+
+            if (fields.size() == 4) {
+                fields.emplace_back();
+            }
+
+            principal p;
+
+            if (fields.size() != 5 || fields[0].empty() || !from_hex(fields[2], p.salt) || !from_hex(fields[3], p.key) || p.key.empty()) {
+                return std::nullopt;
+            }
+
+            try {
+                p.iterations = static_cast<unsigned>(std::stoul(fields[1]));
+            }
+            catch (const std::exception&) {
+                return std::nullopt;
+            }
+
+            p.name = std::move(fields[0]);
+
+            std::istringstream users{fields[4]};
+            for (std::string user; std::getline(users, user, ',');) {
+                if (!user.empty()) {
+                    p.may_proxy_for.push_back(std::move(user));
+                }
+            }
+
+            return p;
+        } // parse
+
+        static bool from_hex(const std::string& _hex, std::vector<unsigned char>& _out)
+        {
+            if (_hex.size() % 2 != 0) {
+                return false;
+            }
+
+            auto nibble = [](char c) -> int {
+                if (c >= '0' && c <= '9') return c - '0';
+                if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+                return -1;
+            };
+
+            _out.clear();
+
+            for (std::size_t i = 0; i < _hex.size(); i += 2) {
+                const auto high = nibble(_hex[i]);
+                const auto low = nibble(_hex[i + 1]);
+
+                if (high < 0 || low < 0) {
+                    return false;
+                }
+
+                _out.push_back(static_cast<unsigned char>(high << 4 | low));
+            }
+
+            return true;
+        } // from_hex
+
+        std::string path_;
+        profiled_mutex mutex_{"file_auth_provider"};
+        timespec mtime_{};
+        std::unordered_map<std::string, principal> principals_;
+    }; // class file_auth_provider
+
+    enum class auth_status
+    {
+        granted,
+        denied,  // Unknown user, wrong credential or not allowed to proxy.
+        error    // The provider failed. The client may retry.
+    }; // enum class auth_status
+
+    // Authenticates a proxy user by its credential and checks that it may act
+    // for the client user, without blocking the io_service.
+    //
+    // The provider lookups and the key derivation (deliberately slow) run
+    // together as one job on the authenticator's own threads. The completion
+    // handler is posted back to the io_service.
+    //
+    // Threads do not survive fork(), so an authenticator is created by the
+    // process that uses it.
+    class authenticator
+    {
+    public:
+        using completion_handler = std::function<void(auth_status)>;
+
+        authenticator(boost::asio::io_service& _io_service, auth_provider& _provider, unsigned _threads = 2)
+            : io_service_{_io_service}
+            , provider_{_provider}
+            , workers_{_threads}
+        {
+        } // authenticator (constructor)
+
+        authenticator(const authenticator&) = delete;
+        auto operator=(const authenticator&) -> authenticator& = delete;
+
+        // Authenticates _proxy_user with _credential and checks that it may act
+        // for _user. _completion runs on the io_service.
+        void authenticate(std::string _user, std::string _proxy_user, std::string _credential, completion_handler _completion)
+        {
+            // Keeps the io_service running until the completion handler ran.
+            auto work = std::make_shared<boost::asio::io_service::work>(io_service_);
+
+            workers_.submit([this, work, _user = std::move(_user), _proxy_user = std::move(_proxy_user),
+                             _credential = std::move(_credential), _completion = std::move(_completion)]() mutable {
+                const auto status = check(_user, _proxy_user, _credential);
+                io_service_.post([work = std::move(work), _completion = std::move(_completion), status] { _completion(status); });
+                return 0;
+            });
+        } // authenticate
+
+    private:
+        // Runs on the authenticator's threads. The client user only has to
+        // exist, and is not looked up separately when a user acts for itself.
+        auth_status check(const std::string& _user, const std::string& _proxy_user, const std::string& _credential)
+        {
+            std::optional<principal> proxy;
+            bool user_exists = false;
+
+            try {
+                proxy = provider_.lookup(_proxy_user);
+                user_exists = _user == _proxy_user ? proxy.has_value() : provider_.lookup(_user).has_value();
+            }
+            catch (const std::exception& e) {
+                syslog(LOG_ERR | LOG_USER, "Auth provider failed [user:%s, proxy user:%s, error:%s]", _user.c_str(), _proxy_user.c_str(), e.what());
+                return auth_status::error;
+            }
+
+            if (!proxy || !user_exists || (_user != _proxy_user && !may_proxy(*proxy, _user))) {
+                return auth_status::denied;
+            }
+
+            return verify(*proxy, _credential) ? auth_status::granted : auth_status::denied;
+        } // check
+
+        static bool may_proxy(const principal& _proxy, const std::string& _user)
+        {
+            return std::any_of(std::begin(_proxy.may_proxy_for), std::end(_proxy.may_proxy_for), [&_user](const std::string& u) {
+                return u == "*" || u == _user;
+            });
+        } // may_proxy
+
+        static bool verify(const principal& _principal, const std::string& _credential)
+        {
+            std::vector<unsigned char> derived(_principal.key.size());
+
+            if (PKCS5_PBKDF2_HMAC(_credential.data(), static_cast<int>(_credential.size()),
+                                  _principal.salt.data(), static_cast<int>(_principal.salt.size()),
+                                  static_cast<int>(_principal.iterations), EVP_sha256(),
+                                  static_cast<int>(derived.size()), derived.data()) != 1)
+            {
+                return false;
+            }
+
+            return CRYPTO_memcmp(derived.data(), _principal.key.data(), derived.size()) == 0;
+        } // verify
+
+        boost::asio::io_service& io_service_;
+        auth_provider& provider_;
+
+        // Declared last, so the threads are joined before anything they use is
+        // destroyed.
+        crypto_workers workers_;
+    }; // class authenticator
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_AUTHENTICATOR_HPP
@@ -0,0 +1,439 @@
+#ifndef KDD_SCPPS_BLOCK_CHECKSUM_HPP
+#define KDD_SCPPS_BLOCK_CHECKSUM_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+    #include <nmmintrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    namespace detail
+    {
+        inline const std::array<std::uint32_t, 256>& crc32c_table()
+        {
+            static const auto table = [] {
+                std::array<std::uint32_t, 256> t{};
+
+                for (std::uint32_t i = 0; i < 256; ++i) {
+                    auto c = i;
+                    for (int k = 0; k < 8; ++k) {
+                        c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+                    }
+                    t[i] = c;
+                }
+
+                return t;
+            }();
+
+            return table;
+        } // crc32c_table
+
+        inline std::uint32_t crc32c_portable(std::uint32_t _crc, const unsigned char* _data, std::size_t _size)
+        {
+            const auto& table = crc32c_table();
+
+            for (std::size_t i = 0; i < _size; ++i) {
+                _crc = table[(_crc ^ _data[i]) & 0xff] ^ (_crc >> 8);
+            }
+
+            return _crc;
+        } // crc32c_portable
+
+#if defined(__x86_64__)
+        // The SSE 4.2 crc32 instruction processes 8 bytes per instruction.
+        __attribute__((target("sse4.2")))
+        inline std::uint32_t crc32c_sse42(std::uint32_t _crc, const unsigned char* _data, std::size_t _size)
+        {
+            std::uint64_t crc = _crc;
+
+            for (; _size >= 8; _data += 8, _size -= 8) {
+                std::uint64_t word;
+                std::memcpy(&word, _data, 8);
+                crc = _mm_crc32_u64(crc, word);
+            }
+
+            auto crc32 = static_cast<std::uint32_t>(crc);
+
+            for (; _size > 0; ++_data, --_size) {
+                crc32 = _mm_crc32_u8(crc32, *_data);
+            }
+
+            return crc32;
+        } // crc32c_sse42
+#endif
+    } // namespace detail
+
+    // CRC-32C (Castagnoli) of _size bytes. Uses the SSE 4.2 instruction when
+    // the CPU has it and a table-driven implementation otherwise.
+    inline std::uint32_t crc32c(const void* _data, std::size_t _size, std::uint32_t _seed = 0)
+    {
+        const auto* p = static_cast<const unsigned char*>(_data);
+
+#if defined(__x86_64__)
+        static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+
+        if (has_sse42) {
+            return ~detail::crc32c_sse42(~_seed, p, _size);
+        }
+#endif
+
+        return ~detail::crc32c_portable(~_seed, p, _size);
+    } // crc32c
+
+    // A file with a CRC-32C stored for every block in "<path>.crc".
+    //
+    // Writes update the checksums of the blocks they touch and nothing else.
+    // Reads verify every block they return and fail with EIO when a block does
+    // not match its checksum, so bit rot is reported instead of served.
+    //
+    // Data and checksums live in different files and cannot be written
+    // atomically. Every block therefore has a record with two checksums: the
+    // committed one and the one of a write in progress. A write stores the
+    // checksums of the new contents as pending, writes the data and then
+    // commits them. A block matching either checksum is intact, so a process
+    // that dies between the two writes leaves readable blocks behind. A zeroed
+    // record means the block has no checksum yet (objects written before
+    // checksums were kept, or holes in the checksum file). Such blocks are
+    // returned unverified until they are written.
+    //
+    // A read also hands back the checksum of each returned segment (a segment
+    // is the part of a block that falls inside the requested range). For
+    // segments covering a whole block, this is the stored checksum, so
+    // block-aligned reads can be forwarded to the client together with their
+    // verified checksums and no bytes are hashed twice.
+    class checksummed_file
+    {
+    public:
+        static constexpr std::size_t block_size = 64 * 1024;
+
+        checksummed_file() = default;
+
+        checksummed_file(const checksummed_file&) = delete;
+        auto operator=(const checksummed_file&) -> checksummed_file& = delete;
+
+        ~checksummed_file()
+        {
+            close();
+        } // destructor
+
+        // The checksum file is created if it does not exist, so that objects
+        // without one can be opened and get checksums as they are written.
+        int open(const std::string& _path, int _flags, mode_t _mode = S_IRUSR | S_IWUSR)
+        {
+            fd_ = ::open(_path.c_str(), _flags, _mode);
+            if (fd_ == -1) {
+                return -1;
+            }
+
+            const auto crc_flags = (_flags & O_TRUNC) | O_CREAT | O_RDWR | O_CLOEXEC;
+            crc_fd_ = ::open((_path + ".crc").c_str(), crc_flags, S_IRUSR | S_IWUSR);
+
+            if (crc_fd_ == -1) {
+                const auto saved_errno = errno;
+                close();
+                errno = saved_errno;
+                return -1;
+            }
+
+            return 0;
+        } // open
+
+        void close()
+        {
+            if (fd_ != -1) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+
+            if (crc_fd_ != -1) {
+                ::close(crc_fd_);
+                crc_fd_ = -1;
+            }
+        } // close
+
+        int native_handle() const noexcept
+        {
+            return fd_;
+        } // native_handle
+
+        ssize_t pwrite(const void* _buffer, std::size_t _count, off_t _offset)
+        {
+            const auto* in = static_cast<const char*>(_buffer);
+            const auto end = static_cast<std::uint64_t>(_offset) + _count;
+            const auto old_size = file_size();
+
+            if (old_size < 0) {
+                return -1;
+            }
+
+            const auto first = static_cast<std::uint64_t>(_offset) / block_size;
+            const auto last = (end + block_size - 1) / block_size;
+
+            // A hole between the old end of the file and _offset changes the
+            // checksum of the block that held the old end, and creates zero-filled
+            // blocks that need checksums of their own.
+            const auto from = std::min(first, static_cast<std::uint64_t>(old_size) / block_size);
+            const auto size = std::max<std::uint64_t>(old_size, end);
+
+            std::vector<std::uint32_t> crcs;
+            crcs.reserve(last - from);
+
+            for (auto block = from; block < last; ++block) {
+                const auto block_begin = block * block_size;
+                const auto length = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - block_begin));
+
+                // Fully overwritten blocks are hashed straight from the caller's
+                // buffer. Anything else is the old contents with the new bytes
+                // laid over them.
+                if (block_begin >= static_cast<std::uint64_t>(_offset) && block_begin + length <= end) {
+                    crcs.push_back(crc32c(in + (block_begin - _offset), length));
+                    continue;
+                }
+
+                if (read_old(block_begin, length, old_size) == -1) {
+                    return -1;
+                }
+
+                const auto overlap_begin = std::max<std::uint64_t>(block_begin, _offset);
+                const auto overlap_end = std::min<std::uint64_t>(block_begin + length, end);
+
+                if (overlap_begin < overlap_end) {
+                    std::memcpy(scratch_.data() + (overlap_begin - block_begin), in + (overlap_begin - _offset), overlap_end - overlap_begin);
+                }
+
+                crcs.push_back(crc32c(scratch_.data(), length));
+            }
+
+            const auto written = update(from, crcs, [&] {
+                return ::pwrite(fd_, in, _count, _offset) == static_cast<ssize_t>(_count);
+            });
+
+            return written ? static_cast<ssize_t>(_count) : -1;
+        } // pwrite
+
+        // Reads and verifies up to _count bytes at _offset. The checksum of each
+        // returned segment is appended to _segment_crcs when it is not null.
+        ssize_t pread(void* _buffer, std::size_t _count, off_t _offset, std::vector<std::uint32_t>* _segment_crcs = nullptr)
+        {
+            const auto size = file_size();
+            if (size < 0) {
+                return -1;
+            }
+
+            if (_offset >= size) {
+                return 0;
+            }
+
+            auto* out = static_cast<char*>(_buffer);
+            const auto end = std::min<std::uint64_t>(size, static_cast<std::uint64_t>(_offset) + _count);
+            const auto first = static_cast<std::uint64_t>(_offset) / block_size;
+            const auto last = (end + block_size - 1) / block_size;
+
+            std::vector<crc_record> records;
+            if (read_records(first, last - first, records) == -1) {
+                return -1;
+            }
+
+            std::size_t copied = 0;
+
+            for (auto block = first; block < last; ++block) {
+                const auto block_begin = block * block_size;
+                const auto length = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - block_begin));
+                const auto seg_begin = std::max<std::uint64_t>(block_begin, _offset);
+                const auto seg_end = std::min<std::uint64_t>(block_begin + length, end);
+                const bool whole = seg_begin == block_begin && seg_end == block_begin + length;
+                const auto& record = records[block - first];
+
+                // Whole blocks are read straight into the caller's buffer. Partial
+                // blocks still have to be read (and verified) in full.
+                char* target = out + copied;
+                if (!whole) {
+                    scratch_.resize(block_size);
+                    target = scratch_.data();
+                }
+
+                if (::pread(fd_, target, length, block_begin) != static_cast<ssize_t>(length)) {
+                    return -1;
+                }
+
+                auto crc = crc32c(target, length);
+
+                if (record.state != 0 && !record.matches(crc)) {
+                    syslog(LOG_ERR | LOG_USER, "Checksum mismatch [fd:%d, block:%lu]", fd_, block);
+                    errno = EIO;
+                    return -1;
+                }
+
+                if (!whole) {
+                    std::memcpy(out + copied, target + (seg_begin - block_begin), seg_end - seg_begin);
+                    crc = crc32c(out + copied, seg_end - seg_begin);
+                }
+
+                if (_segment_crcs) {
+                    _segment_crcs->push_back(crc);
+                }
+
+                copied += seg_end - seg_begin;
+            }
+
+            return static_cast<ssize_t>(copied);
+        } // pread
+
+        // Cutting the file short changes the checksum of its new last block.
+        // Growing it changes the checksum of the old last block and adds
+        // zero-filled blocks, so those are recomputed up to the new end.
+        int truncate(off_t _size)
+        {
+            const auto old_size = file_size();
+            if (old_size < 0) {
+                return -1;
+            }
+
+            const auto size = static_cast<std::uint64_t>(_size);
+            const auto blocks = (size + block_size - 1) / block_size;
+            const auto from = std::min<std::uint64_t>(old_size, size) / block_size;
+
+            std::vector<std::uint32_t> crcs;
+            crcs.reserve(blocks - std::min(from, blocks));
+
+            for (auto block = from; block < blocks; ++block) {
+                const auto block_begin = block * block_size;
+                const auto length = static_cast<std::size_t>(std::min<std::uint64_t>(block_size, size - block_begin));
+
+                if (block_begin >= static_cast<std::uint64_t>(old_size)) {
+                    crcs.push_back(zero_crc(length));
+                    continue;
+                }
+
+                if (read_old(block_begin, length, old_size) == -1) {
+                    return -1;
+                }
+
+                crcs.push_back(crc32c(scratch_.data(), length));
+            }
+
+            const auto truncated = update(from, crcs, [&] {
+                return ::ftruncate(fd_, _size) == 0;
+            });
+
+            if (!truncated || ::ftruncate(crc_fd_, blocks * sizeof(crc_record)) == -1) {
+                return -1;
+            }
+
+            return 0;
+        } // truncate
+
+    private:
+        struct crc_record
+        {
+            enum : std::uint32_t
+            {
+                has_crc     = 1,
+                has_pending = 2
+            };
+
+            std::uint32_t crc;
+            std::uint32_t pending;
+            std::uint32_t state; // Zero: the block has no checksum yet.
+
+            bool matches(std::uint32_t _crc) const noexcept
+            {
+                return ((state & has_crc) && crc == _crc) || ((state & has_pending) && pending == _crc);
+            }
+        }; // struct crc_record
+
+        static_assert(sizeof(crc_record) == 12);
+
+        off_t file_size() const
+        {
+            struct stat st;
+            return ::fstat(fd_, &st) == 0 ? st.st_size : -1;
+        } // file_size
+
+        // Reads the current contents of the block at _begin into scratch_,
+        // zero-filled beyond the old end of the file.
+        int read_old(std::uint64_t _begin, std::size_t _length, off_t _old_size)
+        {
+            scratch_.assign(block_size, 0);
+
+            if (_begin >= static_cast<std::uint64_t>(_old_size)) {
+                return 0;
+            }
+
+            const auto available = static_cast<std::size_t>(std::min<std::uint64_t>(_length, _old_size - _begin));
+
+            return ::pread(fd_, scratch_.data(), available, _begin) == static_cast<ssize_t>(available) ? 0 : -1;
+        } // read_old
+
+        static std::uint32_t zero_crc(std::size_t _length)
+        {
+            static const std::vector<char> zeros(block_size, 0);
+            static const auto full = crc32c(zeros.data(), block_size);
+
+            return _length == block_size ? full : crc32c(zeros.data(), _length);
+        } // zero_crc
+
+        // Records missing from the checksum file read as zero (no checksum yet).
+        int read_records(std::uint64_t _first, std::size_t _count, std::vector<crc_record>& _records)
+        {
+            _records.assign(_count, crc_record{});
+
+            const auto bytes = _count * sizeof(crc_record);
+            const auto n = ::pread(crc_fd_, _records.data(), bytes, _first * sizeof(crc_record));
+
+            return n < 0 ? -1 : 0;
+        } // read_records
+
+        // Replaces the checksums of the blocks from _first on with _crcs around
+        // _change, which modifies the data: the new checksums are stored as
+        // pending first and committed once _change succeeded.
+        template <typename Change>
+        bool update(std::uint64_t _first, const std::vector<std::uint32_t>& _crcs, Change&& _change)
+        {
+            std::vector<crc_record> records;
+            if (read_records(_first, _crcs.size(), records) == -1) {
+                return false;
+            }
+
+            const auto bytes = static_cast<ssize_t>(records.size() * sizeof(crc_record));
+            const auto offset = static_cast<off_t>(_first * sizeof(crc_record));
+
+            // Blocks without a checksum stay unverified until the commit.
+            for (std::size_t i = 0; i < records.size(); ++i) {
+                if (records[i].state != 0) {
+                    records[i].pending = _crcs[i];
+                    records[i].state |= crc_record::has_pending;
+                }
+            }
+
+            if (::pwrite(crc_fd_, records.data(), bytes, offset) != bytes || !_change()) {
+                return false;
+            }
+
+            for (std::size_t i = 0; i < records.size(); ++i) {
+                records[i] = crc_record{_crcs[i], 0, crc_record::has_crc};
+            }
+
+            return ::pwrite(crc_fd_, records.data(), bytes, offset) == bytes;
+        } // update
+
+        int fd_ = -1;
+        int crc_fd_ = -1;
+        std::vector<char> scratch_;
+    }; // class checksummed_file
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_BLOCK_CHECKSUM_HPP
@@ -0,0 +1,3 @@
+#! /bin/bash
+
+g++ -std=c++17 -O2 -o migrate_layout migrate_layout.cpp -lboost_filesystem -lboost_system -lfmt
@@ -1,3 +1,28 @@
 #! /bin/bash
 
 g++ -std=c++17 -o test_fbs_message test_fbs_message.cpp -lfmt
+g++ -std=c++17 -o test_compressed_object test_compressed_object.cpp -lfmt -lz
+g++ -std=c++17 -o test_tiered_storage test_tiered_storage.cpp -lboost_filesystem -lboost_system -lfmt -pthread
+g++ -std=c++17 -o test_quota_table test_quota_table.cpp -lfmt
+g++ -std=c++17 -o test_buffer_pool test_buffer_pool.cpp -lfmt -pthread
+g++ -std=c++17 -o test_handle_table test_handle_table.cpp -lfmt
+g++ -std=c++17 -o test_object_layout test_object_layout.cpp -lboost_filesystem -lboost_system -lfmt -pthread
+g++ -std=c++17 -o test_stream_mux test_stream_mux.cpp -lfmt
+g++ -std=c++17 -o test_session_resumption test_session_resumption.cpp -lfmt -lcrypto
+g++ -std=c++17 -o test_merkle_digest test_merkle_digest.cpp -lfmt -lcrypto -pthread
+g++ -std=c++17 -o test_block_checksum test_block_checksum.cpp -lfmt
+g++ -std=c++17 -o test_memory_governor test_memory_governor.cpp -lfmt
+g++ -std=c++17 -o test_worker_pool test_worker_pool.cpp -lboost_system -lfmt -pthread
+g++ -std=c++17 -o test_output_queue test_output_queue.cpp -lboost_system -lfmt -pthread
+g++ -std=c++17 -o test_authenticator test_authenticator.cpp -lboost_system -lfmt -lcrypto -pthread
+g++ -std=c++17 -o test_tenant_pools test_tenant_pools.cpp -lfmt -pthread
+g++ -std=c++17 -o test_read_coalescer test_read_coalescer.cpp -lfmt -pthread
+g++ -std=c++17 -o test_mapped_object_cache test_mapped_object_cache.cpp -lfmt
+g++ -std=c++17 -o test_resource_limits test_resource_limits.cpp -lfmt
+g++ -std=c++17 -o test_accept_limiter test_accept_limiter.cpp -lboost_system -lfmt
+g++ -std=c++17 -o test_encrypted_object test_encrypted_object.cpp -lfmt -lcrypto -pthread
+g++ -std=c++17 -o test_compact_message test_compact_message.cpp -lfmt
+g++ -std=c++17 -o test_tls_context test_tls_context.cpp -lfmt -lssl -lcrypto -pthread
+g++ -std=c++17 -o test_tls_write_stream test_tls_write_stream.cpp -lboost_system -lfmt -lssl -lcrypto -pthread
+g++ -std=c++17 -o test_frame_header test_frame_header.cpp -lfmt
+g++ -std=c++17 -o test_lock_profiler test_lock_profiler.cpp -lfmt -pthread
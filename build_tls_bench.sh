@@ -0,0 +1,3 @@
+#! /bin/bash
+
+g++ -std=c++17 -O2 -o tls_bench tls_bench.cpp -lfmt -lssl -lcrypto
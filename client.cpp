@@ -1,4 +1,7 @@
 #include "message_generated.h"
+#include "block_checksum.hpp"
+#include "compact_message.hpp"
+#include "frame_header.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/endian/buffers.hpp>
@@ -11,8 +14,8 @@
 
 int main(int _argc, char* _argv[])
 {
-    if (_argc != 3) {
-        fmt::print(stderr, "Usage: fbs_client <port> <message>\n");
+    if (_argc != 3 && _argc != 4) {
+        fmt::print(stderr, "Usage: fbs_client <port> <message> [<resumption token>]\n");
         return 1;
     }
 
@@ -34,14 +37,20 @@ int main(int _argc, char* _argv[])
         // Hence, the creation of strings here.
         auto username = builder.CreateString("kory");
         auto proxy_username = builder.CreateString("rods");
+        auto proxy_credential = builder.CreateString("rods");
         auto payload = builder.CreateString(_argv[2]);
 
+        // Reconnecting with the same token resumes the session the server kept
+        // for this client after the previous connection dropped.
+        auto resumption_token = builder.CreateString(_argc == 4 ? _argv[3] : "");
+
         kdd::user_infoBuilder user_builder{builder};
         user_builder.add_name(username);
         auto user = user_builder.Finish();
 
         kdd::user_infoBuilder proxy_user_builder{builder};
         proxy_user_builder.add_name(proxy_username);
+        proxy_user_builder.add_credential(proxy_credential);
         auto proxy_user = proxy_user_builder.Finish();
 
         kdd::messageBuilder message_builder{builder};
@@ -50,15 +59,57 @@ int main(int _argc, char* _argv[])
         message_builder.add_proxy_user(proxy_user);
         message_builder.add_api_number(kdd::api_no_data_object_open);
         message_builder.add_payload(payload);
+        message_builder.add_compact_ops(true);
+        if (_argc == 4) {
+            message_builder.add_resumption_token(resumption_token);
+        }
         auto msg = message_builder.Finish();
 
         builder.Finish(msg);
 
-        using int_type = boost::endian::little_int32_buf_t;
-        int_type v(builder.GetSize());
-        fmt::print("message size (binary): {}\n", v);
-        s.write((char*) &v, sizeof(int_type));
-        s.write((char*) builder.GetBufferPointer(), builder.GetSize());
+        // Frames use the version 2 header, so the operation and request id can
+        // be read without parsing the body. The body carries a CRC-32C trailer.
+        auto write_frame = [&s](kdd::api_no _opcode, std::uint16_t _flags, std::uint64_t _request_id, const void* _body, std::uint32_t _size) {
+            const bool checksummed = _flags & kdd::frame_checksummed;
+            boost::endian::little_uint32_buf_t crc(kdd::crc32c(_body, _size));
+
+            auto header = kdd::make_frame_header(_opcode, _flags, _request_id, _size + (checksummed ? sizeof(crc) : 0));
+            s.write((char*) &header, sizeof(header));
+            s.write((const char*) _body, _size);
+
+            if (checksummed) {
+                s.write((char*) &crc, sizeof(crc));
+            }
+        };
+
+        fmt::print("message size (binary): {}\n", builder.GetSize());
+        write_frame(kdd::api_no_data_object_open, kdd::frame_checksummed, 1, builder.GetBufferPointer(), builder.GetSize());
+
+        // Once the session is established, the server replies with the token
+        // that resumes it.
+        boost::endian::little_int32_buf_t reply_size;
+        if (!s.read((char*) &reply_size, sizeof(reply_size)) || reply_size.value() <= 0 || reply_size.value() > 64 * 1024) {
+            fmt::print(stderr, "No session established.\n");
+            return 1;
+        }
+
+        std::string reply(reply_size.value(), '\0');
+        s.read(reply.data(), reply.size());
+
+        fbs::Verifier verifier{(const std::uint8_t*) reply.data(), reply.size()};
+        if (s && kdd::VerifymessageBuffer(verifier)) {
+            if (const auto* token = kdd::Getmessage(reply.data())->resumption_token()) {
+                fmt::print("resumption token: {}\n", token->str());
+            }
+        }
+
+        // The server now accepts compact messages on this session. Close the
+        // handle with one.
+        kdd::compact_message close_msg{};
+        close_msg.api_number = kdd::api_no_data_object_close;
+        close_msg.handle = 1;
+
+        write_frame(kdd::api_no_data_object_close, kdd::frame_compact | kdd::frame_checksummed, 2, &close_msg, sizeof(close_msg));
     }
     catch (const std::exception& e) {
         fmt::print(stderr, "Exception: {}\n", e.what());
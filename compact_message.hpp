@@ -0,0 +1,59 @@
+#ifndef KDD_SCPPS_COMPACT_MESSAGE_HPP
+#define KDD_SCPPS_COMPACT_MESSAGE_HPP
+
+#include "message_generated.h"
+
+#include <boost/endian/buffers.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+namespace kdd::scpps
+{
+    // Set in the 4-byte length prefix of a frame whose body is a
+    // compact_message instead of a FlatBuffers message. Lengths of regular
+    // frames never come close to using this bit.
+    constexpr std::uint32_t compact_frame_flag = 0x80000000u;
+
+    // Fixed-layout encoding of the operations that only take a handle and at
+    // most one number. The FlatBuffers message for these (vtable, user tables,
+    // strings) is several times larger than their arguments. A compact message
+    // is 16 bytes and is decoded with a single load.
+    //
+    // Compact messages are only accepted on a session whose client announced
+    // support for them by setting compact_ops in a regular message. They carry
+    // no user information, so they are only valid after that message.
+    struct compact_message
+    {
+        boost::endian::little_uint16_buf_t api_number;
+        boost::endian::little_uint16_buf_t whence;   // data_object_seek only.
+        boost::endian::little_uint32_buf_t handle;
+        boost::endian::little_int64_buf_t argument; // Offset, length or size, depending on the operation.
+    }; // struct compact_message
+
+    static_assert(sizeof(compact_message) == 16, "compact_message must not contain padding");
+
+    // The operations that may be sent as compact messages.
+    inline bool is_compact_op(api_no _api_number) noexcept
+    {
+        switch (_api_number) {
+            case api_no_data_object_close:
+            case api_no_data_object_read:
+            case api_no_data_object_seek:
+            case api_no_data_object_truncate:
+                return true;
+
+            default:
+                return false;
+        }
+    } // is_compact_op
+
+    inline compact_message decode_compact_message(const void* _data) noexcept
+    {
+        compact_message msg;
+        std::memcpy(&msg, _data, sizeof(msg));
+        return msg;
+    } // decode_compact_message
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_COMPACT_MESSAGE_HPP
@@ -0,0 +1,685 @@
+#ifndef KDD_SCPPS_COMPRESSED_OBJECT_HPP
+#define KDD_SCPPS_COMPRESSED_OBJECT_HPP
+
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // On-disk description of a single frame. Frames are compressed independently
+    // of each other, so any frame can be decoded without touching its neighbours.
+    struct frame_index_entry
+    {
+        std::uint64_t offset;      // Position of the stored frame in the data file.
+        std::uint32_t stored_size; // Bytes occupied on disk. Zero means the frame is a hole.
+        std::uint32_t capacity;    // Bytes reserved on disk. Rewrites that fit reuse the slot.
+        std::uint32_t raw_size;    // Logical bytes held by the frame.
+        std::uint32_t flags;       // See compressed_object::frame_flags.
+    }; // struct frame_index_entry
+
+    struct frame_index_header
+    {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t frame_size;
+        std::uint64_t logical_size;
+        std::uint64_t frame_count;
+    }; // struct frame_index_header
+
+    // A seekable object stored as a sequence of fixed-size, independently
+    // compressed frames. The frame index lives next to the data in "<path>.fidx".
+    //
+    // The interface mirrors the POSIX calls the data_object_* operations map to,
+    // so a handler can use it in place of a raw file descriptor. Reading at an
+    // arbitrary offset only decompresses the frames covering the requested range.
+    //
+    // Frames that do not shrink by at least 1/8th are stored raw. Once several
+    // frames in a row turn out to be incompressible, compression is only
+    // attempted periodically so that already-compressed data costs (almost)
+    // nothing extra to write.
+    //
+    // The index on disk only ever describes complete frames. A frame the stored
+    // index refers to is never rewritten in place. Its new version goes to a
+    // different slot, and the index is replaced atomically (written to a
+    // temporary file and renamed) after the data has reached the disk. A crash
+    // therefore leaves the object as of the last sync() or close().
+    //
+    // Objects are shared between the server's processes. An object open for
+    // writing holds an exclusive flock() on its data file, and an object open
+    // for reading a shared one, so there is one writer or any number of
+    // readers. The locks are not waited for: open() fails with EWOULDBLOCK
+    // instead, so a session cannot block the others (or itself) indefinitely.
+    class compressed_object
+    {
+    public:
+        static constexpr std::uint32_t default_frame_size = 64 * 1024;
+        static constexpr std::uint32_t max_frame_size = 16 * 1024 * 1024;
+
+        enum frame_flags : std::uint32_t
+        {
+            frame_raw  = 0,
+            frame_zlib = 1
+        };
+
+        compressed_object() = default;
+
+        compressed_object(const compressed_object&) = delete;
+        auto operator=(const compressed_object&) -> compressed_object& = delete;
+
+        ~compressed_object()
+        {
+            close();
+        } // destructor
+
+        // Returns true if the object at _path was written in compressed form.
+        static bool exists(const std::string& _path)
+        {
+            struct stat st;
+            return ::stat(index_path(_path).c_str(), &st) == 0;
+        } // exists
+
+        // Opens (or creates, if O_CREAT is passed) the object at _path. The frame
+        // size only applies to newly created objects. Existing objects always use
+        // the frame size recorded in their index.
+        //
+        // A non-empty file without a frame index is an uncompressed object, which
+        // is refused (EINVAL) rather than treated as empty.
+        int open(const std::string& _path, int _flags, std::uint32_t _frame_size = default_frame_size)
+        {
+            if (_frame_size == 0 || _frame_size > max_frame_size) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            const int data_flags = (_flags & ~(O_WRONLY | O_APPEND)) | O_RDWR;
+            data_fd_ = ::open(_path.c_str(), data_flags & ~O_TRUNC, S_IRUSR | S_IWUSR);
+            if (data_fd_ == -1) {
+                return -1;
+            }
+
+            path_ = _path;
+
+            const bool writable = (_flags & O_ACCMODE) != O_RDONLY;
+
+            if (::flock(data_fd_, (writable ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1 ||
+                load_index(_flags, _frame_size) == -1)
+            {
+                const auto saved_errno = errno;
+                discard();
+                errno = saved_errno;
+                return -1;
+            }
+
+            if ((_flags & O_TRUNC) && truncate(0) == -1) {
+                return -1;
+            }
+
+            position_ = 0;
+
+            return 0;
+        } // open
+
+        bool is_open() const noexcept
+        {
+            return data_fd_ != -1;
+        } // is_open
+
+        std::int64_t read(void* _buffer, std::size_t _count)
+        {
+            if (position_ >= logical_size_) {
+                return 0;
+            }
+
+            auto* out = static_cast<char*>(_buffer);
+            std::size_t remaining = std::min<std::uint64_t>(_count, logical_size_ - position_);
+            std::int64_t total = 0;
+
+            while (remaining > 0) {
+                const auto frame = position_ / frame_size_;
+                const auto in_frame = position_ % frame_size_;
+                const auto chunk = std::min<std::size_t>(remaining, frame_size_ - in_frame);
+
+                if (load_frame(frame) == -1) {
+                    return total > 0 ? total : -1;
+                }
+
+                std::memcpy(out, frame_buffer_.data() + in_frame, chunk);
+
+                out += chunk;
+                remaining -= chunk;
+                position_ += chunk;
+                total += chunk;
+            }
+
+            return total;
+        } // read
+
+        std::int64_t write(const void* _buffer, std::size_t _count)
+        {
+            const auto* in = static_cast<const char*>(_buffer);
+            std::size_t remaining = _count;
+            std::int64_t total = 0;
+
+            while (remaining > 0) {
+                const auto frame = position_ / frame_size_;
+                const auto in_frame = position_ % frame_size_;
+                const auto chunk = std::min<std::size_t>(remaining, frame_size_ - in_frame);
+
+                // A write covering the entire frame does not need the old contents.
+                if (chunk == frame_size_ && frame != cached_frame_) {
+                    if (flush_frame() == -1) {
+                        return total > 0 ? total : -1;
+                    }
+
+                    cached_frame_ = frame;
+                }
+                else if (load_frame(frame) == -1) {
+                    return total > 0 ? total : -1;
+                }
+
+                std::memcpy(frame_buffer_.data() + in_frame, in, chunk);
+                cached_frame_size_ = std::max<std::uint32_t>(cached_frame_size_, in_frame + chunk);
+                if (chunk == frame_size_) {
+                    cached_frame_size_ = frame_size_;
+                }
+                frame_dirty_ = true;
+
+                in += chunk;
+                remaining -= chunk;
+                position_ += chunk;
+                total += chunk;
+                logical_size_ = std::max(logical_size_, position_);
+            }
+
+            index_dirty_ = index_dirty_ || total > 0;
+
+            return total;
+        } // write
+
+        std::int64_t seek(std::int64_t _offset, int _whence)
+        {
+            std::int64_t base = 0;
+
+            switch (_whence) {
+                case SEEK_SET: base = 0; break;
+                case SEEK_CUR: base = static_cast<std::int64_t>(position_); break;
+                case SEEK_END: base = static_cast<std::int64_t>(logical_size_); break;
+                default:
+                    errno = EINVAL;
+                    return -1;
+            }
+
+            if (base + _offset < 0) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            position_ = base + _offset;
+
+            return static_cast<std::int64_t>(position_);
+        } // seek
+
+        int truncate(std::uint64_t _size)
+        {
+            if (flush_frame() == -1) {
+                return -1;
+            }
+
+            if (_size < logical_size_) {
+                const auto frames = (_size + frame_size_ - 1) / frame_size_;
+
+                // The stored index may still refer to the dropped frames, so their
+                // slots are only reused once the new index is stored. An empty
+                // data file is reclaimed entirely at that point.
+                for (auto frame = frames; frame < index_.size(); ++frame) {
+                    release_slot(frame);
+                }
+
+                if (frames < index_.size()) {
+                    index_.resize(frames);
+                }
+
+                cached_frame_ = no_frame;
+
+                // Zero the tail of the last frame so that a later extension
+                // does not resurrect the truncated bytes.
+                if (const auto tail = static_cast<std::uint32_t>(_size % frame_size_); tail > 0 && frames > 0) {
+                    if (load_frame(frames - 1) == -1) {
+                        return -1;
+                    }
+
+                    if (cached_frame_size_ > tail) {
+                        std::fill(frame_buffer_.begin() + tail, frame_buffer_.end(), 0);
+                        cached_frame_size_ = tail;
+                        frame_dirty_ = true;
+                    }
+                }
+            }
+
+            logical_size_ = _size;
+            index_dirty_ = true;
+
+            return 0;
+        } // truncate
+
+        // Writes the pending frame and the frame index to disk.
+        int sync()
+        {
+            if (flush_frame() == -1 || store_index() == -1) {
+                return -1;
+            }
+
+            return ::fdatasync(data_fd_);
+        } // sync
+
+        int close()
+        {
+            int ec = 0;
+
+            if (data_fd_ != -1 && (flush_frame() == -1 || store_index() == -1)) {
+                syslog(LOG_ERR | LOG_USER, "Could not flush compressed object: %m");
+                ec = -1;
+            }
+
+            discard();
+
+            return ec;
+        } // close
+
+        std::uint64_t size() const noexcept
+        {
+            return logical_size_;
+        } // size
+
+        // Number of bytes the object occupies in its data file.
+        std::uint64_t stored_size() const noexcept
+        {
+            return data_end_;
+        } // stored_size
+
+        std::uint32_t frame_size() const noexcept
+        {
+            return frame_size_;
+        } // frame_size
+
+    private:
+        struct slot
+        {
+            std::uint64_t offset;
+            std::uint32_t capacity;
+        }; // struct slot
+
+        static constexpr std::uint64_t no_frame = ~std::uint64_t{0};
+        static constexpr std::uint32_t index_version = 1;
+        static constexpr char index_magic[8] = {'S', 'C', 'P', 'P', 'S', 'F', 'X', '\0'};
+
+        // Number of consecutive incompressible frames after which compression is
+        // only retried every retry_interval frames.
+        static constexpr int incompressible_limit = 4;
+        static constexpr int retry_interval = 16;
+
+        static std::string index_path(const std::string& _path)
+        {
+            return _path + ".fidx";
+        } // index_path
+
+        // Closes the data file (releasing its lock) without writing anything.
+        void discard()
+        {
+            if (data_fd_ != -1) {
+                ::close(data_fd_);
+                data_fd_ = -1;
+            }
+
+            index_.clear();
+            fresh_.clear();
+            free_.clear();
+            released_.clear();
+            cached_frame_ = no_frame;
+            frame_dirty_ = false;
+            index_dirty_ = false;
+        } // discard
+
+        int load_index(int _flags, std::uint32_t _frame_size)
+        {
+            struct stat st;
+            if (::fstat(data_fd_, &st) == -1) {
+                return -1;
+            }
+
+            data_end_ = st.st_size;
+
+            const int index_fd = ::open(index_path(path_).c_str(), O_RDONLY);
+
+            if (index_fd == -1) {
+                if (errno != ENOENT) {
+                    return -1;
+                }
+
+                if (st.st_size > 0) {
+                    syslog(LOG_ERR | LOG_USER, "Refusing to open uncompressed object as compressed object [path:%s]", path_.c_str());
+                    errno = EINVAL;
+                    return -1;
+                }
+
+                if (!(_flags & O_CREAT)) {
+                    errno = ENOENT;
+                    return -1;
+                }
+
+                // A brand new object. Its index is written on the first store.
+                frame_size_ = _frame_size;
+                logical_size_ = 0;
+                index_dirty_ = true;
+            }
+            else {
+                frame_index_header header{};
+                const auto n = ::pread(index_fd, &header, sizeof(header), 0);
+
+                if (n != sizeof(header) ||
+                    std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0 ||
+                    header.version != index_version ||
+                    header.frame_size == 0 ||
+                    header.frame_size > max_frame_size)
+                {
+                    syslog(LOG_ERR | LOG_USER, "Invalid frame index for compressed object [path:%s]", path_.c_str());
+                    ::close(index_fd);
+                    errno = EIO;
+                    return -1;
+                }
+
+                frame_size_ = header.frame_size;
+                logical_size_ = header.logical_size;
+                index_.resize(header.frame_count);
+
+                const auto bytes = static_cast<ssize_t>(index_.size() * sizeof(frame_index_entry));
+                if (::pread(index_fd, index_.data(), bytes, sizeof(header)) != bytes) {
+                    ::close(index_fd);
+                    errno = EIO;
+                    return -1;
+                }
+
+                ::close(index_fd);
+            }
+
+            frame_buffer_.assign(frame_size_, 0);
+            scratch_.resize(compressBound(frame_size_));
+            cached_frame_ = no_frame;
+
+            return 0;
+        } // load_index
+
+        // Replaces the index on disk. The frames it refers to are synced first,
+        // so the stored index never describes data that did not make it.
+        int store_index()
+        {
+            if (!index_dirty_) {
+                return 0;
+            }
+
+            frame_index_header header{};
+            std::memcpy(header.magic, index_magic, sizeof(index_magic));
+            header.version = index_version;
+            header.frame_size = frame_size_;
+            header.logical_size = logical_size_;
+            header.frame_count = index_.size();
+
+            const auto bytes = static_cast<ssize_t>(index_.size() * sizeof(frame_index_entry));
+            const auto path = index_path(path_);
+            const auto temp_path = path + ".tmp";
+
+            if (::fdatasync(data_fd_) == -1) {
+                return -1;
+            }
+
+            const int index_fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (index_fd == -1) {
+                return -1;
+            }
+
+            if (::pwrite(index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+                ::pwrite(index_fd, index_.data(), bytes, sizeof(header)) != bytes ||
+                ::fdatasync(index_fd) == -1)
+            {
+                const auto saved_errno = errno;
+                ::close(index_fd);
+                ::unlink(temp_path.c_str());
+                errno = saved_errno;
+                return -1;
+            }
+
+            ::close(index_fd);
+
+            if (::rename(temp_path.c_str(), path.c_str()) == -1) {
+                const auto saved_errno = errno;
+                ::unlink(temp_path.c_str());
+                errno = saved_errno;
+                return -1;
+            }
+
+            index_dirty_ = false;
+
+            // Nothing refers to the slots of replaced frames any more.
+            free_.insert(std::end(free_), std::begin(released_), std::end(released_));
+            released_.clear();
+            fresh_.clear();
+
+            if (index_.empty() && data_end_ > 0) {
+                if (::ftruncate(data_fd_, 0) == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not reclaim compressed object data [path:%s]: %m", path_.c_str());
+                }
+                else {
+                    data_end_ = 0;
+                    free_.clear();
+                }
+            }
+
+            return 0;
+        } // store_index
+
+        // Gives up the slot of _frame. A slot the stored index refers to only
+        // becomes reusable once the index has been replaced.
+        void release_slot(std::uint64_t _frame)
+        {
+            auto& entry = index_[_frame];
+
+            if (entry.capacity == 0) {
+                return;
+            }
+
+            if (fresh_.erase(_frame) > 0) {
+                free_.push_back({entry.offset, entry.capacity});
+            }
+            else {
+                released_.push_back({entry.offset, entry.capacity});
+            }
+
+            entry = frame_index_entry{};
+        } // release_slot
+
+        // Finds room for _size bytes: the first free slot that is large enough,
+        // or the end of the data file.
+        slot allocate_slot(std::uint32_t _size)
+        {
+            const auto iter = std::find_if(std::begin(free_), std::end(free_), [_size](const slot& _slot) {
+                return _slot.capacity >= _size;
+            });
+
+            if (iter != std::end(free_)) {
+                const auto found = *iter;
+                free_.erase(iter);
+                return found;
+            }
+
+            const slot appended{data_end_, _size};
+            data_end_ += _size;
+
+            return appended;
+        } // allocate_slot
+
+        // Makes _frame the cached frame, decoding it from disk if necessary.
+        int load_frame(std::uint64_t _frame)
+        {
+            if (_frame == cached_frame_) {
+                return 0;
+            }
+
+            if (flush_frame() == -1) {
+                return -1;
+            }
+
+            cached_frame_ = no_frame;
+            cached_frame_size_ = 0;
+
+            if (_frame >= index_.size() || index_[_frame].stored_size == 0) {
+                std::fill(frame_buffer_.begin(), frame_buffer_.end(), 0);
+                cached_frame_ = _frame;
+                return 0;
+            }
+
+            const auto& entry = index_[_frame];
+
+            if (entry.flags == frame_raw) {
+                if (::pread(data_fd_, frame_buffer_.data(), entry.stored_size, entry.offset) != static_cast<ssize_t>(entry.stored_size)) {
+                    errno = EIO;
+                    return -1;
+                }
+            }
+            else {
+                if (::pread(data_fd_, scratch_.data(), entry.stored_size, entry.offset) != static_cast<ssize_t>(entry.stored_size)) {
+                    errno = EIO;
+                    return -1;
+                }
+
+                uLongf length = frame_size_;
+                if (uncompress(reinterpret_cast<Bytef*>(frame_buffer_.data()), &length,
+                               reinterpret_cast<const Bytef*>(scratch_.data()), entry.stored_size) != Z_OK ||
+                    length != entry.raw_size)
+                {
+                    syslog(LOG_ERR | LOG_USER, "Corrupt frame in compressed object [frame:%lu]", _frame);
+                    errno = EIO;
+                    return -1;
+                }
+            }
+
+            std::fill(frame_buffer_.begin() + entry.raw_size, frame_buffer_.end(), 0);
+            cached_frame_ = _frame;
+            cached_frame_size_ = entry.raw_size;
+
+            return 0;
+        } // load_frame
+
+        bool should_try_compression() noexcept
+        {
+            if (incompressible_streak_ < incompressible_limit) {
+                return true;
+            }
+
+            return ++skipped_frames_ % retry_interval == 0;
+        } // should_try_compression
+
+        // Encodes the cached frame and writes it to the data file.
+        int flush_frame()
+        {
+            if (!frame_dirty_) {
+                return 0;
+            }
+
+            const char* data = frame_buffer_.data();
+            std::uint32_t stored_size = cached_frame_size_;
+            std::uint32_t flags = frame_raw;
+
+            if (should_try_compression()) {
+                uLongf length = scratch_.size();
+                const auto ec = compress2(reinterpret_cast<Bytef*>(scratch_.data()), &length,
+                                          reinterpret_cast<const Bytef*>(frame_buffer_.data()),
+                                          cached_frame_size_, Z_BEST_SPEED);
+
+                if (ec == Z_OK && length < cached_frame_size_ - cached_frame_size_ / 8) {
+                    data = scratch_.data();
+                    stored_size = length;
+                    flags = frame_zlib;
+                    incompressible_streak_ = 0;
+                    skipped_frames_ = 0;
+                }
+                else {
+                    ++incompressible_streak_;
+                }
+            }
+
+            if (cached_frame_ >= index_.size()) {
+                index_.resize(cached_frame_ + 1, frame_index_entry{});
+            }
+
+            auto& entry = index_[cached_frame_];
+
+            // A slot written since the index was last stored is reused when the
+            // frame still fits, or grown when it sits at the end of the data
+            // file. Any other frame moves to a new slot, so the stored index keeps
+            // pointing at intact data.
+            const bool fresh = fresh_.count(cached_frame_) > 0;
+
+            if (fresh && entry.capacity > 0 && stored_size > entry.capacity && entry.offset + entry.capacity == data_end_) {
+                entry.capacity = stored_size;
+                data_end_ = entry.offset + entry.capacity;
+            }
+            else if (!fresh || stored_size > entry.capacity) {
+                release_slot(cached_frame_);
+
+                const auto found = allocate_slot(stored_size);
+                entry.offset = found.offset;
+                entry.capacity = found.capacity;
+                fresh_.insert(cached_frame_);
+            }
+
+            if (::pwrite(data_fd_, data, stored_size, entry.offset) != static_cast<ssize_t>(stored_size)) {
+                errno = EIO;
+                return -1;
+            }
+
+            entry.stored_size = stored_size;
+            entry.raw_size = cached_frame_size_;
+            entry.flags = flags;
+
+            frame_dirty_ = false;
+            index_dirty_ = true;
+
+            return 0;
+        } // flush_frame
+
+        std::string path_;
+        int data_fd_ = -1;
+        std::uint32_t frame_size_ = default_frame_size;
+        std::uint64_t logical_size_ = 0;
+        std::uint64_t position_ = 0;
+        std::uint64_t data_end_ = 0;
+        std::vector<frame_index_entry> index_;
+        std::set<std::uint64_t> fresh_; // Frames whose slot the stored index does not refer to.
+        std::vector<slot> free_;        // Slots nothing refers to.
+        std::vector<slot> released_;    // Slots only the stored index refers to.
+        std::vector<char> frame_buffer_;
+        std::vector<char> scratch_;
+        std::uint64_t cached_frame_ = no_frame;
+        std::uint32_t cached_frame_size_ = 0;
+        bool frame_dirty_ = false;
+        bool index_dirty_ = false;
+        int incompressible_streak_ = 0;
+        int skipped_frames_ = 0;
+    }; // class compressed_object
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_COMPRESSED_OBJECT_HPP
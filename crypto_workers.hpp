@@ -0,0 +1,108 @@
+#ifndef KDD_SCPPS_CRYPTO_WORKERS_HPP
+#define KDD_SCPPS_CRYPTO_WORKERS_HPP
+
+#include "resource_limits.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // A fixed set of threads that run CPU-bound jobs (encryption, decryption,
+    // key derivation). One pool is meant to be shared by everything a process
+    // does.
+    //
+    // The threads are started by the first submit(). Threads do not survive
+    // fork(), so a pool may be created by the parent before it forks, but a
+    // process that used its pool must not fork a child that uses it too. The
+    // child's copy would have no threads and its jobs would never run.
+    class crypto_workers
+    {
+    public:
+        // _threads of 0 uses resource_sizing::worker_threads.
+        explicit crypto_workers(unsigned _threads = 0)
+            : size_{_threads > 0 ? _threads : resource_probe::derive(resource_probe{}.detect()).worker_threads}
+        {
+        } // crypto_workers (constructor)
+
+        crypto_workers(const crypto_workers&) = delete;
+        auto operator=(const crypto_workers&) -> crypto_workers& = delete;
+
+        ~crypto_workers()
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                stopping_ = true;
+            }
+
+            ready_.notify_all();
+
+            for (auto& t : threads_) {
+                t.join();
+            }
+        } // destructor
+
+        std::future<int> submit(std::function<int()> _job)
+        {
+            std::packaged_task<int()> task{std::move(_job)};
+            auto result = task.get_future();
+
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                jobs_.push_back(std::move(task));
+
+                if (threads_.empty()) {
+                    for (unsigned i = 0; i < size_; ++i) {
+                        threads_.emplace_back([this] { run(); });
+                    }
+                }
+            }
+
+            ready_.notify_one();
+
+            return result;
+        } // submit
+
+        std::size_t size() const noexcept
+        {
+            return size_;
+        } // size
+
+    private:
+        void run()
+        {
+            for (;;) {
+                std::packaged_task<int()> task;
+
+                {
+                    std::unique_lock<std::mutex> lock{mutex_};
+                    ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+
+                    if (jobs_.empty()) {
+                        return;
+                    }
+
+                    task = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+
+                task();
+            }
+        } // run
+
+        unsigned size_;
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<std::packaged_task<int()>> jobs_;
+        std::vector<std::thread> threads_;
+        bool stopping_ = false;
+    }; // class crypto_workers
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_CRYPTO_WORKERS_HPP
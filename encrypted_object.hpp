@@ -0,0 +1,446 @@
+#ifndef KDD_SCPPS_ENCRYPTED_OBJECT_HPP
+#define KDD_SCPPS_ENCRYPTED_OBJECT_HPP
+
+#include "crypto_workers.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    using master_key = std::array<unsigned char, 32>;
+
+    // An object encrypted at rest with AES-256-XTS.
+    //
+    // The data is encrypted in 4 KB sectors, each tweaked with its sector number,
+    // so any range can be read or rewritten without touching the rest of the
+    // object, and ciphertext is exactly as large as plaintext. Every object has
+    // its own key, derived from the master key and a random salt stored in the
+    // object's header. OpenSSL picks AES-NI/VAES code paths when the CPU has them
+    // and portable code otherwise.
+    //
+    // XTS protects confidentiality only. Integrity comes from the block
+    // checksums (see checksummed_file), which can be layered on top.
+    //
+    // Large transfers are split into chunks. Chunks are encrypted on the worker
+    // pool while the calling thread writes the chunks that are already done, and
+    // read ahead while earlier chunks are decrypted, so the cipher runs in
+    // parallel with disk I/O.
+    class encrypted_object
+    {
+    public:
+        static constexpr std::size_t sector_size = 4096;
+        static constexpr std::size_t chunk_sectors = 256;
+
+        explicit encrypted_object(crypto_workers& _workers)
+            : workers_{_workers}
+        {
+        } // encrypted_object (constructor)
+
+        encrypted_object(const encrypted_object&) = delete;
+        auto operator=(const encrypted_object&) -> encrypted_object& = delete;
+
+        ~encrypted_object()
+        {
+            close();
+        } // destructor
+
+        // Opens the object at _path. Partial sectors are written by merging them
+        // with their current contents, so write access (O_WRONLY or O_RDWR) opens
+        // the file for reading and writing. O_APPEND is ignored.
+        int open(const std::string& _path, int _flags, const master_key& _key)
+        {
+            if ((_flags & O_ACCMODE) != O_RDONLY) {
+                _flags = (_flags & ~(O_ACCMODE | O_APPEND)) | O_RDWR;
+            }
+
+            fd_ = ::open(_path.c_str(), _flags, S_IRUSR | S_IWUSR);
+            if (fd_ == -1) {
+                return -1;
+            }
+
+            if (load_header() == -1 || derive_key(_key) == -1) {
+                const auto saved_errno = errno;
+                close();
+                errno = saved_errno;
+                return -1;
+            }
+
+            return 0;
+        } // open
+
+        void close()
+        {
+            if (fd_ != -1) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+
+            OPENSSL_cleanse(key_.data(), key_.size());
+        } // close
+
+        std::uint64_t size() const noexcept
+        {
+            return header_.size;
+        } // size
+
+        ssize_t pwrite(const void* _buffer, std::size_t _count, std::uint64_t _offset)
+        {
+            if (_count == 0) {
+                return 0;
+            }
+
+            const auto* in = static_cast<const unsigned char*>(_buffer);
+            const auto end = _offset + _count;
+
+            // Bytes between the current end of the object and _offset read as
+            // zeros, so they are encrypted along with the new data.
+            const auto begin = std::min(_offset, header_.size);
+            const auto first = begin / sector_size;
+            const auto last = (end + sector_size - 1) / sector_size;
+
+            auto fill = [=](std::uint64_t _sector, unsigned char* _plain) {
+                const auto sector_begin = _sector * sector_size;
+
+                // Sectors only partly covered by the write are merged with their
+                // current contents.
+                if (sector_begin < _offset || sector_begin + sector_size > end) {
+                    if (sector_begin >= header_.size) {
+                        std::memset(_plain, 0, sector_size);
+                    }
+                    else if (read_sectors(_sector, 1, _plain) == -1) {
+                        return -1;
+                    }
+
+                    const auto keep = header_.size > sector_begin ? header_.size - sector_begin : 0;
+                    if (keep < sector_size) {
+                        std::memset(_plain + keep, 0, sector_size - keep);
+                    }
+                }
+
+                const auto from = std::max(sector_begin, _offset);
+                const auto to = std::min(sector_begin + sector_size, end);
+                if (from < to) {
+                    std::memcpy(_plain + (from - sector_begin), in + (from - _offset), to - from);
+                }
+
+                return 0;
+            };
+
+            const bool ok = pipeline(first, last, [&](std::uint64_t _chunk, std::uint64_t _sectors, unsigned char* _buf) {
+                return workers_.submit([=] {
+                    for (std::uint64_t i = 0; i < _sectors; ++i) {
+                        if (fill(_chunk + i, _buf + i * sector_size) == -1) {
+                            return -1;
+                        }
+                    }
+
+                    return transform(true, _chunk, _sectors, _buf, _buf);
+                });
+            }, [&](std::uint64_t _chunk, std::uint64_t _sectors, unsigned char* _buf) {
+                const auto bytes = static_cast<ssize_t>(_sectors * sector_size);
+                return ::pwrite(fd_, _buf, bytes, data_offset(_chunk)) == bytes ? 0 : -1;
+            });
+
+            if (!ok) {
+                return -1;
+            }
+
+            if (end > header_.size) {
+                header_.size = end;
+                if (store_header() == -1) {
+                    return -1;
+                }
+            }
+
+            return static_cast<ssize_t>(_count);
+        } // pwrite
+
+        ssize_t pread(void* _buffer, std::size_t _count, std::uint64_t _offset)
+        {
+            if (_offset >= header_.size) {
+                return 0;
+            }
+
+            auto* out = static_cast<unsigned char*>(_buffer);
+            const auto end = std::min<std::uint64_t>(header_.size, _offset + _count);
+            const auto first = _offset / sector_size;
+            const auto last = (end + sector_size - 1) / sector_size;
+
+            // The calling thread reads each chunk and hands it to a worker, then
+            // goes on to read the next chunk while the worker decrypts.
+            const bool ok = pipeline(first, last, [&](std::uint64_t _chunk, std::uint64_t _sectors, unsigned char* _buf) {
+                const auto bytes = static_cast<ssize_t>(_sectors * sector_size);
+
+                if (::pread(fd_, _buf, bytes, data_offset(_chunk)) != bytes) {
+                    std::promise<int> failed;
+                    failed.set_value(-1);
+                    return failed.get_future();
+                }
+
+                return workers_.submit([=] {
+                    if (transform(false, _chunk, _sectors, _buf, _buf) == -1) {
+                        return -1;
+                    }
+
+                    const auto chunk_begin = _chunk * sector_size;
+                    const auto from = std::max(chunk_begin, _offset);
+                    const auto to = std::min(chunk_begin + _sectors * sector_size, end);
+                    std::memcpy(out + (from - _offset), _buf + (from - chunk_begin), to - from);
+
+                    return 0;
+                });
+            }, [](std::uint64_t, std::uint64_t, unsigned char*) {
+                return 0;
+            });
+
+            return ok ? static_cast<ssize_t>(end - _offset) : -1;
+        } // pread
+
+        int truncate(std::uint64_t _size)
+        {
+            if (_size == header_.size) {
+                return 0;
+            }
+
+            if (_size > header_.size) {
+                // Growing is a write of zeros, which pwrite() does for the gap.
+                const unsigned char zero = 0;
+                return pwrite(&zero, 1, _size - 1) == 1 ? 0 : -1;
+            }
+
+            // Clear the cut-off part of the new last sector, so growing the object
+            // later reads zeros there and not the old data.
+            if (const auto tail = _size % sector_size; tail > 0) {
+                std::array<unsigned char, sector_size> plain;
+                const auto sector = _size / sector_size;
+
+                if (read_sectors(sector, 1, plain.data()) == -1) {
+                    return -1;
+                }
+
+                std::memset(plain.data() + tail, 0, sector_size - tail);
+
+                if (transform(true, sector, 1, plain.data(), plain.data()) == -1 ||
+                    ::pwrite(fd_, plain.data(), sector_size, data_offset(sector)) != static_cast<ssize_t>(sector_size))
+                {
+                    return -1;
+                }
+            }
+
+            header_.size = _size;
+
+            if (store_header() == -1) {
+                return -1;
+            }
+
+            return ::ftruncate(fd_, data_offset((_size + sector_size - 1) / sector_size));
+        } // truncate
+
+        int sync()
+        {
+            return ::fdatasync(fd_);
+        } // sync
+
+    private:
+        static constexpr std::size_t header_size = sector_size;
+        static constexpr std::uint32_t header_version = 1;
+        static constexpr char header_magic[8] = {'S', 'C', 'P', 'P', 'S', 'E', 'N', 'C'};
+
+        struct header
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t sector_size;
+            std::uint64_t size;
+            unsigned char salt[16];
+        }; // struct header
+
+        using prepare_fn = std::function<std::future<int>(std::uint64_t, std::uint64_t, unsigned char*)>;
+        using complete_fn = std::function<int(std::uint64_t, std::uint64_t, unsigned char*)>;
+
+        static std::uint64_t data_offset(std::uint64_t _sector)
+        {
+            return header_size + _sector * sector_size;
+        } // data_offset
+
+        // Runs _prepare for every chunk of [_first, _last) and _complete for the
+        // chunks in order once their prepare job has finished. At most two chunks
+        // per worker are in flight, which bounds the memory used.
+        bool pipeline(std::uint64_t _first, std::uint64_t _last, const prepare_fn& _prepare, const complete_fn& _complete)
+        {
+            struct in_flight
+            {
+                std::uint64_t chunk;
+                std::uint64_t sectors;
+                std::size_t buffer;
+                std::future<int> result;
+            }; // struct in_flight
+
+            const auto depth = 2 * workers_.size();
+            buffers_.resize(std::max(buffers_.size(), depth));
+
+            std::deque<in_flight> queue;
+            std::vector<std::size_t> free_buffers;
+            for (std::size_t i = 0; i < depth; ++i) {
+                free_buffers.push_back(i);
+            }
+
+            bool ok = true;
+
+            auto retire = [&] {
+                auto& front = queue.front();
+                ok = front.result.get() == 0 && ok &&
+                     _complete(front.chunk, front.sectors, buffers_[front.buffer].data()) == 0;
+                free_buffers.push_back(front.buffer);
+                queue.pop_front();
+            };
+
+            for (auto chunk = _first; chunk < _last && ok; chunk += chunk_sectors) {
+                if (free_buffers.empty()) {
+                    retire();
+                }
+
+                const auto sectors = std::min<std::uint64_t>(chunk_sectors, _last - chunk);
+                const auto buffer = free_buffers.back();
+                free_buffers.pop_back();
+
+                buffers_[buffer].resize(chunk_sectors * sector_size);
+                queue.push_back({chunk, sectors, buffer, _prepare(chunk, sectors, buffers_[buffer].data())});
+            }
+
+            // Jobs still reference the buffers, so wait for all of them even after
+            // a failure.
+            while (!queue.empty()) {
+                retire();
+            }
+
+            return ok;
+        } // pipeline
+
+        // Reads and decrypts sectors. Sectors past the end of the file read as
+        // zeros.
+        int read_sectors(std::uint64_t _sector, std::uint64_t _count, unsigned char* _out) const
+        {
+            const auto bytes = static_cast<ssize_t>(_count * sector_size);
+            const auto n = ::pread(fd_, _out, bytes, data_offset(_sector));
+
+            if (n < 0) {
+                return -1;
+            }
+
+            std::memset(_out + n, 0, bytes - n);
+
+            return transform(false, _sector, _count, _out, _out);
+        } // read_sectors
+
+        int transform(bool _encrypt, std::uint64_t _sector, std::uint64_t _count, const unsigned char* _in, unsigned char* _out) const
+        {
+            EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+            // The key schedule is set up once. Only the tweak changes per sector.
+            bool ok = ctx && EVP_CipherInit_ex(ctx, EVP_aes_256_xts(), nullptr, key_.data(), nullptr, _encrypt) == 1;
+
+            for (std::uint64_t i = 0; i < _count && ok; ++i) {
+                unsigned char tweak[16]{};
+                const auto sector = _sector + i;
+
+                for (int b = 0; b < 8; ++b) {
+                    tweak[b] = static_cast<unsigned char>(sector >> (8 * b));
+                }
+
+                int length = 0;
+                ok = EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, tweak, _encrypt) == 1 &&
+                     EVP_CipherUpdate(ctx, _out + i * sector_size, &length, _in + i * sector_size, sector_size) == 1;
+            }
+
+            EVP_CIPHER_CTX_free(ctx);
+
+            if (!ok) {
+                syslog(LOG_ERR | LOG_USER, "AES-XTS %s failed [sector:%lu]", _encrypt ? "encryption" : "decryption", _sector);
+                return -1;
+            }
+
+            return 0;
+        } // transform
+
+        int load_header()
+        {
+            const auto n = ::pread(fd_, &header_, sizeof(header_), 0);
+
+            // A new object needs its header written, which a read-only object
+            // cannot do.
+            if (n == 0 && (::fcntl(fd_, F_GETFL) & O_ACCMODE) != O_RDONLY) {
+                // A new object. Give it its own salt.
+                std::memcpy(header_.magic, header_magic, sizeof(header_magic));
+                header_.version = header_version;
+                header_.sector_size = sector_size;
+                header_.size = 0;
+
+                if (RAND_bytes(header_.salt, sizeof(header_.salt)) != 1) {
+                    errno = EIO;
+                    return -1;
+                }
+
+                return store_header();
+            }
+
+            if (n != sizeof(header_) || std::memcmp(header_.magic, header_magic, sizeof(header_magic)) != 0 ||
+                header_.version != header_version || header_.sector_size != sector_size)
+            {
+                syslog(LOG_ERR | LOG_USER, "Not an encrypted object [fd:%d]", fd_);
+                errno = EINVAL;
+                return -1;
+            }
+
+            return 0;
+        } // load_header
+
+        int store_header()
+        {
+            return ::pwrite(fd_, &header_, sizeof(header_), 0) == sizeof(header_) ? 0 : -1;
+        } // store_header
+
+        // XTS takes two independent AES-256 keys. Both are derived from the master
+        // key and the object's salt with HMAC-SHA-512.
+        int derive_key(const master_key& _key)
+        {
+            unsigned int length = 0;
+
+            if (!HMAC(EVP_sha512(), _key.data(), _key.size(), header_.salt, sizeof(header_.salt), key_.data(), &length) ||
+                length != key_.size() || std::memcmp(key_.data(), key_.data() + 32, 32) == 0)
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            return 0;
+        } // derive_key
+
+        crypto_workers& workers_;
+        int fd_ = -1;
+        header header_{};
+        std::array<unsigned char, 64> key_{};
+        std::vector<std::vector<unsigned char>> buffers_;
+    }; // class encrypted_object
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_ENCRYPTED_OBJECT_HPP
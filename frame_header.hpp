@@ -0,0 +1,154 @@
+#ifndef KDD_SCPPS_FRAME_HEADER_HPP
+#define KDD_SCPPS_FRAME_HEADER_HPP
+
+#include "block_checksum.hpp"
+#include "message_generated.h"
+
+#include <boost/endian/buffers.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace kdd::scpps
+{
+    // Every frame starts with a 4-byte little-endian word. In version 1 frames
+    // this word is the body length, which never reaches the top byte (the top
+    // bit marks compact messages, see compact_message.hpp). A version 2 frame
+    // stores its version in the top byte and the body length in the lower 24
+    // bits, followed by the rest of frame_header_v2.
+    //
+    // Everything needed to route, prioritize, rate limit or forward a frame is
+    // in the header, so none of that requires parsing the body.
+    constexpr std::uint8_t frame_version_2 = 2;
+    constexpr std::uint32_t max_frame_body_size = (1u << 24) - 1;
+
+    enum frame_flags : std::uint16_t
+    {
+        frame_compressed  = 1 << 0, // The body is zlib-compressed.
+        frame_checksummed = 1 << 1, // The body ends with a CRC-32C of the bytes before it.
+        frame_batched     = 1 << 2, // The body holds several messages, each prefixed with a 4-byte length.
+        frame_compact     = 1 << 3  // The body is a compact_message.
+    };
+
+    struct frame_header_v2
+    {
+        boost::endian::little_uint32_buf_t version_and_length;
+        boost::endian::little_uint16_buf_t opcode;     // An api_no. For batches, the operation of the first message.
+        boost::endian::little_uint16_buf_t flags;      // See frame_flags.
+        boost::endian::little_uint64_buf_t request_id; // Chosen by the client and echoed in responses.
+    }; // struct frame_header_v2
+
+    static_assert(sizeof(frame_header_v2) == 16, "frame_header_v2 must not contain padding");
+
+    // Returns the frame version given the first 4 bytes of a frame.
+    inline std::uint8_t frame_version(std::uint32_t _first_word) noexcept
+    {
+        return (_first_word & 0x80000000u) ? 1 : std::max<std::uint8_t>(1, _first_word >> 24);
+    } // frame_version
+
+    inline std::uint32_t frame_body_size(const frame_header_v2& _header) noexcept
+    {
+        return _header.version_and_length.value() & max_frame_body_size;
+    } // frame_body_size
+
+    inline frame_header_v2 make_frame_header(api_no _opcode, std::uint16_t _flags, std::uint64_t _request_id, std::uint32_t _body_size) noexcept
+    {
+        frame_header_v2 header;
+        header.version_and_length = (std::uint32_t{frame_version_2} << 24) | (_body_size & max_frame_body_size);
+        header.opcode = _opcode;
+        header.flags = _flags;
+        header.request_id = _request_id;
+
+        return header;
+    } // make_frame_header
+
+    // Verifies and strips the CRC-32C trailer of a frame_checksummed body.
+    // Returns false if the body is too short to hold one or does not match it.
+    inline bool verify_frame_checksum(const char* _body, std::size_t& _size) noexcept
+    {
+        boost::endian::little_uint32_buf_t expected;
+
+        if (_size < sizeof(expected)) {
+            return false;
+        }
+
+        std::memcpy(&expected, _body + _size - sizeof(expected), sizeof(expected));
+
+        if (crc32c(_body, _size - sizeof(expected)) != expected.value()) {
+            return false;
+        }
+
+        _size -= sizeof(expected);
+
+        return true;
+    } // verify_frame_checksum
+
+    // Walks the messages of a frame_batched body, each prefixed with its
+    // 4-byte little-endian length.
+    class batch_reader
+    {
+    public:
+        batch_reader(const char* _body, std::size_t _size) noexcept
+            : next_{_body}
+            , remaining_{_size}
+        {
+        } // batch_reader (constructor)
+
+        // Returns the next message in _data and _length, or false at the end of
+        // the body. A truncated length prefix or message also ends the walk, and
+        // malformed() turns true.
+        bool next(const char*& _data, std::size_t& _length) noexcept
+        {
+            if (remaining_ == 0 || malformed_) {
+                return false;
+            }
+
+            boost::endian::little_uint32_buf_t length;
+
+            if (remaining_ < sizeof(length)) {
+                malformed_ = true;
+                return false;
+            }
+
+            std::memcpy(&length, next_, sizeof(length));
+
+            if (length.value() > remaining_ - sizeof(length)) {
+                malformed_ = true;
+                return false;
+            }
+
+            _data = next_ + sizeof(length);
+            _length = length.value();
+
+            next_ += sizeof(length) + _length;
+            remaining_ -= sizeof(length) + _length;
+
+            return true;
+        } // next
+
+        bool malformed() const noexcept
+        {
+            return malformed_;
+        } // malformed
+
+        // The part of the body that next() has not returned yet.
+        const char* rest() const noexcept
+        {
+            return next_;
+        } // rest
+
+        std::size_t rest_size() const noexcept
+        {
+            return remaining_;
+        } // rest_size
+
+    private:
+        const char* next_;
+        std::size_t remaining_;
+        bool malformed_ = false;
+    }; // class batch_reader
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_FRAME_HEADER_HPP
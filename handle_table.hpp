@@ -0,0 +1,180 @@
+#ifndef KDD_SCPPS_HANDLE_TABLE_HPP
+#define KDD_SCPPS_HANDLE_TABLE_HPP
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // The handle returned by data_object_open. The low 16 bits select a slot in
+    // the session's handle table and the high 16 bits hold the generation of
+    // that slot at the time the handle was issued.
+    using handle_type = std::uint32_t;
+
+    inline constexpr handle_type invalid_handle = 0;
+
+    // A dense table mapping handles to per-handle state.
+    //
+    // Slots live in a single contiguous array and freed slots are kept on an
+    // intrusive free list, so insertion, lookup and removal are O(1) and a
+    // lookup touches exactly one slot. Every slot carries a generation counter.
+    // It is odd while the slot is in use and incremented again when the slot is
+    // freed, so a handle to a closed object never matches the slot's current
+    // generation, even after the slot has been reused.
+    //
+    // A slot whose generation would wrap around is retired instead of reused.
+    // This guarantees that a stale handle can never alias a live one.
+    template <typename T>
+    class handle_table
+    {
+    public:
+        static constexpr std::uint32_t slot_bits = 16;
+        static constexpr std::uint32_t max_slots = std::uint32_t{1} << slot_bits;
+
+        handle_table() = default;
+
+        explicit handle_table(std::size_t _reserve)
+        {
+            slots_.reserve(_reserve);
+        } // handle_table (constructor)
+
+        // Stores _value and returns its handle, or invalid_handle if the table
+        // is full.
+        template <typename... Args>
+        handle_type emplace(Args&&... _args)
+        {
+            std::uint32_t index;
+
+            if (free_head_ != end_of_list) {
+                index = free_head_;
+            }
+            else if (slots_.size() < max_slots) {
+                index = static_cast<std::uint32_t>(slots_.size());
+                slots_.emplace_back();
+            }
+            else {
+                return invalid_handle;
+            }
+
+            // The slot only leaves the free list once the value is constructed,
+            // so a throwing constructor leaves the table unchanged.
+            auto& slot = slots_[index];
+            slot.value.emplace(std::forward<Args>(_args)...);
+
+            if (index == free_head_) {
+                free_head_ = slot.next_free;
+            }
+
+            ++slot.generation;
+            ++size_;
+
+            return make_handle(index, slot.generation);
+        } // emplace
+
+        // Returns a pointer to the value for _handle, or nullptr if the handle is
+        // unknown, stale or forged. Handles come from clients, so an even
+        // generation (which names a free slot) is rejected as well.
+        T* find(handle_type _handle) noexcept
+        {
+            const auto index = _handle & slot_mask;
+            const auto generation = _handle >> slot_bits;
+
+            if (index >= slots_.size() || (generation & 1) == 0) {
+                return nullptr;
+            }
+
+            auto& slot = slots_[index];
+
+            if (slot.generation != generation || !slot.value) {
+                return nullptr;
+            }
+
+            return &*slot.value;
+        } // find
+
+        const T* find(handle_type _handle) const noexcept
+        {
+            return const_cast<handle_table*>(this)->find(_handle);
+        } // find
+
+        // Destroys the value for _handle. Returns false if the handle is unknown,
+        // stale or forged, in which case the table is left untouched.
+        bool erase(handle_type _handle)
+        {
+            if (!find(_handle)) {
+                return false;
+            }
+
+            const auto index = _handle & slot_mask;
+            auto& slot = slots_[index];
+
+            slot.value.reset();
+            ++slot.generation;
+            --size_;
+
+            // Retire the slot rather than let its generation wrap.
+            if (slot.generation < generation_mask) {
+                slot.next_free = free_head_;
+                free_head_ = index;
+            }
+
+            return true;
+        } // erase
+
+        std::size_t size() const noexcept
+        {
+            return size_;
+        } // size
+
+        bool empty() const noexcept
+        {
+            return size_ == 0;
+        } // empty
+
+        // Invokes _func(handle, value) for every live entry.
+        template <typename Func>
+        void for_each(Func&& _func)
+        {
+            for (std::uint32_t i = 0; i < slots_.size(); ++i) {
+                if (auto& slot = slots_[i]; slot.value) {
+                    _func(make_handle(i, slot.generation), *slot.value);
+                }
+            }
+        } // for_each
+
+        void clear()
+        {
+            for (handle_type i = 0; i < slots_.size(); ++i) {
+                if (slots_[i].value) {
+                    erase(make_handle(i, slots_[i].generation));
+                }
+            }
+        } // clear
+
+    private:
+        static constexpr std::uint32_t slot_mask = max_slots - 1;
+        static constexpr std::uint32_t generation_mask = (std::uint32_t{1} << (32 - slot_bits)) - 1;
+        static constexpr std::uint32_t end_of_list = ~std::uint32_t{0};
+
+        struct slot
+        {
+            std::uint32_t generation = 0; // Odd while in use.
+            std::uint32_t next_free = end_of_list;
+            std::optional<T> value;
+        }; // struct slot
+
+        static handle_type make_handle(std::uint32_t _index, std::uint32_t _generation) noexcept
+        {
+            // The generation is odd for live slots, so a valid handle is never 0.
+            return (_generation << slot_bits) | _index;
+        } // make_handle
+
+        std::vector<slot> slots_;
+        std::uint32_t free_head_ = end_of_list;
+        std::size_t size_ = 0;
+    }; // class handle_table
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_HANDLE_TABLE_HPP
@@ -0,0 +1,520 @@
+#ifndef KDD_SCPPS_HUGE_PAGE_REGION_HPP
+#define KDD_SCPPS_HUGE_PAGE_REGION_HPP
+
+#include "lock_profiler.hpp"
+
+#include <fmt/format.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // A large anonymous memory region backed by huge pages whenever possible.
+    //
+    // Allocation is attempted in the following order:
+    // 1. Explicit hugetlb pages (MAP_HUGETLB). These are guaranteed to be huge
+    //    but only exist if the administrator reserved them (vm.nr_hugepages).
+    // 2. A region aligned to the huge page size and advised with MADV_HUGEPAGE,
+    //    which lets transparent huge pages back it when the kernel can find
+    //    contiguous memory.
+    // 3. Regular 4 KB pages.
+    //
+    // Since THP is best effort, huge_page_coverage() reports the fraction of the
+    // region the kernel actually backed with huge pages.
+    //
+    // The fork policy decides what a forked child sees of the region. Every
+    // inherited page has to be write-protected and its page table entries
+    // copied during fork(), so large regions the children never touch make
+    // every fork slower:
+    // - inherit:      The child shares the pages copy-on-write (the default).
+    // - exclude:      The region does not exist in the child (MADV_DONTFORK).
+    //                 Use for parent-only caches and pools.
+    // - wipe_on_fork: The child gets the region zero-filled (MADV_WIPEONFORK).
+    //                 Use for per-process scratch space. The kernel refuses this
+    //                 for hugetlb mappings, so such regions use THP at best.
+    class huge_page_region
+    {
+    public:
+        static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+        enum class backing
+        {
+            none,
+            hugetlb,
+            transparent,
+            regular
+        }; // enum class backing
+
+        enum class fork_policy
+        {
+            inherit,
+            exclude,
+            wipe_on_fork
+        }; // enum class fork_policy
+
+        huge_page_region() = default;
+
+        explicit huge_page_region(std::size_t _size, fork_policy _policy = fork_policy::inherit)
+        {
+            size_ = round_up(_size, huge_page_size);
+
+            // 1. Explicit huge pages.
+            if (_policy != fork_policy::wipe_on_fork) {
+                data_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (data_ != MAP_FAILED) {
+                    backing_ = backing::hugetlb;
+                    set_fork_policy(_policy);
+                    return;
+                }
+            }
+
+            // 2. Over-allocate so the region can be aligned to a huge page boundary,
+            //    then give the unaligned head and tail back.
+            const auto padded = size_ + huge_page_size;
+            auto* raw = static_cast<char*>(::mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (raw == MAP_FAILED) {
+                data_ = nullptr;
+                throw std::system_error{errno, std::generic_category(), "Could not map memory region"};
+            }
+
+            auto* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<std::uintptr_t>(raw), huge_page_size));
+            if (const auto head = static_cast<std::size_t>(aligned - raw); head > 0) {
+                ::munmap(raw, head);
+            }
+            if (const auto tail = static_cast<std::size_t>((raw + padded) - (aligned + size_)); tail > 0) {
+                ::munmap(aligned + size_, tail);
+            }
+
+            data_ = aligned;
+            backing_ = ::madvise(data_, size_, MADV_HUGEPAGE) == 0 ? backing::transparent : backing::regular;
+
+            if (backing_ == backing::regular) {
+                syslog(LOG_INFO | LOG_USER, "Huge pages unavailable. Falling back to regular pages [size:%zu]", size_);
+            }
+
+            set_fork_policy(_policy);
+        } // huge_page_region (constructor)
+
+        huge_page_region(const huge_page_region&) = delete;
+        auto operator=(const huge_page_region&) -> huge_page_region& = delete;
+
+        huge_page_region(huge_page_region&& _other) noexcept
+            : data_{std::exchange(_other.data_, nullptr)}
+            , size_{std::exchange(_other.size_, 0)}
+            , backing_{std::exchange(_other.backing_, backing::none)}
+            , fork_policy_{std::exchange(_other.fork_policy_, fork_policy::inherit)}
+        {
+        } // huge_page_region (move constructor)
+
+        auto operator=(huge_page_region&& _other) noexcept -> huge_page_region&
+        {
+            if (this != &_other) {
+                release();
+                data_ = std::exchange(_other.data_, nullptr);
+                size_ = std::exchange(_other.size_, 0);
+                backing_ = std::exchange(_other.backing_, backing::none);
+                fork_policy_ = std::exchange(_other.fork_policy_, fork_policy::inherit);
+            }
+
+            return *this;
+        } // operator=
+
+        ~huge_page_region()
+        {
+            release();
+        } // destructor
+
+        void* data() const noexcept
+        {
+            return data_;
+        } // data
+
+        std::size_t size() const noexcept
+        {
+            return size_;
+        } // size
+
+        backing kind() const noexcept
+        {
+            return backing_;
+        } // kind
+
+        fork_policy policy() const noexcept
+        {
+            return fork_policy_;
+        } // policy
+
+        // Changes what children forked from now on see of the region. Returns
+        // false (and leaves the policy unchanged) if the kernel refused, e.g.
+        // because it predates MADV_WIPEONFORK (Linux 4.14).
+        bool set_fork_policy(fork_policy _policy)
+        {
+            if (!data_ || _policy == fork_policy_) {
+                return true;
+            }
+
+            // Undo the current advice first. The two are independent flags on the
+            // mapping, and only one of them should be set.
+            const int undo = fork_policy_ == fork_policy::exclude ? MADV_DOFORK
+                           : fork_policy_ == fork_policy::wipe_on_fork ? MADV_KEEPONFORK
+                           : 0;
+            const int advice = _policy == fork_policy::exclude ? MADV_DONTFORK
+                             : _policy == fork_policy::wipe_on_fork ? MADV_WIPEONFORK
+                             : 0;
+
+            if ((undo && ::madvise(data_, size_, undo) == -1) || (advice && ::madvise(data_, size_, advice) == -1)) {
+                syslog(LOG_ERR | LOG_USER, "Could not set fork policy of memory region [size:%zu]: %m", size_);
+                return false;
+            }
+
+            fork_policy_ = _policy;
+
+            return true;
+        } // set_fork_policy
+
+        // Returns the fraction (0 to 1) of the region backed by huge pages. For
+        // THP regions this inspects /proc/self/smaps, so it is meant for metrics
+        // and should not be called on a hot path.
+        double huge_page_coverage() const
+        {
+            switch (backing_) {
+                case backing::hugetlb:     return 1.0;
+                case backing::transparent: break;
+                default:                   return 0.0;
+            }
+
+            std::FILE* smaps = std::fopen("/proc/self/smaps", "r");
+            if (!smaps) {
+                return 0.0;
+            }
+
+            const auto begin = reinterpret_cast<std::uintptr_t>(data_);
+            const auto end = begin + size_;
+
+            std::size_t huge_bytes = 0;
+            bool inside = false;
+            char line[256];
+
+            while (std::fgets(line, sizeof(line), smaps)) {
+                std::uintptr_t lo;
+                std::uintptr_t hi;
+
+                // Mapping headers look like "7f1c00000000-7f1c00200000 rw-p ...". Every
+                // other line is a "Key: value" pair describing the last header.
+                if (std::sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+                    inside = lo < end && hi > begin;
+                    continue;
+                }
+
+                std::size_t kb;
+                if (inside && std::sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+                    huge_bytes += kb * 1024;
+                }
+            }
+
+            std::fclose(smaps);
+
+            return static_cast<double>(huge_bytes) / size_;
+        } // huge_page_coverage
+
+    private:
+        static std::size_t round_up(std::size_t _value, std::size_t _multiple) noexcept
+        {
+            return (_value + _multiple - 1) / _multiple * _multiple;
+        } // round_up
+
+        void release() noexcept
+        {
+            if (data_ && data_ != MAP_FAILED) {
+                ::munmap(data_, size_);
+            }
+
+            data_ = nullptr;
+            size_ = 0;
+            backing_ = backing::none;
+            fork_policy_ = fork_policy::inherit;
+        } // release
+
+        void* data_ = nullptr;
+        std::size_t size_ = 0;
+        backing backing_ = backing::none;
+        fork_policy fork_policy_ = fork_policy::inherit;
+    }; // class huge_page_region
+
+    // Resident memory of the calling process, split by what a fork() does with
+    // it. Only inherited anonymous pages cost the fork time (their page table
+    // entries are copied and write-protected) and cost the parent copies when it
+    // writes to them while children are alive.
+    struct fork_footprint
+    {
+        std::size_t inherited = 0; // Anonymous pages shared copy-on-write with children.
+        std::size_t excluded = 0;  // Resident in MADV_DONTFORK mappings.
+        std::size_t wiped = 0;     // Resident in MADV_WIPEONFORK mappings.
+    }; // struct fork_footprint
+
+    // Reads /proc/self/smaps, so it is meant for metrics and should not be
+    // called on a hot path.
+    inline fork_footprint measure_fork_footprint()
+    {
+        fork_footprint footprint;
+
+        std::FILE* smaps = std::fopen("/proc/self/smaps", "r");
+        if (!smaps) {
+            return footprint;
+        }
+
+        // VmFlags is the last line of every mapping, so the sizes seen before it
+        // are only attributed once the flags are known.
+        std::size_t rss = 0;
+        std::size_t anonymous = 0;
+        char line[512];
+
+        while (std::fgets(line, sizeof(line), smaps)) {
+            std::size_t kb;
+
+            if (std::sscanf(line, "Rss: %zu kB", &kb) == 1) {
+                rss = kb * 1024;
+            }
+            else if (std::sscanf(line, "Anonymous: %zu kB", &kb) == 1) {
+                anonymous = kb * 1024;
+            }
+            else if (std::strncmp(line, "VmFlags:", 8) == 0) {
+                // "dc" is VM_DONTCOPY (MADV_DONTFORK), "wf" is VM_WIPEONFORK.
+                if (std::strstr(line, " dc")) {
+                    footprint.excluded += rss;
+                }
+                else if (std::strstr(line, " wf")) {
+                    footprint.wiped += rss;
+                }
+                else {
+                    footprint.inherited += anonymous;
+                }
+
+                rss = 0;
+                anonymous = 0;
+            }
+        }
+
+        std::fclose(smaps);
+
+        return footprint;
+    } // measure_fork_footprint
+
+    // A pool of fixed-size buffers carved out of a single huge page region. Meant
+    // for I/O buffers and cache blocks, where random access over a large working
+    // set would otherwise thrash the TLB.
+    //
+    // Neither server uses one. Session buffers start small and grow and shrink
+    // with the memory governor, while a pool pins at least one 2 MB page per
+    // process whether a session needs it or not. mapped_object_cache maps the
+    // object files themselves, which anonymous huge pages cannot back.
+    //
+    // A pool owned by the parent should be excluded from forks. A pool every
+    // process uses on its own should be wiped on fork. The free list lives on
+    // the heap and is always inherited, so a fork handler brings it in line
+    // with the region in the child:
+    // - exclude:      The pool is empty in the child. acquire() returns nullptr.
+    // - wipe_on_fork: Every buffer is free in the child. The buffers the
+    //                 parent had acquired belong to the parent.
+    // - inherit:      The child keeps the parent's free list and the buffers
+    //                 it had acquired, copy-on-write.
+    class buffer_pool
+    {
+    public:
+        using fork_policy = huge_page_region::fork_policy;
+
+        buffer_pool(std::size_t _buffer_size, std::size_t _buffer_count, fork_policy _policy = fork_policy::inherit)
+            : region_{_buffer_size * _buffer_count, _policy}
+            , buffer_size_{_buffer_size}
+            , buffer_count_{_buffer_count}
+        {
+            refill();
+            registry::instance().add(this);
+        } // buffer_pool (constructor)
+
+        buffer_pool(const buffer_pool&) = delete;
+        auto operator=(const buffer_pool&) -> buffer_pool& = delete;
+
+        ~buffer_pool()
+        {
+            registry::instance().remove(this);
+        } // destructor
+
+        // Returns nullptr when the pool is exhausted.
+        void* acquire()
+        {
+            std::lock_guard lock{mutex_};
+
+            if (free_.empty()) {
+                return nullptr;
+            }
+
+            auto* buffer = free_.back();
+            free_.pop_back();
+
+            return buffer;
+        } // acquire
+
+        void release(void* _buffer)
+        {
+            std::lock_guard lock{mutex_};
+            free_.push_back(static_cast<char*>(_buffer));
+        } // release
+
+        std::size_t buffer_size() const noexcept
+        {
+            return buffer_size_;
+        } // buffer_size
+
+        const huge_page_region& region() const noexcept
+        {
+            return region_;
+        } // region
+
+        // One line per live pool in this process, with its free buffers and
+        // the fraction of its region backed by huge pages. Reads
+        // /proc/self/smaps for THP regions, so it is meant for metrics.
+        static std::string report()
+        {
+            return registry::instance().report();
+        } // report
+
+    private:
+        // Every live pool, so that the fork handlers can reach them. The
+        // handlers hold the registry's and every pool's lock across fork(), so
+        // the child never inherits a lock another thread held.
+        class registry
+        {
+        public:
+            static registry& instance()
+            {
+                static registry r;
+                return r;
+            } // instance
+
+            void add(buffer_pool* _pool)
+            {
+                std::lock_guard lock{mutex_};
+                pools_.push_back(_pool);
+            } // add
+
+            void remove(buffer_pool* _pool)
+            {
+                std::lock_guard lock{mutex_};
+                pools_.erase(std::remove(std::begin(pools_), std::end(pools_), _pool), std::end(pools_));
+            } // remove
+
+            std::string report()
+            {
+                static constexpr const char* backings[] = {"none", "hugetlb", "transparent", "regular"};
+                static constexpr const char* policies[] = {"inherit", "exclude", "wipe_on_fork"};
+
+                std::lock_guard lock{mutex_};
+                std::string out;
+
+                for (auto* pool : pools_) {
+                    std::size_t free = 0;
+                    {
+                        std::lock_guard pool_lock{pool->mutex_};
+                        free = pool->free_.size();
+                    }
+
+                    const auto& region = pool->region_;
+                    out += fmt::format("buffer_pool: buffers={}x{} free={} backing={} fork={} huge_pages={:.0f}%\n",
+                                       pool->buffer_count_,
+                                       pool->buffer_size_,
+                                       free,
+                                       backings[static_cast<int>(region.kind())],
+                                       policies[static_cast<int>(region.policy())],
+                                       region.huge_page_coverage() * 100);
+                }
+
+                return out;
+            } // report
+
+        private:
+            registry()
+            {
+                ::pthread_atfork(&prepare, &parent, &child);
+            } // registry (constructor)
+
+            static void prepare()
+            {
+                auto& r = instance();
+                r.mutex_.lock();
+
+                for (auto* pool : r.pools_) {
+                    pool->mutex_.lock();
+                }
+            } // prepare
+
+            static void parent()
+            {
+                auto& r = instance();
+
+                for (auto* pool : r.pools_) {
+                    pool->mutex_.unlock();
+                }
+
+                r.mutex_.unlock();
+            } // parent
+
+            static void child()
+            {
+                auto& r = instance();
+
+                for (auto* pool : r.pools_) {
+                    pool->after_fork();
+                    pool->mutex_.unlock();
+                }
+
+                r.mutex_.unlock();
+            } // child
+
+            std::mutex mutex_;
+            std::vector<buffer_pool*> pools_;
+        }; // class registry
+
+        void refill()
+        {
+            free_.clear();
+            free_.reserve(buffer_count_);
+
+            auto* base = static_cast<char*>(region_.data());
+            for (std::size_t i = buffer_count_; i > 0; --i) {
+                free_.push_back(base + (i - 1) * buffer_size_);
+            }
+        } // refill
+
+        // Runs in the child, with mutex_ held.
+        void after_fork()
+        {
+            switch (region_.policy()) {
+                case fork_policy::exclude:      free_.clear(); break;
+                case fork_policy::wipe_on_fork: refill(); break;
+                case fork_policy::inherit:      break;
+            }
+        } // after_fork
+
+        huge_page_region region_;
+        std::size_t buffer_size_;
+        std::size_t buffer_count_;
+        profiled_spinlock mutex_{"buffer_pool"};
+        std::vector<char*> free_;
+    }; // class buffer_pool
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_HUGE_PAGE_REGION_HPP
@@ -0,0 +1,436 @@
+#ifndef KDD_SCPPS_LOCK_PROFILER_HPP
+#define KDD_SCPPS_LOCK_PROFILER_HPP
+
+#include <fmt/format.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // Contention statistics of one named lock site. All locks constructed with
+    // the same name share a site, e.g. every tiered_storage instance.
+    //
+    // Only sampled acquisitions are timed. Acquisitions and contended
+    // acquisitions are counted exactly while profiling is enabled. A failed
+    // try_lock() counts as contended but not as an acquisition.
+    struct lock_site
+    {
+        explicit lock_site(std::string _name)
+            : name{std::move(_name)}
+        {
+        }
+
+        const std::string name;
+        std::atomic<std::uint64_t> acquisitions{0};
+        std::atomic<std::uint64_t> contended{0}; // The lock was not free on the first try.
+        std::atomic<std::uint64_t> sampled{0};
+        std::atomic<std::uint64_t> wait_ns{0};   // Sum over sampled acquisitions.
+        std::atomic<std::uint64_t> wait_max_ns{0};
+        std::atomic<std::uint64_t> hold_sampled{0};
+        std::atomic<std::uint64_t> hold_ns{0};   // Sum over sampled exclusive holds.
+        std::atomic<std::uint64_t> hold_max_ns{0};
+        std::atomic<std::uint64_t> shared_hold_sampled{0};
+        std::atomic<std::uint64_t> shared_hold_ns{0}; // Sum over sampled shared holds.
+        std::atomic<std::uint64_t> shared_hold_max_ns{0};
+    }; // struct lock_site
+
+    // The registry of lock sites and the global sampling switch.
+    //
+    // Profiling is off by default. A disabled profiler costs each lock() one
+    // relaxed load and a predictable branch. When enabled, every lock() first
+    // tries to take the lock without blocking to tell contended acquisitions
+    // apart, and one in sample_every acquisitions (per thread) is timed.
+    //
+    // Statistics are per process. Children forked after enable() inherit the
+    // setting and start with the parent's counts.
+    class lock_profiler
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static lock_profiler& instance()
+        {
+            static lock_profiler profiler;
+            return profiler;
+        } // instance
+
+        // Returns the site called _name, creating it on first use. Meant to be
+        // called when a lock is constructed, not when it is taken.
+        lock_site& site(const std::string& _name)
+        {
+            std::lock_guard lock{mutex_};
+
+            const auto iter = std::find_if(std::begin(sites_), std::end(sites_), [&_name](const lock_site& s) {
+                return s.name == _name;
+            });
+
+            return iter != std::end(sites_) ? *iter : sites_.emplace_back(_name);
+        } // site
+
+        // Times one in _sample_every acquisitions. Zero disables profiling.
+        void enable(std::uint32_t _sample_every)
+        {
+            sample_every_.store(_sample_every, std::memory_order_relaxed);
+        } // enable
+
+        void disable()
+        {
+            enable(0);
+        } // disable
+
+        bool enabled() const noexcept
+        {
+            return sample_every_.load(std::memory_order_relaxed) != 0;
+        } // enabled
+
+        std::uint32_t sample_every() const noexcept
+        {
+            return sample_every_.load(std::memory_order_relaxed);
+        } // sample_every
+
+        // One line per site, the _top sites with the highest total (sampled) wait
+        // time first: acquisitions, contended acquisitions, and the average and
+        // maximum wait and hold times in microseconds. Sites taken in shared mode
+        // also report their shared hold times.
+        std::string report(std::size_t _top = 10) const
+        {
+            struct row
+            {
+                const lock_site* site;
+                std::uint64_t wait_ns;
+            };
+
+            std::vector<row> rows;
+
+            {
+                std::lock_guard lock{mutex_};
+
+                for (const auto& s : sites_) {
+                    if (s.acquisitions.load(std::memory_order_relaxed) > 0) {
+                        rows.push_back({&s, s.wait_ns.load(std::memory_order_relaxed)});
+                    }
+                }
+            }
+
+            std::sort(std::begin(rows), std::end(rows), [](const row& _a, const row& _b) {
+                return _a.wait_ns > _b.wait_ns;
+            });
+
+            rows.resize(std::min(rows.size(), _top));
+
+            std::string out = fmt::format("lock profiling: sample_every={}\n", sample_every());
+
+            for (const auto& r : rows) {
+                const auto& s = *r.site;
+                const auto sampled = std::max<std::uint64_t>(1, s.sampled.load(std::memory_order_relaxed));
+                const auto hold_sampled = std::max<std::uint64_t>(1, s.hold_sampled.load(std::memory_order_relaxed));
+
+                out += fmt::format("{}: acquisitions={} contended={} wait_avg={:.1f}us wait_max={:.1f}us hold_avg={:.1f}us hold_max={:.1f}us",
+                                   s.name,
+                                   s.acquisitions.load(std::memory_order_relaxed),
+                                   s.contended.load(std::memory_order_relaxed),
+                                   r.wait_ns / 1e3 / sampled,
+                                   s.wait_max_ns.load(std::memory_order_relaxed) / 1e3,
+                                   s.hold_ns.load(std::memory_order_relaxed) / 1e3 / hold_sampled,
+                                   s.hold_max_ns.load(std::memory_order_relaxed) / 1e3);
+
+                if (const auto shared_sampled = s.shared_hold_sampled.load(std::memory_order_relaxed); shared_sampled > 0) {
+                    out += fmt::format(" shared_hold_avg={:.1f}us shared_hold_max={:.1f}us",
+                                       s.shared_hold_ns.load(std::memory_order_relaxed) / 1e3 / shared_sampled,
+                                       s.shared_hold_max_ns.load(std::memory_order_relaxed) / 1e3);
+                }
+
+                out += '\n';
+            }
+
+            return out;
+        } // report
+
+        // Clears the statistics of all sites, e.g. between benchmark runs.
+        void reset()
+        {
+            std::lock_guard lock{mutex_};
+
+            for (auto& s : sites_) {
+                for (auto* counter : {&s.acquisitions, &s.contended, &s.sampled, &s.wait_ns, &s.wait_max_ns, &s.hold_sampled, &s.hold_ns, &s.hold_max_ns,
+                                      &s.shared_hold_sampled, &s.shared_hold_ns, &s.shared_hold_max_ns}) {
+                    counter->store(0, std::memory_order_relaxed);
+                }
+            }
+        } // reset
+
+        // Decides whether the calling thread times this acquisition.
+        bool sample() noexcept
+        {
+            thread_local std::uint32_t countdown = 0;
+
+            if (countdown == 0) {
+                countdown = std::max(1u, sample_every()) - 1;
+                return true;
+            }
+
+            --countdown;
+
+            return false;
+        } // sample
+
+        static std::uint64_t since(clock::time_point _start) noexcept
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count();
+        } // since
+
+        static void record_max(std::atomic<std::uint64_t>& _max, std::uint64_t _value) noexcept
+        {
+            auto current = _max.load(std::memory_order_relaxed);
+            while (_value > current && !_max.compare_exchange_weak(current, _value, std::memory_order_relaxed)) {
+            }
+        } // record_max
+
+    private:
+        lock_profiler() = default;
+
+        mutable std::mutex mutex_;
+        std::deque<lock_site> sites_; // A deque never moves its elements.
+        std::atomic<std::uint32_t> sample_every_{0};
+    }; // class lock_profiler
+
+    // Wraps a lockable type and records its contention at a lock_site. Sampled
+    // exclusive and shared holds are timed separately. Shared holds overlap, so
+    // their start times are kept per thread rather than in the lock.
+    //
+    // Meets the Lockable requirements (and SharedLockable if Lockable does), so
+    // it works with std::lock_guard, std::unique_lock, std::shared_lock and
+    // std::condition_variable_any.
+    template <typename Lockable>
+    class profiled_lock
+    {
+    public:
+        explicit profiled_lock(const std::string& _site)
+            : site_{lock_profiler::instance().site(_site)}
+        {
+        } // profiled_lock (constructor)
+
+        profiled_lock(const profiled_lock&) = delete;
+        auto operator=(const profiled_lock&) -> profiled_lock& = delete;
+
+        void lock()
+        {
+            auto& profiler = lock_profiler::instance();
+
+            if (!profiler.enabled()) {
+                lock_.lock();
+                return;
+            }
+
+            site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+            const bool timed = profiler.sample();
+            const auto start = timed ? lock_profiler::clock::now() : lock_profiler::clock::time_point{};
+
+            if (!lock_.try_lock()) {
+                site_.contended.fetch_add(1, std::memory_order_relaxed);
+                lock_.lock();
+            }
+
+            if (timed) {
+                record_wait(start);
+                held_since_ = lock_profiler::clock::now();
+            }
+        } // lock
+
+        bool try_lock()
+        {
+            auto& profiler = lock_profiler::instance();
+
+            if (!profiler.enabled()) {
+                return lock_.try_lock();
+            }
+
+            if (!lock_.try_lock()) {
+                site_.contended.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+            if (profiler.sample()) {
+                record_wait(lock_profiler::clock::now());
+                held_since_ = lock_profiler::clock::now();
+            }
+
+            return true;
+        } // try_lock
+
+        void unlock()
+        {
+            // Only the holder writes held_since_, so reading it here is safe.
+            if (held_since_ != lock_profiler::clock::time_point{}) {
+                const auto held = lock_profiler::since(held_since_);
+                held_since_ = {};
+
+                site_.hold_sampled.fetch_add(1, std::memory_order_relaxed);
+                site_.hold_ns.fetch_add(held, std::memory_order_relaxed);
+                lock_profiler::record_max(site_.hold_max_ns, held);
+            }
+
+            lock_.unlock();
+        } // unlock
+
+        void lock_shared()
+        {
+            auto& profiler = lock_profiler::instance();
+
+            if (!profiler.enabled()) {
+                lock_.lock_shared();
+                return;
+            }
+
+            site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+            const bool timed = profiler.sample();
+            const auto start = timed ? lock_profiler::clock::now() : lock_profiler::clock::time_point{};
+
+            if (!lock_.try_lock_shared()) {
+                site_.contended.fetch_add(1, std::memory_order_relaxed);
+                lock_.lock_shared();
+            }
+
+            if (timed) {
+                record_wait(start);
+                shared_holds().emplace_back(this, lock_profiler::clock::now());
+            }
+        } // lock_shared
+
+        bool try_lock_shared()
+        {
+            auto& profiler = lock_profiler::instance();
+
+            if (!profiler.enabled()) {
+                return lock_.try_lock_shared();
+            }
+
+            if (!lock_.try_lock_shared()) {
+                site_.contended.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+            if (profiler.sample()) {
+                record_wait(lock_profiler::clock::now());
+                shared_holds().emplace_back(this, lock_profiler::clock::now());
+            }
+
+            return true;
+        } // try_lock_shared
+
+        void unlock_shared()
+        {
+            auto& holds = shared_holds();
+
+            if (!holds.empty()) {
+                const auto iter = std::find_if(holds.rbegin(), holds.rend(), [this](const auto& _hold) {
+                    return _hold.first == this;
+                });
+
+                if (iter != holds.rend()) {
+                    const auto held = lock_profiler::since(iter->second);
+                    holds.erase(std::next(iter).base());
+
+                    site_.shared_hold_sampled.fetch_add(1, std::memory_order_relaxed);
+                    site_.shared_hold_ns.fetch_add(held, std::memory_order_relaxed);
+                    lock_profiler::record_max(site_.shared_hold_max_ns, held);
+                }
+            }
+
+            lock_.unlock_shared();
+        } // unlock_shared
+
+        const lock_site& site() const noexcept
+        {
+            return site_;
+        } // site
+
+    private:
+        // The sampled shared holds of the calling thread, on any lock. A thread
+        // rarely holds more than a few, so a linear search is enough.
+        static std::vector<std::pair<const profiled_lock*, lock_profiler::clock::time_point>>& shared_holds()
+        {
+            thread_local std::vector<std::pair<const profiled_lock*, lock_profiler::clock::time_point>> holds;
+            return holds;
+        } // shared_holds
+
+        void record_wait(lock_profiler::clock::time_point _start) noexcept
+        {
+            const auto waited = lock_profiler::since(_start);
+
+            site_.sampled.fetch_add(1, std::memory_order_relaxed);
+            site_.wait_ns.fetch_add(waited, std::memory_order_relaxed);
+            lock_profiler::record_max(site_.wait_max_ns, waited);
+        } // record_wait
+
+        Lockable lock_;
+        lock_site& site_;
+        lock_profiler::clock::time_point held_since_{};
+    }; // class profiled_lock
+
+    // A test-and-test-and-set spinlock for critical sections of a few dozen
+    // instructions. Anything longer, or anything that may block, belongs under a
+    // mutex.
+    class spinlock
+    {
+    public:
+        void lock() noexcept
+        {
+            while (locked_.exchange(true, std::memory_order_acquire)) {
+                // Spin on a plain load so that waiting cores don't keep stealing the
+                // cache line from each other.
+                while (locked_.load(std::memory_order_relaxed)) {
+                    pause();
+                }
+            }
+        } // lock
+
+        bool try_lock() noexcept
+        {
+            return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+        } // try_lock
+
+        void unlock() noexcept
+        {
+            locked_.store(false, std::memory_order_release);
+        } // unlock
+
+    private:
+        static void pause() noexcept
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#else
+            std::this_thread::yield();
+#endif
+        } // pause
+
+        std::atomic<bool> locked_{false};
+    }; // class spinlock
+
+    using profiled_mutex = profiled_lock<std::mutex>;
+    using profiled_shared_mutex = profiled_lock<std::shared_mutex>;
+    using profiled_spinlock = profiled_lock<spinlock>;
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_LOCK_PROFILER_HPP
@@ -0,0 +1,355 @@
+#ifndef KDD_SCPPS_MAPPED_OBJECT_CACHE_HPP
+#define KDD_SCPPS_MAPPED_OBJECT_CACHE_HPP
+
+#include "memory_governor.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+namespace kdd::scpps
+{
+    // A read-only mapping of a whole object. Mappings are reference counted, so
+    // one that is evicted or replaced stays valid until the last response using
+    // it has been sent.
+    class mapped_object
+    {
+    public:
+        mapped_object(void* _data, std::size_t _size)
+            : data_{_data}
+            , size_{_size}
+        {
+        } // mapped_object (constructor)
+
+        mapped_object(const mapped_object&) = delete;
+        auto operator=(const mapped_object&) -> mapped_object& = delete;
+
+        ~mapped_object()
+        {
+            if (data_) {
+                ::munmap(data_, size_);
+            }
+        } // destructor
+
+        const char* data() const noexcept
+        {
+            return static_cast<const char*>(data_);
+        } // data
+
+        std::size_t size() const noexcept
+        {
+            return size_;
+        } // size
+
+    private:
+        void* data_;
+        std::size_t size_;
+    }; // class mapped_object
+
+    // Keeps small, frequently read objects mapped so that a read can be answered
+    // with a single writev() of the response header and the mapped bytes, with
+    // no pread() and no copy into a user buffer.
+    //
+    // An object is mapped (with MAP_POPULATE, so serving it never page faults)
+    // once it has been read hot_after times within a hot_window, counting the
+    // reads of all sessions. The server forks a child per connection, so the
+    // read counters live in an anonymous shared mapping and the cache must be
+    // created by the parent before it starts forking. The mappings themselves
+    // belong to the process that made them.
+    //
+    // The shared mapping also holds a generation per object, which invalidate()
+    // bumps. A hit only compares the generation the mapping was made at with
+    // the current one, and never calls stat(). Every handler that writes,
+    // truncates or removes an object must therefore call invalidate() once the
+    // change reached storage. Changes made behind the server's back are not
+    // noticed. Counters and generations are kept per hash bucket, so objects
+    // sharing a bucket heat up and are invalidated together, which costs a
+    // remap at worst.
+    //
+    // The mapped bytes of all processes are charged to a memory_governor
+    // subsystem, whose budget (resource_sizing::cache_budget) caps the cache.
+    // An object that does not fit evicts the least recently used mappings of
+    // the process first. The constructor registers shrink() as the subsystem's
+    // shrinker. A process that dies without destroying the cache leaves its
+    // charge behind.
+    class mapped_object_cache
+    {
+    public:
+        static constexpr std::size_t default_max_object_size = 256 * 1024;
+        static constexpr std::uint32_t hot_after = 2;
+        static constexpr std::chrono::seconds hot_window{60};
+        static constexpr std::uint32_t default_buckets = 4096;
+
+        mapped_object_cache(memory_governor& _governor, memory_governor::subsystem _subsystem,
+                            std::size_t _max_object_size = default_max_object_size,
+                            std::uint32_t _buckets = default_buckets)
+            : governor_{_governor}
+            , subsystem_{_subsystem}
+            , max_object_size_{_max_object_size}
+            , bucket_count_{std::max<std::uint32_t>(_buckets, 1)}
+        {
+            auto* p = ::mmap(nullptr, bucket_count_ * sizeof(bucket), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map object cache state"};
+            }
+
+            // Anonymous mappings are zero-filled: cold and at generation 0.
+            buckets_ = static_cast<bucket*>(p);
+
+            governor_.set_shrinker(subsystem_, [this](auto _bytes) { return shrink(_bytes); });
+        } // mapped_object_cache (constructor)
+
+        mapped_object_cache(const mapped_object_cache&) = delete;
+        auto operator=(const mapped_object_cache&) -> mapped_object_cache& = delete;
+
+        ~mapped_object_cache()
+        {
+            governor_.set_shrinker(subsystem_, nullptr);
+            clear();
+            ::munmap(buckets_, bucket_count_ * sizeof(bucket));
+        } // destructor
+
+        // Returns the mapping for the object at _path, or nullptr if the object is
+        // not (yet) hot, too large, empty or does not fit the budget. The caller
+        // then reads it the usual way.
+        std::shared_ptr<const mapped_object> acquire(const std::string& _path)
+        {
+            auto& b = bucket_of(_path);
+            const auto generation = b.generation.load(std::memory_order_acquire);
+
+            if (const auto iter = entries_.find(_path); iter != std::end(entries_)) {
+                if (iter->second.generation == generation) {
+                    lru_.splice(std::begin(lru_), lru_, iter->second.position);
+                    ++hits_;
+                    return iter->second.mapping;
+                }
+
+                // The object changed but is still hot. Map its new contents right
+                // away.
+                erase(iter);
+                return insert(_path, b, generation);
+            }
+
+            if (heat(b) < hot_after) {
+                return nullptr;
+            }
+
+            return insert(_path, b, generation);
+        } // acquire
+
+        // Drops the mappings of the object at _path in all processes. Called after
+        // the object was written, truncated or removed.
+        void invalidate(const std::string& _path)
+        {
+            bucket_of(_path).generation.fetch_add(1, std::memory_order_release);
+
+            if (const auto iter = entries_.find(_path); iter != std::end(entries_)) {
+                erase(iter);
+            }
+        } // invalidate
+
+        // Unmaps the least recently used objects of this process until at least
+        // _bytes have been freed. Returns the number of bytes freed.
+        std::uint64_t shrink(std::uint64_t _bytes)
+        {
+            std::uint64_t freed = 0;
+
+            while (freed < _bytes && !lru_.empty()) {
+                const auto iter = entries_.find(lru_.back());
+                freed += iter->second.mapping->size();
+                erase(iter);
+            }
+
+            return freed;
+        } // shrink
+
+        void clear()
+        {
+            shrink(mapped_bytes_);
+        } // clear
+
+        std::size_t mapped_bytes() const noexcept
+        {
+            return mapped_bytes_;
+        } // mapped_bytes
+
+        std::uint64_t hits() const noexcept
+        {
+            return hits_;
+        } // hits
+
+        // Sends _header followed by [_offset, _offset + _length) of _object on
+        // _socket with a single writev(). Returns the number of bytes sent, which
+        // may be short on a non-blocking socket.
+        static ssize_t send(int _socket, const void* _header, std::size_t _header_size,
+                            const mapped_object& _object, std::size_t _offset, std::size_t _length)
+        {
+            if (_offset > _object.size()) {
+                _offset = _object.size();
+            }
+
+            if (_length > _object.size() - _offset) {
+                _length = _object.size() - _offset;
+            }
+
+            iovec iov[2] = {
+                {const_cast<void*>(_header), _header_size},
+                {const_cast<char*>(_object.data() + _offset), _length}
+            };
+
+            ssize_t n;
+            do {
+                n = ::writev(_socket, iov, 2);
+            } while (n == -1 && errno == EINTR);
+
+            return n;
+        } // send
+
+    private:
+        struct alignas(16) bucket
+        {
+            std::atomic<std::uint64_t> heat;       // Window number << 32 | reads in that window.
+            std::atomic<std::uint64_t> generation; // Bumped by invalidate().
+        }; // struct bucket
+
+        struct entry
+        {
+            std::shared_ptr<const mapped_object> mapping;
+            std::list<std::string>::iterator position;
+            std::uint64_t generation;
+        }; // struct entry
+
+        using entry_map = std::unordered_map<std::string, entry>;
+
+        bucket& bucket_of(const std::string& _path) const noexcept
+        {
+            return buckets_[std::hash<std::string>{}(_path) % bucket_count_];
+        } // bucket_of
+
+        // Counts a read of a cold object. Returns the number of reads in the
+        // current window, this one included.
+        static std::uint32_t heat(bucket& _bucket) noexcept
+        {
+            const auto now = std::chrono::steady_clock::now().time_since_epoch();
+            const auto window = static_cast<std::uint64_t>(now / hot_window) & 0xffffffff;
+
+            auto current = _bucket.heat.load(std::memory_order_relaxed);
+            std::uint64_t next;
+
+            do {
+                const auto reads = (current >> 32) == window ? (current & 0xffffffff) : 0;
+                next = window << 32 | std::min<std::uint64_t>(reads + 1, 0xffffffff);
+            } while (!_bucket.heat.compare_exchange_weak(current, next, std::memory_order_relaxed));
+
+            return static_cast<std::uint32_t>(next & 0xffffffff);
+        } // heat
+
+        std::shared_ptr<const mapped_object> map(const std::string& _path)
+        {
+            const int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return nullptr;
+            }
+
+            struct stat st;
+            if (::fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+                static_cast<std::size_t>(st.st_size) > max_object_size_)
+            {
+                ::close(fd);
+                return nullptr;
+            }
+
+            const auto size = static_cast<std::size_t>(st.st_size);
+
+            if (!reserve(size)) {
+                ::close(fd);
+                return nullptr;
+            }
+
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            ::close(fd);
+
+            if (data == MAP_FAILED) {
+                syslog(LOG_ERR | LOG_USER, "Could not map %s: %m", _path.c_str());
+                governor_.release(subsystem_, size);
+                return nullptr;
+            }
+
+            return std::make_shared<const mapped_object>(data, size);
+        } // map
+
+        // Charges _size bytes to the cache, unmapping this process' least
+        // recently used objects if that is what it takes to fit the budget.
+        bool reserve(std::size_t _size)
+        {
+            while (!governor_.reserve(subsystem_, _size)) {
+                if (lru_.empty()) {
+                    return false;
+                }
+
+                erase(entries_.find(lru_.back()));
+            }
+
+            return true;
+        } // reserve
+
+        std::shared_ptr<const mapped_object> insert(const std::string& _path, bucket& _bucket, std::uint64_t _generation)
+        {
+            auto mapping = map(_path);
+            if (!mapping) {
+                return nullptr;
+            }
+
+            // A write that completed while the object was being mapped may or may
+            // not be part of the mapping. Serve it this once, but do not keep it.
+            if (_bucket.generation.load(std::memory_order_acquire) != _generation) {
+                governor_.release(subsystem_, mapping->size());
+                return mapping;
+            }
+
+            mapped_bytes_ += mapping->size();
+            lru_.push_front(_path);
+            entries_.emplace(_path, entry{mapping, std::begin(lru_), _generation});
+
+            return mapping;
+        } // insert
+
+        void erase(entry_map::iterator _iter)
+        {
+            const auto size = _iter->second.mapping->size();
+            mapped_bytes_ -= size;
+            governor_.release(subsystem_, size);
+            lru_.erase(_iter->second.position);
+            entries_.erase(_iter);
+        } // erase
+
+        memory_governor& governor_;
+        memory_governor::subsystem subsystem_;
+        std::size_t max_object_size_;
+        std::uint32_t bucket_count_;
+        bucket* buckets_;
+        std::size_t mapped_bytes_ = 0;
+        std::uint64_t hits_ = 0;
+        std::list<std::string> lru_;
+        entry_map entries_;
+    }; // class mapped_object_cache
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_MAPPED_OBJECT_CACHE_HPP
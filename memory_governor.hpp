@@ -0,0 +1,343 @@
+#ifndef KDD_SCPPS_MEMORY_GOVERNOR_HPP
+#define KDD_SCPPS_MEMORY_GOVERNOR_HPP
+
+#include <fmt/format.h>
+
+#include <sys/mman.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace kdd::scpps
+{
+    enum class memory_pressure
+    {
+        none,     // Nothing to do.
+        moderate, // Caches are shrunk.
+        critical  // Caches are shrunk harder and new work is turned away.
+    }; // enum class memory_pressure
+
+    struct memory_governor_config
+    {
+        // Thresholds on the share of time (in percent, averaged over the last 10
+        // seconds) in which some or all tasks were stalled waiting for memory.
+        double moderate_some_avg10 = 10.0;
+        double critical_some_avg10 = 40.0;
+        double critical_full_avg10 = 5.0;
+
+        // Pressure is sampled at most this often. Reading the PSI file is cheap,
+        // but not free.
+        std::chrono::milliseconds poll_interval{1000};
+
+        // See resource_probe::memory_pressure_path().
+        std::string psi_path = "/proc/pressure/memory";
+    }; // struct memory_governor_config
+
+    // Central accounting of the memory held by the server's caches, pools and
+    // buffers.
+    //
+    // Each subsystem is registered with a budget and charges what it allocates
+    // with reserve() and release(). A reservation that would exceed the budget
+    // fails, and the subsystem has to evict or do without.
+    //
+    // On top of the budgets, the governor watches Linux pressure stall
+    // information (PSI). When the system starts stalling on memory, every
+    // process asks its subsystems to give memory back through the shrinkers they
+    // registered. Once pressure turns critical, admit() also starts returning
+    // false so that the accept loop can shed new connections instead of pushing
+    // the machine into the OOM killer.
+    //
+    // The counters live in an anonymous shared mapping, so they cover the
+    // parent and all its children. The governor must be created (and all
+    // subsystems registered) before the parent starts forking. Shrinkers are
+    // process-local and are registered by whichever process owns the memory.
+    class memory_governor
+    {
+    public:
+        using subsystem = std::uint32_t;
+
+        // Called with the number of bytes the subsystem is asked to free. Returns
+        // the number of bytes it actually freed.
+        using shrinker = std::function<std::uint64_t(std::uint64_t)>;
+
+        static constexpr std::uint32_t max_subsystems = 32;
+        static constexpr std::size_t max_name_length = 31;
+
+        explicit memory_governor(memory_governor_config _config = {})
+            : config_{_config}
+            , shrinkers_(max_subsystems)
+        {
+            auto* p = ::mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map memory governor state"};
+            }
+
+            // Anonymous mappings are zero-filled, which is the initial state.
+            state_ = static_cast<shared_state*>(p);
+        } // memory_governor (constructor)
+
+        memory_governor(const memory_governor&) = delete;
+        auto operator=(const memory_governor&) -> memory_governor& = delete;
+
+        ~memory_governor()
+        {
+            ::munmap(state_, sizeof(shared_state));
+        } // destructor
+
+        // Registers a subsystem. A budget of zero means the subsystem is only
+        // accounted, not limited.
+        subsystem add_subsystem(std::string_view _name, std::uint64_t _budget)
+        {
+            const auto id = state_->count.load(std::memory_order_relaxed);
+
+            if (id == max_subsystems || _name.size() > max_name_length) {
+                throw std::invalid_argument{"Could not register memory subsystem"};
+            }
+
+            auto& slot = state_->subsystems[id];
+            std::memcpy(slot.name, _name.data(), _name.size());
+            slot.name[_name.size()] = '\0';
+            slot.budget.store(_budget, std::memory_order_relaxed);
+            state_->count.store(id + 1, std::memory_order_release);
+
+            return id;
+        } // add_subsystem
+
+        void set_budget(subsystem _id, std::uint64_t _budget)
+        {
+            state_->subsystems[_id].budget.store(_budget, std::memory_order_relaxed);
+        } // set_budget
+
+        void set_shrinker(subsystem _id, shrinker _shrinker)
+        {
+            shrinkers_[_id] = std::move(_shrinker);
+        } // set_shrinker
+
+        // Charges _bytes to _id. Returns false, without charging, if that would
+        // exceed the subsystem's budget or if memory pressure is critical.
+        bool reserve(subsystem _id, std::uint64_t _bytes)
+        {
+            auto& slot = state_->subsystems[_id];
+
+            if (pressure() == memory_pressure::critical) {
+                slot.denied.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            const auto budget = slot.budget.load(std::memory_order_relaxed);
+            auto used = slot.used.load(std::memory_order_relaxed);
+
+            do {
+                if (budget > 0 && used + _bytes > budget) {
+                    slot.denied.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            } while (!slot.used.compare_exchange_weak(used, used + _bytes, std::memory_order_relaxed));
+
+            // The peak is informational, so a lost race only makes it slightly low.
+            if (used + _bytes > slot.peak.load(std::memory_order_relaxed)) {
+                slot.peak.store(used + _bytes, std::memory_order_relaxed);
+            }
+
+            return true;
+        } // reserve
+
+        // Charges memory that is in use already, ignoring the budget and the
+        // pressure level.
+        void charge(subsystem _id, std::uint64_t _bytes)
+        {
+            auto& slot = state_->subsystems[_id];
+            const auto used = slot.used.fetch_add(_bytes, std::memory_order_relaxed) + _bytes;
+
+            if (used > slot.peak.load(std::memory_order_relaxed)) {
+                slot.peak.store(used, std::memory_order_relaxed);
+            }
+        } // charge
+
+        void release(subsystem _id, std::uint64_t _bytes)
+        {
+            state_->subsystems[_id].used.fetch_sub(_bytes, std::memory_order_relaxed);
+        } // release
+
+        std::uint64_t used(subsystem _id) const
+        {
+            return state_->subsystems[_id].used.load(std::memory_order_relaxed);
+        } // used
+
+        memory_pressure pressure() const
+        {
+            return static_cast<memory_pressure>(state_->level.load(std::memory_order_relaxed));
+        } // pressure
+
+        // Returns false while memory pressure is critical. The accept loop should
+        // turn new connections away then.
+        bool admit()
+        {
+            if (pressure() != memory_pressure::critical) {
+                return true;
+            }
+
+            state_->shed.fetch_add(1, std::memory_order_relaxed);
+
+            return false;
+        } // admit
+
+        // Samples PSI (at most once per poll interval across all processes) and
+        // runs this process' shrinkers if there is pressure. Meant to be called
+        // from event loops, e.g. when accepting or finishing a request. Every
+        // process that registered shrinkers has to call it, or it never shrinks.
+        memory_pressure poll()
+        {
+            const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            auto last = state_->last_poll.load(std::memory_order_relaxed);
+
+            const bool due = now - last >= std::chrono::duration_cast<std::chrono::steady_clock::duration>(config_.poll_interval).count();
+
+            if (due && state_->last_poll.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+                const auto level = sample();
+
+                if (level != pressure()) {
+                    syslog(LOG_INFO | LOG_USER, "Memory pressure changed [level:%s]", name(level));
+                }
+
+                state_->level.store(static_cast<int>(level), std::memory_order_relaxed);
+            }
+
+            const auto level = pressure();
+
+            // Every process shrinks its own subsystems, but only once per sample.
+            if (level != memory_pressure::none && shrunk_at_ != state_->last_poll.load(std::memory_order_relaxed)) {
+                shrunk_at_ = state_->last_poll.load(std::memory_order_relaxed);
+                shrink(level == memory_pressure::critical ? 2 : 4);
+            }
+
+            return level;
+        } // poll
+
+        // One line per subsystem: name, bytes used, budget, peak, denied
+        // reservations. Followed by the pressure level and the number of shed
+        // connections.
+        std::string report() const
+        {
+            std::string out;
+            const auto count = state_->count.load(std::memory_order_acquire);
+
+            for (std::uint32_t i = 0; i < count; ++i) {
+                const auto& slot = state_->subsystems[i];
+
+                out += fmt::format("{}: used={} budget={} peak={} denied={}\n",
+                                   slot.name,
+                                   slot.used.load(std::memory_order_relaxed),
+                                   slot.budget.load(std::memory_order_relaxed),
+                                   slot.peak.load(std::memory_order_relaxed),
+                                   slot.denied.load(std::memory_order_relaxed));
+            }
+
+            out += fmt::format("pressure={} shed={}\n", name(pressure()), state_->shed.load(std::memory_order_relaxed));
+
+            return out;
+        } // report
+
+    private:
+        struct alignas(64) subsystem_slot
+        {
+            char name[max_name_length + 1];
+            std::atomic<std::uint64_t> used;
+            std::atomic<std::uint64_t> budget;
+            std::atomic<std::uint64_t> peak;
+            std::atomic<std::uint64_t> denied;
+        }; // struct subsystem_slot
+
+        struct shared_state
+        {
+            std::atomic<std::uint32_t> count;
+            std::atomic<int> level;
+            std::atomic<std::int64_t> last_poll;
+            std::atomic<std::uint64_t> shed;
+            subsystem_slot subsystems[max_subsystems];
+        }; // struct shared_state
+
+        static const char* name(memory_pressure _level)
+        {
+            switch (_level) {
+                case memory_pressure::none    : return "none";
+                case memory_pressure::moderate: return "moderate";
+                case memory_pressure::critical: return "critical";
+            }
+
+            return "?";
+        } // name
+
+        // Reads the "some" and "full" 10 second averages. Kernels without PSI
+        // (or with PSI disabled) never report pressure.
+        memory_pressure sample() const
+        {
+            std::FILE* file = std::fopen(config_.psi_path.c_str(), "r");
+            if (!file) {
+                return memory_pressure::none;
+            }
+
+            double some = 0;
+            double full = 0;
+            char kind[8];
+            double avg10;
+
+            while (std::fscanf(file, "%7s avg10=%lf %*[^\n]", kind, &avg10) == 2) {
+                if (std::strcmp(kind, "some") == 0) {
+                    some = avg10;
+                }
+                else if (std::strcmp(kind, "full") == 0) {
+                    full = avg10;
+                }
+            }
+
+            std::fclose(file);
+
+            if (some >= config_.critical_some_avg10 || full >= config_.critical_full_avg10) {
+                return memory_pressure::critical;
+            }
+
+            if (some >= config_.moderate_some_avg10) {
+                return memory_pressure::moderate;
+            }
+
+            return memory_pressure::none;
+        } // sample
+
+        // Asks every subsystem to give back 1/_divisor of its usage. A process
+        // holding less than that frees what it has.
+        void shrink(std::uint64_t _divisor)
+        {
+            const auto count = state_->count.load(std::memory_order_acquire);
+
+            for (std::uint32_t i = 0; i < count; ++i) {
+                const auto target = used(i) / _divisor;
+
+                if (shrinkers_[i] && target > 0) {
+                    const auto freed = shrinkers_[i](target);
+                    syslog(LOG_INFO | LOG_USER, "Shrunk %s [pid:%d, target:%lu, freed:%lu]",
+                           state_->subsystems[i].name, getpid(), target, freed);
+                }
+            }
+        } // shrink
+
+        memory_governor_config config_;
+        shared_state* state_;
+        std::vector<shrinker> shrinkers_;
+        std::int64_t shrunk_at_ = 0;
+    }; // class memory_governor
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_MEMORY_GOVERNOR_HPP
@@ -0,0 +1,356 @@
+#ifndef KDD_SCPPS_MERKLE_DIGEST_HPP
+#define KDD_SCPPS_MERKLE_DIGEST_HPP
+
+#include "resource_limits.hpp"
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    using sha256_digest = std::array<unsigned char, 32>;
+
+    inline std::string to_hex(const sha256_digest& _digest)
+    {
+        std::string hex;
+        hex.reserve(_digest.size() * 2);
+
+        for (const auto b : _digest) {
+            hex += fmt::format("{:02x}", b);
+        }
+
+        return hex;
+    } // to_hex
+
+    // Computes SHA-256 Merkle digests of objects and byte ranges of objects.
+    //
+    // The range is split along a fixed grid of chunks (the grid always starts at
+    // offset 0 of the object, so ranges that share chunks share work). Leaf
+    // digests are SHA-256(0x00 || chunk) and interior nodes are
+    // SHA-256(0x01 || left || right). A node without a sibling is promoted to the
+    // next level unchanged. The prefixes keep a leaf from ever being mistaken for
+    // an interior node.
+    //
+    // Leaves are hashed in parallel on as many threads as the cgroup's CPU
+    // quota allows. Digests of whole chunks and of the subtrees built from them
+    // are cached, so a second request over an unchanged file hashes next to
+    // nothing.
+    //
+    // The cache is only trusted while the file looks exactly as it did when
+    // the digests were taken (size, mtime, ctime and inode). Any change, by
+    // this process or another one, drops it. Timestamps are coarse, so a write
+    // can leave them unchanged if it lands shortly after the previous one.
+    // Digests of a file modified within the last racy_window_ns are therefore not
+    // kept either. Writers in this process may still call invalidate() for the
+    // ranges they modify.
+    class merkle_digest
+    {
+    public:
+        static constexpr std::size_t default_chunk_size = 1024 * 1024;
+        static constexpr std::int64_t racy_window_ns = 1000000000;
+
+        // _threads of 0 uses resource_sizing::worker_threads.
+        explicit merkle_digest(std::size_t _chunk_size = default_chunk_size, unsigned _threads = 0)
+            : chunk_size_{_chunk_size}
+            , threads_{_threads > 0 ? _threads : resource_probe::derive(resource_probe{}.detect()).worker_threads}
+        {
+        } // merkle_digest (constructor)
+
+        // Computes the digest of [_offset, _offset + _length) of the file open
+        // on _fd. A length of 0 means "up to the end of the file". Returns -1 on
+        // I/O errors.
+        int compute(int _fd, std::uint64_t _offset, std::uint64_t _length, sha256_digest& _digest)
+        {
+            struct stat st;
+            if (::fstat(_fd, &st) == -1) {
+                return -1;
+            }
+
+            const auto size = static_cast<std::uint64_t>(st.st_size);
+            const file_stamp stamp{size, st.st_mtim, st.st_ctim, st.st_ino, st.st_dev};
+
+            if (racy_ || !(stamp == stamp_)) {
+                // The file may have changed. Nothing cached can be trusted.
+                valid_.assign(valid_.size(), 0);
+                nodes_.clear();
+            }
+
+            leaves_.resize((size + chunk_size_ - 1) / chunk_size_);
+            valid_.resize(leaves_.size(), 0);
+
+            // Files modified a moment ago may change again without their
+            // timestamps showing it, so what is hashed now is not reused.
+            stamp_ = stamp;
+            racy_ = is_recent(st.st_mtim) || is_recent(st.st_ctim);
+
+            const auto begin = std::min(_offset, size);
+            const auto end = _length == 0 ? size : std::min(size, _offset + _length);
+
+            std::vector<leaf> range;
+
+            for (auto pos = begin; pos < end;) {
+                const auto index = pos / chunk_size_;
+                const auto next = std::min(end, (index + 1) * chunk_size_);
+                const bool whole = pos == index * chunk_size_ && (next == (index + 1) * chunk_size_ || next == size);
+
+                range.push_back({pos, next, whole ? static_cast<std::int64_t>(index) : -1, {}});
+                pos = next;
+            }
+
+            if (hash_leaves(_fd, range) == -1) {
+                return -1;
+            }
+
+            std::vector<node> level;
+            level.reserve(range.size());
+
+            for (const auto& l : range) {
+                level.push_back({l.digest, l.cache_index, 1});
+            }
+
+            if (level.empty()) {
+                const unsigned char prefix = 0;
+                return hash({{&prefix, 1}}, _digest);
+            }
+
+            for (unsigned height = 1; level.size() > 1; ++height) {
+                std::vector<node> parent;
+                parent.reserve((level.size() + 1) / 2);
+
+                for (std::size_t i = 0; i + 1 < level.size(); i += 2) {
+                    if (combine(level[i], level[i + 1], height, parent.emplace_back()) == -1) {
+                        return -1;
+                    }
+                }
+
+                if (level.size() % 2 == 1) {
+                    parent.push_back(level.back());
+                }
+
+                level = std::move(parent);
+            }
+
+            _digest = level.front().digest;
+
+            return 0;
+        } // compute
+
+        // Drops cached digests of all chunks overlapping [_offset, _offset + _length).
+        void invalidate(std::uint64_t _offset, std::uint64_t _length)
+        {
+            if (_length == 0) {
+                return;
+            }
+
+            const auto first = _offset / chunk_size_;
+            const auto last = std::min<std::uint64_t>((_offset + _length - 1) / chunk_size_ + 1, valid_.size());
+
+            for (auto i = first; i < last; ++i) {
+                valid_[i] = 0;
+            }
+
+            // Subtrees are keyed by their height and first chunk, so the ones
+            // covering chunk i start at most 2^height - 1 chunks before it.
+            for (unsigned height = 1; height < 64 && (std::uint64_t{1} << (height - 1)) < valid_.size(); ++height) {
+                const auto span = std::uint64_t{1} << height;
+                const auto from = first >= span ? first - span + 1 : 0;
+
+                nodes_.erase(nodes_.lower_bound({height, from}), nodes_.lower_bound({height, last}));
+            }
+        } // invalidate
+
+        // Chunks read and hashed so far, as opposed to taken from the cache.
+        std::uint64_t chunks_hashed() const noexcept
+        {
+            return chunks_hashed_;
+        } // chunks_hashed
+
+    private:
+        struct leaf
+        {
+            std::uint64_t begin;
+            std::uint64_t end;
+            std::int64_t cache_index; // -1 for partial chunks, which are not cached.
+            sha256_digest digest;
+        }; // struct leaf
+
+        // A subtree of the range being digested. Subtrees made of whole chunks
+        // only are the same for every range containing them, and are cached.
+        struct node
+        {
+            sha256_digest digest;
+            std::int64_t first;  // First chunk, or -1 if the subtree includes a partial one.
+            std::uint64_t count; // Number of chunks.
+        }; // struct node
+
+        struct span
+        {
+            const unsigned char* data;
+            std::size_t size;
+        }; // struct span
+
+        struct file_stamp
+        {
+            std::uint64_t size = 0;
+            timespec mtime{};
+            timespec ctime{};
+            ino_t inode = 0;
+            dev_t device = 0;
+
+            bool operator==(const file_stamp& _other) const noexcept
+            {
+                return size == _other.size && inode == _other.inode && device == _other.device &&
+                       mtime.tv_sec == _other.mtime.tv_sec && mtime.tv_nsec == _other.mtime.tv_nsec &&
+                       ctime.tv_sec == _other.ctime.tv_sec && ctime.tv_nsec == _other.ctime.tv_nsec;
+            }
+        }; // struct file_stamp
+
+        static bool is_recent(const timespec& _time)
+        {
+            timespec now;
+            ::clock_gettime(CLOCK_REALTIME, &now);
+
+            const auto age = (static_cast<std::int64_t>(now.tv_sec) - _time.tv_sec) * 1000000000 + (now.tv_nsec - _time.tv_nsec);
+
+            return age < racy_window_ns;
+        } // is_recent
+
+        // Builds the parent of _left and _right at _height, from the cache if
+        // possible.
+        int combine(const node& _left, const node& _right, unsigned _height, node& _parent)
+        {
+            const auto full = std::uint64_t{1} << (_height - 1);
+            const bool cacheable = _left.first >= 0 && _right.first >= 0 && _left.count == full && _right.count == full;
+
+            _parent.first = cacheable ? _left.first : -1;
+            _parent.count = _left.count + _right.count;
+
+            const auto key = std::make_pair(_height, static_cast<std::uint64_t>(_left.first));
+
+            if (cacheable) {
+                if (const auto iter = nodes_.find(key); iter != std::end(nodes_)) {
+                    _parent.digest = iter->second;
+                    return 0;
+                }
+            }
+
+            const unsigned char prefix = 1;
+
+            if (hash({{&prefix, 1}, {_left.digest.data(), 32}, {_right.digest.data(), 32}}, _parent.digest) == -1) {
+                return -1;
+            }
+
+            if (cacheable) {
+                nodes_.emplace(key, _parent.digest);
+            }
+
+            return 0;
+        } // combine
+
+        static int hash(std::initializer_list<span> _parts, sha256_digest& _digest)
+        {
+            EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+            bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1;
+
+            for (const auto& part : _parts) {
+                ok = ok && EVP_DigestUpdate(ctx, part.data, part.size) == 1;
+            }
+
+            ok = ok && EVP_DigestFinal_ex(ctx, _digest.data(), nullptr) == 1;
+            EVP_MD_CTX_free(ctx);
+
+            return ok ? 0 : -1;
+        } // hash
+
+        int hash_leaves(int _fd, std::vector<leaf>& _leaves)
+        {
+            // Collect the leaves that have to be read from disk.
+            std::vector<leaf*> work;
+
+            for (auto& l : _leaves) {
+                if (l.cache_index >= 0 && valid_[l.cache_index]) {
+                    l.digest = leaves_[l.cache_index];
+                }
+                else {
+                    work.push_back(&l);
+                }
+            }
+
+            if (work.empty()) {
+                return 0;
+            }
+
+            const auto workers = std::min<std::size_t>(work.size(), threads_);
+            std::atomic<std::size_t> next{0};
+            std::atomic<bool> failed{false};
+
+            auto run = [&] {
+                std::vector<unsigned char> buffer(chunk_size_);
+                const unsigned char prefix = 0;
+
+                for (auto i = next++; i < work.size() && !failed; i = next++) {
+                    auto& l = *work[i];
+                    const auto length = static_cast<std::size_t>(l.end - l.begin);
+
+                    if (::pread(_fd, buffer.data(), length, l.begin) != static_cast<ssize_t>(length) ||
+                        hash({{&prefix, 1}, {buffer.data(), length}}, l.digest) == -1)
+                    {
+                        failed = true;
+                    }
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (std::size_t i = 1; i < workers; ++i) {
+                threads.emplace_back(run);
+            }
+
+            run();
+
+            for (auto& t : threads) {
+                t.join();
+            }
+
+            if (failed) {
+                return -1;
+            }
+
+            chunks_hashed_ += work.size();
+
+            for (const auto* l : work) {
+                if (l->cache_index >= 0) {
+                    leaves_[l->cache_index] = l->digest;
+                    valid_[l->cache_index] = 1;
+                }
+            }
+
+            return 0;
+        } // hash_leaves
+
+        std::size_t chunk_size_;
+        unsigned threads_;
+        file_stamp stamp_{};
+        bool racy_ = false;
+        std::vector<sha256_digest> leaves_;
+        std::vector<char> valid_;
+        std::map<std::pair<unsigned, std::uint64_t>, sha256_digest> nodes_; // (height, first chunk) -> digest.
+        std::uint64_t chunks_hashed_ = 0;
+    }; // class merkle_digest
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_MERKLE_DIGEST_HPP
@@ -0,0 +1,38 @@
+#include "object_layout.hpp"
+
+#include <fmt/format.h>
+
+#include <string>
+
+int main(int _argc, char** _argv)
+{
+    if (_argc < 2 || _argc > 3) {
+        fmt::print(stderr, "Usage: migrate_layout <data root> [objects per second]\n");
+        return 1;
+    }
+
+    try {
+        kdd::scpps::object_layout layout{_argv[1]};
+
+        if (layout.mode() == kdd::scpps::layout_mode::sharded) {
+            fmt::print("{} already uses the sharded layout.\n", _argv[1]);
+            return 0;
+        }
+
+        const auto rate = _argc == 3 ? static_cast<std::uint32_t>(std::stoul(_argv[2])) : 10000u;
+        const auto moved = layout.migrate_to_sharded(rate);
+
+        if (moved < 0) {
+            fmt::print(stderr, "Migration failed. Run the tool again to resume.\n");
+            return 1;
+        }
+
+        fmt::print("Moved {} objects into the sharded layout.\n", moved);
+    }
+    catch (const std::exception& e) {
+        fmt::print(stderr, "Exception: {}\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,587 @@
+#ifndef KDD_SCPPS_OBJECT_LAYOUT_HPP
+#define KDD_SCPPS_OBJECT_LAYOUT_HPP
+
+#include "lock_profiler.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    enum class layout_mode
+    {
+        flat,      // <root>/<name>
+        migrating, // Flat objects are being moved. Lookups check both places.
+        sharded    // <root>/.shards/<h0>/<h1>/<encoded name>
+    }; // enum class layout_mode
+
+    // Maps object names to paths under a data root.
+    //
+    // The flat layout stores an object at its name, so a handful of directories
+    // end up holding millions of entries. The sharded layout hashes the name and
+    // uses the first two bytes of the hash as two levels of 256-way fan-out,
+    // which keeps every directory small even with 10^8 objects. The object file
+    // is named after the object (with '/' and '%' percent-encoded), so the path
+    // alone is enough to recover the name.
+    //
+    // Because hashing scatters names across directories, prefix listings are
+    // served from a name index instead of a directory walk. The index is an
+    // append-only journal ("+name" and "-name" lines) written with O_APPEND, so
+    // forked children can update it concurrently. Each instance keeps the names
+    // in memory and only reads what was appended since its last listing.
+    //
+    // The current mode is recorded in "<root>/.layout", which every lookup
+    // checks for changes, so running servers follow a migration done by
+    // another process. Objects are created under a shared lock on
+    // "<root>/.layout.lock", which a migration holds exclusively while it
+    // switches modes. An object is therefore either created at its flat
+    // location before the migration scans the root, or at its sharded one.
+    class object_layout
+    {
+    public:
+        explicit object_layout(boost::filesystem::path _root)
+            : root_{std::move(_root)}
+        {
+            boost::filesystem::create_directories(root_);
+            refresh_mode();
+        } // object_layout (constructor)
+
+        layout_mode mode() const
+        {
+            std::lock_guard lock{mutex_};
+            return refresh_mode();
+        } // mode
+
+        // Object names are relative paths. Empty names, absolute names, names
+        // with empty, "." or ".." components or with NUL bytes, and names
+        // starting with '.' (reserved for the layout's own files) are invalid.
+        static bool is_valid_name(std::string_view _name) noexcept
+        {
+            if (_name.empty() || _name.size() > max_name_length || _name[0] == '.' ||
+                _name.find('\0') != std::string_view::npos)
+            {
+                return false;
+            }
+
+            for (std::size_t begin = 0; begin <= _name.size();) {
+                const auto end = std::min(_name.find('/', begin), _name.size());
+                const auto component = _name.substr(begin, end - begin);
+
+                if (component.empty() || component == "." || component == "..") {
+                    return false;
+                }
+
+                begin = end + 1;
+            }
+
+            return true;
+        } // is_valid_name
+
+        // Opens object _name like ::open(), creating it (and its parent
+        // directories) at the location of the current mode if necessary.
+        // Returns the file descriptor, or -1 with errno set.
+        int create(std::string_view _name, int _flags, mode_t _mode = S_IRUSR | S_IWUSR) const
+        {
+            if (!is_valid_name(_name)) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            const auto layout_lock = lock_layout(LOCK_SH);
+            if (layout_lock == -1) {
+                return -1;
+            }
+
+            boost::filesystem::path p;
+
+            {
+                std::lock_guard lock{mutex_};
+                p = refresh_mode() == layout_mode::flat ? root_ / std::string{_name} : sharded_path(_name);
+            }
+
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(p.parent_path(), ec);
+
+            const auto fd = ::open(p.c_str(), _flags | O_CREAT, _mode);
+            const auto saved_errno = errno;
+
+            ::close(layout_lock);
+
+            if (fd != -1) {
+                append_journal('+', _name);
+            }
+
+            errno = saved_errno;
+
+            return fd;
+        } // create
+
+        // Returns the path of an existing object, or nothing if the name is
+        // invalid. While a migration is running the object may still be at its
+        // flat location.
+        std::optional<boost::filesystem::path> resolve(std::string_view _name) const
+        {
+            if (!is_valid_name(_name)) {
+                return std::nullopt;
+            }
+
+            std::lock_guard lock{mutex_};
+
+            switch (refresh_mode()) {
+                case layout_mode::flat:
+                    return root_ / std::string{_name};
+
+                case layout_mode::migrating:
+                    // Objects only move from the flat to the sharded location,
+                    // so an object that is not at its flat location any more is
+                    // at its sharded one.
+                    if (auto p = root_ / std::string{_name}; boost::filesystem::exists(p)) {
+                        return p;
+                    }
+                    return sharded_path(_name);
+
+                default:
+                    return sharded_path(_name);
+            }
+        } // resolve
+
+        void record_unlink(std::string_view _name) const
+        {
+            if (is_valid_name(_name)) {
+                append_journal('-', _name);
+            }
+        } // record_unlink
+
+        // Returns the names of all objects starting with _prefix, in order.
+        std::vector<std::string> list(std::string_view _prefix) const
+        {
+            std::lock_guard lock{mutex_};
+
+            refresh_index();
+
+            std::vector<std::string> result;
+
+            for (auto iter = names_.lower_bound(std::string{_prefix});
+                 iter != std::end(names_) && std::string_view{*iter}.substr(0, _prefix.size()) == _prefix;
+                 ++iter)
+            {
+                result.push_back(*iter);
+            }
+
+            return result;
+        } // list
+
+        // Moves every flat object into the sharded layout while the server keeps
+        // running. Each object is hard-linked to its new location before the
+        // old name is removed, so it is reachable at every point in time. At most
+        // _objects_per_second objects are moved to limit the I/O impact. Objects
+        // are moved in batches as the root is walked, so memory use does not
+        // grow with the number of objects.
+        //
+        // Returns the number of objects moved, or -1 on error.
+        std::int64_t migrate_to_sharded(std::uint32_t _objects_per_second = 10000)
+        {
+            namespace fs = boost::filesystem;
+
+            if (mode() == layout_mode::sharded) {
+                return 0;
+            }
+
+            // Waits for objects being created at their flat location. Every later
+            // creation uses the sharded one.
+            if (switch_mode(layout_mode::migrating) == -1) {
+                return -1;
+            }
+
+            std::int64_t moved = 0;
+            std::vector<std::string> batch;
+            const auto shards = root_ / shard_directory;
+            const auto pause = std::chrono::microseconds{1'000'000 / std::max<std::uint32_t>(1, _objects_per_second)};
+
+            auto move_batch = [&] {
+                for (const auto& name : batch) {
+                    const auto from = root_ / name;
+                    const auto to = sharded_path(name);
+
+                    boost::system::error_code ec;
+                    fs::create_directories(to.parent_path(), ec);
+
+                    if (::link(from.c_str(), to.c_str()) == -1 && errno != EEXIST) {
+                        syslog(LOG_ERR | LOG_USER, "Could not migrate object [%s]: %m", name.c_str());
+                        return false;
+                    }
+
+                    ::unlink(from.c_str());
+                    append_journal('+', name);
+                    ++moved;
+
+                    std::this_thread::sleep_for(pause);
+                }
+
+                batch.clear();
+
+                return true;
+            };
+
+            // Entries the walk has already returned can be removed safely.
+            for (fs::recursive_directory_iterator iter{root_}, end; iter != end; ++iter) {
+                if (iter->path() == shards) {
+                    iter.disable_recursion_pending();
+                    continue;
+                }
+
+                if (!fs::is_regular_file(iter->symlink_status())) {
+                    continue;
+                }
+
+                auto name = fs::relative(iter->path(), root_).generic_string();
+                if (!is_valid_name(name)) {
+                    continue;
+                }
+
+                batch.push_back(std::move(name));
+
+                if (batch.size() == migration_batch_size && !move_batch()) {
+                    return -1;
+                }
+            }
+
+            if (!move_batch()) {
+                return -1;
+            }
+
+            remove_empty_directories();
+
+            if (switch_mode(layout_mode::sharded) == -1) {
+                return -1;
+            }
+
+            return moved;
+        } // migrate_to_sharded
+
+        // Rewrites the journal so it only holds live names. Entries appended while
+        // this runs would be lost, so only call it while the server is stopped.
+        int compact_index() const
+        {
+            std::lock_guard lock{mutex_};
+
+            refresh_index();
+
+            const auto tmp = root_ / ".names.tmp";
+
+            {
+                std::ofstream out{tmp.string(), std::ios::trunc};
+                for (const auto& name : names_) {
+                    out << '+' << encode(name) << '\n';
+                }
+
+                if (!out.flush()) {
+                    return -1;
+                }
+            }
+
+            return ::rename(tmp.c_str(), (root_ / index_file).c_str());
+        } // compact_index
+
+        static std::string encode(std::string_view _name)
+        {
+            std::string out;
+            out.reserve(_name.size());
+
+            for (std::size_t i = 0; i < _name.size(); ++i) {
+                const auto c = _name[i];
+
+                if (c == '/' || c == '%' || (c == '.' && i == 0)) {
+                    out += fmt::format("%{:02X}", static_cast<unsigned char>(c));
+                }
+                else {
+                    out += c;
+                }
+            }
+
+            return out;
+        } // encode
+
+        static std::string decode(std::string_view _file_name)
+        {
+            std::string out;
+            out.reserve(_file_name.size());
+
+            for (std::size_t i = 0; i < _file_name.size(); ++i) {
+                if (_file_name[i] == '%' && i + 2 < _file_name.size()) {
+                    out += static_cast<char>(std::stoi(std::string{_file_name.substr(i + 1, 2)}, nullptr, 16));
+                    i += 2;
+                }
+                else {
+                    out += _file_name[i];
+                }
+            }
+
+            return out;
+        } // decode
+
+    private:
+        static constexpr const char* shard_directory = ".shards";
+        static constexpr const char* layout_file = ".layout";
+        static constexpr const char* index_file = ".names";
+        static constexpr const char* lock_file = ".layout.lock";
+        static constexpr std::size_t max_name_length = 4096;
+        static constexpr std::size_t migration_batch_size = 1024;
+
+        static std::uint64_t hash(std::string_view _name) noexcept
+        {
+            // FNV-1a. Stable across builds and platforms, unlike std::hash.
+            std::uint64_t h = 14695981039346656037ull;
+
+            for (const auto c : _name) {
+                h ^= static_cast<unsigned char>(c);
+                h *= 1099511628211ull;
+            }
+
+            return h;
+        } // hash
+
+        boost::filesystem::path sharded_path(std::string_view _name) const
+        {
+            const auto h = hash(_name);
+            return root_ / shard_directory
+                         / fmt::format("{:02x}", (h >> 56) & 0xff)
+                         / fmt::format("{:02x}", (h >> 48) & 0xff)
+                         / encode(_name);
+        } // sharded_path
+
+        // Re-reads the mode if the layout file was replaced since it was last
+        // read. Called with mutex_ held.
+        layout_mode refresh_mode() const
+        {
+            struct stat st;
+            if (::stat((root_ / layout_file).c_str(), &st) == -1) {
+                mode_ = layout_mode::flat;
+                mode_inode_ = 0;
+                return mode_;
+            }
+
+            // The file is only ever replaced by rename(), so a new inode (or a
+            // reused inode with a new modification time) means a new mode.
+            const auto modified = std::chrono::seconds{st.st_mtim.tv_sec} + std::chrono::nanoseconds{st.st_mtim.tv_nsec};
+
+            if (st.st_ino == mode_inode_ && modified == mode_modified_) {
+                return mode_;
+            }
+
+            std::ifstream in{(root_ / layout_file).string()};
+            std::string mode;
+
+            mode_ = layout_mode::flat;
+            mode_inode_ = st.st_ino;
+            mode_modified_ = modified;
+
+            if (in >> mode) {
+                if (mode == "sharded") {
+                    mode_ = layout_mode::sharded;
+                }
+                else if (mode == "migrating") {
+                    mode_ = layout_mode::migrating;
+                }
+            }
+
+            return mode_;
+        } // refresh_mode
+
+        // Returns a descriptor holding a flock() of the given type on the layout
+        // lock file, or -1. Closing the descriptor releases the lock.
+        int lock_layout(int _operation) const
+        {
+            const auto fd = ::open((root_ / lock_file).c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if (fd == -1) {
+                syslog(LOG_ERR | LOG_USER, "Could not open layout lock: %m");
+                return -1;
+            }
+
+            if (::flock(fd, _operation) == -1) {
+                syslog(LOG_ERR | LOG_USER, "Could not lock layout: %m");
+                ::close(fd);
+                return -1;
+            }
+
+            return fd;
+        } // lock_layout
+
+        // Records _mode while no object is being created.
+        int switch_mode(layout_mode _mode)
+        {
+            const auto layout_lock = lock_layout(LOCK_EX);
+            if (layout_lock == -1) {
+                return -1;
+            }
+
+            const auto ec = write_mode(_mode);
+            ::close(layout_lock);
+
+            return ec;
+        } // switch_mode
+
+        int write_mode(layout_mode _mode)
+        {
+            const auto path = root_ / layout_file;
+            const auto tmp = root_ / ".layout.tmp";
+
+            {
+                std::ofstream out{tmp.string(), std::ios::trunc};
+                out << (_mode == layout_mode::sharded ? "sharded" : "migrating") << '\n';
+
+                if (!out.flush()) {
+                    return -1;
+                }
+            }
+
+            if (::rename(tmp.c_str(), path.c_str()) == -1) {
+                return -1;
+            }
+
+            std::lock_guard lock{mutex_};
+            refresh_mode();
+
+            return 0;
+        } // write_mode
+
+        void append_journal(char _op, std::string_view _name) const
+        {
+            const auto fd = ::open((root_ / index_file).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if (fd == -1) {
+                syslog(LOG_ERR | LOG_USER, "Could not open name index: %m");
+                return;
+            }
+
+            // A single write() per entry keeps concurrent appends from interleaving.
+            const auto entry = fmt::format("{}{}\n", _op, encode(_name));
+            if (::write(fd, entry.data(), entry.size()) != static_cast<ssize_t>(entry.size())) {
+                syslog(LOG_ERR | LOG_USER, "Could not update name index: %m");
+            }
+
+            ::close(fd);
+        } // append_journal
+
+        // Applies the journal entries appended since the last call to names_.
+        // The whole journal is only read again after it was compacted. Called
+        // with mutex_ held.
+        void refresh_index() const
+        {
+            const auto fd = ::open((root_ / index_file).c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+
+            if (fd == -1 || ::fstat(fd, &st) == -1) {
+                if (fd != -1) {
+                    ::close(fd);
+                }
+
+                names_.clear();
+                index_offset_ = 0;
+                index_inode_ = 0;
+                return;
+            }
+
+            if (st.st_ino != index_inode_ || static_cast<std::uint64_t>(st.st_size) < index_offset_) {
+                names_.clear();
+                index_offset_ = 0;
+                index_inode_ = st.st_ino;
+            }
+
+            std::string pending;
+            char buffer[64 * 1024];
+
+            for (ssize_t n; (n = ::pread(fd, buffer, sizeof(buffer), index_offset_ + pending.size())) > 0;) {
+                pending.append(buffer, n);
+
+                // Only complete lines are applied. A partial one is read again
+                // next time.
+                const auto complete = pending.rfind('\n');
+                if (complete == std::string::npos) {
+                    continue;
+                }
+
+                apply_journal(std::string_view{pending}.substr(0, complete + 1));
+                index_offset_ += complete + 1;
+                pending.erase(0, complete + 1);
+            }
+
+            ::close(fd);
+        } // refresh_index
+
+        void apply_journal(std::string_view _entries) const
+        {
+            while (!_entries.empty()) {
+                const auto end = _entries.find('\n');
+                const auto line = _entries.substr(0, end);
+                _entries.remove_prefix(end + 1);
+
+                if (line.size() < 2) {
+                    continue;
+                }
+
+                if (line[0] == '+') {
+                    names_.insert(decode(line.substr(1)));
+                }
+                else if (line[0] == '-') {
+                    names_.erase(decode(line.substr(1)));
+                }
+            }
+        } // apply_journal
+
+        void remove_empty_directories() const
+        {
+            namespace fs = boost::filesystem;
+
+            std::vector<fs::path> dirs;
+            const auto shards = root_ / shard_directory;
+
+            for (fs::recursive_directory_iterator iter{root_}, end; iter != end; ++iter) {
+                if (iter->path() == shards) {
+                    iter.disable_recursion_pending();
+                }
+                else if (fs::is_directory(iter->symlink_status())) {
+                    dirs.push_back(iter->path());
+                }
+            }
+
+            // Deepest directories first.
+            for (auto iter = dirs.rbegin(); iter != dirs.rend(); ++iter) {
+                boost::system::error_code ec;
+                if (fs::is_empty(*iter, ec)) {
+                    fs::remove(*iter, ec);
+                }
+            }
+        } // remove_empty_directories
+
+        boost::filesystem::path root_;
+        mutable profiled_mutex mutex_{"object_layout"};
+        mutable layout_mode mode_ = layout_mode::flat;
+        mutable ino_t mode_inode_ = 0;
+        mutable std::chrono::nanoseconds mode_modified_{};
+        mutable std::set<std::string> names_;
+        mutable std::uint64_t index_offset_ = 0; // Journal bytes applied to names_.
+        mutable ino_t index_inode_ = 0;
+    }; // class object_layout
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_OBJECT_LAYOUT_HPP
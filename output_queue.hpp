@@ -0,0 +1,255 @@
+#ifndef KDD_SCPPS_OUTPUT_QUEUE_HPP
+#define KDD_SCPPS_OUTPUT_QUEUE_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <fmt/format.h>
+
+#include <syslog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    struct output_queue_config
+    {
+        // Reading pauses once this many bytes are queued and resumes once the
+        // queue has drained below resume_bytes.
+        std::size_t pause_bytes = 256 * 1024;
+        std::size_t resume_bytes = 64 * 1024;
+
+        // Responses to requests that were already read are always queued, so
+        // the queue can grow past pause_bytes. Beyond this hard limit the
+        // session is dropped.
+        std::size_t max_bytes = 1024 * 1024;
+
+        // A session whose queued output makes no progress for this long is
+        // considered a stuck reader and dropped.
+        std::chrono::milliseconds slow_consumer_timeout{30000};
+    }; // struct output_queue_config
+
+    // The outgoing side of a session: responses are queued and written in order,
+    // one write in flight at a time.
+    //
+    // A client that stops reading must not be able to make the server buffer
+    // responses without bound. The session's read loop asks paused() before
+    // reading the next request and, if the queue is full, hands its continuation
+    // to when_drained() instead. The client's own requests are then throttled
+    // by TCP flow control, while the event loop stays free for other work.
+    //
+    // If a write fails or does not make progress within the slow-consumer
+    // timeout, or the queue exceeds its hard limit, the stall handler runs. It
+    // is expected to close the connection.
+    //
+    // Stream only needs async_write_some(). On a TLS connection without kTLS
+    // send offload, use tls_write_stream so responses are encrypted.
+    template <typename Stream>
+    class output_queue
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+        using handler = std::function<void()>;
+
+        output_queue(boost::asio::io_service& _io_service, Stream& _stream, output_queue_config _config = {})
+            : stream_{_stream}
+            , config_{_config}
+            , timer_{_io_service}
+        {
+        } // output_queue (constructor)
+
+        output_queue(const output_queue&) = delete;
+        auto operator=(const output_queue&) -> output_queue& = delete;
+
+        void set_config(const output_queue_config& _config)
+        {
+            config_ = _config;
+        } // set_config
+
+        // Called instead of the completion handlers when the client is not
+        // reading, either for too long or too much.
+        void on_stall(handler _handler)
+        {
+            on_stall_ = std::move(_handler);
+        } // on_stall
+
+        // Queues _data for sending. Returns false (and runs the stall handler) if
+        // the queue would exceed its hard limit.
+        bool push(std::vector<char> _data)
+        {
+            if (_data.empty()) {
+                return true;
+            }
+
+            if (queued_ + _data.size() > config_.max_bytes) {
+                stall("output limit exceeded");
+                return false;
+            }
+
+            queued_ += _data.size();
+            peak_ = std::max(peak_, queued_);
+            buffers_.push_back(std::move(_data));
+
+            if (!paused_since_ && queued_ >= config_.pause_bytes) {
+                paused_since_ = clock::now();
+                ++pauses_;
+            }
+
+            if (!writing_) {
+                write_next();
+            }
+
+            return true;
+        } // push
+
+        // True while the session should not read further requests.
+        bool paused() const noexcept
+        {
+            return paused_since_.has_value();
+        } // paused
+
+        // Runs _handler once the queue has drained below resume_bytes, right
+        // away if it is not paused. Only one continuation can be pending.
+        void when_drained(handler _handler)
+        {
+            if (!paused()) {
+                _handler();
+                return;
+            }
+
+            on_drained_ = std::move(_handler);
+        } // when_drained
+
+        std::size_t queued_bytes() const noexcept
+        {
+            return queued_;
+        } // queued_bytes
+
+        // Bytes queued and written, the peak queue size, how often and for how
+        // long reading was paused, and whether the session was dropped.
+        std::string report() const
+        {
+            auto blocked = blocked_;
+            if (paused_since_) {
+                blocked += clock::now() - *paused_since_;
+            }
+
+            return fmt::format("output: queued={} peak={} written={} pauses={} blocked={}ms stalled={}",
+                               queued_, peak_, written_, pauses_,
+                               std::chrono::duration_cast<std::chrono::milliseconds>(blocked).count(),
+                               stalled_);
+        } // report
+
+    private:
+        void write_next()
+        {
+            if (buffers_.empty()) {
+                writing_ = false;
+                timer_.cancel();
+                return;
+            }
+
+            writing_ = true;
+            arm_timer();
+
+            const auto& front = buffers_.front();
+
+            stream_.async_write_some(boost::asio::buffer(front.data() + offset_, front.size() - offset_),
+                [this](auto _ec, std::size_t _length) {
+                    if (_ec) {
+                        // The read side may never notice, e.g. while it waits in
+                        // when_drained(), so the session is dropped here. A write
+                        // aborted because the stall handler closed the stream
+                        // has already been dealt with.
+                        writing_ = false;
+                        timer_.cancel();
+
+                        if (_ec != boost::asio::error::operation_aborted) {
+                            stall("write failed");
+                        }
+
+                        return;
+                    }
+
+                    written_ += _length;
+                    queued_ -= _length;
+                    offset_ += _length;
+
+                    if (offset_ == buffers_.front().size()) {
+                        buffers_.pop_front();
+                        offset_ = 0;
+                    }
+
+                    if (paused_since_ && queued_ < config_.resume_bytes) {
+                        blocked_ += clock::now() - *paused_since_;
+                        paused_since_.reset();
+
+                        if (on_drained_) {
+                            // The continuation may queue more output, so the write
+                            // loop is resumed first.
+                            auto next = std::move(on_drained_);
+                            on_drained_ = nullptr;
+                            write_next();
+                            next();
+                            return;
+                        }
+                    }
+
+                    write_next();
+                });
+        } // write_next
+
+        // Every completed write re-arms the timer, so it only fires if a single
+        // write makes no progress at all for the whole timeout.
+        void arm_timer()
+        {
+            timer_.expires_after(config_.slow_consumer_timeout);
+            timer_.async_wait([this](auto _ec) {
+                if (!_ec) {
+                    stall("slow consumer");
+                }
+            });
+        } // arm_timer
+
+        void stall(const char* _reason)
+        {
+            ++stalled_;
+            syslog(LOG_ERR | LOG_USER, "Dropping session [reason:%s, queued:%zu]", _reason, queued_);
+
+            timer_.cancel();
+            on_drained_ = nullptr;
+
+            if (on_stall_) {
+                on_stall_();
+            }
+        } // stall
+
+        Stream& stream_;
+        output_queue_config config_;
+        boost::asio::steady_timer timer_;
+        handler on_stall_;
+        handler on_drained_;
+        std::deque<std::vector<char>> buffers_;
+        std::size_t offset_ = 0;          // Bytes of the front buffer already written.
+        std::size_t queued_ = 0;
+        std::size_t peak_ = 0;
+        std::uint64_t written_ = 0;
+        std::uint64_t pauses_ = 0;
+        std::uint64_t stalled_ = 0;
+        bool writing_ = false;
+        std::optional<clock::time_point> paused_since_;
+        clock::duration blocked_{};
+    }; // class output_queue
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_OUTPUT_QUEUE_HPP
@@ -0,0 +1,392 @@
+#ifndef KDD_SCPPS_QUOTA_TABLE_HPP
+#define KDD_SCPPS_QUOTA_TABLE_HPP
+
+#include <fmt/format.h>
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace kdd::scpps
+{
+    // Per-user storage and bandwidth accounting that can be charged from any
+    // process and any core without taking a lock.
+    //
+    // The table lives in an anonymous shared mapping, so it must be created by
+    // the parent before it starts forking children. Every user slot has one
+    // counter per CPU. Charges land on the counter of the CPU the caller runs on
+    // and are folded into the slot's shared total once they exceed a batch size,
+    // which bounds the error of the shared total to (batch * CPUs). A charge
+    // only sums the per-CPU counters when the shared total is within that error
+    // of the limit. Far from the limit, the check is a single relaxed load.
+    //
+    // Concurrent charges near the limit can overshoot it by at most one charge
+    // per CPU. The limit is therefore a soft limit.
+    class quota_table
+    {
+    public:
+        using account = std::uint32_t;
+
+        static constexpr account no_account = ~account{0};
+        static constexpr std::size_t max_name_length = 47;
+
+        explicit quota_table(std::uint32_t _max_users = 4096,
+                             std::chrono::seconds _bandwidth_window = std::chrono::seconds{60})
+            : max_users_{_max_users}
+            , cpus_{static_cast<std::uint32_t>(std::max(1, get_nprocs_conf()))}
+            , window_{_bandwidth_window}
+        {
+            mapping_size_ = sizeof(shared_header) + max_users_ * sizeof(user_slot) + max_users_ * cpus_ * sizeof(cpu_counter);
+            auto* p = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map quota table"};
+            }
+
+            // Anonymous mappings are zero-filled, which is the empty state for
+            // every slot and counter.
+            header_ = static_cast<shared_header*>(p);
+            slots_ = reinterpret_cast<user_slot*>(header_ + 1);
+            counters_ = reinterpret_cast<cpu_counter*>(slots_ + max_users_);
+            header_->window_start.store(now(), std::memory_order_relaxed);
+        } // quota_table (constructor)
+
+        quota_table(const quota_table&) = delete;
+        auto operator=(const quota_table&) -> quota_table& = delete;
+
+        ~quota_table()
+        {
+            ::munmap(header_, mapping_size_);
+        } // destructor
+
+        // Returns the account for _user, creating it if necessary. Sessions should
+        // call this once after authentication and keep the result.
+        account lookup(std::string_view _user)
+        {
+            if (_user.empty() || _user.size() > max_name_length) {
+                return no_account;
+            }
+
+            const auto start = std::hash<std::string_view>{}(_user) % max_users_;
+
+            const auto claim = claimed_by(getpid());
+
+            for (std::uint32_t i = 0; i < max_users_; ++i) {
+                auto& slot = slots_[(start + i) % max_users_];
+                auto state = slot.state.load(std::memory_order_acquire);
+
+                // Try to claim an empty slot. If another process beats us to it,
+                // the slot is inspected like any other occupied slot.
+                if (state == slot_empty && slot.state.compare_exchange_strong(state, claim, std::memory_order_acq_rel)) {
+                    return publish(slot, (start + i) % max_users_, _user);
+                }
+
+                // Wait for a concurrent claim to publish the name. A process that
+                // died while claiming never will, so its claim is taken over.
+                while (state != slot_ready) {
+                    if (const pid_t claimer = state - slot_claiming; ::kill(claimer, 0) == -1 && errno == ESRCH &&
+                        slot.state.compare_exchange_strong(state, claim, std::memory_order_acq_rel))
+                    {
+                        return publish(slot, (start + i) % max_users_, _user);
+                    }
+
+                    sched_yield();
+                    state = slot.state.load(std::memory_order_acquire);
+                }
+
+                if (_user == slot.name) {
+                    return (start + i) % max_users_;
+                }
+            }
+
+            syslog(LOG_ERR | LOG_USER, "Quota table is full.");
+
+            return no_account;
+        } // lookup
+
+        // A limit of zero means unlimited.
+        void set_limits(account _account, std::int64_t _storage_limit, std::int64_t _bandwidth_limit)
+        {
+            auto& slot = slots_[_account];
+            slot.storage_limit.store(_storage_limit, std::memory_order_relaxed);
+            slot.bandwidth_limit.store(_bandwidth_limit, std::memory_order_relaxed);
+
+            // Pick the batch so that the combined per-CPU error stays around 1/8th
+            // of the smallest limit.
+            const auto smallest = std::min(_storage_limit > 0 ? _storage_limit : default_batch * 8 * cpus_,
+                                           _bandwidth_limit > 0 ? _bandwidth_limit : default_batch * 8 * cpus_);
+            slot.batch.store(std::clamp<std::int64_t>(smallest / (8 * cpus_), 1, default_batch),
+                             std::memory_order_relaxed);
+        } // set_limits
+
+        // Adds _delta bytes (negative when data is removed) to the stored bytes of
+        // _account. Returns false, without charging, if this would exceed the
+        // storage limit.
+        bool charge_storage(account _account, std::int64_t _delta)
+        {
+            auto& slot = slots_[_account];
+            return charge(slot, slot.storage_used, slot.storage_limit, &cpu_counter::storage, _account, _delta);
+        } // charge_storage
+
+        // Adds _bytes to the bytes transferred by _account in the current window.
+        // Returns false, without charging, if this would exceed the bandwidth limit.
+        bool charge_bandwidth(account _account, std::int64_t _bytes)
+        {
+            auto& slot = slots_[_account];
+            return charge(slot, slot.bandwidth_used, slot.bandwidth_limit, &cpu_counter::bandwidth, _account, _bytes);
+        } // charge_bandwidth
+
+        std::int64_t storage_used(account _account) const
+        {
+            return slots_[_account].storage_used.load(std::memory_order_relaxed) + pending(_account, &cpu_counter::storage);
+        } // storage_used
+
+        std::int64_t bandwidth_used(account _account) const
+        {
+            return slots_[_account].bandwidth_used.load(std::memory_order_relaxed) + pending(_account, &cpu_counter::bandwidth);
+        } // bandwidth_used
+
+        // Folds all per-CPU counters into the shared totals and starts a new
+        // bandwidth window if the current one has expired. The parent calls this
+        // periodically, typically right before save().
+        void reconcile()
+        {
+            const auto t = now();
+            const auto start = header_->window_start.load(std::memory_order_relaxed);
+            const bool new_window = t - start >= std::chrono::duration_cast<std::chrono::milliseconds>(window_).count();
+
+            for (account a = 0; a < max_users_; ++a) {
+                auto& slot = slots_[a];
+
+                if (slot.state.load(std::memory_order_acquire) != slot_ready) {
+                    continue;
+                }
+
+                for (std::uint32_t cpu = 0; cpu < cpus_; ++cpu) {
+                    auto& c = counter(a, cpu);
+                    slot.storage_used.fetch_add(c.storage.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+                    slot.bandwidth_used.fetch_add(c.bandwidth.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+
+                if (new_window) {
+                    slot.bandwidth_used.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            if (new_window) {
+                header_->window_start.store(t, std::memory_order_relaxed);
+            }
+        } // reconcile
+
+        // Persists usage and limits so they survive a restart. Each line holds
+        // "<name length> <user> <storage used> <storage limit> <bandwidth limit>".
+        // User names may contain any character, including blanks and newlines,
+        // so the name is length-prefixed rather than delimited.
+        int save(const std::string& _path)
+        {
+            reconcile();
+
+            const auto tmp = _path + ".tmp";
+            std::FILE* out = std::fopen(tmp.c_str(), "w");
+            if (!out) {
+                syslog(LOG_ERR | LOG_USER, "Could not open quota file for writing: %m");
+                return -1;
+            }
+
+            for (account a = 0; a < max_users_; ++a) {
+                const auto& slot = slots_[a];
+
+                if (slot.state.load(std::memory_order_acquire) == slot_ready) {
+                    fmt::print(out, "{} {} {} {} {}\n",
+                               std::strlen(slot.name),
+                               slot.name,
+                               slot.storage_used.load(std::memory_order_relaxed),
+                               slot.storage_limit.load(std::memory_order_relaxed),
+                               slot.bandwidth_limit.load(std::memory_order_relaxed));
+                }
+            }
+
+            if (std::fflush(out) != 0 || ::fsync(fileno(out)) == -1) {
+                std::fclose(out);
+                return -1;
+            }
+
+            std::fclose(out);
+
+            return std::rename(tmp.c_str(), _path.c_str());
+        } // save
+
+        int load(const std::string& _path)
+        {
+            std::ifstream in{_path};
+            if (!in) {
+                return -1;
+            }
+
+            std::size_t length;
+            std::int64_t used;
+            std::int64_t storage_limit;
+            std::int64_t bandwidth_limit;
+
+            while (in >> length) {
+                // The length is checked before it sizes anything, so a corrupt
+                // file cannot make us allocate arbitrary amounts of memory.
+                if (length == 0 || length > max_name_length) {
+                    syslog(LOG_ERR | LOG_USER, "Invalid entry in quota file [path:%s]", _path.c_str());
+                    return -1;
+                }
+
+                std::string name(length, '\0');
+
+                if (in.get() != ' ' || !in.read(name.data(), length) ||
+                    !(in >> used >> storage_limit >> bandwidth_limit))
+                {
+                    syslog(LOG_ERR | LOG_USER, "Invalid entry in quota file [path:%s]", _path.c_str());
+                    return -1;
+                }
+
+                if (const auto a = lookup(name); a != no_account) {
+                    slots_[a].storage_used.store(used, std::memory_order_relaxed);
+                    set_limits(a, storage_limit, bandwidth_limit);
+                }
+            }
+
+            return in.eof() ? 0 : -1;
+        } // load
+
+    private:
+        // A slot being claimed holds slot_claiming plus the claimer's PID.
+        static constexpr std::uint32_t slot_empty = 0;
+        static constexpr std::uint32_t slot_ready = 1;
+        static constexpr std::uint32_t slot_claiming = 2;
+        static constexpr std::int64_t default_batch = 1024 * 1024;
+
+        struct alignas(64) shared_header
+        {
+            std::atomic<std::int64_t> window_start;
+        }; // struct shared_header
+
+        struct alignas(64) user_slot
+        {
+            std::atomic<std::uint32_t> state;
+            char name[max_name_length + 1];
+            std::atomic<std::int64_t> batch;
+            std::atomic<std::int64_t> storage_used;
+            std::atomic<std::int64_t> storage_limit;
+            std::atomic<std::int64_t> bandwidth_used;
+            std::atomic<std::int64_t> bandwidth_limit;
+        }; // struct user_slot
+
+        // One cache line per (user, CPU) pair so that cores never share a line.
+        struct alignas(64) cpu_counter
+        {
+            std::atomic<std::int64_t> storage;
+            std::atomic<std::int64_t> bandwidth;
+        }; // struct cpu_counter
+
+        using counter_member = std::atomic<std::int64_t> cpu_counter::*;
+
+        static std::uint32_t claimed_by(pid_t _pid) noexcept
+        {
+            return slot_claiming + static_cast<std::uint32_t>(_pid);
+        } // claimed_by
+
+        // Fills in a slot this process has claimed and makes it visible.
+        account publish(user_slot& _slot, account _account, std::string_view _user)
+        {
+            std::memcpy(_slot.name, _user.data(), _user.size());
+            _slot.name[_user.size()] = '\0';
+            _slot.batch.store(default_batch, std::memory_order_relaxed);
+            _slot.state.store(slot_ready, std::memory_order_release);
+
+            return _account;
+        } // publish
+
+        static std::int64_t now()
+        {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+        } // now
+
+        cpu_counter& counter(account _account, std::uint32_t _cpu) const noexcept
+        {
+            return counters_[_account * cpus_ + _cpu];
+        } // counter
+
+        std::uint32_t current_cpu() const noexcept
+        {
+            const auto cpu = sched_getcpu();
+            return cpu < 0 ? 0 : static_cast<std::uint32_t>(cpu) % cpus_;
+        } // current_cpu
+
+        std::int64_t pending(account _account, counter_member _member) const
+        {
+            std::int64_t sum = 0;
+
+            for (std::uint32_t cpu = 0; cpu < cpus_; ++cpu) {
+                sum += (counter(_account, cpu).*_member).load(std::memory_order_relaxed);
+            }
+
+            return sum;
+        } // pending
+
+        bool charge(user_slot& _slot,
+                    std::atomic<std::int64_t>& _used,
+                    const std::atomic<std::int64_t>& _limit,
+                    counter_member _member,
+                    account _account,
+                    std::int64_t _delta)
+        {
+            const auto batch = _slot.batch.load(std::memory_order_relaxed);
+
+            if (const auto limit = _limit.load(std::memory_order_relaxed); limit > 0 && _delta > 0) {
+                auto used = _used.load(std::memory_order_relaxed);
+
+                // The shared total is at most (batch * CPUs) behind. Only sum the
+                // per-CPU counters when that uncertainty matters.
+                if (used + _delta > limit - batch * cpus_) {
+                    used += pending(_account, _member);
+
+                    if (used + _delta > limit) {
+                        return false;
+                    }
+                }
+            }
+
+            auto& local = counter(_account, current_cpu()).*_member;
+            const auto value = local.fetch_add(_delta, std::memory_order_relaxed) + _delta;
+
+            if (value >= batch || value <= -batch) {
+                _used.fetch_add(local.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+
+            return true;
+        } // charge
+
+        std::uint32_t max_users_;
+        std::uint32_t cpus_;
+        std::chrono::seconds window_;
+        std::size_t mapping_size_;
+        shared_header* header_;
+        user_slot* slots_;
+        cpu_counter* counters_;
+    }; // class quota_table
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_QUOTA_TABLE_HPP
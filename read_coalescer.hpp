@@ -0,0 +1,462 @@
+#ifndef KDD_SCPPS_READ_COALESCER_HPP
+#define KDD_SCPPS_READ_COALESCER_HPP
+
+#include <fmt/format.h>
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // Single-flight reads: concurrent reads of the same bytes of an object cost
+    // one read of the underlying storage, across all sessions.
+    //
+    // Objects are divided into fixed-size blocks. A read claims a slot for
+    // every block of its range that no other read is fetching, fetches the
+    // claimed blocks into their slots, and waits for the blocks other reads
+    // are fetching. Identical and overlapping reads therefore share the blocks
+    // they have in common, and the callers that wait copy from the fetching
+    // read's slot instead of reading storage again. Besides the storage read,
+    // this saves the work on top of it (checksum verification, decryption,
+    // decompression).
+    //
+    // The server forks a child per connection, so the slots live in an
+    // anonymous shared mapping and the coalescer must be created by the parent
+    // before it starts forking. Threads of one process coalesce the same way.
+    //
+    // Nothing is kept once the last read of a block has completed. Keeping hot
+    // data around is the job of the caches. When every slot a block may use is
+    // busy, the block is read directly, without coalescing.
+    //
+    // A write must call invalidate() once it reached storage, before it
+    // completes. Reads that start afterwards then never share a fetch that may
+    // have read the old data.
+    //
+    // A read waiting for a block whose fetching process died fails with EIO.
+    // The slots a process used when it died stay in use, so reads of their
+    // blocks are no longer coalesced.
+    class read_coalescer
+    {
+    public:
+        // Reads up to _count bytes at _offset, like pread(). Returns the number of
+        // bytes read, or -1 with errno set.
+        using reader = std::function<ssize_t(char* _buffer, std::size_t _count, off_t _offset)>;
+
+        static constexpr std::size_t default_block_size = 64 * 1024;
+        static constexpr std::uint32_t default_slots = 256;
+        static constexpr std::size_t max_name_length = 255;
+
+        explicit read_coalescer(std::size_t _block_size = default_block_size, std::uint32_t _slots = default_slots)
+            : block_size_{_block_size}
+            , slot_count_{std::max<std::uint32_t>(_slots, 1)}
+        {
+            mapping_size_ = sizeof(shared_header) + slot_count_ * (sizeof(slot) + block_size_);
+            auto* p = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map read coalescer"};
+            }
+
+            // Anonymous mappings are zero-filled, which is the empty state of
+            // every slot.
+            header_ = static_cast<shared_header*>(p);
+            slots_ = reinterpret_cast<slot*>(header_ + 1);
+            data_ = reinterpret_cast<char*>(slots_ + slot_count_);
+        } // read_coalescer (constructor)
+
+        read_coalescer(const read_coalescer&) = delete;
+        auto operator=(const read_coalescer&) -> read_coalescer& = delete;
+
+        ~read_coalescer()
+        {
+            ::munmap(header_, mapping_size_);
+        } // destructor
+
+        // Reads _count bytes of _object at _offset into _buffer, fetching the
+        // blocks nobody else is fetching with _read. Returns the number of bytes
+        // read (less than _count at the end of the object), or -1 with errno set.
+        ssize_t read(const std::string& _object, void* _buffer, std::size_t _count, off_t _offset, const reader& _read)
+        {
+            if (_count == 0) {
+                return 0;
+            }
+
+            const auto begin = static_cast<std::uint64_t>(_offset);
+            const auto end = begin + _count;
+            const auto first = begin / block_size_;
+            const auto last = (end - 1) / block_size_;
+
+            header_->reads.fetch_add(1, std::memory_order_relaxed);
+
+            // 1. Join the blocks in flight and claim the others.
+            std::vector<use> uses;
+            uses.reserve(last - first + 1);
+
+            for (auto b = first; b <= last; ++b) {
+                uses.push_back(_object.size() <= max_name_length ? join_or_claim(_object, b) : use{});
+            }
+
+            // 2. Fetch the claimed blocks before waiting for anyone else's, so
+            //    that two reads waiting for each other's blocks cannot deadlock.
+            for (std::size_t i = 0; i < uses.size(); ++i) {
+                if (uses[i].owned) {
+                    fetch(uses[i], first + i, _read);
+                }
+            }
+
+            // 3. Assemble the result. A block that ends before the bytes wanted
+            //    of it (or, in a slot, before the block size) marks the end of the
+            //    object. Every slot is given back, also after an error.
+            auto* out = static_cast<char*>(_buffer);
+            std::size_t copied = 0;
+            int error = 0;
+            bool done = false;
+
+            for (std::size_t i = 0; i < uses.size(); ++i) {
+                auto& u = uses[i];
+
+                if (!done && error == 0) {
+                    const auto block_begin = (first + i) * block_size_;
+                    const auto from = std::max(begin, block_begin) - block_begin;
+                    const auto to = std::min<std::uint64_t>(end - block_begin, block_size_);
+                    std::uint64_t available = 0;
+
+                    if (u.target) {
+                        wait(u);
+                        available = u.target->size;
+                        error = u.target->error;
+                        done = available < block_size_;
+                    }
+                    else {
+                        header_->bypassed.fetch_add(1, std::memory_order_relaxed);
+                        available = from + read_fully(_read, out + copied, to - from, block_begin + from, error);
+                        done = available < to;
+                    }
+
+                    if (error == 0 && from < std::min(to, available)) {
+                        const auto n = std::min(to, available) - from;
+
+                        if (u.target) {
+                            std::memcpy(out + copied, data(u.target) + from, n);
+                        }
+
+                        copied += n;
+                    }
+                }
+
+                if (u.target) {
+                    release(*u.target);
+                }
+            }
+
+            if (error != 0) {
+                errno = error;
+                return -1;
+            }
+
+            return static_cast<ssize_t>(copied);
+        } // read
+
+        // Called after a write of _count bytes of _object at _offset reached
+        // storage. Fetches of the written blocks that are in flight are not
+        // shared with reads starting from now on.
+        void invalidate(const std::string& _object, off_t _offset, std::size_t _count)
+        {
+            if (_count == 0 || _object.size() > max_name_length) {
+                return;
+            }
+
+            const auto begin = static_cast<std::uint64_t>(_offset);
+            const auto first = begin / block_size_;
+            const auto last = (begin + _count - 1) / block_size_;
+
+            for (auto b = first; b <= last; ++b) {
+                const auto hash = key_hash(_object, b);
+
+                for (std::uint32_t i = 0; i < probe_length(); ++i) {
+                    auto& s = slots_[(hash + i) % slot_count_];
+
+                    if (pin(s, _object, b, hash)) {
+                        s.stale.store(1, std::memory_order_relaxed);
+                        release(s);
+                    }
+                }
+            }
+        } // invalidate
+
+        // Reads, storage fetches, blocks that were shared with another read,
+        // blocks read without a slot and blocks in flight, over all processes.
+        std::string report() const
+        {
+            std::uint32_t in_flight = 0;
+
+            for (std::uint32_t i = 0; i < slot_count_; ++i) {
+                in_flight += phase(slots_[i].state.load(std::memory_order_relaxed)) == phase_fetching;
+            }
+
+            return fmt::format("reads: reads={} fetches={} coalesced_blocks={} bypassed={} in_flight={}",
+                               header_->reads.load(std::memory_order_relaxed),
+                               header_->fetches.load(std::memory_order_relaxed),
+                               header_->coalesced_blocks.load(std::memory_order_relaxed),
+                               header_->bypassed.load(std::memory_order_relaxed),
+                               in_flight);
+        } // report
+
+    private:
+        // A slot's state holds its phase in the low two bits and a generation,
+        // bumped by every claim, above them. A process that acts on an old state
+        // therefore never changes a slot that was reused in the meantime.
+        static constexpr std::uint32_t phase_empty = 0;
+        static constexpr std::uint32_t phase_claimed = 1;  // Being filled in by the claimer.
+        static constexpr std::uint32_t phase_fetching = 2;
+        static constexpr std::uint32_t phase_ready = 3;    // Fetched. Read by those who use it.
+        static constexpr std::uint32_t phase_mask = 3;
+        static constexpr std::uint32_t generation = 4;
+        static constexpr std::uint32_t max_probe = 16;
+
+        struct alignas(64) shared_header
+        {
+            std::atomic<std::uint64_t> reads;
+            std::atomic<std::uint64_t> fetches;
+            std::atomic<std::uint64_t> coalesced_blocks;
+            std::atomic<std::uint64_t> bypassed;
+        }; // struct shared_header
+
+        struct alignas(64) slot
+        {
+            std::atomic<std::uint32_t> state;
+            std::atomic<std::uint32_t> users;  // Reads using the slot, the fetching one included.
+            std::atomic<std::uint64_t> hash;   // Of the key, to skip unrelated slots cheaply.
+            std::atomic<pid_t> owner;          // The fetching process. Zero once the fetch ended.
+            std::atomic<std::uint32_t> stale;  // Written while the fetch was in flight.
+            std::uint64_t block;
+            std::uint64_t size;                // Bytes fetched. Short at the end of the object.
+            int error;
+            char object[max_name_length + 1];
+        }; // struct slot
+
+        // A block of a read: the slot it uses, if any, and whether this read
+        // fetches it.
+        struct use
+        {
+            slot* target = nullptr;
+            bool owned = false;
+        }; // struct use
+
+        static std::uint32_t phase(std::uint32_t _state) noexcept
+        {
+            return _state & phase_mask;
+        } // phase
+
+        // _state moved to _phase, within the same generation.
+        static std::uint32_t with_phase(std::uint32_t _state, std::uint32_t _phase) noexcept
+        {
+            return (_state & ~phase_mask) | _phase;
+        } // with_phase
+
+        static std::uint64_t key_hash(const std::string& _object, std::uint64_t _block) noexcept
+        {
+            return std::hash<std::string>{}(_object) ^ (_block * 0x9e3779b97f4a7c15ull);
+        } // key_hash
+
+        std::uint32_t probe_length() const noexcept
+        {
+            return std::min(max_probe, slot_count_);
+        } // probe_length
+
+        char* data(const slot* _slot) const noexcept
+        {
+            return data_ + static_cast<std::size_t>(_slot - slots_) * block_size_;
+        } // data
+
+        // Joins the fetch of _block if one is in flight, and claims a slot for
+        // it otherwise. Two reads may rarely both claim the same block, which
+        // costs a second fetch but is otherwise harmless.
+        use join_or_claim(const std::string& _object, std::uint64_t _block)
+        {
+            const auto hash = key_hash(_object, _block);
+
+            for (std::uint32_t i = 0; i < probe_length(); ++i) {
+                auto& s = slots_[(hash + i) % slot_count_];
+
+                if (pin(s, _object, _block, hash)) {
+                    if (s.stale.load(std::memory_order_relaxed) == 0) {
+                        header_->coalesced_blocks.fetch_add(1, std::memory_order_relaxed);
+                        return {&s, false};
+                    }
+
+                    release(s);
+                }
+            }
+
+            for (std::uint32_t i = 0; i < probe_length(); ++i) {
+                auto& s = slots_[(hash + i) % slot_count_];
+                auto state = s.state.load(std::memory_order_acquire);
+
+                const auto claimed = with_phase(state + generation, phase_claimed);
+
+                if (phase(state) != phase_empty || !s.state.compare_exchange_strong(state, claimed, std::memory_order_acq_rel)) {
+                    continue;
+                }
+
+                s.users.fetch_add(1, std::memory_order_acq_rel);
+                s.hash.store(hash, std::memory_order_relaxed);
+                s.owner.store(getpid(), std::memory_order_relaxed);
+                s.stale.store(0, std::memory_order_relaxed);
+                s.block = _block;
+                s.size = 0;
+                s.error = 0;
+                std::memcpy(s.object, _object.c_str(), _object.size() + 1);
+
+                s.state.store(with_phase(claimed, phase_fetching), std::memory_order_release);
+
+                return {&s, true};
+            }
+
+            return {};
+        } // join_or_claim
+
+        // Takes a use of _slot if it is fetching the block of _object. The key
+        // is only compared once the slot is pinned, since an unused slot may be
+        // reused at any time.
+        bool pin(slot& _slot, const std::string& _object, std::uint64_t _block, std::uint64_t _hash)
+        {
+            const auto state = _slot.state.load(std::memory_order_acquire);
+
+            if (phase(state) != phase_fetching || _slot.hash.load(std::memory_order_relaxed) != _hash) {
+                return false;
+            }
+
+            _slot.users.fetch_add(1, std::memory_order_acq_rel);
+
+            // Still the same fetch: the slot cannot be reused until released.
+            if (_slot.state.load(std::memory_order_acquire) == state && _slot.block == _block && _object == _slot.object) {
+                return true;
+            }
+
+            release(_slot);
+
+            return false;
+        } // pin
+
+        // Gives back a use. Whoever leaves a fetched slot unused empties it.
+        void release(slot& _slot)
+        {
+            _slot.users.fetch_sub(1, std::memory_order_acq_rel);
+
+            auto state = _slot.state.load(std::memory_order_acquire);
+
+            if (phase(state) == phase_ready && _slot.users.load(std::memory_order_acquire) == 0) {
+                _slot.state.compare_exchange_strong(state, with_phase(state, phase_empty), std::memory_order_acq_rel);
+            }
+        } // release
+
+        void fetch(use& _use, std::uint64_t _block, const reader& _read)
+        {
+            auto& s = *_use.target;
+            int error = 0;
+
+            header_->fetches.fetch_add(1, std::memory_order_relaxed);
+            const auto size = read_fully(_read, data(&s), block_size_, _block * block_size_, error);
+
+            finish(s, getpid(), size, error);
+        } // fetch
+
+        // Ends the fetch of _owner and makes its result visible. Returns false if
+        // another process already ended it.
+        static bool finish(slot& _slot, pid_t _owner, std::uint64_t _size, int _error)
+        {
+            if (!_slot.owner.compare_exchange_strong(_owner, 0, std::memory_order_acq_rel)) {
+                return false;
+            }
+
+            _slot.size = _size;
+            _slot.error = _error;
+            _slot.state.store(with_phase(_slot.state.load(std::memory_order_relaxed), phase_ready), std::memory_order_release);
+
+            return true;
+        } // finish
+
+        // Waits until the block of _use is fetched. If the fetching process died,
+        // the block fails with EIO, and the dead process' use is given back.
+        void wait(use& _use)
+        {
+            auto& s = *_use.target;
+
+            for (int spins = 0; phase(s.state.load(std::memory_order_acquire)) != phase_ready; ++spins) {
+                if (spins < 64) {
+                    sched_yield();
+                    continue;
+                }
+
+                if (const pid_t owner = s.owner.load(std::memory_order_relaxed); owner != 0 && ::kill(owner, 0) == -1 && errno == ESRCH) {
+                    if (finish(s, owner, 0, EIO)) {
+                        release(s);
+                    }
+
+                    continue;
+                }
+
+                std::this_thread::sleep_for(std::chrono::microseconds{100});
+            }
+        } // wait
+
+        // Reads until _count bytes are read or the reader reports the end of
+        // the object. Storage may return less than asked for without being at
+        // the end. Returns the bytes read. On failure, _error is set.
+        static std::size_t read_fully(const reader& _read, char* _buffer, std::size_t _count, std::uint64_t _offset, int& _error)
+        {
+            std::size_t total = 0;
+
+            while (total < _count) {
+                ssize_t n = -1;
+
+                // A throwing reader must not leave the block in flight forever.
+                try {
+                    n = _read(_buffer + total, _count - total, static_cast<off_t>(_offset + total));
+                }
+                catch (const std::exception&) {
+                    errno = EIO;
+                }
+
+                if (n < 0) {
+                    _error = errno;
+                    break;
+                }
+
+                if (n == 0) {
+                    break;
+                }
+
+                total += static_cast<std::size_t>(n);
+            }
+
+            return total;
+        } // read_fully
+
+        std::size_t block_size_;
+        std::uint32_t slot_count_;
+        std::size_t mapping_size_;
+        shared_header* header_;
+        slot* slots_;
+        char* data_;
+    }; // class read_coalescer
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_READ_COALESCER_HPP
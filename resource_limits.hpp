@@ -0,0 +1,254 @@
+#ifndef KDD_SCPPS_RESOURCE_LIMITS_HPP
+#define KDD_SCPPS_RESOURCE_LIMITS_HPP
+
+#include <sched.h>
+#include <sys/sysinfo.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace kdd::scpps
+{
+    // The resources the process may use, taken from its cgroup (v2) when it
+    // runs in one and from the host otherwise.
+    struct resource_limits
+    {
+        double cpus = 1;             // cpu.max quota / period, capped by the cpuset.
+        unsigned cpuset_size = 1;    // CPUs the process may run on.
+        std::uint64_t memory = 0;    // memory.max, capped by physical memory.
+
+        bool operator==(const resource_limits& _other) const noexcept
+        {
+            return cpus == _other.cpus && cpuset_size == _other.cpuset_size && memory == _other.memory;
+        }
+
+        bool operator!=(const resource_limits& _other) const noexcept
+        {
+            return !(*this == _other);
+        }
+    }; // struct resource_limits
+
+    // Sizes derived from resource_limits. Everything that used to be a fixed
+    // default and depends on the shape of the container should come from here.
+    struct resource_sizing
+    {
+        unsigned worker_threads;          // Threads for CPU-bound pools (crypto, hashing).
+        unsigned max_children;            // Concurrently served connections.
+        std::size_t message_buffer_size;  // Largest message a session accepts.
+        std::uint64_t cache_budget;       // Bytes all caches together may hold.
+    }; // struct resource_sizing
+
+    // Reads the limits of the cgroup the process runs in.
+    //
+    // Limits are inherited, so the effective CPU quota and memory limit are the
+    // smallest ones found on the way from the process' cgroup up to the root.
+    // cpuset.cpus.effective already reflects the ancestors.
+    class resource_probe
+    {
+    public:
+        explicit resource_probe(std::string _cgroup_root = "/sys/fs/cgroup", std::string _proc_cgroup = "/proc/self/cgroup")
+            : cgroup_root_{std::move(_cgroup_root)}
+            , proc_cgroup_{std::move(_proc_cgroup)}
+        {
+        } // resource_probe (constructor)
+
+        resource_limits detect() const
+        {
+            resource_limits limits;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            limits.cpuset_size = sched_getaffinity(0, sizeof(set), &set) == 0
+                ? static_cast<unsigned>(CPU_COUNT(&set))
+                : static_cast<unsigned>(std::max(1, get_nprocs()));
+
+            struct sysinfo info;
+            limits.memory = sysinfo(&info) == 0 ? static_cast<std::uint64_t>(info.totalram) * info.mem_unit : 0;
+
+            double quota = limits.cpuset_size;
+
+            if (auto dir = cgroup_directory(); !dir.empty()) {
+                if (const auto cpus = count_cpus(read_file(dir + "/cpuset.cpus.effective")); cpus > 0) {
+                    limits.cpuset_size = std::min(limits.cpuset_size, cpus);
+                }
+
+                quota = limits.cpuset_size;
+
+                for (;;) {
+                    quota = std::min(quota, parse_cpu_max(read_file(dir + "/cpu.max")));
+                    limits.memory = std::min(limits.memory, parse_memory_max(read_file(dir + "/memory.max")));
+
+                    if (dir.size() <= cgroup_root_.size()) {
+                        break;
+                    }
+
+                    dir.erase(dir.rfind('/'));
+                }
+            }
+
+            limits.cpus = std::min<double>(quota, limits.cpuset_size);
+
+            return limits;
+        } // detect
+
+        static resource_sizing derive(const resource_limits& _limits)
+        {
+            constexpr std::uint64_t mib = 1024 * 1024;
+
+            resource_sizing sizing;
+
+            // A fractional quota still gets one thread. Threads beyond the quota
+            // would only be throttled.
+            sizing.worker_threads = std::max(1u, static_cast<unsigned>(std::ceil(_limits.cpus)));
+
+            // Each child costs a few MB (its own heap, stacks and dirty pages). Keep
+            // half of the memory for caches and the page cache.
+            sizing.max_children = static_cast<unsigned>(std::clamp<std::uint64_t>(_limits.memory / 2 / (8 * mib), 4, 1024));
+
+            // Small containers keep the historical 4 KB limit. Larger ones accept
+            // larger messages (batches in particular).
+            sizing.message_buffer_size = _limits.memory >= 4096 * mib ? 64 * 1024
+                                       : _limits.memory >= 512 * mib  ? 16 * 1024
+                                       : 4096;
+
+            sizing.cache_budget = _limits.memory / 8;
+
+            return sizing;
+        } // derive
+
+        // The PSI file for memory. Inside a cgroup, the cgroup's own
+        // memory.pressure, which reports stalls against its memory.max rather
+        // than the host's memory.
+        std::string memory_pressure_path() const
+        {
+            if (const auto dir = cgroup_directory(); !dir.empty()) {
+                if (std::ifstream in{dir + "/memory.pressure"}; in) {
+                    return dir + "/memory.pressure";
+                }
+            }
+
+            return "/proc/pressure/memory";
+        } // memory_pressure_path
+
+        // The parsers below are used on files that the resize timers read
+        // again and again. A value they cannot parse means "no limit" rather than
+        // an exception.
+
+        // Parses cpu.max, "max <period>" or "<quota> <period>", into CPUs.
+        static double parse_cpu_max(std::string_view _value)
+        {
+            const auto space = _value.find(' ');
+            std::uint64_t quota = 0;
+            std::uint64_t period = 0;
+
+            if (space == std::string_view::npos || !parse_number(_value.substr(0, space), quota) ||
+                !parse_number(_value.substr(space + 1), period) || period == 0)
+            {
+                return unlimited_cpus;
+            }
+
+            return static_cast<double>(quota) / period;
+        } // parse_cpu_max
+
+        // Parses memory.max, "max" or a number of bytes.
+        static std::uint64_t parse_memory_max(std::string_view _value)
+        {
+            std::uint64_t bytes = 0;
+
+            return parse_number(_value, bytes) ? bytes : unlimited;
+        } // parse_memory_max
+
+        // Counts the CPUs in a list like "0-3,8,10-11". Returns 0 if the list is
+        // malformed.
+        static unsigned count_cpus(std::string_view _list)
+        {
+            unsigned count = 0;
+
+            while (!_list.empty()) {
+                const auto comma = _list.find(',');
+                const auto range = _list.substr(0, comma);
+                _list.remove_prefix(comma == std::string_view::npos ? _list.size() : comma + 1);
+
+                if (range.empty()) {
+                    continue;
+                }
+
+                const auto dash = range.find('-');
+                unsigned first = 0;
+
+                if (!parse_number(range.substr(0, dash), first)) {
+                    return 0;
+                }
+
+                unsigned last = first;
+
+                if (dash != std::string_view::npos && (!parse_number(range.substr(dash + 1), last) || last < first)) {
+                    return 0;
+                }
+
+                count += last - first + 1;
+            }
+
+            return count;
+        } // count_cpus
+
+    private:
+        static constexpr std::uint64_t unlimited = ~std::uint64_t{0};
+        static constexpr double unlimited_cpus = 1e9;
+
+        // Parses all of _text as a decimal number.
+        template <typename T>
+        static bool parse_number(std::string_view _text, T& _value)
+        {
+            const auto* end = _text.data() + _text.size();
+            const auto [ptr, ec] = std::from_chars(_text.data(), end, _value);
+
+            return ec == std::errc{} && ptr == end && !_text.empty();
+        } // parse_number
+
+        static std::string read_file(const std::string& _path)
+        {
+            std::ifstream in{_path};
+            std::string contents;
+            std::getline(in, contents);
+
+            return contents;
+        } // read_file
+
+        // Returns the directory of the process' cgroup, or an empty string if
+        // the process is not in a cgroup v2 hierarchy.
+        std::string cgroup_directory() const
+        {
+            std::ifstream in{proc_cgroup_};
+
+            for (std::string line; std::getline(in, line);) {
+                // The unified hierarchy is listed as "0::<path>".
+                if (line.compare(0, 3, "0::") == 0) {
+                    auto path = line.substr(3);
+
+                    if (path == "/") {
+                        path.clear();
+                    }
+
+                    const auto dir = cgroup_root_ + path;
+                    std::ifstream controllers{dir + "/cgroup.controllers"};
+
+                    return controllers ? dir : std::string{};
+                }
+            }
+
+            return {};
+        } // cgroup_directory
+
+        std::string cgroup_root_;
+        std::string proc_cgroup_;
+    }; // class resource_probe
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_RESOURCE_LIMITS_HPP
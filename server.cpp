@@ -1,6 +1,11 @@
+#include "accept_limiter.hpp"
+#include "resource_limits.hpp"
+#include "worker_pool.hpp"
+
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/filesystem.hpp>
 
 #include <fmt/format.h>
@@ -87,12 +92,28 @@ public:
         , signals_{_io_service, SIGTERM, SIGINT, SIGCHLD}
         , acceptor_{_io_service, tcp::endpoint(tcp::v4(), _port)}
         , socket_{_io_service}
+        , limiter_{}
+        , probe_{}
+        , limits_{probe_.detect()}
+        , resize_timer_{_io_service}
+        , pool_{_io_service, make_pool_config(limits_),
+                [this] { setup_worker(); },
+                [](int _socket) { serve(_socket); },
+                [this](const auto& _source) { limiter_.release(_source); }}
     {
+        signals_.add(SIGUSR1);
         wait_for_signal();
         do_accept();
+
+        // Workers are forked once the io_service runs, which is after the
+        // process has become a daemon.
+        io_service_.post([this] { pool_.start(); });
+        schedule_resize();
     } // server (constructor)
 
 private:
+    static constexpr std::chrono::seconds resize_interval{10};
+
     void wait_for_signal()
     {
         signals_.async_wait([this](auto, auto _signal)
@@ -102,6 +123,7 @@ private:
                 case SIGTERM: signal_name = "SIGTERM"; break;
                 case SIGINT : signal_name = "SIGINT" ; break;
                 case SIGCHLD: signal_name = "SIGCHLD"; break;
+                case SIGUSR1: signal_name = "SIGUSR1"; break;
             }
 
             // Only the parent process should check for this signal. We can determine
@@ -111,11 +133,20 @@ private:
 
                 // Reap completed child processes so that we don't end up with zombies.
                 if (SIGCHLD == _signal) {
-                    for (int status = 0; waitpid(-1, &status, WNOHANG) > 0;) {}
+                    pid_t pid;
+                    for (int status = 0; (pid = waitpid(-1, &status, WNOHANG)) > 0;) {
+                        pool_.on_exit(pid);
+                    }
+                }
+
+                if (SIGUSR1 == _signal) {
+                    syslog(LOG_INFO | LOG_USER, "Worker pool: %s", pool_.report().c_str());
                 }
 
                 if (SIGTERM == _signal || SIGINT == _signal) {
                     acceptor_.close();
+                    resize_timer_.cancel();
+                    pool_.stop();
                     syslog(LOG_INFO | LOG_USER, "Closed acceptor socket");
                 }
                 else {
@@ -138,50 +169,37 @@ private:
             }
 
             if (!_ec) {
-                // Inform the io_service that we are about to fork. The io_service cleans
-                // up any internal resources, such as threads, that may interfere with
-                // forking.
-                io_service_.notify_fork(boost::asio::io_service::fork_prepare);
-
-                if (fork() == 0) {
-                    // Inform the io_service that the fork is finished and that this is the
-                    // child process. The io_service uses this opportunity to create any
-                    // internal file descriptors that must be private to the new process.
-                    io_service_.notify_fork(boost::asio::io_service::fork_child);
-                    
-                    // The child won't be accepting new connections, so we can close the
-                    // acceptor. It remains open in the parent.
-                    acceptor_.close();
+                // Reject sources that connect too often or hold too many connections
+                // before they occupy a worker. The connection is reset rather than shut
+                // down gracefully so that a flood costs us as little as possible.
+                boost::system::error_code ec;
+                const auto source = socket_.remote_endpoint(ec).address();
+
+                if (!ec && limiter_.admit(source) != kdd::scpps::accept_limiter::verdict::accept) {
+                    socket_.set_option(boost::asio::socket_base::linger{true, 0}, ec);
+                    socket_.close(ec);
+                    do_accept();
+                    return;
+                }
 
-                    // The child process is not interested in processing the SIGCHLD signal.
-                    signals_.remove(SIGCHLD);
+                // Hand the connection to the worker pool. The pool gets its own
+                // descriptor, so the acceptor's socket can be reused right away.
+                const int fd = ::dup(socket_.native_handle());
+                socket_.close();
 
-                    syslog(LOG_INFO | LOG_USER, "Forked child [pid:%d]", getpid());
+                if (fd == -1 || !pool_.dispatch(fd, source)) {
+                    syslog(LOG_ERR | LOG_USER, "Could not dispatch connection (all workers busy).");
 
-                    // This is where the child starts!
-                    //
-                    // Start the request-response loop.
-                    // 1. Client needs to negotiate with server about communication rules.
-                    // 2. Client must authenticate the user and proxy user against the
-                    //    server.
-                    // 3. Verify the API request information. Is the client allowed to
-                    //    perform the operation?
+                    if (fd != -1) {
+                        ::close(fd);
+                    }
 
-                    // This allows the child process to exit normally. Another way to
-                    // achieve this is by replacing signals_.remove(SIGCHLD) with
-                    // signals_.cancel().
-                    io_service_.stop();
+                    if (!ec) {
+                        limiter_.release(source);
+                    }
                 }
-                else {
-                    // Inform the io_service that the fork is finished (or failed) and that
-                    // this is the parent process. The io_service uses this opportunity to
-                    // recreate any internal resources that were cleaned up during
-                    // preparation for the fork.
-                    io_service_.notify_fork(boost::asio::io_service::fork_parent);
 
-                    socket_.close();
-                    do_accept();
-                }
+                do_accept();
             }
             else {
                 syslog(LOG_ERR | LOG_USER, "Accept error: %m");
@@ -190,10 +208,78 @@ private:
         });
     } // do_accept
 
+    static kdd::scpps::worker_pool_config make_pool_config(const kdd::scpps::resource_limits& _limits)
+    {
+        kdd::scpps::worker_pool_config config;
+        config.max_workers = kdd::scpps::resource_probe::derive(_limits).max_children;
+        config.min_workers = std::min(config.min_workers, config.max_workers);
+
+        return config;
+    } // make_pool_config
+
+    // Containers can be resized while the server runs. Re-reads the limits
+    // periodically and adjusts the size of the worker pool.
+    void schedule_resize()
+    {
+        resize_timer_.expires_after(resize_interval);
+        resize_timer_.async_wait([this](auto _ec) {
+            if (_ec || !acceptor_.is_open()) {
+                return;
+            }
+
+            if (const auto limits = probe_.detect(); limits != limits_) {
+                limits_ = limits;
+                const auto sizing = kdd::scpps::resource_probe::derive(limits_);
+                pool_.set_max_workers(sizing.max_children);
+
+                syslog(LOG_INFO | LOG_USER, "Resource limits changed [cpus:%.2f, memory:%lu, max_workers:%u]",
+                       limits_.cpus, limits_.memory, sizing.max_children);
+            }
+
+            schedule_resize();
+        });
+    } // schedule_resize
+
+    // Runs in every new worker before it waits for its first connection.
+    void setup_worker()
+    {
+        // The worker won't be accepting new connections, so we can close the
+        // acceptor. It remains open in the parent.
+        acceptor_.close();
+        resize_timer_.cancel();
+
+        // The worker process is not interested in processing signals. It leaves
+        // when the parent retires it. clear() restores the default dispositions.
+        // cancel() would leave asio's handler installed, swallowing SIGTERM and
+        // SIGINT with nobody waiting for them.
+        signals_.clear();
+
+        syslog(LOG_INFO | LOG_USER, "Forked worker [pid:%d]", getpid());
+    } // setup_worker
+
+    static void serve([[maybe_unused]] int _socket)
+    {
+        syslog(LOG_INFO | LOG_USER, "Serving connection [pid:%d]", getpid());
+
+        // This is where the worker starts!
+        //
+        // Start the request-response loop.
+        // 1. Client needs to negotiate with server about communication rules.
+        // 2. Client must authenticate the user and proxy user against the
+        //    server.
+        // 3. Verify the API request information. Is the client allowed to
+        //    perform the operation?
+    } // serve
+
     boost::asio::io_service& io_service_;
     boost::asio::signal_set signals_;
     tcp::acceptor acceptor_;
     tcp::socket socket_;
+    kdd::scpps::accept_limiter limiter_;
+    kdd::scpps::resource_probe probe_;
+    kdd::scpps::resource_limits limits_;
+    boost::asio::steady_timer resize_timer_;
+    kdd::scpps::worker_pool pool_;
 }; // class server
 
 int main(int _argc, const char** _argv)
@@ -1,15 +1,35 @@
 #include "message_generated.h"
+#include "accept_limiter.hpp"
+#include "authenticator.hpp"
+#include "block_checksum.hpp"
+#include "compact_message.hpp"
+#include "frame_header.hpp"
+#include "huge_page_region.hpp"
+#include "lock_profiler.hpp"
+#include "mapped_object_cache.hpp"
+#include "memory_governor.hpp"
+#include "output_queue.hpp"
+#include "quota_table.hpp"
+#include "resource_limits.hpp"
+#include "session_resumption.hpp"
+#include "tenant_pools.hpp"
+#include "tls_context.hpp"
+#include "tls_write_stream.hpp"
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/read.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/endian/buffers.hpp>
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
 
+#include <zlib.h>
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syslog.h>
@@ -17,6 +37,10 @@
 
 #include <memory>
 #include <array>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 
 using boost::asio::ip::tcp;
 
@@ -81,15 +105,60 @@ int create_pid_file()
 class server
 {
 public:
-    server(boost::asio::io_service& _io_service, int _port)
+    using read_handler = std::function<void(boost::system::error_code, std::size_t)>;
+
+    server(boost::asio::io_service& _io_service, int _port, const kdd::scpps::tls_context* _tls = nullptr)
         : io_service_{_io_service}
         , signals_{_io_service, SIGTERM, SIGINT, SIGCHLD}
         , acceptor_{_io_service, tcp::endpoint(tcp::v4(), _port)}
         , socket_{_io_service}
+        , limiter_{}
+        , probe_{}
+        , limits_{probe_.detect()}
+        , sizing_{kdd::scpps::resource_probe::derive(limits_)}
+        , resize_timer_{_io_service}
+        , children_{}
+        , governor_{governor_config(probe_)}
+        , sessions_memory_{governor_.add_subsystem("sessions", 0)}
+        , objects_memory_{governor_.add_subsystem("mapped objects", sizing_.cache_budget)}
+        , object_cache_{governor_, objects_memory_}
+        , forks_{}
+        , fork_time_total_{}
+        , fork_time_max_{}
+        , tls_context_{_tls}
+        , tls_stream_{}
+        , tls_timer_{_io_service}
+        , resumption_token_{}
+        , session_user_{}
+        , session_proxy_user_{}
+        , compact_ops_{}
         , message_size_{}
+        , frame_header_{}
         , message_{}
+        , frame_buffer_{}
+        , output_stream_{socket_}
+        , output_{_io_service, output_stream_}
+        , auth_provider_{}
+        , authenticator_{}
+        , authenticated_{}
+        , auth_pending_{}
+        , read_after_auth_{}
+        , deferred_messages_{}
+        , deferred_flags_{}
+        , deferred_request_id_{}
+        , tenants_{tenants_file}
+        , tenant_session_{}
+        , quotas_{}
+        , quota_timer_{_io_service}
+        , account_{kdd::scpps::quota_table::no_account}
     {
+        log_sizing();
+        load_quotas();
+        signals_.add(SIGUSR1);
+        signals_.add(SIGUSR2);
         wait_for_signal();
+        schedule_resize();
+        schedule_quota_save();
         do_accept();
     } // server (constructor)
 
@@ -103,6 +172,8 @@ private:
                 case SIGTERM: signal_name = "SIGTERM"; break;
                 case SIGINT : signal_name = "SIGINT" ; break;
                 case SIGCHLD: signal_name = "SIGCHLD"; break;
+                case SIGUSR1: signal_name = "SIGUSR1"; break;
+                case SIGUSR2: signal_name = "SIGUSR2"; break;
             }
 
             // Only the parent process should check for this signal. We can determine
@@ -112,10 +183,37 @@ private:
 
                 // Reap completed child processes so that we don't end up with zombies.
                 if (SIGCHLD == _signal) {
-                    for (int status = 0; waitpid(-1, &status, WNOHANG) > 0;) {}
+                    pid_t pid;
+                    for (int status = 0; (pid = waitpid(-1, &status, WNOHANG)) > 0;) {
+                        limiter_.release(pid);
+                        tenants_.on_exit(pid);
+
+                        if (const auto child = children_.find(pid); child != std::end(children_)) {
+                            governor_.release(sessions_memory_, child->second);
+                            children_.erase(child);
+                        }
+                    }
+                }
+
+                // Report memory usage per subsystem and what forking costs.
+                if (SIGUSR1 == _signal) {
+                    syslog(LOG_INFO | LOG_USER, "%s", governor_.report().c_str());
+                    log_fork_cost();
+                    syslog(LOG_INFO | LOG_USER, "%s", tenants_.report().c_str());
+                    syslog(LOG_INFO | LOG_USER, "%s", kdd::scpps::lock_profiler::instance().report().c_str());
+                }
+
+                // Toggle lock profiling. Children forked from now on inherit the
+                // setting.
+                if (SIGUSR2 == _signal) {
+                    auto& profiler = kdd::scpps::lock_profiler::instance();
+                    profiler.enabled() ? profiler.disable() : profiler.enable(lock_sample_every);
+                    syslog(LOG_INFO | LOG_USER, "Lock profiling %s", profiler.enabled() ? "enabled" : "disabled");
                 }
 
                 if (SIGTERM == _signal || SIGINT == _signal) {
+                    quota_timer_.cancel();
+                    save_quotas();
                     acceptor_.close();
                     syslog(LOG_INFO | LOG_USER, "Closed acceptor socket");
                 }
@@ -126,6 +224,20 @@ private:
             }
             else {
                 syslog(LOG_INFO | LOG_USER, "Caught signal (child) [pid:%d]", getpid());
+
+                // Lock statistics are per process, so a child reports its own,
+                // together with the state of its output queue.
+                if (SIGUSR1 == _signal) {
+                    syslog(LOG_INFO | LOG_USER, "%s", kdd::scpps::lock_profiler::instance().report().c_str());
+                    syslog(LOG_INFO | LOG_USER, "%s", output_.report().c_str());
+                }
+
+                // Keep listening, so that reports can be requested any number of
+                // times over the life of a session. SIGUSR2 has no effect here,
+                // but must not end the wait either.
+                if (SIGUSR1 == _signal || SIGUSR2 == _signal) {
+                    wait_for_signal();
+                }
             }
         });
     } // wait_for_signal
@@ -139,12 +251,34 @@ private:
             }
 
             if (!_ec) {
+                // Reject sources that connect too often or hold too many connections
+                // before paying for a fork. The connection is reset rather than shut
+                // down gracefully so that a flood costs us as little as possible.
+                boost::system::error_code ec;
+                const auto source = socket_.remote_endpoint(ec).address();
+
+                // Under critical memory pressure another child could tip the machine
+                // into the OOM killer, so new connections are shed until it eases.
+                governor_.poll();
+
+                if (!governor_.admit() || children_.size() >= sizing_.max_children ||
+                    (!ec && limiter_.admit(source) != kdd::scpps::accept_limiter::verdict::accept))
+                {
+                    socket_.set_option(boost::asio::socket_base::linger{true, 0}, ec);
+                    socket_.close(ec);
+                    do_accept();
+                    return;
+                }
+
                 // Inform the io_service that we are about to fork. The io_service cleans
                 // up any internal resources, such as threads, that may interfere with
                 // forking.
                 io_service_.notify_fork(boost::asio::io_service::fork_prepare);
 
-                if (fork() == 0) {
+                const auto fork_started = std::chrono::steady_clock::now();
+                const auto pid = fork();
+
+                if (pid == 0) {
                     // Inform the io_service that the fork is finished and that this is the
                     // child process. The io_service uses this opportunity to create any
                     // internal file descriptors that must be private to the new process.
@@ -156,6 +290,16 @@ private:
 
                     // The child process is not interested in processing the SIGCHLD signal.
                     signals_.remove(SIGCHLD);
+                    resize_timer_.cancel();
+                    quota_timer_.cancel();
+
+                    // Session buffers are only needed in the child. They start
+                    // small and grow with the messages, up to the size allowed
+                    // for the container as of the fork.
+                    message_.resize(initial_buffer_size);
+                    frame_buffer_.resize(initial_buffer_size);
+                    governor_.set_shrinker(sessions_memory_, [this](auto) { return shrink_buffers(); });
+                    configure_output();
 
                     syslog(LOG_INFO | LOG_USER, "Forked child [pid:%d]", getpid());
 
@@ -167,7 +311,12 @@ private:
                     //    server.
                     // 3. Verify the API request information. Is the client allowed to
                     //    perform the operation?
-                    do_read();
+                    if (tls_context_) {
+                        start_tls();
+                    }
+                    else {
+                        do_read();
+                    }
 
                     // This allows the child process to exit normally. Another way to
                     // achieve this is by replacing signals_.remove(SIGCHLD) with
@@ -181,6 +330,23 @@ private:
                     // preparation for the fork.
                     io_service_.notify_fork(boost::asio::io_service::fork_parent);
 
+                    if (pid > 0) {
+                        const auto fork_time = std::chrono::steady_clock::now() - fork_started;
+                        fork_time_total_ += fork_time;
+                        fork_time_max_ = std::max(fork_time_max_, fork_time);
+                        ++forks_;
+
+                        limiter_.track(pid, source);
+
+                        // Charged by the parent, so a child that crashes cannot leak
+                        // its share. This is what the child's buffers may grow to.
+                        children_[pid] = 2 * sizing_.message_buffer_size;
+                        governor_.charge(sessions_memory_, children_[pid]);
+                    }
+                    else if (!ec) {
+                        limiter_.release(source);
+                    }
+
                     socket_.close();
                     do_accept();
                 }
@@ -196,54 +362,866 @@ private:
     {
         using int_type = boost::endian::little_int32_buf_t;
 
-        boost::asio::async_read(socket_, boost::asio::buffer(&message_size_, sizeof(int_type)),
+        // Requests are only read once the session is authenticated.
+        if (auth_pending_) {
+            read_after_auth_ = true;
+            return;
+        }
+
+        // Between requests the session buffers are idle, so this is where the
+        // child gives memory back under pressure.
+        governor_.poll();
+
+        // Don't read further requests while the client isn't reading the
+        // responses to earlier ones. TCP flow control then slows the client down.
+        if (output_.paused()) {
+            output_.when_drained([this] { do_read(); });
+            return;
+        }
+
+        read_exactly(boost::asio::buffer(&message_size_, sizeof(int_type)),
             [this](auto _ec, auto _length) {
                 if (!_ec) {
                     const auto msg = fmt::format("Bytes read: {}, value: {}", _length, message_size_);
                     syslog(LOG_INFO | LOG_USER, "%s", msg.c_str());
+
+                    const auto first_word = static_cast<std::uint32_t>(message_size_.value());
+                    const auto version = kdd::scpps::frame_version(first_word);
+
+                    if (version == kdd::scpps::frame_version_2) {
+                        do_read_frame_header();
+                        return;
+                    }
+
+                    if (version != 1) {
+                        syslog(LOG_ERR | LOG_USER, "Unsupported frame version [version:%u]", version);
+                        io_service_.stop();
+                        return;
+                    }
+
+                    if (first_word & kdd::scpps::compact_frame_flag) {
+                        do_read_compact();
+                        return;
+                    }
+
                     do_read_body();
                     return;
                 }
 
                 syslog(LOG_ERR | LOG_USER, "%s", fmt::format("Network error: {}", _ec.message()).c_str());
+
+                if (!resumption_token_.empty()) {
+                    park_session();
+                    return;
+                }
+
                 io_service_.stop();
             });
     } // do_read
 
     void do_read_body()
     {
-        boost::asio::async_read(socket_, boost::asio::buffer(message_, message_size_.value()),
+        if (message_size_.value() < 0 || !reserve_buffer(message_, message_size_.value())) {
+            syslog(LOG_ERR | LOG_USER, "Message too large [size:%d, limit:%zu]", message_size_.value(), sizing_.message_buffer_size);
+            io_service_.stop();
+            return;
+        }
+
+        read_exactly(boost::asio::buffer(message_, message_size_.value()),
             [this](auto _ec, auto _length) {
                 if (!_ec) {
                     syslog(LOG_INFO | LOG_USER, "%s", fmt::format("Bytes read: {}, value: {}", _length, message_size_).c_str());
 
-                    using namespace kdd::scpps;
-                    auto msg = Getmessage((std::uint8_t*) message_.data());
-
-                    syslog(LOG_INFO | LOG_USER,
-                           "min protocol version: %i, user: %s, proxy user: %s, payload: %s",
-                           msg->minimum_protocol_version(),
-                           msg->user()->name()->c_str(),
-                           msg->proxy_user()->name()->c_str(),
-                           msg->payload()->c_str());
+                    if (handle_message(message_.data(), message_size_.value())) {
+                        do_read();
+                        return;
+                    }
+                }
+                else if (!resumption_token_.empty()) {
+                    park_session();
+                    return;
                 }
 
                 io_service_.stop();
             });
     } // do_read_body
 
+    void do_read_compact()
+    {
+        using kdd::scpps::compact_message;
+
+        const auto size = static_cast<std::uint32_t>(message_size_.value()) & ~kdd::scpps::compact_frame_flag;
+
+        if (!compact_ops_ || size != sizeof(compact_message)) {
+            syslog(LOG_ERR | LOG_USER, "Unexpected compact message [size:%u]", size);
+            io_service_.stop();
+            return;
+        }
+
+        read_exactly(boost::asio::buffer(message_, sizeof(compact_message)),
+            [this](auto _ec, auto) {
+                if (!_ec) {
+                    if (handle_compact_message(message_.data())) {
+                        do_read();
+                        return;
+                    }
+                }
+                else if (!resumption_token_.empty()) {
+                    park_session();
+                    return;
+                }
+
+                io_service_.stop();
+            });
+    } // do_read_compact
+
+    // Grows _buffer to hold _size bytes. Fails for sizes beyond the message
+    // buffer size and, under critical memory pressure, for any growth.
+    bool reserve_buffer(std::vector<char>& _buffer, std::size_t _size)
+    {
+        if (_size <= _buffer.size()) {
+            return true;
+        }
+
+        if (_size > sizing_.message_buffer_size || governor_.pressure() == kdd::scpps::memory_pressure::critical) {
+            return false;
+        }
+
+        _buffer.resize(std::min(sizing_.message_buffer_size, std::max(_size, 2 * _buffer.size())));
+
+        return true;
+    } // reserve_buffer
+
+    // Shrinker for the session buffers. Runs from do_read(), while no request
+    // uses them.
+    std::uint64_t shrink_buffers()
+    {
+        std::uint64_t freed = 0;
+
+        for (auto* buffer : {&message_, &frame_buffer_}) {
+            if (buffer->size() > initial_buffer_size) {
+                freed += buffer->size() - initial_buffer_size;
+                std::vector<char>(initial_buffer_size).swap(*buffer);
+            }
+        }
+
+        return freed;
+    } // shrink_buffers
+
+    static kdd::scpps::memory_governor_config governor_config(const kdd::scpps::resource_probe& _probe)
+    {
+        kdd::scpps::memory_governor_config config;
+        config.psi_path = _probe.memory_pressure_path();
+        return config;
+    } // governor_config
+
+    // Output limits scale with the largest message a session accepts, so a
+    // handful of pipelined requests can always be answered without pausing.
+    void configure_output()
+    {
+        kdd::scpps::output_queue_config config;
+        config.pause_bytes = 16 * sizing_.message_buffer_size;
+        config.resume_bytes = 4 * sizing_.message_buffer_size;
+        config.max_bytes = 64 * sizing_.message_buffer_size;
+        config.slow_consumer_timeout = slow_consumer_timeout;
+
+        output_.set_config(config);
+        output_.on_stall([this] {
+            boost::system::error_code ec;
+            socket_.close(ec);
+            io_service_.stop();
+        });
+    } // configure_output
+
+    // Re-reads the cgroup limits periodically. Containers can be resized while
+    // the server runs. New sizes apply to children forked afterwards.
+    void schedule_resize()
+    {
+        resize_timer_.expires_after(resize_interval);
+        resize_timer_.async_wait([this](auto _ec) {
+            if (_ec || !acceptor_.is_open()) {
+                return;
+            }
+
+            if (const auto limits = probe_.detect(); limits != limits_) {
+                limits_ = limits;
+                sizing_ = kdd::scpps::resource_probe::derive(limits_);
+                governor_.set_budget(objects_memory_, sizing_.cache_budget);
+                log_sizing();
+            }
+
+            schedule_resize();
+        });
+    } // schedule_resize
+
+    void load_quotas()
+    {
+        if (boost::filesystem::exists(quotas_file) && quotas_.load(quotas_file) == -1) {
+            syslog(LOG_ERR | LOG_USER, "Could not load quotas [path:%s]", quotas_file);
+        }
+    } // load_quotas
+
+    // Folds the children's charges into the shared totals and persists them,
+    // so that usage survives a restart.
+    void save_quotas()
+    {
+        if (quotas_.save(quotas_file) == -1) {
+            syslog(LOG_ERR | LOG_USER, "Could not save quotas [path:%s]: %m", quotas_file);
+        }
+    } // save_quotas
+
+    void schedule_quota_save()
+    {
+        quota_timer_.expires_after(quota_save_interval);
+        quota_timer_.async_wait([this](auto _ec) {
+            if (_ec || !acceptor_.is_open()) {
+                return;
+            }
+
+            save_quotas();
+            schedule_quota_save();
+        });
+    } // schedule_quota_save
+
+    void log_sizing() const
+    {
+        syslog(LOG_INFO | LOG_USER,
+               "Resource limits [cpus:%.2f, cpuset:%u, memory:%lu] sizing [threads:%u, children:%u, message buffer:%zu, cache budget:%lu]",
+               limits_.cpus, limits_.cpuset_size, limits_.memory,
+               sizing_.worker_threads, sizing_.max_children, sizing_.message_buffer_size,
+               sizing_.cache_budget);
+    } // log_sizing
+
+    // Reads the rest of a version 2 frame header. The first 4 bytes have
+    // already been read into message_size_.
+    void do_read_frame_header()
+    {
+        std::memcpy(&frame_header_, &message_size_, sizeof(message_size_));
+
+        auto* rest = reinterpret_cast<char*>(&frame_header_) + sizeof(message_size_);
+
+        read_exactly(boost::asio::buffer(rest, sizeof(frame_header_) - sizeof(message_size_)),
+            [this](auto _ec, auto) {
+                if (!_ec) {
+                    do_read_frame_body();
+                    return;
+                }
+
+                if (!resumption_token_.empty()) {
+                    park_session();
+                    return;
+                }
+
+                io_service_.stop();
+            });
+    } // do_read_frame_header
+
+    void do_read_frame_body()
+    {
+        const auto size = kdd::scpps::frame_body_size(frame_header_);
+
+        // The header alone is enough to turn away frames we are not going to
+        // serve. The body is never read in that case.
+        if (frame_header_.opcode.value() > kdd::scpps::api_no_MAX || !reserve_buffer(frame_buffer_, size)) {
+            syslog(LOG_ERR | LOG_USER, "Rejected frame [request id:%llu, opcode:%u, size:%u]",
+                   static_cast<unsigned long long>(frame_header_.request_id.value()), frame_header_.opcode.value(), size);
+            io_service_.stop();
+            return;
+        }
+
+        read_exactly(boost::asio::buffer(frame_buffer_, size),
+            [this, size](auto _ec, auto) {
+                if (!_ec) {
+                    if (handle_frame(size)) {
+                        do_read();
+                        return;
+                    }
+                }
+                else if (!resumption_token_.empty()) {
+                    park_session();
+                    return;
+                }
+
+                io_service_.stop();
+            });
+    } // do_read_frame_body
+
+    // Unwraps the body of a version 2 frame (checksum, compression, batching)
+    // and handles the message(s) it contains.
+    bool handle_frame(std::size_t _size)
+    {
+        using namespace kdd::scpps;
+
+        const auto flags = frame_header_.flags.value();
+        const auto request_id = static_cast<unsigned long long>(frame_header_.request_id.value());
+
+        syslog(LOG_INFO | LOG_USER, "frame: request id: %llu, opcode: %s, flags: %#x, size: %zu",
+               request_id, EnumNameapi_no(static_cast<api_no>(frame_header_.opcode.value())), flags, _size);
+
+        const char* body = frame_buffer_.data();
+        std::size_t body_size = _size;
+
+        if ((flags & frame_checksummed) && !verify_frame_checksum(body, body_size)) {
+            syslog(LOG_ERR | LOG_USER, "Frame checksum mismatch [request id:%llu]", request_id);
+            return false;
+        }
+
+        if (flags & frame_compressed) {
+            if (!reserve_buffer(message_, sizing_.message_buffer_size)) {
+                return false;
+            }
+
+            uLongf length = message_.size();
+
+            if (uncompress(reinterpret_cast<Bytef*>(message_.data()), &length, reinterpret_cast<const Bytef*>(body), body_size) != Z_OK) {
+                syslog(LOG_ERR | LOG_USER, "Could not decompress frame [request id:%llu]", request_id);
+                return false;
+            }
+
+            body = message_.data();
+            body_size = length;
+        }
+
+        // The header's opcode is the operation of the (first) message, and
+        // whatever routes on it must see the operation that actually runs.
+        return handle_messages(body, body_size, flags, request_id, static_cast<api_no>(frame_header_.opcode.value()));
+    } // handle_frame
+
+    // Handles the message(s) in the unwrapped body of a version 2 frame.
+    // _opcode is checked against the first message.
+    //
+    // A message that starts authentication pauses the session. The rest of a
+    // batch must not run before the outcome is known, so it is set aside and
+    // handled by resume_messages() once the session is authenticated.
+    bool handle_messages(const char* _body, std::size_t _size, std::uint16_t _flags, unsigned long long _request_id,
+                         std::optional<kdd::scpps::api_no> _opcode)
+    {
+        using namespace kdd::scpps;
+
+        auto handle = [this, _flags, _request_id, &_opcode](const char* _data, std::size_t _length) {
+            const auto expected = std::exchange(_opcode, std::nullopt);
+
+            if (_flags & frame_compact) {
+                if (!compact_ops_ || _length != sizeof(compact_message)) {
+                    return false;
+                }
+
+                if (expected && decode_compact_message(_data).api_number.value() != *expected) {
+                    syslog(LOG_ERR | LOG_USER, "Frame opcode does not match its message [request id:%llu]", _request_id);
+                    return false;
+                }
+
+                return handle_compact_message(_data);
+            }
+
+            return handle_message(_data, _length, expected);
+        };
+
+        if (!(_flags & frame_batched)) {
+            return handle(_body, _size);
+        }
+
+        batch_reader batch{_body, _size};
+        const char* data = nullptr;
+        std::size_t length = 0;
+
+        while (batch.next(data, length)) {
+            if (!handle(data, length)) {
+                return false;
+            }
+
+            if (auth_pending_ && batch.rest_size() > 0) {
+                deferred_messages_.assign(batch.rest(), batch.rest() + batch.rest_size());
+                deferred_flags_ = _flags;
+                deferred_request_id_ = _request_id;
+                return true;
+            }
+        }
+
+        return !batch.malformed();
+    } // handle_messages
+
+    // Handles the rest of a batch that was set aside while the session
+    // authenticated. Returns false if the session has to end.
+    bool resume_messages()
+    {
+        if (deferred_messages_.empty()) {
+            return true;
+        }
+
+        const auto messages = std::move(deferred_messages_);
+        deferred_messages_.clear();
+
+        return handle_messages(messages.data(), messages.size(), deferred_flags_, deferred_request_id_, std::nullopt);
+    } // resume_messages
+
+    bool handle_compact_message(const char* _data)
+    {
+        using namespace kdd::scpps;
+
+        const auto msg = decode_compact_message(_data);
+        const auto api_number = static_cast<api_no>(msg.api_number.value());
+
+        if (!is_compact_op(api_number)) {
+            syslog(LOG_ERR | LOG_USER, "Operation not allowed in compact form [api number:%u]", msg.api_number.value());
+            return false;
+        }
+
+        // Compact messages count against the bandwidth quota like any other.
+        if (account_ != quota_table::no_account && !quotas_.charge_bandwidth(account_, sizeof(compact_message))) {
+            syslog(LOG_ERR | LOG_USER, "Bandwidth quota exceeded [pid:%d]", getpid());
+            return false;
+        }
+
+        syslog(LOG_INFO | LOG_USER,
+               "compact op: %s, handle: %u, argument: %lld, whence: %u",
+               EnumNameapi_no(api_number),
+               msg.handle.value(),
+               static_cast<long long>(msg.argument.value()),
+               msg.whence.value());
+
+        return true;
+    } // handle_compact_message
+
+    // Returns false if the message is malformed, the connection was handed
+    // over to another process or the session has to end. _opcode is the
+    // operation the frame header announced for this message, if any.
+    bool handle_message(const char* _data, std::size_t _size, std::optional<kdd::scpps::api_no> _opcode = std::nullopt)
+    {
+        using namespace kdd::scpps;
+
+        // Bodies come straight from the client (or out of zlib), so they are
+        // verified before any field is accessed.
+        flatbuffers::Verifier verifier{reinterpret_cast<const std::uint8_t*>(_data), _size};
+
+        if (!VerifymessageBuffer(verifier)) {
+            syslog(LOG_ERR | LOG_USER, "Malformed message [pid:%d, size:%zu]", getpid(), _size);
+            return false;
+        }
+
+        auto msg = Getmessage((std::uint8_t*) _data);
+
+        if (_opcode && msg->api_number() != *_opcode) {
+            syslog(LOG_ERR | LOG_USER, "Frame opcode does not match its message [opcode:%s, api number:%s]",
+                   EnumNameapi_no(*_opcode), EnumNameapi_no(msg->api_number()));
+            return false;
+        }
+
+        syslog(LOG_INFO | LOG_USER,
+               "min protocol version: %i, user: %s, proxy user: %s, payload: %s",
+               msg->minimum_protocol_version(),
+               user_name(msg->user()).c_str(),
+               user_name(msg->proxy_user()).c_str(),
+               msg->payload() ? msg->payload()->c_str() : "");
+
+        // A client presenting a resumption token on a new connection may have a
+        // session parked from an earlier connection. If so, and the parked
+        // session accepts the client's identity, it takes over the connection.
+        // Otherwise this is a new session.
+        if (const auto* token = msg->resumption_token(); token && !authenticated_ && !auth_pending_ && can_resume()) {
+            if (session_parking::hand_off(token->str(), socket_.native_handle(), _data, _size) == 0) {
+                syslog(LOG_INFO | LOG_USER, "Handed connection to parked session [pid:%d]", getpid());
+                return false;
+            }
+        }
+
+        if (!authenticated_ && !auth_pending_ && !start_authentication(msg)) {
+            return false;
+        }
+
+        if (account_ != kdd::scpps::quota_table::no_account && !quotas_.charge_bandwidth(account_, _size)) {
+            syslog(LOG_ERR | LOG_USER, "Bandwidth quota exceeded [pid:%d]", getpid());
+            return false;
+        }
+
+        // Once announced, the client may send the operations listed in
+        // is_compact_op() as compact messages for the rest of the session.
+        if (msg->compact_ops() && !compact_ops_) {
+            compact_ops_ = true;
+            syslog(LOG_INFO | LOG_USER, "Compact messages enabled [pid:%d]", getpid());
+        }
+
+        return true;
+    } // handle_message
+
+    // Authenticates the proxy user and checks that it may act for the user.
+    // The check runs on the authenticator's threads, and reading pauses until
+    // it completes. Returns false if the session has to end, which it does
+    // without a user file since no one can be authenticated then.
+    bool start_authentication(const kdd::scpps::message* _msg)
+    {
+        if (!boost::filesystem::exists(users_file)) {
+            syslog(LOG_ERR | LOG_USER, "Cannot authenticate without user file [pid:%d, path:%s]", getpid(), users_file);
+            return false;
+        }
+
+        const auto* proxy_user = _msg->proxy_user();
+        auto credential = proxy_user && proxy_user->credential() ? proxy_user->credential()->str() : std::string{};
+
+        if (!authenticator_) {
+            auth_provider_ = std::make_unique<kdd::scpps::file_auth_provider>(users_file);
+            authenticator_ = std::make_unique<kdd::scpps::authenticator>(io_service_, *auth_provider_, 1);
+        }
+
+        auth_pending_ = true;
+
+        authenticator_->authenticate(user_name(_msg->user()), user_name(proxy_user), std::move(credential),
+            [this, user = user_name(_msg->user()), proxy = user_name(proxy_user)](auto _status) {
+                auth_pending_ = false;
+
+                if (_status != kdd::scpps::auth_status::granted) {
+                    syslog(LOG_ERR | LOG_USER, "Authentication failed [pid:%d, user:%s, proxy user:%s]", getpid(), user.c_str(), proxy.c_str());
+                    io_service_.stop();
+                    return;
+                }
+
+                syslog(LOG_INFO | LOG_USER, "Authenticated [pid:%d, user:%s, proxy user:%s]", getpid(), user.c_str(), proxy.c_str());
+                authenticated_ = true;
+
+                if (!join_tenant(user)) {
+                    return;
+                }
+
+                issue_resumption_token(user, proxy);
+
+                if (!resume_messages()) {
+                    io_service_.stop();
+                    return;
+                }
+
+                if (std::exchange(read_after_auth_, false)) {
+                    do_read();
+                }
+            });
+
+        return true;
+    } // start_authentication
+
+    // Moves the session into the resource pool of the user's tenant class.
+    // Sessions of a class that is at its limit are turned away.
+    bool join_tenant(const std::string& _user)
+    {
+        if (tenant_session_) {
+            return true;
+        }
+
+        auto session = tenants_.join(_user);
+
+        if (!session) {
+            syslog(LOG_ERR | LOG_USER, "Tenant class is full [pid:%d, user:%s, class:%s]",
+                   getpid(), _user.c_str(), tenants_.get(tenants_.classify(_user)).name.c_str());
+            io_service_.stop();
+            return false;
+        }
+
+        tenant_session_.emplace(std::move(*session));
+        account_ = quotas_.lookup(_user);
+
+        syslog(LOG_INFO | LOG_USER, "Joined tenant class [pid:%d, user:%s, class:%s]",
+               getpid(), _user.c_str(), tenants_.get(tenant_session_->class_id()).name.c_str());
+
+        return true;
+    } // join_tenant
+
+    // Creates the token the client can present to resume this session after a
+    // dropped connection. The session remembers who it was authenticated as,
+    // since only the same identity may resume it.
+    void issue_resumption_token(const std::string& _user, const std::string& _proxy_user)
+    {
+        if (!can_resume() || !resumption_token_.empty()) {
+            return;
+        }
+
+        resumption_token_ = kdd::scpps::make_resumption_token();
+        if (resumption_token_.empty()) {
+            syslog(LOG_ERR | LOG_USER, "Could not create resumption token [pid:%d]", getpid());
+            return;
+        }
+
+        session_user_ = _user;
+        session_proxy_user_ = _proxy_user;
+
+        send_resumption_token();
+    } // issue_resumption_token
+
+    // The reply is a length-prefixed message carrying only the token.
+    void send_resumption_token()
+    {
+        flatbuffers::FlatBufferBuilder builder{128};
+        const auto token = builder.CreateString(resumption_token_);
+
+        kdd::scpps::messageBuilder message_builder{builder};
+        message_builder.add_resumption_token(token);
+        builder.Finish(message_builder.Finish());
+
+        const boost::endian::little_int32_buf_t size(static_cast<std::int32_t>(builder.GetSize()));
+        const auto* p = reinterpret_cast<const char*>(&size);
+
+        std::vector<char> reply(p, p + sizeof(size));
+        reply.insert(std::end(reply), builder.GetBufferPointer(), builder.GetBufferPointer() + builder.GetSize());
+
+        output_.push(std::move(reply));
+    } // send_resumption_token
+
+    static std::string user_name(const kdd::scpps::user_info* _user)
+    {
+        return _user && _user->name() ? _user->name()->str() : std::string{};
+    } // user_name
+
+    // Only the identity the session was authenticated as may take it over.
+    bool may_resume(const char* _data, std::size_t _size) const
+    {
+        flatbuffers::Verifier verifier{reinterpret_cast<const std::uint8_t*>(_data), _size};
+
+        if (!kdd::scpps::VerifymessageBuffer(verifier)) {
+            return false;
+        }
+
+        const auto* msg = kdd::scpps::Getmessage(_data);
+
+        return user_name(msg->user()) == session_user_ && user_name(msg->proxy_user()) == session_proxy_user_;
+    } // may_resume
+
+    // Sessions can only move between processes if no TLS state lives in user
+    // space. With kTLS the state travels with the socket.
+    bool can_resume() const
+    {
+        return !tls_stream_ || (tls_stream_->ktls_send() && tls_stream_->ktls_recv());
+    } // can_resume
+
+    // Keeps the session (and everything the child holds for it) alive for a
+    // while after the connection dropped, so that the client can pick up where
+    // it left off.
+    void park_session()
+    {
+        socket_.close();
+
+        std::vector<char> message;
+        const int fd = kdd::scpps::session_parking::park(resumption_token_, session_grace_period, message,
+            [this](const char* _data, std::size_t _size) { return may_resume(_data, _size); });
+
+        if (fd == -1) {
+            syslog(LOG_INFO | LOG_USER, "Parked session expired [pid:%d]", getpid());
+            io_service_.stop();
+            return;
+        }
+
+        if (!reserve_buffer(message_, message.size())) {
+            close(fd);
+            io_service_.stop();
+            return;
+        }
+
+        socket_.assign(tcp::v4(), fd);
+        std::copy(std::begin(message), std::end(message), std::begin(message_));
+        message_size_ = static_cast<std::int32_t>(message.size());
+
+        syslog(LOG_INFO | LOG_USER, "Session resumed [pid:%d]", getpid());
+
+        send_resumption_token();
+
+        handle_message(message_.data(), message_size_.value());
+        do_read();
+    } // park_session
+
+    // The handshake runs asynchronously and must complete within
+    // tls_handshake_timeout, so a client that connects and goes quiet does not
+    // hold on to the child.
+    void start_tls()
+    {
+        tls_stream_ = std::make_unique<kdd::scpps::tls_stream>(*tls_context_, socket_.native_handle());
+        socket_.non_blocking(true);
+
+        tls_timer_.expires_after(tls_handshake_timeout);
+        tls_timer_.async_wait([this](auto _ec) {
+            if (!_ec) {
+                syslog(LOG_ERR | LOG_USER, "TLS handshake timed out [pid:%d]", getpid());
+                io_service_.stop();
+            }
+        });
+
+        continue_handshake();
+    } // start_tls
+
+    void continue_handshake()
+    {
+        using kdd::scpps::tls_io;
+
+        switch (const auto result = tls_stream_->handshake_step(); result) {
+            case tls_io::done:
+                tls_timer_.cancel();
+
+                // With kTLS in both directions the kernel decrypts incoming records,
+                // so the socket carries plaintext from our point of view.
+                // Otherwise read_exactly() decrypts in user space, and responses
+                // are encrypted by the output queue's stream. Either way the
+                // session runs the regular read loop.
+                output_stream_.set_tls(tls_stream_.get());
+                do_read();
+                return;
+
+            case tls_io::want_read:
+            case tls_io::want_write:
+                socket_.async_wait(result == tls_io::want_read ? tcp::socket::wait_read : tcp::socket::wait_write,
+                    [this](auto _ec) {
+                        if (_ec) {
+                            io_service_.stop();
+                            return;
+                        }
+
+                        continue_handshake();
+                    });
+                return;
+
+            default:
+                io_service_.stop();
+                return;
+        }
+    } // continue_handshake
+
+    // Reads exactly the size of _buffer from the client, decrypting in user
+    // space if the connection uses TLS without kTLS receive offload.
+    template <typename Handler>
+    void read_exactly(boost::asio::mutable_buffer _buffer, Handler _handler)
+    {
+        if (tls_stream_ && !tls_stream_->ktls_recv()) {
+            read_tls(_buffer, 0, std::move(_handler));
+            return;
+        }
+
+        boost::asio::async_read(socket_, _buffer, std::move(_handler));
+    } // read_exactly
+
+    // Userspace TLS fallback for kernels or OpenSSL builds without kTLS. Reads
+    // whatever OpenSSL has decrypted and waits for the socket whenever it needs
+    // more records.
+    void read_tls(boost::asio::mutable_buffer _buffer, std::size_t _done, read_handler _handler)
+    {
+        using kdd::scpps::tls_io;
+
+        auto* data = static_cast<char*>(_buffer.data());
+
+        while (_done < _buffer.size()) {
+            std::size_t n = 0;
+
+            switch (const auto result = tls_stream_->read_some(data + _done, _buffer.size() - _done, n); result) {
+                case tls_io::done:
+                    _done += n;
+                    continue;
+
+                case tls_io::want_read:
+                case tls_io::want_write:
+                    socket_.async_wait(result == tls_io::want_read ? tcp::socket::wait_read : tcp::socket::wait_write,
+                        [this, _buffer, _done, handler = std::move(_handler)](auto _ec) mutable {
+                            if (_ec) {
+                                handler(_ec, _done);
+                                return;
+                            }
+
+                            read_tls(_buffer, _done, std::move(handler));
+                        });
+                    return;
+
+                case tls_io::closed:
+                    _handler(boost::asio::error::eof, _done);
+                    return;
+
+                default:
+                    syslog(LOG_ERR | LOG_USER, "TLS read error: %s", kdd::scpps::last_tls_error().c_str());
+                    _handler(boost::asio::error::connection_reset, _done);
+                    return;
+            }
+        }
+
+        // Records OpenSSL had already decrypted can satisfy a whole series of
+        // reads. Completing through the io_service keeps the stack from
+        // growing with each of them.
+        boost::asio::post(io_service_, [handler = std::move(_handler), _done]() mutable {
+            handler(boost::system::error_code{}, _done);
+        });
+    } // read_tls
+
+    static constexpr std::chrono::milliseconds session_grace_period{30000};
+    static constexpr std::chrono::milliseconds slow_consumer_timeout{30000};
+    static constexpr std::chrono::seconds tls_handshake_timeout{10};
+    static constexpr std::size_t initial_buffer_size = 4096;
+    static constexpr const char* users_file = "/etc/scpps/users";
+    static constexpr const char* tenants_file = "/etc/scpps/tenants";
+    static constexpr const char* quotas_file = "/var/lib/scpps/quotas";
+    static constexpr std::chrono::seconds quota_save_interval{60};
+
+    // Forks get slower with every inherited anonymous page, so large
+    // parent-only regions should be excluded from forks (see
+    // huge_page_region::fork_policy). A growing inherited footprint together
+    // with growing fork times shows that one was missed.
+    void log_fork_cost() const
+    {
+        using std::chrono::microseconds;
+        using std::chrono::duration_cast;
+
+        const auto footprint = kdd::scpps::measure_fork_footprint();
+        const auto average = forks_ > 0 ? fork_time_total_ / static_cast<std::int64_t>(forks_) : fork_time_total_;
+
+        syslog(LOG_INFO | LOG_USER,
+               "Fork cost [forks:%lu, average:%ldus, max:%ldus] footprint [inherited:%zu, excluded:%zu, wiped:%zu]",
+               forks_,
+               static_cast<long>(duration_cast<microseconds>(average).count()),
+               static_cast<long>(duration_cast<microseconds>(fork_time_max_).count()),
+               footprint.inherited, footprint.excluded, footprint.wiped);
+    } // log_fork_cost
+
+    static constexpr std::chrono::seconds resize_interval{10};
+    static constexpr std::uint32_t lock_sample_every = 64;
+
     boost::asio::io_service& io_service_;
     boost::asio::signal_set signals_;
     tcp::acceptor acceptor_;
     tcp::socket socket_;
+    kdd::scpps::accept_limiter limiter_;
+    kdd::scpps::resource_probe probe_;
+    kdd::scpps::resource_limits limits_;
+    kdd::scpps::resource_sizing sizing_;
+    boost::asio::steady_timer resize_timer_;
+    std::unordered_map<pid_t, std::uint64_t> children_; // Live children and the session memory charged for them.
+    kdd::scpps::memory_governor governor_;
+    kdd::scpps::memory_governor::subsystem sessions_memory_;
+    kdd::scpps::memory_governor::subsystem objects_memory_;
+    kdd::scpps::mapped_object_cache object_cache_; // Shared hotness and invalidation; mappings are per child.
+    std::uint64_t forks_;
+    std::chrono::steady_clock::duration fork_time_total_;
+    std::chrono::steady_clock::duration fork_time_max_;
+    const kdd::scpps::tls_context* tls_context_;
+    std::unique_ptr<kdd::scpps::tls_stream> tls_stream_;
+    boost::asio::steady_timer tls_timer_;
+    std::string resumption_token_;
+    std::string session_user_;
+    std::string session_proxy_user_;
+    bool compact_ops_;
     boost::endian::little_int32_buf_t message_size_;
-    std::array<char, 4096> message_;
+    kdd::scpps::frame_header_v2 frame_header_;
+    std::vector<char> message_;
+    std::vector<char> frame_buffer_;
+    kdd::scpps::tls_write_stream<tcp::socket> output_stream_;
+    kdd::scpps::output_queue<kdd::scpps::tls_write_stream<tcp::socket>> output_;
+    std::unique_ptr<kdd::scpps::file_auth_provider> auth_provider_;
+    std::unique_ptr<kdd::scpps::authenticator> authenticator_;
+    bool authenticated_;
+    bool auth_pending_;
+    bool read_after_auth_;
+    std::vector<char> deferred_messages_; // The rest of a batch that arrived while authenticating.
+    std::uint16_t deferred_flags_;
+    unsigned long long deferred_request_id_;
+    kdd::scpps::tenant_pools tenants_;
+    std::optional<kdd::scpps::tenant_session> tenant_session_; // Declared after tenants_, so it leaves first.
+    kdd::scpps::quota_table quotas_;
+    boost::asio::steady_timer quota_timer_;
+    kdd::scpps::quota_table::account account_;
 }; // class server
 
 int main(int _argc, const char** _argv)
 {
-    if (_argc != 2) {
-        fmt::print("Usage: {} <port>\n", _argv[0]);
+    if (_argc != 2 && _argc != 4) {
+        fmt::print("Usage: {} <port> [<certificate chain file> <private key file>]\n", _argv[0]);
         return 1;
     }
 
@@ -320,10 +1298,17 @@ int main(int _argc, const char** _argv)
 
         boost::asio::io_service io_service;
 
+        // The TLS context is created once, before any children are forked, so
+        // that every child shares the same session ticket keys.
+        std::unique_ptr<kdd::scpps::tls_context> tls;
+        if (_argc == 4) {
+            tls = std::make_unique<kdd::scpps::tls_context>(kdd::scpps::tls_config{_argv[2], _argv[3]});
+        }
+
         // Initialize the server before becoming a daemon. If the process is
         // started from a shell, this means any errors will be reported back to the
         // user.
-        server svr{io_service, std::stoi(_argv[1])};
+        server svr{io_service, std::stoi(_argv[1]), tls.get()};
 
         // The io_service can now be used normally.
         syslog(LOG_INFO | LOG_USER, "Daemon started [pid:%d]", getpid());
@@ -0,0 +1,258 @@
+#ifndef KDD_SCPPS_SESSION_RESUMPTION_HPP
+#define KDD_SCPPS_SESSION_RESUMPTION_HPP
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // Returns a random 128-bit resumption token as 32 hex characters.
+    inline std::string make_resumption_token()
+    {
+        unsigned char bytes[16];
+
+        if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+            return {};
+        }
+
+        std::string token;
+        for (const auto b : bytes) {
+            token += fmt::format("{:02x}", b);
+        }
+
+        return token;
+    } // make_resumption_token
+
+    inline bool is_valid_resumption_token(std::string_view _token)
+    {
+        return _token.size() >= 16 && _token.size() <= 64 &&
+               std::all_of(std::begin(_token), std::end(_token), [](unsigned char c) { return std::isxdigit(c); });
+    } // is_valid_resumption_token
+
+    // Keeps a session alive across client reconnects.
+    //
+    // Every connection is served by its own forked child, so everything the
+    // session owns (open handles, transfer offsets, ...) is simply the child's
+    // memory. The server issues the resumption token once the session is
+    // authenticated. When the connection drops, the child parks itself: it
+    // listens on an abstract Unix socket named after a hash of the token and
+    // waits for the grace period to pass. Abstract socket names are visible to
+    // every local user (/proc/net/unix), so the token itself never appears in
+    // one.
+    //
+    // A client that reconnects presents the token in its first message. The
+    // child that accepted the new connection finds the parked child through
+    // that name and passes it the client socket (SCM_RIGHTS) together with the
+    // message it already read. The parked child checks that the message comes
+    // from the identity the session was authenticated as before it carries on
+    // with its original state, and the new child exits. If the parked child
+    // refuses, the new child serves the connection as a new session.
+    //
+    // Only processes running as the same user may hand over a socket.
+    class session_parking
+    {
+    public:
+        // Decides whether the first message of a reconnecting client may take
+        // over the parked session.
+        using admission = std::function<bool(const char* _message, std::size_t _size)>;
+
+        // Passes _socket and the already received _message to the session
+        // parked under _token. Returns 0 on success and -1 if no such session
+        // exists or the hand-off failed. On success the caller must stop using
+        // _socket.
+        static int hand_off(const std::string& _token, int _socket, const char* _message, std::size_t _size)
+        {
+            if (!is_valid_resumption_token(_token)) {
+                return -1;
+            }
+
+            const int channel = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (channel == -1) {
+                return -1;
+            }
+
+            const auto addr = make_address(_token);
+            if (::connect(channel, reinterpret_cast<const sockaddr*>(&addr.first), addr.second) == -1) {
+                ::close(channel);
+                return -1;
+            }
+
+            iovec iov{const_cast<char*>(_message), _size};
+            char control[CMSG_SPACE(sizeof(int))]{};
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            auto* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &_socket, sizeof(int));
+
+            char ack = 0;
+            const bool ok = ::sendmsg(channel, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(_size) &&
+                            ::read(channel, &ack, 1) == 1 && ack == 1;
+
+            ::close(channel);
+
+            return ok ? 0 : -1;
+        } // hand_off
+
+        // Waits up to _grace for a reconnecting client that _admit accepts.
+        // Returns the new client socket and stores the first message the client
+        // sent in _message. Returns -1 if the grace period expired.
+        static int park(const std::string& _token,
+                        std::chrono::milliseconds _grace,
+                        std::vector<char>& _message,
+                        const admission& _admit)
+        {
+            const int listener = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if (listener == -1) {
+                return -1;
+            }
+
+            const auto addr = make_address(_token);
+            if (::bind(listener, reinterpret_cast<const sockaddr*>(&addr.first), addr.second) == -1 ||
+                ::listen(listener, 1) == -1)
+            {
+                syslog(LOG_ERR | LOG_USER, "Could not park session: %m");
+                ::close(listener);
+                return -1;
+            }
+
+            syslog(LOG_INFO | LOG_USER, "Session parked [pid:%d, grace:%lldms]", getpid(), static_cast<long long>(_grace.count()));
+
+            const auto deadline = std::chrono::steady_clock::now() + _grace;
+
+            for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now()) {
+                pollfd pfd{listener, POLLIN, 0};
+                const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+
+                if (::poll(&pfd, 1, static_cast<int>(timeout)) <= 0) {
+                    continue;
+                }
+
+                const int channel = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                if (channel == -1) {
+                    continue;
+                }
+
+                if (const int fd = receive(channel, _message, _admit); fd != -1) {
+                    ::close(listener);
+                    return fd;
+                }
+            }
+
+            ::close(listener);
+
+            return -1;
+        } // park
+
+    private:
+        static constexpr std::size_t max_message_size = 64 * 1024;
+
+        static std::pair<sockaddr_un, socklen_t> make_address(const std::string& _token)
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+
+            // A leading NUL byte places the name in the abstract namespace. The
+            // socket disappears with the process, so nothing needs cleaning up.
+            const auto name = "scpps-session-" + hash_token(_token);
+            std::memcpy(addr.sun_path + 1, name.data(), name.size());
+
+            return {addr, static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + name.size())};
+        } // make_address
+
+        // The first 128 bits of the SHA-256 of the token, as hex. Finding the
+        // session still requires the token, but the name does not reveal it.
+        static std::string hash_token(const std::string& _token)
+        {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+
+            if (EVP_Digest(_token.data(), _token.size(), digest, &length, EVP_sha256(), nullptr) != 1) {
+                return {};
+            }
+
+            std::string hash;
+            for (unsigned int i = 0; i < std::min(length, 16u); ++i) {
+                hash += fmt::format("{:02x}", digest[i]);
+            }
+
+            return hash;
+        } // hash_token
+
+        // Receives a client socket from a hand-off. The peer must run as the
+        // same user as this process, and _admit must accept the message.
+        static int receive(int _channel, std::vector<char>& _message, const admission& _admit)
+        {
+            ucred cred{};
+            socklen_t length = sizeof(cred);
+
+            if (::getsockopt(_channel, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1 || cred.uid != ::getuid()) {
+                ::close(_channel);
+                return -1;
+            }
+
+            _message.resize(max_message_size);
+            iovec iov{_message.data(), _message.size()};
+            char control[CMSG_SPACE(sizeof(int))]{};
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            const auto n = ::recvmsg(_channel, &msg, MSG_CMSG_CLOEXEC);
+            const auto* cmsg = CMSG_FIRSTHDR(&msg);
+
+            if (n < 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                ::close(_channel);
+                return -1;
+            }
+
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            _message.resize(n);
+
+            const char ack = _admit(_message.data(), _message.size()) ? 1 : 0;
+            if (ack == 0) {
+                syslog(LOG_ERR | LOG_USER, "Refused to resume session for a different identity [pid:%d]", getpid());
+            }
+
+            if (::write(_channel, &ack, 1) != 1 || ack == 0) {
+                ::close(fd);
+                fd = -1;
+            }
+
+            ::close(_channel);
+
+            return fd;
+        } // receive
+    }; // class session_parking
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_SESSION_RESUMPTION_HPP
@@ -0,0 +1,483 @@
+#ifndef KDD_SCPPS_STREAM_MUX_HPP
+#define KDD_SCPPS_STREAM_MUX_HPP
+
+#include <boost/endian/buffers.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <map>
+#include <vector>
+
+namespace kdd::scpps
+{
+    enum class frame_type : std::uint8_t
+    {
+        data          = 0, // Payload for a stream.
+        window_update = 1, // The receiver grants the sender more credit.
+        reset         = 2  // The stream is abandoned by the sender.
+    }; // enum class frame_type
+
+    enum mux_frame_flags : std::uint8_t
+    {
+        flag_none = 0,
+        flag_fin  = 1 // Last data frame of a stream.
+    }; // enum mux_frame_flags
+
+    // Header that precedes every frame on a multiplexed connection. For
+    // window_update frames, length holds the credit being granted and no
+    // payload follows. A stream id of 0 addresses the connection as a whole.
+    struct mux_frame_header
+    {
+        boost::endian::little_uint32_buf_t stream_id;
+        boost::endian::little_uint32_buf_t length;
+        std::uint8_t type;
+        std::uint8_t flags;
+    }; // struct mux_frame_header
+
+    static_assert(sizeof(mux_frame_header) == 10);
+
+    // Interleaves many logical streams over a single connection.
+    //
+    // The multiplexer does no I/O itself. Bytes received from the socket are
+    // handed to on_input() and bytes to transmit are collected with
+    // poll_output(), which lets the caller drive it from asio completion
+    // handlers or from a blocking loop.
+    //
+    // Outgoing data is split into frames of at most max_frame_payload bytes and
+    // streams take turns, so a short response never waits behind more than one
+    // frame of a bulk transfer. Each stream, and the connection as a whole, may
+    // only have as many unacknowledged bytes in flight as the receiver has
+    // granted. The receiver grants more credit (window_update) once the
+    // application has consumed half of a window, so the memory a connection can
+    // pin on the receiving side is bounded by the windows it advertises. The
+    // number of streams is capped as well, since every stream the peer names
+    // costs an entry whether or not it carries data.
+    class stream_mux
+    {
+    public:
+        static constexpr std::uint32_t max_frame_payload = 16 * 1024;
+        static constexpr std::uint32_t default_stream_window = 256 * 1024;
+        static constexpr std::uint32_t default_connection_window = 1024 * 1024;
+        static constexpr std::size_t default_max_streams = 256;
+
+        // _local_id_parity keeps stream ids opened by the two endpoints from
+        // colliding. Clients use odd ids (1) and servers even ids (0).
+        explicit stream_mux(std::uint32_t _local_id_parity,
+                            std::uint32_t _stream_window = default_stream_window,
+                            std::uint32_t _connection_window = default_connection_window,
+                            std::size_t _max_streams = default_max_streams)
+            : next_stream_id_{_local_id_parity % 2 == 1 ? 1u : 2u}
+            , max_streams_{_max_streams}
+            , stream_window_{_stream_window}
+            , connection_window_{_connection_window}
+            , send_credit_{_connection_window}
+            , receive_window_{_connection_window}
+        {
+        } // stream_mux (constructor)
+
+        std::uint32_t open_stream()
+        {
+            const auto id = next_stream_id_;
+            next_stream_id_ += 2;
+            stream(id);
+            return id;
+        } // open_stream
+
+        // Queues data for _stream_id. At most one stream window worth of data
+        // is buffered per stream. Returns the number of bytes accepted. The rest
+        // must be retried once poll_output() has drained the queue.
+        std::size_t send(std::uint32_t _stream_id, const void* _data, std::size_t _size, bool _fin = false)
+        {
+            auto& s = stream(_stream_id);
+
+            if (s.send_fin) {
+                return 0;
+            }
+
+            const auto room = stream_window_ - std::min<std::size_t>(stream_window_, s.outgoing.size());
+            const auto n = std::min(room, _size);
+            const auto* p = static_cast<const char*>(_data);
+
+            s.outgoing.insert(std::end(s.outgoing), p, p + n);
+            s.send_fin = _fin && n == _size;
+
+            if (n > 0 || s.send_fin) {
+                schedule(_stream_id);
+            }
+
+            return n;
+        } // send
+
+        // Appends frames ready for transmission to _out, using up to _budget bytes.
+        // Streams are served round-robin, one frame per turn.
+        std::size_t poll_output(std::vector<char>& _out, std::size_t _budget = ~std::size_t{0})
+        {
+            const auto start = _out.size();
+
+            // Window updates are tiny and unblock the peer, so they go first.
+            for (const auto& [id, credit] : pending_updates_) {
+                append_header(_out, id, frame_type::window_update, flag_none, credit);
+            }
+            pending_updates_.clear();
+
+            for (std::size_t turns = ready_.size(); turns > 0 && !ready_.empty(); --turns) {
+                const auto id = ready_.front();
+                ready_.pop_front();
+
+                auto iter = streams_.find(id);
+                if (iter == std::end(streams_)) {
+                    continue;
+                }
+
+                auto& s = iter->second;
+
+                if (s.reset) {
+                    append_header(_out, id, frame_type::reset, flag_none, 0);
+                    streams_.erase(iter);
+                    continue;
+                }
+
+                const auto used = _out.size() - start;
+                if (used + sizeof(mux_frame_header) >= _budget) {
+                    ready_.push_front(id);
+                    break;
+                }
+
+                const auto n = std::min<std::size_t>({s.outgoing.size(),
+                                                      max_frame_payload,
+                                                      s.send_credit,
+                                                      send_credit_,
+                                                      _budget - used - sizeof(mux_frame_header)});
+                const bool fin = s.send_fin && n == s.outgoing.size();
+
+                if (n == 0 && !fin) {
+                    // Blocked on credit. The stream is rescheduled when a
+                    // window update arrives.
+                    s.scheduled = false;
+                    continue;
+                }
+
+                append_header(_out, id, frame_type::data, fin ? flag_fin : flag_none, static_cast<std::uint32_t>(n));
+                _out.insert(std::end(_out), std::begin(s.outgoing), std::begin(s.outgoing) + n);
+                s.outgoing.erase(std::begin(s.outgoing), std::begin(s.outgoing) + n);
+                s.send_credit -= n;
+                send_credit_ -= n;
+
+                if (fin) {
+                    s.send_fin_sent = true;
+                    s.scheduled = false;
+                    maybe_forget(id);
+                }
+                else if (!s.outgoing.empty()) {
+                    ready_.push_back(id);
+                }
+                else {
+                    s.scheduled = false;
+                }
+            }
+
+            return _out.size() - start;
+        } // poll_output
+
+        // Consumes bytes received from the peer. Returns -1 if the peer violated
+        // the protocol (e.g. sent more than it was granted, granted credit beyond
+        // 4 GiB or opened more than max_streams streams), in which case the
+        // connection should be closed.
+        int on_input(const char* _data, std::size_t _size)
+        {
+            input_.insert(std::end(input_), _data, _data + _size);
+
+            auto offset = input_start_;
+
+            while (input_.size() - offset >= sizeof(mux_frame_header)) {
+                mux_frame_header header;
+                std::memcpy(&header, input_.data() + offset, sizeof(header));
+
+                const auto id = header.stream_id.value();
+                const auto length = header.length.value();
+                const auto type = static_cast<frame_type>(header.type);
+
+                if (type == frame_type::window_update) {
+                    offset += sizeof(header);
+                    if (!grant(id, length)) {
+                        return -1;
+                    }
+                    continue;
+                }
+
+                if (type == frame_type::reset) {
+                    offset += sizeof(header);
+                    forget_reset(id);
+                    continue;
+                }
+
+                if (type != frame_type::data || id == 0 || length > max_frame_payload) {
+                    return -1;
+                }
+
+                if (input_.size() - offset < sizeof(header) + length) {
+                    break;
+                }
+
+                if (streams_.size() >= max_streams_ && streams_.count(id) == 0) {
+                    return -1;
+                }
+
+                auto& s = stream(id);
+
+                if (length > s.receive_window || length > receive_window_) {
+                    return -1;
+                }
+
+                const auto* payload = input_.data() + offset + sizeof(header);
+                s.incoming.insert(std::end(s.incoming), payload, payload + length);
+                s.receive_window -= length;
+                receive_window_ -= length;
+                s.receive_fin = s.receive_fin || (header.flags & flag_fin);
+
+                offset += sizeof(header) + length;
+            }
+
+            // Parsed frames are dropped lazily, so a burst of small frames does
+            // not shift the rest of the input once per call.
+            if (offset == input_.size()) {
+                input_.clear();
+                input_start_ = 0;
+            }
+            else if (offset > input_.size() / 2) {
+                input_.erase(std::begin(input_), std::begin(input_) + offset);
+                input_start_ = 0;
+            }
+            else {
+                input_start_ = offset;
+            }
+
+            return 0;
+        } // on_input
+
+        // Copies up to _size received bytes of _stream_id into _buffer.
+        std::size_t read(std::uint32_t _stream_id, void* _buffer, std::size_t _size)
+        {
+            const auto iter = streams_.find(_stream_id);
+            if (iter == std::end(streams_)) {
+                return 0;
+            }
+
+            auto& s = iter->second;
+            const auto n = std::min(_size, s.incoming.size());
+
+            std::copy_n(std::begin(s.incoming), n, static_cast<char*>(_buffer));
+            s.incoming.erase(std::begin(s.incoming), std::begin(s.incoming) + n);
+
+            s.consumed += n;
+            connection_consumed_ += n;
+
+            // Return credit in batches of half a window to keep the number of
+            // window updates low.
+            if (s.consumed >= stream_window_ / 2 && !s.receive_fin) {
+                s.receive_window += s.consumed;
+                pending_updates_.emplace_back(_stream_id, s.consumed);
+                s.consumed = 0;
+            }
+
+            if (connection_consumed_ >= connection_window_ / 2) {
+                receive_window_ += connection_consumed_;
+                pending_updates_.emplace_back(0, connection_consumed_);
+                connection_consumed_ = 0;
+            }
+
+            maybe_forget(_stream_id);
+
+            return n;
+        } // read
+
+        std::size_t stream_count() const noexcept
+        {
+            return streams_.size();
+        } // stream_count
+
+        std::size_t readable(std::uint32_t _stream_id) const
+        {
+            const auto iter = streams_.find(_stream_id);
+            return iter == std::end(streams_) ? 0 : iter->second.incoming.size();
+        } // readable
+
+        // True once the peer has finished the stream and all of its data was read.
+        bool finished(std::uint32_t _stream_id) const
+        {
+            const auto iter = streams_.find(_stream_id);
+            return iter == std::end(streams_) || (iter->second.receive_fin && iter->second.incoming.empty());
+        } // finished
+
+        void reset(std::uint32_t _stream_id)
+        {
+            if (auto iter = streams_.find(_stream_id); iter != std::end(streams_)) {
+                iter->second.outgoing.clear();
+                iter->second.reset = true;
+                schedule(_stream_id);
+            }
+        } // reset
+
+        // Streams with data received but not yet read, in id order.
+        std::vector<std::uint32_t> readable_streams() const
+        {
+            std::vector<std::uint32_t> ids;
+
+            for (const auto& [id, s] : streams_) {
+                if (!s.incoming.empty() || s.receive_fin) {
+                    ids.push_back(id);
+                }
+            }
+
+            return ids;
+        } // readable_streams
+
+        bool has_output() const noexcept
+        {
+            return !ready_.empty() || !pending_updates_.empty();
+        } // has_output
+
+    private:
+        struct stream_state
+        {
+            std::deque<char> outgoing;
+            std::deque<char> incoming;
+            std::uint32_t send_credit = 0;
+            std::uint32_t receive_window = 0;
+            std::uint32_t consumed = 0;
+            bool scheduled = false;
+            bool send_fin = false;
+            bool send_fin_sent = false;
+            bool receive_fin = false;
+            bool reset = false;
+        }; // struct stream_state
+
+        stream_state& stream(std::uint32_t _id)
+        {
+            auto [iter, inserted] = streams_.try_emplace(_id);
+
+            if (inserted) {
+                iter->second.send_credit = stream_window_;
+                iter->second.receive_window = stream_window_;
+            }
+
+            return iter->second;
+        } // stream
+
+        void schedule(std::uint32_t _id)
+        {
+            auto& s = stream(_id);
+
+            if (!s.scheduled) {
+                s.scheduled = true;
+                ready_.push_back(_id);
+            }
+        } // schedule
+
+        // Returns false if the credit would exceed what a window can express.
+        bool grant(std::uint32_t _id, std::uint32_t _credit)
+        {
+            constexpr auto max_credit = std::numeric_limits<std::uint32_t>::max();
+
+            if (_id == 0) {
+                if (_credit > max_credit - send_credit_) {
+                    return false;
+                }
+
+                send_credit_ += _credit;
+
+                // Connection-level credit may unblock any stream.
+                for (auto& [id, s] : streams_) {
+                    if (!s.outgoing.empty() || (s.send_fin && !s.send_fin_sent)) {
+                        schedule(id);
+                    }
+                }
+
+                return true;
+            }
+
+            if (auto iter = streams_.find(_id); iter != std::end(streams_)) {
+                if (_credit > max_credit - iter->second.send_credit) {
+                    return false;
+                }
+
+                iter->second.send_credit += _credit;
+
+                if (!iter->second.outgoing.empty()) {
+                    schedule(_id);
+                }
+            }
+
+            return true;
+        } // grant
+
+        // The peer abandoned the stream, so nothing more is sent or read on it.
+        // Data it sent but nobody read still occupies the connection window and
+        // is credited back.
+        void forget_reset(std::uint32_t _id)
+        {
+            const auto iter = streams_.find(_id);
+
+            if (iter == std::end(streams_)) {
+                return;
+            }
+
+            connection_consumed_ += static_cast<std::uint32_t>(iter->second.incoming.size());
+            streams_.erase(iter);
+
+            if (connection_consumed_ >= connection_window_ / 2) {
+                receive_window_ += connection_consumed_;
+                pending_updates_.emplace_back(0, connection_consumed_);
+                connection_consumed_ = 0;
+            }
+        } // forget_reset
+
+        // Drops a stream once both directions are done.
+        void maybe_forget(std::uint32_t _id)
+        {
+            const auto iter = streams_.find(_id);
+
+            if (iter != std::end(streams_)) {
+                const auto& s = iter->second;
+
+                if (s.send_fin_sent && s.receive_fin && s.incoming.empty()) {
+                    streams_.erase(iter);
+                }
+            }
+        } // maybe_forget
+
+        static void append_header(std::vector<char>& _out,
+                                  std::uint32_t _id,
+                                  frame_type _type,
+                                  std::uint8_t _flags,
+                                  std::uint32_t _length)
+        {
+            mux_frame_header header;
+            header.stream_id = _id;
+            header.length = _length;
+            header.type = static_cast<std::uint8_t>(_type);
+            header.flags = _flags;
+
+            const auto* p = reinterpret_cast<const char*>(&header);
+            _out.insert(std::end(_out), p, p + sizeof(header));
+        } // append_header
+
+        std::map<std::uint32_t, stream_state> streams_;
+        std::deque<std::uint32_t> ready_;
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> pending_updates_;
+        std::vector<char> input_;
+        std::size_t input_start_ = 0; // Bytes of input_ already parsed.
+        std::uint32_t next_stream_id_;
+        std::size_t max_streams_;
+        std::uint32_t stream_window_;
+        std::uint32_t connection_window_;
+        std::uint32_t send_credit_;
+        std::uint32_t receive_window_;
+        std::uint32_t connection_consumed_ = 0;
+    }; // class stream_mux
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_STREAM_MUX_HPP
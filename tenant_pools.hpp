@@ -0,0 +1,457 @@
+#ifndef KDD_SCPPS_TENANT_POOLS_HPP
+#define KDD_SCPPS_TENANT_POOLS_HPP
+
+#include <fmt/format.h>
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace kdd::scpps
+{
+    // A class of tenants that shares one pool of resources.
+    struct tenant_class
+    {
+        std::string name;
+        std::vector<std::string> users; // "*" matches every user.
+        cpu_set_t cpus;                 // Empty means no restriction.
+        unsigned max_sessions = 0;      // Concurrent sessions. Zero means no limit.
+        int nice = 0;
+        std::string cgroup;             // cgroup v2 directory sessions are moved into, if any.
+    }; // struct tenant_class
+
+    class tenant_pools;
+
+    // A session's membership in its tenant class. Leaving the class (when the
+    // session ends) records the session's scheduling statistics and frees its
+    // slot.
+    class tenant_session
+    {
+    public:
+        tenant_session(tenant_session&& _other) noexcept
+            : pools_{std::exchange(_other.pools_, nullptr)}
+            , class_{_other.class_}
+            , slot_{_other.slot_}
+            , run_ns_{_other.run_ns_}
+            , wait_ns_{_other.wait_ns_}
+        {
+        } // tenant_session (move constructor)
+
+        tenant_session(const tenant_session&) = delete;
+        auto operator=(const tenant_session&) -> tenant_session& = delete;
+        auto operator=(tenant_session&&) -> tenant_session& = delete;
+
+        inline ~tenant_session();
+
+        std::uint32_t class_id() const noexcept
+        {
+            return class_;
+        } // class_id
+
+    private:
+        friend class tenant_pools;
+
+        tenant_session(tenant_pools* _pools, std::uint32_t _class, std::uint32_t _slot, std::uint64_t _run_ns, std::uint64_t _wait_ns)
+            : pools_{_pools}
+            , class_{_class}
+            , slot_{_slot}
+            , run_ns_{_run_ns}
+            , wait_ns_{_wait_ns}
+        {
+        } // tenant_session (constructor)
+
+        tenant_pools* pools_;
+        std::uint32_t class_;
+        std::uint32_t slot_;
+        std::uint64_t run_ns_;  // Scheduler statistics when the session joined.
+        std::uint64_t wait_ns_;
+    }; // class tenant_session
+
+    // Routes sessions to per-tenant resource pools.
+    //
+    // Every connection is served by its own forked child, so a tenant's pool is
+    // the set of children serving its sessions. Once the first message names the
+    // user, the child joins the user's tenant class: it moves onto the class' CPU
+    // set (and cgroup, if configured), takes the class' nice level, and takes
+    // one of the class' session slots. A class without a free slot turns the
+    // session away, so one tenant's load cannot take CPUs or processes from the
+    // others.
+    //
+    // Interference is measured with the kernel's run-queue statistics: the time
+    // a session's process was runnable but waiting for a CPU, relative to the
+    // time it ran. A noisy neighbour shows up as a rising wait share in the
+    // classes that share its CPUs.
+    //
+    // Classes are read from a file with one line per class:
+    //
+    //   <name>:<users (comma separated, * for all)>:<CPUs, e.g. 0-3,8>:<max sessions>:<nice>[:<cgroup directory>]
+    //
+    // The first matching class wins. Users that match no class are served
+    // without restrictions in the implicit class "default".
+    //
+    // The counters live in an anonymous shared mapping, so the pools must be
+    // created by the parent before it starts forking.
+    class tenant_pools
+    {
+    public:
+        static constexpr std::uint32_t max_classes = 32;
+        static constexpr std::uint32_t max_sessions = 4096;
+
+        explicit tenant_pools(const std::string& _config_path)
+        {
+            tenant_class fallback;
+            fallback.name = "default";
+            fallback.users = {"*"};
+            CPU_ZERO(&fallback.cpus);
+
+            if (std::ifstream in{_config_path}; in) {
+                int line_number = 0;
+
+                for (std::string line; std::getline(in, line);) {
+                    ++line_number;
+
+                    if (line.empty() || line[0] == '#') {
+                        continue;
+                    }
+
+                    if (classes_.size() == max_classes - 1) {
+                        throw std::invalid_argument{"Too many tenant classes"};
+                    }
+
+                    auto c = parse(line);
+                    if (!c) {
+                        throw std::invalid_argument{fmt::format("Malformed tenant class [path:{}, line:{}]", _config_path, line_number)};
+                    }
+
+                    classes_.push_back(std::move(*c));
+                }
+            }
+
+            classes_.push_back(std::move(fallback));
+
+            auto* p = ::mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map tenant pool state"};
+            }
+
+            // Anonymous mappings are zero-filled, which is the initial state.
+            state_ = static_cast<shared_state*>(p);
+        } // tenant_pools (constructor)
+
+        tenant_pools(const tenant_pools&) = delete;
+        auto operator=(const tenant_pools&) -> tenant_pools& = delete;
+
+        ~tenant_pools()
+        {
+            ::munmap(state_, sizeof(shared_state));
+        } // destructor
+
+        const tenant_class& get(std::uint32_t _class) const
+        {
+            return classes_[_class];
+        } // get
+
+        std::uint32_t classify(const std::string& _user) const
+        {
+            for (std::uint32_t i = 0; i < classes_.size(); ++i) {
+                const auto& users = classes_[i].users;
+
+                if (std::any_of(std::begin(users), std::end(users), [&_user](const std::string& u) { return u == "*" || u == _user; })) {
+                    return i;
+                }
+            }
+
+            return static_cast<std::uint32_t>(classes_.size() - 1);
+        } // classify
+
+        // Moves the calling process into _user's tenant class. Returns
+        // std::nullopt if the class has no free session slot.
+        std::optional<tenant_session> join(const std::string& _user)
+        {
+            const auto id = classify(_user);
+            const auto& c = classes_[id];
+            auto& counters = state_->classes[id];
+
+            auto active = counters.active.load(std::memory_order_relaxed);
+            do {
+                if (c.max_sessions > 0 && active >= c.max_sessions) {
+                    counters.rejected.fetch_add(1, std::memory_order_relaxed);
+                    return std::nullopt;
+                }
+            } while (!counters.active.compare_exchange_weak(active, active + 1, std::memory_order_relaxed));
+
+            // The slot ties the session to the process, so the parent can give it
+            // back if the process dies without leaving.
+            std::uint32_t slot = 0;
+            for (pid_t expected = 0; slot < max_sessions; ++slot, expected = 0) {
+                if (state_->owners[slot].pid.compare_exchange_strong(expected, getpid(), std::memory_order_relaxed)) {
+                    state_->owners[slot].tenant_class.store(id, std::memory_order_release);
+                    break;
+                }
+            }
+
+            if (slot == max_sessions) {
+                counters.active.fetch_sub(1, std::memory_order_relaxed);
+                counters.rejected.fetch_add(1, std::memory_order_relaxed);
+                return std::nullopt;
+            }
+
+            // Sessions of a class join concurrently in different processes.
+            auto peak = counters.peak.load(std::memory_order_relaxed);
+            while (active + 1 > peak && !counters.peak.compare_exchange_weak(peak, active + 1, std::memory_order_relaxed)) {
+            }
+
+            counters.admitted.fetch_add(1, std::memory_order_relaxed);
+            apply(c);
+
+            const auto [run_ns, wait_ns] = read_schedstat();
+
+            return tenant_session{this, id, slot, run_ns, wait_ns};
+        } // join
+
+        // Called by the parent's SIGCHLD handler for every reaped process. Frees
+        // the slot of a child that exited without leaving its class.
+        void on_exit(pid_t _pid)
+        {
+            for (auto& owner : state_->owners) {
+                if (owner.pid.load(std::memory_order_relaxed) == _pid) {
+                    state_->classes[owner.tenant_class.load(std::memory_order_acquire)].active.fetch_sub(1, std::memory_order_relaxed);
+                    owner.pid.store(0, std::memory_order_release);
+                    return;
+                }
+            }
+        } // on_exit
+
+        // One line per class: active, peak, admitted and rejected sessions, and
+        // the share of time its sessions spent waiting for a CPU.
+        std::string report() const
+        {
+            std::string out;
+
+            for (std::uint32_t i = 0; i < classes_.size(); ++i) {
+                const auto& counters = state_->classes[i];
+                const auto run_ns = counters.run_ns.load(std::memory_order_relaxed);
+                const auto wait_ns = counters.wait_ns.load(std::memory_order_relaxed);
+
+                out += fmt::format("tenant {}: active={} peak={} admitted={} rejected={} cpu={}ms run_queue_wait={}ms wait_share={:.1f}%\n",
+                                   classes_[i].name,
+                                   counters.active.load(std::memory_order_relaxed),
+                                   counters.peak.load(std::memory_order_relaxed),
+                                   counters.admitted.load(std::memory_order_relaxed),
+                                   counters.rejected.load(std::memory_order_relaxed),
+                                   run_ns / 1000000,
+                                   wait_ns / 1000000,
+                                   run_ns + wait_ns > 0 ? 100.0 * wait_ns / (run_ns + wait_ns) : 0.0);
+            }
+
+            return out;
+        } // report
+
+    private:
+        friend class tenant_session;
+
+        struct alignas(64) class_counters
+        {
+            std::atomic<std::uint32_t> active;
+            std::atomic<std::uint32_t> peak;
+            std::atomic<std::uint64_t> admitted;
+            std::atomic<std::uint64_t> rejected;
+            std::atomic<std::uint64_t> run_ns;  // CPU time of finished sessions.
+            std::atomic<std::uint64_t> wait_ns; // Run-queue wait of finished sessions.
+        }; // struct class_counters
+
+        struct session_owner
+        {
+            std::atomic<pid_t> pid;
+            std::atomic<std::uint32_t> tenant_class;
+        }; // struct session_owner
+
+        struct shared_state
+        {
+            class_counters classes[max_classes];
+            session_owner owners[max_sessions];
+        }; // struct shared_state
+
+        void leave(const tenant_session& _session)
+        {
+            const auto [run_ns, wait_ns] = read_schedstat();
+            auto& counters = state_->classes[_session.class_];
+
+            // The sums shrink when a thread that ran before joining exits.
+            counters.run_ns.fetch_add(run_ns > _session.run_ns_ ? run_ns - _session.run_ns_ : 0, std::memory_order_relaxed);
+            counters.wait_ns.fetch_add(wait_ns > _session.wait_ns_ ? wait_ns - _session.wait_ns_ : 0, std::memory_order_relaxed);
+
+            // Freeing the slot is what the parent checks, so the count is given
+            // back exactly once even if the parent reaps the process concurrently.
+            pid_t self = getpid();
+            if (state_->owners[_session.slot_].pid.compare_exchange_strong(self, 0, std::memory_order_acq_rel)) {
+                counters.active.fetch_sub(1, std::memory_order_relaxed);
+            }
+        } // leave
+
+        // Scheduling attributes are per thread, and the process may have started
+        // threads (the authenticator's, for instance) before the session
+        // joined. They are set on every thread. Threads started afterwards
+        // inherit them.
+        static void apply(const tenant_class& _class)
+        {
+            for (const auto tid : threads()) {
+                if (CPU_COUNT(&_class.cpus) > 0 && sched_setaffinity(tid, sizeof(_class.cpus), &_class.cpus) == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not move session to the CPUs of tenant class %s [tid:%d]: %m", _class.name.c_str(), tid);
+                }
+
+                if (_class.nice != 0 && setpriority(PRIO_PROCESS, tid, _class.nice) == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not set nice level of tenant class %s [tid:%d]: %m", _class.name.c_str(), tid);
+                }
+            }
+
+            // cgroup.procs moves all threads of the process.
+            if (!_class.cgroup.empty()) {
+                std::ofstream procs{_class.cgroup + "/cgroup.procs"};
+
+                if (!(procs << getpid() << std::flush)) {
+                    syslog(LOG_ERR | LOG_USER, "Could not move session into cgroup %s", _class.cgroup.c_str());
+                }
+            }
+        } // apply
+
+        // Returns the IDs of the threads of the calling process.
+        static std::vector<pid_t> threads()
+        {
+            std::vector<pid_t> tids;
+
+            DIR* tasks = ::opendir("/proc/self/task");
+            if (!tasks) {
+                return {::getpid()};
+            }
+
+            while (const auto* entry = ::readdir(tasks)) {
+                if (entry->d_name[0] != '.') {
+                    tids.push_back(static_cast<pid_t>(std::strtol(entry->d_name, nullptr, 10)));
+                }
+            }
+
+            ::closedir(tasks);
+
+            return tids;
+        } // threads
+
+        // Returns the time the threads of the calling process spent on a CPU and
+        // waiting on a run queue, in nanoseconds. Zero if schedstats are not
+        // available. /proc/self/schedstat only covers the main thread, so the
+        // entries of every thread are summed. Threads that exit between two
+        // readings are missed.
+        static std::pair<std::uint64_t, std::uint64_t> read_schedstat()
+        {
+            std::uint64_t run_ns = 0;
+            std::uint64_t wait_ns = 0;
+
+            for (const auto tid : threads()) {
+                const auto path = fmt::format("/proc/self/task/{}/schedstat", tid);
+
+                if (std::FILE* file = std::fopen(path.c_str(), "r"); file) {
+                    std::uint64_t run = 0;
+                    std::uint64_t wait = 0;
+
+                    if (std::fscanf(file, "%lu %lu", &run, &wait) == 2) {
+                        run_ns += run;
+                        wait_ns += wait;
+                    }
+
+                    std::fclose(file);
+                }
+            }
+
+            return {run_ns, wait_ns};
+        } // read_schedstat
+
+        static std::optional<tenant_class> parse(const std::string& _line)
+        {
+            std::vector<std::string> fields;
+            std::istringstream in{_line};
+
+            for (std::string field; std::getline(in, field, ':');) {
+                fields.push_back(std::move(field));
+            }
+
+            if (fields.size() != 5 && fields.size() != 6) {
+                return std::nullopt;
+            }
+
+            tenant_class c;
+            c.name = fields[0];
+            CPU_ZERO(&c.cpus);
+
+            std::istringstream users{fields[1]};
+            for (std::string user; std::getline(users, user, ',');) {
+                if (!user.empty()) {
+                    c.users.push_back(std::move(user));
+                }
+            }
+
+            try {
+                std::istringstream cpus{fields[2]};
+
+                for (std::string range; std::getline(cpus, range, ',');) {
+                    if (range.empty()) {
+                        continue;
+                    }
+
+                    const auto dash = range.find('-');
+                    const auto first = std::stoul(range.substr(0, dash));
+                    const auto last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+
+                    for (auto cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+                        CPU_SET(cpu, &c.cpus);
+                    }
+                }
+
+                c.max_sessions = static_cast<unsigned>(std::stoul(fields[3]));
+                c.nice = std::stoi(fields[4]);
+            }
+            catch (const std::exception&) {
+                return std::nullopt;
+            }
+
+            if (fields.size() == 6) {
+                c.cgroup = fields[5];
+            }
+
+            if (c.name.empty() || c.users.empty()) {
+                return std::nullopt;
+            }
+
+            return c;
+        } // parse
+
+        std::vector<tenant_class> classes_;
+        shared_state* state_;
+    }; // class tenant_pools
+
+    tenant_session::~tenant_session()
+    {
+        if (pools_) {
+            pools_->leave(*this);
+        }
+    } // destructor
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_TENANT_POOLS_HPP
@@ -0,0 +1,123 @@
+#include "accept_limiter.hpp"
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    using namespace std::chrono_literals;
+
+    accept_limits make_limits(std::uint32_t _rate, std::uint32_t _concurrency, std::chrono::milliseconds _window = 1h)
+    {
+        accept_limits limits;
+        limits.max_connections_per_window = _rate;
+        limits.max_concurrent_connections = _concurrency;
+        limits.window = _window;
+        return limits;
+    } // make_limits
+
+    boost::asio::ip::address source(unsigned _n)
+    {
+        return boost::asio::ip::make_address_v4(0x0a000000 + _n);
+    } // source
+
+    // Accepts and immediately releases connections from _source, so only the
+    // rate limit applies. Returns the number accepted.
+    int connect(accept_limiter& _limiter, const boost::asio::ip::address& _source, int _times)
+    {
+        int accepted = 0;
+
+        for (int i = 0; i < _times; ++i) {
+            if (_limiter.admit(_source) == accept_limiter::verdict::accept) {
+                _limiter.release(_source);
+                ++accepted;
+            }
+        }
+
+        return accepted;
+    } // connect
+
+    // A source is rejected once it exceeds the rate, others are not, and a
+    // new window starts over.
+    void test_rate()
+    {
+        accept_limiter limiter{make_limits(10, 1000, 200ms)};
+
+        check(connect(limiter, source(1), 10) == 10, "within the rate");
+        check(limiter.admit(source(1)) == accept_limiter::verdict::reject_rate, "over the rate");
+        check(connect(limiter, source(2), 10) == 10, "other sources unaffected");
+        check(limiter.rejected() == 1, "rejections counted");
+
+        std::this_thread::sleep_for(250ms);
+        check(connect(limiter, source(1), 10) == 10, "new window");
+    } // test_rate
+
+    // More heavy hitters than the exact table holds, taking turns, are still
+    // held to the rate.
+    void test_eviction()
+    {
+        accept_limiter limiter{make_limits(10, 1000)};
+        std::vector<int> accepted(400);
+
+        for (int round = 0; round < 20; ++round) {
+            for (unsigned s = 0; s < accepted.size(); ++s) {
+                accepted[s] += connect(limiter, source(s), 1);
+            }
+        }
+
+        bool limited = true;
+        for (const auto n : accepted) {
+            limited = limited && n <= 10;
+        }
+
+        check(limited, "rotating heavy hitters limited");
+    } // test_eviction
+
+    void test_concurrency()
+    {
+        accept_limiter limiter{make_limits(1000, 2)};
+
+        check(limiter.admit(source(1)) == accept_limiter::verdict::accept, "first connection");
+        limiter.track(100, source(1));
+        check(limiter.admit(source(1)) == accept_limiter::verdict::accept, "second connection");
+        check(limiter.admit(source(1)) == accept_limiter::verdict::reject_concurrency, "too many connections");
+        check(limiter.admit(source(2)) == accept_limiter::verdict::accept, "other source");
+
+        // Undoing an admitted connection that never reached a child.
+        limiter.release(source(1));
+        check(limiter.admit(source(1)) == accept_limiter::verdict::accept, "released by address");
+        limiter.track(101, source(1));
+        check(limiter.admit(source(1)) == accept_limiter::verdict::reject_concurrency, "full again");
+
+        limiter.release(100);
+        limiter.release(100);
+        check(limiter.admit(source(1)) == accept_limiter::verdict::accept, "released by child once");
+        check(limiter.admit(source(1)) == accept_limiter::verdict::reject_concurrency, "second release ignored");
+    } // test_concurrency
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_rate();
+    test_eviction();
+    test_concurrency();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+#include "authenticator.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::string to_hex(const std::vector<unsigned char>& _bytes)
+    {
+        std::string out;
+
+        for (const auto b : _bytes) {
+            out += fmt::format("{:02x}", b);
+        }
+
+        return out;
+    } // to_hex
+
+    principal make_principal(const std::string& _name, const std::string& _credential, std::vector<std::string> _may_proxy_for = {})
+    {
+        principal p;
+        p.name = _name;
+        p.iterations = 1000;
+        p.salt = {1, 2, 3, 4, 5, 6, 7, 8};
+        p.key.resize(32);
+        p.may_proxy_for = std::move(_may_proxy_for);
+
+        PKCS5_PBKDF2_HMAC(_credential.data(), static_cast<int>(_credential.size()), p.salt.data(), static_cast<int>(p.salt.size()),
+                          static_cast<int>(p.iterations), EVP_sha256(), static_cast<int>(p.key.size()), p.key.data());
+
+        return p;
+    } // make_principal
+
+    std::string entry(const principal& _p)
+    {
+        std::string users;
+
+        for (const auto& u : _p.may_proxy_for) {
+            users += (users.empty() ? "" : ",") + u;
+        }
+
+        return fmt::format("{}:{}:{}:{}:{}\n", _p.name, _p.iterations, to_hex(_p.salt), to_hex(_p.key), users);
+    } // entry
+
+    // Runs one authentication to completion.
+    auth_status authenticate(auth_provider& _provider, const std::string& _user, const std::string& _proxy_user, const std::string& _credential)
+    {
+        boost::asio::io_service io_service;
+        authenticator auth{io_service, _provider};
+
+        auto result = auth_status::error;
+        auth.authenticate(_user, _proxy_user, _credential, [&result](auto _status) { result = _status; });
+        io_service.run();
+
+        return result;
+    } // authenticate
+
+    // Serves principals from memory, slowly, and counts its lookups.
+    class slow_provider : public auth_provider
+    {
+    public:
+        std::optional<principal> lookup(const std::string& _name) override
+        {
+            ++lookups;
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+
+            if (_name == "alice") {
+                return make_principal("alice", "secret");
+            }
+
+            return std::nullopt;
+        } // lookup
+
+        std::atomic<int> lookups{0};
+    }; // class slow_provider
+
+    void test_file_provider(const std::string& _dir)
+    {
+        const auto path = _dir + "/users";
+
+        {
+            std::ofstream out{path};
+            out << "# name:iterations:salt:key:users\n"
+                << entry(make_principal("alice", "secret"))
+                << entry(make_principal("proxy", "hunter2", {"alice"}))
+                << "broken line\n";
+        }
+
+        file_auth_provider provider{path};
+
+        check(provider.lookup("alice").has_value(), "entry read");
+        check(!provider.lookup("broken line").has_value(), "malformed entry ignored");
+        check(provider.lookup("proxy")->may_proxy_for == std::vector<std::string>{"alice"}, "proxy list read");
+
+        check(authenticate(provider, "alice", "alice", "secret") == auth_status::granted, "right credential granted");
+        check(authenticate(provider, "alice", "alice", "wrong") == auth_status::denied, "wrong credential denied");
+        check(authenticate(provider, "bob", "bob", "secret") == auth_status::denied, "unknown user denied");
+        check(authenticate(provider, "alice", "proxy", "hunter2") == auth_status::granted, "proxy granted");
+        check(authenticate(provider, "proxy", "alice", "secret") == auth_status::denied, "proxy not allowed denied");
+        check(authenticate(provider, "bob", "proxy", "hunter2") == auth_status::denied, "unknown client user denied");
+    } // test_file_provider
+
+    // A slow provider does not hold up the io_service, and a user acting for
+    // itself is looked up once.
+    void test_off_io_thread()
+    {
+        slow_provider provider;
+        boost::asio::io_service io_service;
+        authenticator auth{io_service, provider};
+
+        auto result = auth_status::error;
+        auth.authenticate("alice", "alice", "secret", [&result](auto _status) { result = _status; });
+
+        bool timer_ran = false;
+        boost::asio::steady_timer timer{io_service, std::chrono::milliseconds{10}};
+        timer.async_wait([&](auto) {
+            timer_ran = true;
+            check(result == auth_status::error, "timer runs during the lookup");
+        });
+
+        io_service.run();
+
+        check(timer_ran, "timer ran");
+        check(result == auth_status::granted, "granted");
+        check(provider.lookups == 1, "one lookup");
+    } // test_off_io_thread
+
+    // A provider that throws fails the attempt with an error, not a denial.
+    void test_provider_error()
+    {
+        class failing_provider : public auth_provider
+        {
+        public:
+            std::optional<principal> lookup(const std::string&) override
+            {
+                throw std::runtime_error{"directory unavailable"};
+            }
+        } provider;
+
+        check(authenticate(provider, "alice", "alice", "secret") == auth_status::error, "provider error");
+    } // test_provider_error
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_authenticator.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_file_provider(dir);
+    test_off_io_thread();
+    test_provider_error();
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
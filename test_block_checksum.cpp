@@ -0,0 +1,150 @@
+#include "block_checksum.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    constexpr auto block_size = checksummed_file::block_size;
+
+    void corrupt(const std::string& _path, off_t _offset)
+    {
+        const int fd = ::open(_path.c_str(), O_RDWR);
+        char c = 0;
+        ::pread(fd, &c, 1, _offset);
+        c ^= 1;
+        ::pwrite(fd, &c, 1, _offset);
+        ::close(fd);
+    } // corrupt
+
+    void test_round_trip(const std::string& _dir)
+    {
+        const auto path = _dir + "/round_trip";
+        const std::vector<char> data(3 * block_size + 123, 'a');
+
+        checksummed_file file;
+        check(file.open(path, O_CREAT | O_RDWR) == 0, "open");
+        check(file.pwrite(data.data(), data.size(), 0) == static_cast<ssize_t>(data.size()), "write");
+
+        std::vector<char> back(data.size());
+        std::vector<std::uint32_t> crcs;
+        check(file.pread(back.data(), back.size(), 0, &crcs) == static_cast<ssize_t>(back.size()) && back == data, "read back");
+        check(crcs.size() == 4 && crcs[0] == crc32c(data.data(), block_size), "segment checksums");
+
+        corrupt(path, block_size + 5);
+        check(file.pread(back.data(), back.size(), 0) == -1 && errno == EIO, "corruption detected");
+    } // test_round_trip
+
+    // Growing a file keeps every block readable: the old last block and the
+    // new zero-filled ones get checksums.
+    void test_truncate_grow(const std::string& _dir)
+    {
+        const std::vector<char> data(1000, 'b');
+
+        checksummed_file file;
+        check(file.open(_dir + "/grow", O_CREAT | O_RDWR) == 0, "open");
+        file.pwrite(data.data(), data.size(), 0);
+        check(file.truncate(200000) == 0, "grow");
+
+        std::vector<char> back(block_size);
+        check(file.pread(back.data(), back.size(), 0) == static_cast<ssize_t>(block_size), "read old last block");
+        check(std::equal(std::begin(data), std::end(data), std::begin(back)) && back[1000] == 0, "old last block contents");
+        check(file.pread(back.data(), back.size(), 70000) == static_cast<ssize_t>(block_size), "read new block");
+
+        check(file.truncate(500) == 0, "shrink");
+        check(file.pread(back.data(), back.size(), 0) == 500, "read after shrink");
+    } // test_truncate_grow
+
+    // Objects written before checksums were kept are readable, and get
+    // checksums as they are written.
+    void test_no_checksum_yet(const std::string& _dir)
+    {
+        const auto path = _dir + "/legacy";
+        const std::vector<char> data(2 * block_size, 'c');
+
+        const int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+        check(::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()), "write legacy object");
+        ::close(fd);
+
+        checksummed_file file;
+        check(file.open(path, O_RDWR) == 0, "open legacy object");
+
+        std::vector<char> back(data.size());
+        check(file.pread(back.data(), back.size(), 0) == static_cast<ssize_t>(back.size()) && back == data, "unverified read");
+
+        file.pwrite("d", 1, block_size + 1);
+        corrupt(path, block_size + 7);
+        check(file.pread(back.data(), block_size, 0) == static_cast<ssize_t>(block_size), "unwritten block still unverified");
+        check(file.pread(back.data(), block_size, block_size) == -1 && errno == EIO, "written block verified");
+    } // test_no_checksum_yet
+
+    // A write whose data reached the file but whose checksum was never
+    // committed leaves the block readable.
+    void test_pending_write(const std::string& _dir)
+    {
+        const auto path = _dir + "/pending";
+        const std::vector<char> before(block_size, 'e');
+        const std::vector<char> after(block_size, 'f');
+
+        checksummed_file file;
+        check(file.open(path, O_CREAT | O_RDWR) == 0, "open");
+        file.pwrite(before.data(), before.size(), 0);
+
+        // What a process that died between the data write and the commit
+        // leaves behind.
+        const std::uint32_t record[3] = {crc32c(before.data(), block_size), crc32c(after.data(), block_size), 3};
+        const int crc_fd = ::open((path + ".crc").c_str(), O_WRONLY);
+        ::pwrite(crc_fd, record, sizeof(record), 0);
+        ::close(crc_fd);
+
+        std::vector<char> back(block_size);
+        check(file.pread(back.data(), back.size(), 0) == static_cast<ssize_t>(block_size) && back == before, "old data readable");
+
+        const int fd = ::open(path.c_str(), O_WRONLY);
+        ::pwrite(fd, after.data(), after.size(), 0);
+        ::close(fd);
+
+        check(file.pread(back.data(), back.size(), 0) == static_cast<ssize_t>(block_size) && back == after, "new data readable");
+    } // test_pending_write
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_block_checksum.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_round_trip(dir);
+    test_truncate_grow(dir);
+    test_no_checksum_yet(dir);
+    test_pending_write(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include "huge_page_region.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // Runs _test in a forked child and returns its exit status, or -1 if the
+    // child crashed.
+    template <typename Test>
+    int in_child(Test _test)
+    {
+        const auto pid = ::fork();
+        if (pid == 0) {
+            ::_exit(_test());
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    } // in_child
+
+    std::size_t drain(buffer_pool& _pool)
+    {
+        std::size_t count = 0;
+
+        while (auto* buffer = _pool.acquire()) {
+            std::memset(buffer, 1, _pool.buffer_size());
+            ++count;
+        }
+
+        return count;
+    } // drain
+
+    void test_exclude()
+    {
+        buffer_pool pool{4096, 8, buffer_pool::fork_policy::exclude};
+        check(pool.acquire() != nullptr, "parent acquires");
+
+        check(in_child([&pool] { return pool.acquire() == nullptr ? 0 : 1; }) == 0, "excluded pool is empty in the child");
+        check(drain(pool) == 7, "parent keeps its buffers");
+    } // test_exclude
+
+    void test_wipe_on_fork()
+    {
+        buffer_pool pool{4096, 8, buffer_pool::fork_policy::wipe_on_fork};
+        pool.acquire();
+        pool.acquire();
+
+        check(in_child([&pool] { return drain(pool) == 8 ? 0 : 1; }) == 0, "wiped pool is full in the child");
+        check(drain(pool) == 6, "parent keeps its buffers");
+    } // test_wipe_on_fork
+
+    void test_inherit()
+    {
+        buffer_pool pool{4096, 8};
+        pool.acquire();
+
+        check(in_child([&pool] { return drain(pool) == 7 ? 0 : 1; }) == 0, "inherited pool keeps the parent's state");
+    } // test_inherit
+
+    // Every live pool shows up in the report, and is gone once destroyed.
+    void test_report()
+    {
+        check(buffer_pool::report().empty(), "no pools reported");
+
+        {
+            buffer_pool pool{4096, 8, buffer_pool::fork_policy::exclude};
+            pool.acquire();
+
+            const auto report = buffer_pool::report();
+            check(report.find("buffers=8x4096 free=7") != std::string::npos, "pool reported");
+            check(report.find("fork=exclude") != std::string::npos, "fork policy reported");
+            check(report.find("huge_pages=") != std::string::npos, "coverage reported");
+        }
+
+        check(buffer_pool::report().empty(), "destroyed pool not reported");
+    } // test_report
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_exclude();
+    test_wipe_on_fork();
+    test_inherit();
+    test_report();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "compact_message.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdint>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // The wire layout is little-endian and independent of the host: api number,
+    // whence, handle, argument.
+    void test_layout()
+    {
+        const unsigned char wire[16] = {
+            0x04, 0x00,                                    // api number
+            0x02, 0x00,                                    // whence
+            0x78, 0x56, 0x34, 0x12,                        // handle
+            0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff // argument
+        };
+
+        const auto msg = decode_compact_message(wire);
+        check(msg.api_number.value() == api_no_data_object_seek, "api number");
+        check(msg.whence.value() == 2, "whence");
+        check(msg.handle.value() == 0x12345678, "handle");
+        check(msg.argument.value() == -2, "signed argument");
+
+        compact_message out{};
+        out.api_number = api_no_data_object_read;
+        out.handle = 7;
+        out.argument = 0x0102030405060708;
+
+        const auto* bytes = reinterpret_cast<const unsigned char*>(&out);
+        check(bytes[0] == api_no_data_object_read && bytes[1] == 0, "api number encoded little-endian");
+        check(bytes[4] == 7 && bytes[7] == 0, "handle encoded little-endian");
+        check(bytes[8] == 0x08 && bytes[15] == 0x01, "argument encoded little-endian");
+    } // test_layout
+
+    // Only operations that need nothing but a handle and one number may be
+    // sent in compact form.
+    void test_whitelist()
+    {
+        check(is_compact_op(api_no_data_object_close), "close");
+        check(is_compact_op(api_no_data_object_read), "read");
+        check(is_compact_op(api_no_data_object_seek), "seek");
+        check(is_compact_op(api_no_data_object_truncate), "truncate");
+
+        check(!is_compact_op(api_no_data_object_open), "open carries a path");
+        check(!is_compact_op(api_no_data_object_write), "write carries data");
+        check(!is_compact_op(api_no_data_object_unlink), "unlink carries a path");
+        check(!is_compact_op(api_no_data_object_digest), "digest");
+        check(!is_compact_op(static_cast<api_no>(0xffff)), "unknown operation");
+    } // test_whitelist
+
+    // The flag is the top bit of the length prefix, which no regular frame
+    // length reaches.
+    void test_frame_flag()
+    {
+        check(compact_frame_flag == 0x80000000u, "top bit");
+        check(((compact_frame_flag | sizeof(compact_message)) & ~compact_frame_flag) == 16, "length beside the flag");
+    } // test_frame_flag
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_layout();
+    test_whitelist();
+    test_frame_flag();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+#include "compressed_object.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::vector<char> pattern(std::size_t _size, char _seed)
+    {
+        std::vector<char> data(_size);
+        for (std::size_t i = 0; i < _size; ++i) {
+            data[i] = static_cast<char>(_seed + i % 7);
+        }
+        return data;
+    } // pattern
+
+    std::vector<char> read_all(const std::string& _path)
+    {
+        compressed_object object;
+        if (object.open(_path, O_RDONLY) == -1) {
+            return {};
+        }
+
+        std::vector<char> data(object.size());
+        object.read(data.data(), data.size());
+
+        return data;
+    } // read_all
+
+    void test_round_trip(const std::string& _dir)
+    {
+        const auto path = _dir + "/round_trip";
+        const auto data = pattern(300000, 'a');
+
+        {
+            compressed_object object;
+            check(object.open(path, O_CREAT | O_RDWR, 4096) == 0, "create");
+            check(object.write(data.data(), data.size()) == static_cast<std::int64_t>(data.size()), "write");
+        }
+
+        check(read_all(path) == data, "round trip");
+    } // test_round_trip
+
+    void test_refuses_uncompressed(const std::string& _dir)
+    {
+        const auto path = _dir + "/plain";
+        const int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+        check(::write(fd, "plain data", 10) == 10, "write plain file");
+        ::close(fd);
+
+        compressed_object object;
+        check(object.open(path, O_CREAT | O_RDWR) == -1 && errno == EINVAL, "uncompressed file refused");
+
+        struct stat st;
+        check(::stat(path.c_str(), &st) == 0 && st.st_size == 10, "uncompressed file untouched");
+    } // test_refuses_uncompressed
+
+    void test_single_writer(const std::string& _dir)
+    {
+        const auto path = _dir + "/locked";
+
+        compressed_object writer;
+        check(writer.open(path, O_CREAT | O_RDWR) == 0, "open writer");
+
+        compressed_object second;
+        check(second.open(path, O_RDWR) == -1 && errno == EWOULDBLOCK, "second writer refused");
+
+        compressed_object reader;
+        check(reader.open(path, O_RDONLY) == -1 && errno == EWOULDBLOCK, "reader refused while writing");
+
+        writer.close();
+        check(reader.open(path, O_RDONLY) == 0, "reader after writer closed");
+    } // test_single_writer
+
+    // A process that dies without syncing leaves the object as of the last sync,
+    // even though it rewrote frames the stored index refers to.
+    void test_crash_keeps_last_sync(const std::string& _dir)
+    {
+        const auto path = _dir + "/crash";
+        const auto before = pattern(20000, 'a');
+        const auto after = pattern(20000, 'k');
+
+        {
+            compressed_object object;
+            object.open(path, O_CREAT | O_RDWR, 4096);
+            object.write(before.data(), before.size());
+        }
+
+        const auto pid = ::fork();
+        if (pid == 0) {
+            compressed_object object;
+            object.open(path, O_RDWR);
+            object.write(after.data(), after.size());
+            object.seek(0, SEEK_SET);
+            object.write(after.data(), 4096); // Forces the first frame out.
+            object.truncate(5000);
+            ::_exit(0);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+
+        check(read_all(path) == before, "crash keeps last synced contents");
+    } // test_crash_keeps_last_sync
+
+    void test_truncate_reclaims(const std::string& _dir)
+    {
+        const auto path = _dir + "/truncate";
+        const auto data = pattern(50000, 'a');
+
+        compressed_object object;
+        object.open(path, O_CREAT | O_RDWR, 4096);
+        object.write(data.data(), data.size());
+        check(object.sync() == 0, "sync");
+        check(object.truncate(0) == 0 && object.sync() == 0, "truncate to zero");
+        check(object.stored_size() == 0, "empty object reclaims its data");
+
+        object.seek(0, SEEK_SET);
+        object.write(data.data(), data.size());
+        object.close();
+
+        check(read_all(path) == data, "rewrite after truncate");
+    } // test_truncate_reclaims
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_compressed_object.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_round_trip(dir);
+    test_refuses_uncompressed(dir);
+    test_single_writer(dir);
+    test_crash_keeps_last_sync(dir);
+    test_truncate_reclaims(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
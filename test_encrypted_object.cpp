@@ -0,0 +1,147 @@
+#include "encrypted_object.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    const master_key key = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    std::vector<unsigned char> pattern(std::size_t _size, unsigned char _seed)
+    {
+        std::vector<unsigned char> data(_size);
+        for (std::size_t i = 0; i < _size; ++i) {
+            data[i] = static_cast<unsigned char>(_seed + i * 7);
+        }
+        return data;
+    } // pattern
+
+    // Applies the same write to the object and to a plain copy of the expected
+    // contents.
+    bool write(encrypted_object& _object, std::vector<unsigned char>& _expected, std::uint64_t _offset, std::size_t _size, unsigned char _seed)
+    {
+        const auto data = pattern(_size, _seed);
+
+        if (_expected.size() < _offset + _size) {
+            _expected.resize(_offset + _size, 0);
+        }
+
+        std::memcpy(_expected.data() + _offset, data.data(), _size);
+
+        return _object.pwrite(data.data(), _size, _offset) == static_cast<ssize_t>(_size);
+    } // write
+
+    bool matches(encrypted_object& _object, const std::vector<unsigned char>& _expected)
+    {
+        std::vector<unsigned char> data(_expected.size() + 100);
+        const auto n = _object.pread(data.data(), data.size(), 0);
+
+        return n == static_cast<ssize_t>(_expected.size()) && std::memcmp(data.data(), _expected.data(), _expected.size()) == 0;
+    } // matches
+
+    // Unaligned writes, writes past the end that leave a gap, chunk-sized
+    // writes and truncation all read back what was written, also after the
+    // object is reopened.
+    void test_round_trip(const std::string& _dir)
+    {
+        const auto path = _dir + "/object";
+        crypto_workers workers{2};
+        std::vector<unsigned char> expected;
+
+        {
+            encrypted_object object{workers};
+            check(object.open(path, O_WRONLY | O_CREAT, key) == 0, "open for writing");
+
+            check(write(object, expected, 100, 5000, 1), "unaligned write");
+            check(write(object, expected, 4000, 200, 2), "write across a sector boundary");
+            check(write(object, expected, 20000, 10, 3), "write past the end");
+            check(object.size() == 20010, "size after gap");
+            check(write(object, expected, 3 * 1024 * 1024 + 1, 2 * 1024 * 1024, 4), "multi-chunk write");
+            check(matches(object, expected), "read back");
+
+            std::vector<unsigned char> middle(300);
+            check(object.pread(middle.data(), 300, 4050) == 300 &&
+                  std::memcmp(middle.data(), expected.data() + 4050, 300) == 0, "unaligned read");
+            check(object.pread(middle.data(), 300, expected.size()) == 0, "read at the end");
+
+            check(object.truncate(4100) == 0, "truncate into a sector");
+            expected.resize(4100);
+            check(matches(object, expected), "read after truncate");
+
+            check(object.truncate(9000) == 0, "grow");
+            expected.resize(9000, 0);
+            check(matches(object, expected), "cut-off bytes read as zeros");
+        }
+
+        {
+            encrypted_object object{workers};
+            check(object.open(path, O_RDONLY, key) == 0, "open read-only");
+            check(matches(object, expected), "read after reopen");
+            check(object.pwrite(expected.data(), 1, 0) == -1, "read-only object not writable");
+
+            struct stat st;
+            check(::stat(path.c_str(), &st) == 0 && st.st_size == 4096 + 3 * 4096, "ciphertext as large as plaintext");
+        }
+
+        {
+            master_key other = key;
+            other[0] ^= 1;
+
+            encrypted_object object{workers};
+            check(object.open(path, O_RDONLY, other) == 0, "open with another key");
+            check(!matches(object, expected), "wrong key does not decrypt");
+        }
+    } // test_round_trip
+
+    // Opening an empty file read-only does not write a header into it.
+    void test_read_only_empty(const std::string& _dir)
+    {
+        crypto_workers workers{1};
+        encrypted_object object{workers};
+
+        const auto empty = _dir + "/empty";
+        ::close(::open(empty.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR));
+        check(object.open(empty, O_RDONLY, key) == -1 && errno == EINVAL, "empty file read-only");
+
+        struct stat st;
+        check(::stat(empty.c_str(), &st) == 0 && st.st_size == 0, "empty file untouched");
+    } // test_read_only_empty
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_encrypted_object.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_round_trip(dir);
+    test_read_only_empty(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
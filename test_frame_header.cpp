@@ -0,0 +1,137 @@
+#include "frame_header.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // A version 1 length never reaches the top byte, a version 2 header keeps
+    // its version there, and the compact flag in the top bit is version 1.
+    void test_version()
+    {
+        check(frame_version(0) == 1, "empty v1 frame");
+        check(frame_version(max_frame_body_size) == 1, "largest v1 frame");
+        check(frame_version((2u << 24) | 100) == 2, "v2 frame");
+        check(frame_version(0x80000000u | 16) == 1, "compact message");
+
+        const auto header = make_frame_header(api_no_data_object_read, frame_checksummed, 42, 1000);
+        check(frame_version(header.version_and_length.value()) == frame_version_2, "made header is v2");
+        check(frame_body_size(header) == 1000, "body size");
+        check(header.opcode.value() == api_no_data_object_read && header.flags.value() == frame_checksummed &&
+              header.request_id.value() == 42, "header fields");
+    } // test_version
+
+    // The body length has 24 bits; anything above them does not spill into the
+    // version byte.
+    void test_length_limit()
+    {
+        const auto largest = make_frame_header(api_no_data_object_read, 0, 1, max_frame_body_size);
+        check(frame_body_size(largest) == max_frame_body_size, "largest body");
+
+        const auto oversized = make_frame_header(api_no_data_object_read, 0, 1, max_frame_body_size + 2);
+        check(frame_version(oversized.version_and_length.value()) == frame_version_2, "version kept");
+        check(frame_body_size(oversized) == 1, "length masked to 24 bits");
+    } // test_length_limit
+
+    std::string with_checksum(const std::string& _body)
+    {
+        boost::endian::little_uint32_buf_t crc{crc32c(_body.data(), _body.size())};
+
+        auto result = _body;
+        result.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+
+        return result;
+    } // with_checksum
+
+    void test_checksum()
+    {
+        auto body = with_checksum("hello, world");
+        auto size = body.size();
+        check(verify_frame_checksum(body.data(), size) && size == 12, "trailer verified and stripped");
+
+        body[3] ^= 1;
+        size = body.size();
+        check(!verify_frame_checksum(body.data(), size) && size == body.size(), "corrupted body");
+
+        auto empty = with_checksum("");
+        size = empty.size();
+        check(verify_frame_checksum(empty.data(), size) && size == 0, "empty body");
+
+        size = 3;
+        check(!verify_frame_checksum("abc", size), "too short for a trailer");
+    } // test_checksum
+
+    std::string batch_entry(const std::string& _message)
+    {
+        boost::endian::little_uint32_buf_t length{static_cast<std::uint32_t>(_message.size())};
+
+        return std::string(reinterpret_cast<const char*>(&length), sizeof(length)) + _message;
+    } // batch_entry
+
+    void test_batch()
+    {
+        const auto body = batch_entry("first") + batch_entry("") + batch_entry("third");
+        batch_reader batch{body.data(), body.size()};
+        const char* data = nullptr;
+        std::size_t length = 0;
+
+        check(batch.next(data, length) && std::string(data, length) == "first", "first message");
+        check(batch.rest_size() == body.size() - 9 && batch.rest() == body.data() + 9, "rest after first");
+        check(batch.next(data, length) && length == 0, "empty message");
+        check(batch.next(data, length) && std::string(data, length) == "third", "third message");
+        check(!batch.next(data, length) && !batch.malformed() && batch.rest_size() == 0, "end of batch");
+
+        batch_reader empty{body.data(), 0};
+        check(!empty.next(data, length) && !empty.malformed(), "empty batch");
+    } // test_batch
+
+    // A batch that ends inside a length prefix or inside a message is
+    // malformed, and nothing past the last whole message is returned.
+    void test_truncated_batch()
+    {
+        const auto body = batch_entry("first") + batch_entry("second");
+        const char* data = nullptr;
+        std::size_t length = 0;
+
+        batch_reader prefix{body.data(), 9 + 2};
+        check(prefix.next(data, length), "message before the truncated prefix");
+        check(!prefix.next(data, length) && prefix.malformed(), "truncated length prefix");
+        check(!prefix.next(data, length), "no message after malformed");
+
+        batch_reader message{body.data(), body.size() - 1};
+        check(message.next(data, length), "message before the truncated one");
+        check(!message.next(data, length) && message.malformed(), "length beyond the body");
+
+        const auto huge = std::string("\xff\xff\xff\xff", 4) + "abc";
+        batch_reader overflow{huge.data(), huge.size()};
+        check(!overflow.next(data, length) && overflow.malformed(), "length near the maximum");
+    } // test_truncated_batch
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_version();
+    test_length_limit();
+    test_checksum();
+    test_batch();
+    test_truncated_batch();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
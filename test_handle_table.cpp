@@ -0,0 +1,149 @@
+#include "handle_table.hpp"
+
+#include <fmt/format.h>
+
+#include <set>
+#include <stdexcept>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void test_lookup()
+    {
+        handle_table<std::string> table;
+        const auto a = table.emplace("a");
+        const auto b = table.emplace("b");
+
+        check(a != invalid_handle && b != invalid_handle && a != b, "distinct handles");
+        check(table.find(a) && *table.find(a) == "a", "find a");
+        check(table.find(b) && *table.find(b) == "b", "find b");
+        check(table.size() == 2, "size");
+        check(!table.find(invalid_handle), "invalid handle");
+        check(!table.find(0x1234), "unknown slot");
+    } // test_lookup
+
+    void test_stale_handle()
+    {
+        handle_table<std::string> table;
+        const auto stale = table.emplace("old");
+        check(table.erase(stale), "erase");
+
+        const auto fresh = table.emplace("new");
+        check((fresh & 0xffff) == (stale & 0xffff), "slot reused");
+        check(fresh != stale, "new generation");
+        check(!table.find(stale), "stale handle rejected");
+        check(!table.erase(stale), "stale erase rejected");
+        check(table.find(fresh) && *table.find(fresh) == "new", "fresh handle still valid");
+    } // test_stale_handle
+
+    // Even generations name free slots. A handle with one must not reach the
+    // empty value, nor corrupt the size or the free list.
+    void test_forged_handle()
+    {
+        handle_table<std::string> table;
+        const auto h = table.emplace("x");
+        table.erase(h);
+
+        const handle_type forged = (2u << 16) | 0;
+        check(!table.find(forged), "forged handle rejected by find");
+        check(!table.erase(forged), "forged handle rejected by erase");
+        check(table.size() == 0, "size unchanged");
+
+        const auto first = table.emplace("first");
+        const auto second = table.emplace("second");
+        check((first & 0xffff) != (second & 0xffff), "free list intact after forged erase");
+        check(table.size() == 2, "size after forged erase");
+    } // test_forged_handle
+
+    void test_double_erase()
+    {
+        handle_table<std::string> table;
+        const auto h = table.emplace("x");
+
+        check(table.erase(h), "first erase");
+        check(!table.erase(h), "second erase rejected");
+        check(table.size() == 0 && table.empty(), "size after double erase");
+
+        std::set<handle_type> slots;
+        for (int i = 0; i < 3; ++i) {
+            slots.insert(table.emplace("y") & 0xffff);
+        }
+
+        check(slots.size() == 3, "no slot handed out twice");
+    } // test_double_erase
+
+    // A slot whose generation would wrap is retired, so a stale handle can
+    // never match a later occupant.
+    void test_retirement()
+    {
+        handle_table<int> table;
+        const auto first = table.emplace(0);
+        auto h = first;
+
+        for (int i = 0; i < 40000; ++i) {
+            table.erase(h);
+            h = table.emplace(i);
+
+            if ((h & 0xffff) != (first & 0xffff)) {
+                break;
+            }
+        }
+
+        check((h & 0xffff) != (first & 0xffff), "slot retired before its generation wraps");
+        check(!table.find(first), "first handle stays stale");
+    } // test_retirement
+
+    struct throws_on_demand
+    {
+        explicit throws_on_demand(bool _throw)
+        {
+            if (_throw) {
+                throw std::runtime_error{"construction failed"};
+            }
+        }
+    }; // struct throws_on_demand
+
+    void test_throwing_constructor()
+    {
+        handle_table<throws_on_demand> table;
+        table.erase(table.emplace(false));
+
+        try {
+            table.emplace(true);
+        }
+        catch (const std::runtime_error&) {
+        }
+
+        check(table.size() == 0, "size after throwing constructor");
+
+        const auto a = table.emplace(false);
+        const auto b = table.emplace(false);
+        check((a & 0xffff) != (b & 0xffff), "free list intact after throwing constructor");
+    } // test_throwing_constructor
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_lookup();
+    test_stale_handle();
+    test_forged_handle();
+    test_double_erase();
+    test_retirement();
+    test_throwing_constructor();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
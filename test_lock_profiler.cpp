@@ -0,0 +1,176 @@
+#include "lock_profiler.hpp"
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::uint64_t value(const std::atomic<std::uint64_t>& _counter)
+    {
+        return _counter.load(std::memory_order_relaxed);
+    } // value
+
+    // While disabled nothing is recorded. Enabled, every acquisition is counted
+    // and one in sample_every is timed.
+    void test_sampling()
+    {
+        auto& profiler = lock_profiler::instance();
+        profiled_mutex mutex{"test_sampling"};
+
+        profiler.disable();
+        for (int i = 0; i < 10; ++i) {
+            std::lock_guard lock{mutex};
+        }
+
+        check(value(mutex.site().acquisitions) == 0, "nothing counted while disabled");
+
+        profiler.enable(4);
+
+        // A fresh thread starts its sampling countdown at zero.
+        std::thread{[&mutex] {
+            for (int i = 0; i < 100; ++i) {
+                std::lock_guard lock{mutex};
+            }
+        }}.join();
+
+        check(value(mutex.site().acquisitions) == 100, "acquisitions counted");
+        check(value(mutex.site().contended) == 0, "uncontended");
+        check(value(mutex.site().sampled) == 25, "one in four waits timed");
+        check(value(mutex.site().hold_sampled) == 25, "one in four holds timed");
+
+        profiler.disable();
+    } // test_sampling
+
+    void test_contention()
+    {
+        auto& profiler = lock_profiler::instance();
+        profiled_mutex mutex{"test_contention"};
+        profiler.enable(1);
+
+        mutex.lock();
+
+        std::thread waiter{[&mutex] {
+            check(!mutex.try_lock(), "try_lock fails while held");
+            std::lock_guard lock{mutex};
+        }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        mutex.unlock();
+        waiter.join();
+
+        check(value(mutex.site().acquisitions) == 2, "acquisitions");
+        check(value(mutex.site().contended) == 2, "failed try_lock and blocked lock contended");
+        check(value(mutex.site().wait_max_ns) >= 10'000'000, "wait timed");
+        check(value(mutex.site().hold_max_ns) >= 10'000'000, "hold timed");
+
+        check(mutex.try_lock(), "try_lock on a free lock");
+        mutex.unlock();
+        check(value(mutex.site().acquisitions) == 3 && value(mutex.site().hold_sampled) == 3, "successful try_lock counted and timed");
+
+        profiler.disable();
+    } // test_contention
+
+    // Shared holds are timed, also when they overlap on several threads.
+    void test_shared()
+    {
+        auto& profiler = lock_profiler::instance();
+        profiled_shared_mutex mutex{"test_shared"};
+        profiler.enable(1);
+
+        mutex.lock_shared();
+
+        std::thread reader{[&mutex] {
+            check(mutex.try_lock_shared(), "second reader");
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            mutex.unlock_shared();
+        }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        reader.join();
+        mutex.unlock_shared();
+
+        check(value(mutex.site().acquisitions) == 2, "shared acquisitions");
+        check(value(mutex.site().shared_hold_sampled) == 2, "shared holds timed");
+        check(value(mutex.site().shared_hold_max_ns) >= 20'000'000, "longest shared hold");
+        check(value(mutex.site().hold_sampled) == 0, "no exclusive holds");
+
+        mutex.lock();
+        check(!mutex.try_lock_shared(), "try_lock_shared fails while held exclusively");
+        mutex.unlock();
+        check(value(mutex.site().contended) == 1, "failed try_lock_shared contended");
+
+        // A hold sampled before profiling is turned off still ends cleanly.
+        mutex.lock_shared();
+        profiler.disable();
+        mutex.unlock_shared();
+        check(value(mutex.site().shared_hold_sampled) == 3, "hold ended after disable");
+    } // test_shared
+
+    // The report lists the sites with the longest total wait first and stops
+    // after _top of them.
+    void test_report()
+    {
+        auto& profiler = lock_profiler::instance();
+        profiler.reset();
+
+        profiled_mutex quiet{"test_report_quiet"};
+        profiled_spinlock busy{"test_report_busy"};
+        profiler.enable(1);
+
+        {
+            std::lock_guard lock{quiet};
+        }
+
+        busy.lock();
+        std::thread waiter{[&busy] {
+            std::lock_guard lock{busy};
+        }};
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        busy.unlock();
+        waiter.join();
+
+        profiler.disable();
+
+        const auto report = profiler.report();
+        const auto busy_at = report.find("test_report_busy: acquisitions=2 contended=1");
+        const auto quiet_at = report.find("test_report_quiet: acquisitions=1 contended=0");
+
+        check(report.rfind("lock profiling: sample_every=0\n", 0) == 0, "report header");
+        check(busy_at != std::string::npos && quiet_at != std::string::npos, "sites reported");
+        check(busy_at < quiet_at, "most waited-on site first");
+        check(report.find("test_sampling") == std::string::npos, "sites without acquisitions left out");
+        check(report.find("shared_hold") == std::string::npos, "no shared columns for exclusive sites");
+
+        const auto top = profiler.report(1);
+        check(top.find("test_report_busy") != std::string::npos && top.find("test_report_quiet") == std::string::npos, "top sites only");
+    } // test_report
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_sampling();
+    test_contention();
+    test_shared();
+    test_report();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+#include "mapped_object_cache.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void write_file(const std::string& _path, const std::string& _contents)
+    {
+        std::ofstream{_path} << _contents;
+    } // write_file
+
+    bool holds(const std::shared_ptr<const mapped_object>& _mapping, const std::string& _contents)
+    {
+        return _mapping && _mapping->size() == _contents.size() &&
+               std::memcmp(_mapping->data(), _contents.data(), _contents.size()) == 0;
+    } // holds
+
+    // Objects are mapped once hot, and hits are answered from the mapping until
+    // the object is invalidated.
+    void test_hot_and_invalidate(const std::string& _dir)
+    {
+        const auto path = _dir + "/hot";
+        write_file(path, "first");
+
+        memory_governor governor;
+        mapped_object_cache cache{governor, governor.add_subsystem("mapped objects", 0)};
+
+        check(!cache.acquire(path), "cold after one read");
+        check(holds(cache.acquire(path), "first"), "mapped after hot_after reads");
+        check(holds(cache.acquire(path), "first") && cache.hits() == 1, "hit");
+        check(cache.mapped_bytes() == 5, "mapped bytes");
+
+        // Hits do not look at the file, so a change is only picked up once it
+        // is announced.
+        write_file(path, "second");
+        check(cache.acquire(path)->size() == 5 && cache.hits() == 2, "hit without stat");
+
+        cache.invalidate(path);
+        check(cache.mapped_bytes() == 0, "invalidate unmaps");
+        check(holds(cache.acquire(path), "second"), "still hot after invalidate");
+        check(cache.mapped_bytes() == 6, "remapped");
+
+        check(!cache.acquire(_dir + "/missing"), "missing object");
+    } // test_hot_and_invalidate
+
+    // Reads in different processes heat an object together, and invalidation
+    // in one process reaches the mappings of the others.
+    void test_shared_across_fork(const std::string& _dir)
+    {
+        const auto path = _dir + "/shared";
+        write_file(path, "old");
+
+        memory_governor governor;
+        mapped_object_cache cache{governor, governor.add_subsystem("mapped objects", 0)};
+
+        auto pid = ::fork();
+        if (pid == 0) {
+            ::_exit(cache.acquire(path) ? 1 : 0);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "cold in the child");
+        check(holds(cache.acquire(path), "old"), "hot in the parent after the child's read");
+
+        pid = ::fork();
+        if (pid == 0) {
+            write_file(path, "newer");
+            cache.invalidate(path);
+            ::_exit(0);
+        }
+
+        ::waitpid(pid, &status, 0);
+        check(holds(cache.acquire(path), "newer"), "invalidated by the child");
+        check(cache.hits() == 0, "no stale hit");
+    } // test_shared_across_fork
+
+    // The governor's budget caps the cache. The least recently used mappings
+    // make room, and the governor can ask the cache to shrink.
+    void test_budget(const std::string& _dir)
+    {
+        memory_governor governor;
+        const auto subsystem = governor.add_subsystem("mapped objects", 300);
+
+        {
+            mapped_object_cache cache{governor, subsystem, 200};
+
+            for (const auto* name : {"a", "b", "c", "big"}) {
+                write_file(_dir + "/" + name, std::string(std::strcmp(name, "big") == 0 ? 201 : 100, 'x'));
+            }
+
+            for (const auto* name : {"a", "b", "c"}) {
+                cache.acquire(_dir + "/" + name);
+                cache.acquire(_dir + "/" + name);
+            }
+
+            check(cache.mapped_bytes() == 300 && governor.used(subsystem) == 300, "budget filled");
+
+            cache.acquire(_dir + "/big");
+            check(!cache.acquire(_dir + "/big"), "too large to map");
+
+            // "a" is the least recently used object.
+            cache.acquire(_dir + "/b");
+            cache.acquire(_dir + "/c");
+            write_file(_dir + "/d", std::string(100, 'x'));
+            cache.acquire(_dir + "/d");
+            check(cache.acquire(_dir + "/d") != nullptr, "mapped over budget by evicting");
+            check(cache.mapped_bytes() == 300 && governor.used(subsystem) == 300, "still within budget");
+
+            const auto hits = cache.hits();
+            cache.acquire(_dir + "/b");
+            check(cache.hits() == hits + 1, "recently used object kept");
+
+            check(cache.shrink(150) == 200, "shrink frees whole mappings");
+            check(governor.used(subsystem) == 100, "shrink releases the charge");
+        }
+
+        check(governor.used(subsystem) == 0, "destructor releases the charge");
+    } // test_budget
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_mapped_object_cache.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_hot_and_invalidate(dir);
+    test_shared_across_fork(dir);
+    test_budget(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#include "memory_governor.hpp"
+#include "resource_limits.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void write_file(const std::string& _path, const std::string& _contents)
+    {
+        std::ofstream{_path} << _contents;
+    } // write_file
+
+    void write_psi(const std::string& _path, double _some, double _full)
+    {
+        write_file(_path, fmt::format("some avg10={:.2f} avg60=0.00 avg300=0.00 total=0\n"
+                                      "full avg10={:.2f} avg60=0.00 avg300=0.00 total=0\n", _some, _full));
+    } // write_psi
+
+    // Pressure sampled by one process makes every process that polls shrink
+    // its own subsystems.
+    void test_shrink_in_child(const std::string& _dir)
+    {
+        const auto psi = _dir + "/memory.pressure";
+        write_psi(psi, 0, 0);
+
+        memory_governor_config config;
+        config.psi_path = psi;
+        config.poll_interval = std::chrono::milliseconds{0};
+
+        memory_governor governor{config};
+        const auto buffers = governor.add_subsystem("buffers", 0);
+        governor.charge(buffers, 1000);
+
+        check(governor.poll() == memory_pressure::none, "no pressure");
+
+        write_psi(psi, 50, 0);
+
+        const auto pid = ::fork();
+        if (pid == 0) {
+            std::uint64_t asked = 0;
+            governor.set_shrinker(buffers, [&asked](std::uint64_t _bytes) { asked = _bytes; return _bytes; });
+            governor.poll();
+            ::_exit(asked == 500 ? 0 : 1);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child shrinks under critical pressure");
+        check(governor.pressure() == memory_pressure::critical, "level shared with the parent");
+        check(!governor.admit() && !governor.reserve(buffers, 1), "critical pressure turns work away");
+
+        write_psi(psi, 15, 0);
+        check(governor.poll() == memory_pressure::moderate, "moderate pressure");
+        check(governor.reserve(buffers, 1), "reservations allowed again");
+    } // test_shrink_in_child
+
+    // Inside a cgroup, the cgroup's own PSI file is used.
+    void test_pressure_path(const std::string& _dir)
+    {
+        const auto root = _dir + "/cgroup";
+        ::mkdir(root.c_str(), 0700);
+        ::mkdir((root + "/app").c_str(), 0700);
+        write_file(root + "/app/cgroup.controllers", "cpu memory\n");
+        write_file(_dir + "/proc_cgroup", "0::/app\n");
+
+        resource_probe probe{root, _dir + "/proc_cgroup"};
+        check(probe.memory_pressure_path() == "/proc/pressure/memory", "host file without cgroup PSI");
+
+        write_psi(root + "/app/memory.pressure", 0, 0);
+        check(probe.memory_pressure_path() == root + "/app/memory.pressure", "cgroup PSI file");
+    } // test_pressure_path
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_memory_governor.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_shrink_in_child(dir);
+    test_pressure_path(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include "merkle_digest.hpp"
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    constexpr std::size_t chunk_size = 4096;
+
+    int create(const std::string& _path, std::size_t _size)
+    {
+        const int fd = ::open(_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+
+        std::vector<char> data(_size);
+        for (std::size_t i = 0; i < _size; ++i) {
+            data[i] = static_cast<char>(i * 31 + i / 7);
+        }
+
+        check(::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()), "create file");
+
+        return fd;
+    } // create
+
+    // The digest a fresh instance computes, without any cache.
+    sha256_digest uncached(int _fd, std::uint64_t _offset, std::uint64_t _length)
+    {
+        merkle_digest digest{chunk_size, 2};
+        sha256_digest d{};
+        check(digest.compute(_fd, _offset, _length, d) == 0, "uncached compute");
+        return d;
+    } // uncached
+
+    void wait_out_racy_window()
+    {
+        std::this_thread::sleep_for(std::chrono::nanoseconds{merkle_digest::racy_window_ns + 100000000});
+    } // wait_out_racy_window
+
+    // Leaves and subtrees are reused across requests over an unchanged file,
+    // including ranges that do not start at offset 0.
+    void test_cache(const std::string& _dir)
+    {
+        const int fd = create(_dir + "/cache", 37 * chunk_size + 100);
+        wait_out_racy_window();
+
+        merkle_digest digest{chunk_size, 2};
+        sha256_digest first{};
+        sha256_digest second{};
+
+        check(digest.compute(fd, 0, 0, first) == 0, "compute");
+        check(digest.chunks_hashed() == 38, "all chunks hashed");
+        check(digest.compute(fd, 0, 0, second) == 0 && first == second, "recompute");
+        check(digest.chunks_hashed() == 38, "second request served from the cache");
+        check(first == uncached(fd, 0, 0), "cached digest matches");
+
+        sha256_digest range{};
+        check(digest.compute(fd, 5 * chunk_size, 20 * chunk_size, range) == 0, "range");
+        check(range == uncached(fd, 5 * chunk_size, 20 * chunk_size), "cached range digest matches");
+        check(digest.chunks_hashed() == 38, "range served from the cache");
+
+        digest.invalidate(7 * chunk_size, 1);
+        check(digest.compute(fd, 0, 0, second) == 0 && first == second, "recompute after invalidate");
+        check(digest.chunks_hashed() == 39, "only the invalidated chunk rehashed");
+
+        ::close(fd);
+    } // test_cache
+
+    // A write by another process is never hidden by this process' own
+    // invalidate(), even if the file keeps its size.
+    void test_foreign_write(const std::string& _dir)
+    {
+        const int fd = create(_dir + "/foreign", 8 * chunk_size);
+        wait_out_racy_window();
+
+        merkle_digest digest{chunk_size, 2};
+        sha256_digest before{};
+        check(digest.compute(fd, 0, 0, before) == 0, "compute");
+
+        if (const auto pid = ::fork(); pid == 0) {
+            ::pwrite(fd, "changed", 7, 3 * chunk_size);
+            ::_exit(0);
+        }
+        else {
+            ::waitpid(pid, nullptr, 0);
+        }
+
+        ::pwrite(fd, "mine", 4, 6 * chunk_size);
+        digest.invalidate(6 * chunk_size, 4);
+
+        sha256_digest after{};
+        check(digest.compute(fd, 0, 0, after) == 0, "compute after writes");
+        check(after == uncached(fd, 0, 0), "foreign write seen");
+        check(after != before, "digest changed");
+
+        ::close(fd);
+    } // test_foreign_write
+
+    // Chunks written moments after a digest was taken can keep the file's
+    // timestamps, so recently modified files are not served from the cache.
+    void test_racy_write(const std::string& _dir)
+    {
+        const int fd = create(_dir + "/racy", 8 * chunk_size);
+
+        merkle_digest digest{chunk_size, 2};
+        sha256_digest d{};
+        check(digest.compute(fd, 0, 0, d) == 0, "compute");
+
+        ::pwrite(fd, "x", 1, 0);
+        check(digest.compute(fd, 0, 0, d) == 0 && d == uncached(fd, 0, 0), "write right after digest seen");
+
+        ::close(fd);
+    } // test_racy_write
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_merkle_digest.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_cache(dir);
+    test_foreign_write(dir);
+    test_racy_write(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
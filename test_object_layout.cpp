@@ -0,0 +1,124 @@
+#include "object_layout.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void create(const object_layout& _layout, const std::string& _name)
+    {
+        const auto fd = _layout.create(_name, O_WRONLY);
+        check(fd != -1, "create");
+        ::close(fd);
+    } // create
+
+    void test_name_validation()
+    {
+        check(object_layout::is_valid_name("a"), "plain name");
+        check(object_layout::is_valid_name("a/b/c.txt"), "nested name");
+        check(object_layout::is_valid_name("a/.hidden"), "hidden file below the root");
+
+        for (const auto* name : {"", "/etc/passwd", "..", "../x", "a/../../x", "a/./b", "a//b", "a/", ".layout", ".shards/x"}) {
+            check(!object_layout::is_valid_name(name), name);
+        }
+
+        check(!object_layout::is_valid_name(std::string{"a\0b", 3}), "NUL byte");
+    } // test_name_validation
+
+    void test_rejects_escaping_names(const fs::path& _dir)
+    {
+        object_layout layout{_dir / "escape"};
+
+        check(layout.create("../outside", O_WRONLY) == -1 && errno == EINVAL, "create rejects ..");
+        check(!fs::exists(_dir / "outside"), "nothing created outside the root");
+        check(!layout.resolve("a/../../outside"), "resolve rejects ..");
+    } // test_rejects_escaping_names
+
+    // A running server follows a migration done by another instance, and an
+    // object it creates during the migration is reachable afterwards.
+    void test_migration_seen_by_server(const fs::path& _dir)
+    {
+        const auto root = _dir / "migrate";
+        object_layout server{root};
+
+        create(server, "a/one");
+        create(server, "two");
+        check(fs::exists(root / "a/one"), "flat object");
+
+        object_layout tool{root};
+        check(tool.migrate_to_sharded(1000000) == 2, "objects moved");
+        check(server.mode() == layout_mode::sharded, "server sees the new mode");
+
+        create(server, "three");
+        check(!fs::exists(root / "three"), "new object not created flat");
+
+        for (const auto* name : {"a/one", "two", "three"}) {
+            const auto path = server.resolve(name);
+            check(path && fs::exists(*path), name);
+        }
+
+        check(!fs::exists(root / "a"), "empty flat directories removed");
+    } // test_migration_seen_by_server
+
+    // Listings pick up entries appended by other instances.
+    void test_incremental_listing(const fs::path& _dir)
+    {
+        const auto root = _dir / "list";
+        object_layout reader{root};
+        object_layout writer{root};
+
+        create(writer, "logs/1");
+        create(writer, "logs/2");
+        check(reader.list("logs/") == std::vector<std::string>{"logs/1", "logs/2"}, "first listing");
+
+        writer.record_unlink("logs/1");
+        create(writer, "logs/3");
+        create(writer, "other");
+        check(reader.list("logs/") == std::vector<std::string>{"logs/2", "logs/3"}, "listing after appends");
+
+        check(writer.compact_index() == 0, "compact");
+        create(writer, "logs/4");
+        check(reader.list("logs/") == std::vector<std::string>{"logs/2", "logs/3", "logs/4"}, "listing after compaction");
+    } // test_incremental_listing
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_object_layout.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_name_validation();
+    test_rejects_escaping_names(dir);
+    test_migration_seen_by_server(dir);
+    test_incremental_listing(dir);
+
+    fs::remove_all(dir);
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#include "output_queue.hpp"
+
+#include <boost/asio/post.hpp>
+
+#include <fmt/format.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // Completes every write with _error after writing _accept bytes of it.
+    struct fake_stream
+    {
+        boost::asio::io_service& io_service;
+        boost::system::error_code error;
+        std::size_t accept = 0;
+        std::size_t writes = 0;
+
+        template <typename Buffer, typename Handler>
+        void async_write_some(const Buffer& _buffer, Handler _handler)
+        {
+            ++writes;
+            const auto length = error ? 0 : std::min(accept, _buffer.size());
+            boost::asio::post(io_service, [this, length, _handler] { _handler(error, length); });
+        } // async_write_some
+    }; // struct fake_stream
+
+    void test_write()
+    {
+        boost::asio::io_service io_service;
+        fake_stream stream{io_service, {}, 1024};
+        output_queue<fake_stream> output{io_service, stream};
+
+        bool stalled = false;
+        output.on_stall([&stalled] { stalled = true; });
+
+        check(output.push(std::vector<char>(4096)), "push accepted");
+        io_service.run();
+
+        check(!stalled, "session kept");
+        check(stream.writes == 4, "written in pieces");
+        check(output.queued_bytes() == 0, "queue drained");
+    } // test_write
+
+    // A failed write drops the session, even while nothing is reading.
+    void test_write_error()
+    {
+        boost::asio::io_service io_service;
+        fake_stream stream{io_service, boost::asio::error::broken_pipe};
+        output_queue<fake_stream> output{io_service, stream};
+
+        int stalls = 0;
+        output.on_stall([&stalls] { ++stalls; });
+
+        check(output.push(std::vector<char>(100)), "push accepted");
+        io_service.run();
+
+        check(stalls == 1, "session dropped on write error");
+        check(output.report().find("stalled=1") != std::string::npos, "drop reported");
+    } // test_write_error
+
+    // A write aborted by the stall handler closing the stream does not drop
+    // the session a second time.
+    void test_write_aborted()
+    {
+        boost::asio::io_service io_service;
+        fake_stream stream{io_service, boost::asio::error::operation_aborted};
+        output_queue<fake_stream> output{io_service, stream};
+
+        int stalls = 0;
+        output.on_stall([&stalls] { ++stalls; });
+
+        check(output.push(std::vector<char>(100)), "push accepted");
+        io_service.run();
+
+        check(stalls == 0, "aborted write ignored");
+    } // test_write_aborted
+
+    void test_limit()
+    {
+        boost::asio::io_service io_service;
+        fake_stream stream{io_service, {}, 0};
+
+        output_queue_config config;
+        config.pause_bytes = 100;
+        config.resume_bytes = 50;
+        config.max_bytes = 200;
+
+        output_queue<fake_stream> output{io_service, stream, config};
+
+        int stalls = 0;
+        output.on_stall([&stalls] { ++stalls; });
+
+        check(output.push(std::vector<char>(150)), "push accepted");
+        check(output.paused(), "reading paused");
+        check(!output.push(std::vector<char>(100)), "push beyond limit refused");
+        check(stalls == 1, "session dropped at limit");
+    } // test_limit
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_write();
+    test_write_error();
+    test_write_aborted();
+    test_limit();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
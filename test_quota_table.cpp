@@ -0,0 +1,101 @@
+#include "quota_table.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // Names with blanks and newlines survive a save and load.
+    void test_save_load(const std::string& _dir)
+    {
+        const auto path = _dir + "/quotas";
+        const std::string odd = "john smith\n0 0 0 0";
+
+        {
+            quota_table quotas{64};
+            const auto a = quotas.lookup(odd);
+            const auto b = quotas.lookup("alice");
+            quotas.set_limits(a, 1000, 0);
+            quotas.charge_storage(a, 400);
+            quotas.charge_storage(b, 7);
+            check(quotas.save(path) == 0, "save");
+        }
+
+        quota_table quotas{64};
+        check(quotas.load(path) == 0, "load");
+        check(quotas.storage_used(quotas.lookup(odd)) == 400, "odd name restored");
+        check(quotas.storage_used(quotas.lookup("alice")) == 7, "plain name restored");
+        check(!quotas.charge_storage(quotas.lookup(odd), 601), "limit restored");
+    } // test_save_load
+
+    void test_rejects_corrupt_file(const std::string& _dir)
+    {
+        const auto path = _dir + "/corrupt";
+        std::FILE* out = std::fopen(path.c_str(), "w");
+        std::fputs("99 bob 1 2 3\n", out);
+        std::fclose(out);
+
+        quota_table quotas{64};
+        check(quotas.load(path) == -1, "corrupt file rejected");
+
+        // A huge length must be rejected before anything is allocated for it.
+        out = std::fopen(path.c_str(), "w");
+        std::fputs("99999999999999999 x 1 2 3\n", out);
+        std::fclose(out);
+
+        check(quotas.load(path) == -1, "huge name length rejected");
+    } // test_rejects_corrupt_file
+
+    // Accounts created in one process are found by the others.
+    void test_shared_accounts()
+    {
+        quota_table quotas{64};
+
+        if (const auto pid = ::fork(); pid == 0) {
+            quotas.charge_storage(quotas.lookup("carol"), 5);
+            ::_exit(0);
+        }
+        else {
+            ::waitpid(pid, nullptr, 0);
+        }
+
+        quotas.reconcile();
+        check(quotas.storage_used(quotas.lookup("carol")) == 5, "account shared with child");
+    } // test_shared_accounts
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_quota_table.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_save_load(dir);
+    test_rejects_corrupt_file(dir);
+    test_shared_accounts();
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+#include "read_coalescer.hpp"
+
+#include <fmt/format.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    constexpr std::size_t block_size = 4096;
+
+    // An object whose byte at offset n is (n + version) % 251. Counts its
+    // reads in shared memory, so that children's reads count as well.
+    struct object
+    {
+        object()
+        {
+            state = static_cast<shared*>(::mmap(nullptr, sizeof(shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+        }
+
+        ~object()
+        {
+            ::munmap(state, sizeof(shared));
+        }
+
+        struct shared
+        {
+            std::atomic<int> reads;
+            std::atomic<int> version;
+            std::atomic<int> delay_ms;
+        };
+
+        read_coalescer::reader reader()
+        {
+            return [this](char* _buffer, std::size_t _count, off_t _offset) -> ssize_t {
+                ++state->reads;
+
+                const auto version = state->version.load();
+                std::this_thread::sleep_for(std::chrono::milliseconds{state->delay_ms.load()});
+
+                const auto n = _offset >= static_cast<off_t>(size) ? 0 : std::min<std::size_t>(_count, size - _offset);
+                for (std::size_t i = 0; i < n; ++i) {
+                    _buffer[i] = static_cast<char>((_offset + i + version) % 251);
+                }
+
+                return static_cast<ssize_t>(n);
+            };
+        } // reader
+
+        bool matches(const std::vector<char>& _data, off_t _offset, int _version = 0) const
+        {
+            for (std::size_t i = 0; i < _data.size(); ++i) {
+                if (_data[i] != static_cast<char>((_offset + i + _version) % 251)) {
+                    return false;
+                }
+            }
+
+            return true;
+        } // matches
+
+        std::size_t size = 10 * block_size + 100;
+        shared* state;
+    }; // struct object
+
+    void test_read()
+    {
+        read_coalescer coalescer{block_size};
+        object obj;
+
+        std::vector<char> data(3 * block_size);
+        check(coalescer.read("a", data.data(), data.size(), 1000, obj.reader()) == static_cast<ssize_t>(data.size()), "unaligned read");
+        check(obj.matches(data, 1000), "unaligned data");
+
+        check(coalescer.read("a", data.data(), data.size(), 9 * block_size, obj.reader()) == static_cast<ssize_t>(block_size + 100), "read at the end");
+        data.resize(block_size + 100);
+        check(obj.matches(data, 9 * block_size), "data at the end");
+
+        check(coalescer.read("a", data.data(), data.size(), 20 * block_size, obj.reader()) == 0, "read beyond the end");
+        check(coalescer.report().find("in_flight=0") != std::string::npos, "nothing left in flight");
+    } // test_read
+
+    // Sessions run in separate processes. Reading the same range at the same
+    // time costs one fetch per block.
+    void test_across_processes()
+    {
+        read_coalescer coalescer{block_size};
+        object obj;
+        obj.state->delay_ms = 200;
+
+        constexpr int children = 8;
+        std::vector<pid_t> pids;
+
+        for (int i = 0; i < children; ++i) {
+            if (const auto pid = ::fork(); pid == 0) {
+                std::vector<char> data(4 * block_size);
+                const auto n = coalescer.read("a", data.data(), data.size(), 0, obj.reader());
+                ::_exit(n == static_cast<ssize_t>(data.size()) && obj.matches(data, 0) ? 0 : 1);
+            }
+            else {
+                pids.push_back(pid);
+            }
+        }
+
+        for (const auto pid : pids) {
+            int status = 0;
+            ::waitpid(pid, &status, 0);
+            check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child read");
+        }
+
+        check(obj.state->reads < 2 * 4, "reads coalesced across processes");
+    } // test_across_processes
+
+    // A read that starts after a write never shares a fetch that started
+    // before it.
+    void test_invalidate()
+    {
+        read_coalescer coalescer{block_size};
+        object obj;
+        obj.state->delay_ms = 300;
+
+        std::vector<char> before(block_size);
+        std::thread reader{[&] { coalescer.read("a", before.data(), before.size(), 0, obj.reader()); }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{100});
+        obj.state->version = 1;
+        coalescer.invalidate("a", 10, 1);
+
+        std::vector<char> after(block_size);
+        check(coalescer.read("a", after.data(), after.size(), 0, obj.reader()) == static_cast<ssize_t>(block_size), "read after write");
+        check(obj.matches(after, 0, 1), "read after write sees the write");
+
+        reader.join();
+        check(obj.state->reads == 2, "fetch not shared after write");
+    } // test_invalidate
+
+    void test_errors()
+    {
+        read_coalescer coalescer{block_size};
+        object obj;
+
+        std::vector<char> data(2 * block_size);
+        auto failing = [](char*, std::size_t, off_t) -> ssize_t { errno = ENOSPC; return -1; };
+        auto throwing = [](char*, std::size_t, off_t) -> ssize_t { throw std::runtime_error{"storage"}; };
+
+        check(coalescer.read("a", data.data(), data.size(), 0, failing) == -1 && errno == ENOSPC, "reader error returned");
+        check(coalescer.read("a", data.data(), data.size(), 0, throwing) == -1 && errno == EIO, "reader exception returned");
+        check(coalescer.report().find("in_flight=0") != std::string::npos, "failed blocks not left in flight");
+
+        check(coalescer.read("a", data.data(), data.size(), 0, obj.reader()) == static_cast<ssize_t>(data.size()) && obj.matches(data, 0),
+              "blocks read again after errors");
+    } // test_errors
+
+    // A read waiting for a block fetched by a process that died fails, and
+    // later reads fetch the block again.
+    void test_dead_owner()
+    {
+        read_coalescer coalescer{block_size};
+        object obj;
+        obj.state->delay_ms = 10000;
+
+        const auto pid = ::fork();
+        if (pid == 0) {
+            std::vector<char> data(block_size);
+            coalescer.read("a", data.data(), data.size(), 0, obj.reader());
+            ::_exit(0);
+        }
+
+        while (obj.state->reads == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+
+        std::thread killer{[pid] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }};
+
+        std::vector<char> data(block_size);
+        check(coalescer.read("a", data.data(), data.size(), 0, obj.reader()) == -1 && errno == EIO, "waiting read fails");
+        killer.join();
+
+        obj.state->delay_ms = 0;
+        check(coalescer.read("a", data.data(), data.size(), 0, obj.reader()) == static_cast<ssize_t>(block_size) && obj.matches(data, 0),
+              "block fetched again");
+    } // test_dead_owner
+
+    // Without a free slot, blocks are read directly.
+    void test_bypass()
+    {
+        read_coalescer coalescer{block_size, 1};
+        object obj;
+
+        std::vector<char> data(3 * block_size);
+        check(coalescer.read("a", data.data(), data.size(), 100, obj.reader()) == static_cast<ssize_t>(data.size()), "read without slots");
+        check(obj.matches(data, 100), "data without slots");
+        check(coalescer.report().find("bypassed=3") != std::string::npos, "blocks bypassed");
+    } // test_bypass
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_read();
+    test_across_processes();
+    test_invalidate();
+    test_errors();
+    test_dead_owner();
+    test_bypass();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
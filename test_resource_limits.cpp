@@ -0,0 +1,123 @@
+#include "resource_limits.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void write_file(const std::string& _path, const std::string& _contents)
+    {
+        std::ofstream{_path} << _contents;
+    } // write_file
+
+    void test_parse_cpu_max()
+    {
+        check(resource_probe::parse_cpu_max("50000 100000") == 0.5, "quota and period");
+        check(resource_probe::parse_cpu_max("300000 100000") == 3, "several CPUs");
+        check(resource_probe::parse_cpu_max("max 100000") >= 1e9, "no quota");
+        check(resource_probe::parse_cpu_max("") >= 1e9, "empty");
+        check(resource_probe::parse_cpu_max("50000") >= 1e9, "no period");
+        check(resource_probe::parse_cpu_max("50000 0") >= 1e9, "zero period");
+        check(resource_probe::parse_cpu_max("5e4 100000") >= 1e9, "not an integer");
+        check(resource_probe::parse_cpu_max("99999999999999999999999 100000") >= 1e9, "out of range");
+    } // test_parse_cpu_max
+
+    void test_parse_memory_max()
+    {
+        constexpr auto unlimited = ~std::uint64_t{0};
+
+        check(resource_probe::parse_memory_max("1073741824") == 1073741824, "bytes");
+        check(resource_probe::parse_memory_max("max") == unlimited, "no limit");
+        check(resource_probe::parse_memory_max("") == unlimited, "empty");
+        check(resource_probe::parse_memory_max("12k") == unlimited, "trailing garbage");
+        check(resource_probe::parse_memory_max("-1") == unlimited, "negative");
+        check(resource_probe::parse_memory_max("99999999999999999999999") == unlimited, "out of range");
+    } // test_parse_memory_max
+
+    void test_count_cpus()
+    {
+        check(resource_probe::count_cpus("0") == 1, "single CPU");
+        check(resource_probe::count_cpus("0-3") == 4, "range");
+        check(resource_probe::count_cpus("0-3,8,10-11") == 7, "list");
+        check(resource_probe::count_cpus("0-1,,4") == 3, "empty entry");
+        check(resource_probe::count_cpus("") == 0, "empty");
+        check(resource_probe::count_cpus("3-1") == 0, "reversed range");
+        check(resource_probe::count_cpus("0-") == 0, "open range");
+        check(resource_probe::count_cpus("a-b") == 0, "not a number");
+    } // test_count_cpus
+
+    // Limits come from the process' cgroup and its ancestors. Files that
+    // cannot be parsed do not limit anything.
+    void test_detect(const std::string& _dir)
+    {
+        const auto root = _dir + "/cgroup";
+        ::mkdir(root.c_str(), 0700);
+        ::mkdir((root + "/app").c_str(), 0700);
+        write_file(root + "/app/cgroup.controllers", "cpu memory\n");
+        write_file(_dir + "/proc_cgroup", "0::/app\n");
+
+        resource_probe probe{root, _dir + "/proc_cgroup"};
+        const auto host = resource_probe{root, _dir + "/missing"}.detect();
+
+        write_file(root + "/app/cpuset.cpus.effective", "0\n");
+        write_file(root + "/app/cpu.max", "50000 100000\n");
+        write_file(root + "/app/memory.max", "268435456\n");
+        write_file(root + "/memory.max", "536870912\n");
+
+        auto limits = probe.detect();
+        check(limits.cpuset_size == 1, "cpuset");
+        check(limits.cpus == 0.5, "cpu quota");
+        check(limits.memory == std::min<std::uint64_t>(host.memory, 268435456), "smallest memory limit");
+
+        write_file(root + "/memory.max", "1048576\n");
+        check(probe.detect().memory == std::min<std::uint64_t>(host.memory, 1048576), "parent's memory limit");
+
+        write_file(root + "/app/cpuset.cpus.effective", "5-2\n");
+        write_file(root + "/app/cpu.max", "garbage\n");
+        write_file(root + "/app/memory.max", "max\n");
+        write_file(root + "/memory.max", "12x\n");
+
+        limits = probe.detect();
+        check(limits.cpuset_size == host.cpuset_size, "bad cpuset ignored");
+        check(limits.cpus == host.cpus, "bad quota ignored");
+        check(limits.memory == host.memory, "bad memory limit ignored");
+    } // test_detect
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_resource_limits.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_parse_cpu_max();
+    test_parse_memory_max();
+    test_count_cpus();
+    test_detect(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
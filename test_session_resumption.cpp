@@ -0,0 +1,110 @@
+#include "session_resumption.hpp"
+
+#include <fmt/format.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::string read_file(const char* _path)
+    {
+        std::ifstream in{_path};
+        return {std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    } // read_file
+
+    // Hands _socket to the session parked under _token, retrying while the
+    // parked process is still starting up.
+    int hand_off(const std::string& _token, int _socket, const std::string& _message)
+    {
+        for (int i = 0; i < 100; ++i) {
+            if (session_parking::hand_off(_token, _socket, _message.data(), _message.size()) == 0) {
+                return 0;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+
+        return -1;
+    } // hand_off
+
+    void test_tokens()
+    {
+        const auto a = make_resumption_token();
+        const auto b = make_resumption_token();
+
+        check(a.size() == 32 && is_valid_resumption_token(a), "token format");
+        check(a != b, "tokens differ");
+        check(!is_valid_resumption_token("not a token"), "invalid token rejected");
+    } // test_tokens
+
+    // The parked session only adopts a connection whose first message it
+    // accepts, and the token never shows up in the socket name.
+    void test_park_and_resume()
+    {
+        const auto token = make_resumption_token();
+
+        const auto pid = ::fork();
+        if (pid == 0) {
+            std::vector<char> message;
+            const int fd = session_parking::park(token, std::chrono::milliseconds{5000}, message,
+                [](const char* _data, std::size_t _size) { return std::string(_data, _size) == "alice"; });
+
+            if (fd == -1) {
+                ::_exit(1);
+            }
+
+            ::write(fd, "resumed", 7);
+            ::_exit(std::string(std::begin(message), std::end(message)) == "alice" ? 0 : 2);
+        }
+
+        int client[2];
+        check(::socketpair(AF_UNIX, SOCK_STREAM, 0, client) == 0, "socketpair");
+
+        check(hand_off(token, client[1], "bob") == -1, "other identity refused");
+        check(read_file("/proc/net/unix").find(token) == std::string::npos, "token not in socket name");
+        check(hand_off(token, client[1], "alice") == 0, "same identity resumes");
+
+        char buffer[7];
+        check(::read(client[0], buffer, sizeof(buffer)) == 7 && std::string(buffer, 7) == "resumed", "parked session uses socket");
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "parked session received message");
+
+        check(session_parking::hand_off(token, client[1], "alice", 5) == -1, "session gone after resuming");
+
+        ::close(client[0]);
+        ::close(client[1]);
+    } // test_park_and_resume
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_tokens();
+    test_park_and_resume();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
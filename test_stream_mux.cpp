@@ -0,0 +1,152 @@
+#include "stream_mux.hpp"
+
+// Both define flags for their frames in the same namespace.
+#include "frame_header.hpp"
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::vector<char> frame(std::uint32_t _id, frame_type _type, std::uint32_t _length, const std::string& _payload = {})
+    {
+        mux_frame_header header;
+        header.stream_id = _id;
+        header.length = _length;
+        header.type = static_cast<std::uint8_t>(_type);
+        header.flags = flag_none;
+
+        const auto* p = reinterpret_cast<const char*>(&header);
+        std::vector<char> out(p, p + sizeof(header));
+        out.insert(std::end(out), std::begin(_payload), std::end(_payload));
+
+        return out;
+    } // frame
+
+    int feed(stream_mux& _mux, const std::vector<char>& _bytes)
+    {
+        return _mux.on_input(_bytes.data(), _bytes.size());
+    } // feed
+
+    void test_round_trip()
+    {
+        stream_mux client{1};
+        stream_mux server{0};
+
+        const auto id = client.open_stream();
+        const std::string data(100000, 'x');
+        check(client.send(id, data.data(), data.size(), true) == data.size(), "send accepted");
+
+        std::string received;
+        std::vector<char> wire;
+
+        while (client.has_output() || server.has_output()) {
+            wire.clear();
+            client.poll_output(wire);
+            check(server.on_input(wire.data(), wire.size()) == 0, "server input");
+
+            char buffer[4096];
+            while (const auto n = server.read(id, buffer, sizeof(buffer))) {
+                received.append(buffer, n);
+            }
+
+            wire.clear();
+            server.poll_output(wire);
+            check(client.on_input(wire.data(), wire.size()) == 0, "client input");
+        }
+
+        check(received == data, "data received");
+        check(server.finished(id), "stream finished");
+    } // test_round_trip
+
+    // Frames split at arbitrary points are reassembled.
+    void test_split_input()
+    {
+        stream_mux server{0};
+
+        std::vector<char> wire;
+        for (int i = 0; i < 50; ++i) {
+            const auto f = frame(1, frame_type::data, 3, "abc");
+            wire.insert(std::end(wire), std::begin(f), std::end(f));
+        }
+
+        for (std::size_t i = 0; i < wire.size(); i += 7) {
+            const auto n = std::min<std::size_t>(7, wire.size() - i);
+            check(server.on_input(wire.data() + i, n) == 0, "split input");
+        }
+
+        check(server.readable(1) == 150, "all frames parsed");
+    } // test_split_input
+
+    void test_max_streams()
+    {
+        stream_mux server{0, stream_mux::default_stream_window, stream_mux::default_connection_window, 4};
+
+        for (std::uint32_t id = 1; id <= 7; id += 2) {
+            check(feed(server, frame(id, frame_type::data, 0)) == 0, "stream within limit");
+        }
+
+        check(server.stream_count() == 4, "streams counted");
+        check(feed(server, frame(9, frame_type::data, 0)) == -1, "stream beyond limit rejected");
+        check(feed(server, frame(0, frame_type::data, 0)) == -1, "data on stream 0 rejected");
+    } // test_max_streams
+
+    void test_window_overflow()
+    {
+        stream_mux server{0};
+        const auto id = server.open_stream();
+
+        check(feed(server, frame(0, frame_type::window_update, 0xffffffffu)) == -1, "connection credit overflow rejected");
+        check(feed(server, frame(id, frame_type::window_update, 0xffffffffu)) == -1, "stream credit overflow rejected");
+    } // test_window_overflow
+
+    // A stream the peer reset is forgotten, and its unread data no longer
+    // counts against the connection window.
+    void test_peer_reset()
+    {
+        stream_mux server{0, 1024, 1024};
+
+        const std::string payload(1000, 'x');
+        check(feed(server, frame(1, frame_type::data, 1000, payload)) == 0, "data received");
+        check(feed(server, frame(3, frame_type::data, 1000, payload)) == -1, "connection window exhausted");
+
+        stream_mux other{0, 1024, 1024};
+        check(feed(other, frame(1, frame_type::data, 1000, payload)) == 0, "data received");
+        check(feed(other, frame(1, frame_type::reset, 0)) == 0, "reset received");
+        check(other.stream_count() == 0, "reset stream forgotten");
+        check(other.finished(1), "reset stream finished");
+        check(feed(other, frame(3, frame_type::data, 1000, payload)) == 0, "connection window returned");
+
+        std::vector<char> wire;
+        other.poll_output(wire);
+        check(wire.size() == sizeof(mux_frame_header), "connection window update sent");
+    } // test_peer_reset
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_round_trip();
+    test_split_input();
+    test_max_streams();
+    test_window_overflow();
+    test_peer_reset();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+#include "tenant_pools.hpp"
+
+#include <fmt/format.h>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    std::string write_config(const std::string& _dir, const std::string& _content)
+    {
+        const auto path = _dir + "/tenants";
+        std::ofstream{path} << _content;
+
+        return path;
+    } // write_config
+
+    void test_classify(const std::string& _dir)
+    {
+        tenant_pools pools{write_config(_dir, "# classes\ngold:alice,bob::0:0\nsilver:carol::2:0\n")};
+
+        check(pools.get(pools.classify("bob")).name == "gold", "user classified");
+        check(pools.get(pools.classify("carol")).name == "silver", "second class");
+        check(pools.get(pools.classify("dave")).name == "default", "unknown user in default class");
+    } // test_classify
+
+    void test_max_sessions(const std::string& _dir)
+    {
+        tenant_pools pools{write_config(_dir, "silver:carol::2:0\n")};
+
+        auto a = pools.join("carol");
+        auto b = pools.join("carol");
+
+        check(a && b, "sessions within limit");
+        check(!pools.join("carol"), "session beyond limit rejected");
+
+        a.reset();
+        check(pools.join("carol").has_value(), "slot freed on leave");
+    } // test_max_sessions
+
+    // Children join at the same time. The peak is the most sessions that
+    // were active at once, however the joins interleave.
+    void test_peak(const std::string& _dir)
+    {
+        tenant_pools pools{write_config(_dir, "")};
+        constexpr int children = 16;
+
+        int ready[2];
+        check(::pipe(ready) == 0, "pipe");
+
+        std::vector<pid_t> pids;
+        for (int i = 0; i < children; ++i) {
+            if (const auto pid = ::fork(); pid == 0) {
+                char go;
+                ::close(ready[1]);
+                ::read(ready[0], &go, 1);
+
+                auto session = pools.join("alice");
+                std::this_thread::sleep_for(std::chrono::milliseconds{200});
+                ::_exit(session ? 0 : 1);
+            }
+            else {
+                pids.push_back(pid);
+            }
+        }
+
+        ::close(ready[0]);
+        ::close(ready[1]);
+
+        for (const auto pid : pids) {
+            int status = 0;
+            ::waitpid(pid, &status, 0);
+            check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child joined");
+
+            // The children exit without leaving, so their slots are given
+            // back the way the server's SIGCHLD handler does it.
+            pools.on_exit(pid);
+        }
+
+        check(pools.report().find(fmt::format("active=0 peak={} ", children)) != std::string::npos, "peak counted");
+    } // test_peak
+
+    // CPU time of every thread of the session counts, not just that of the
+    // thread that joined.
+    void test_schedstat(const std::string& _dir)
+    {
+        if (std::ifstream{"/proc/self/schedstat"}.fail()) {
+            return;
+        }
+
+        tenant_pools pools{write_config(_dir, "")};
+
+        {
+            auto session = pools.join("alice");
+
+            std::atomic<bool> done{false};
+            std::thread worker{[&done] {
+                const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds{300};
+                while (std::chrono::steady_clock::now() < until) {
+                }
+
+                // Stay alive until the session left, like the authenticator's
+                // threads in a session.
+                while (!done) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+                }
+            }};
+
+            std::this_thread::sleep_for(std::chrono::milliseconds{400});
+            session.reset();
+            done = true;
+            worker.join();
+        }
+
+        const auto report = pools.report();
+        const auto cpu = report.find("cpu=");
+        check(cpu != std::string::npos && std::stoul(report.substr(cpu + 4)) >= 200, "cpu time of other threads counted");
+    } // test_schedstat
+
+    // Threads that were running before the session joined get the class'
+    // CPUs and nice level too.
+    void test_apply_to_threads(const std::string& _dir)
+    {
+        tenant_pools pools{write_config(_dir, "gold:alice:0:0:5\n")};
+
+        // The nice level cannot be lowered again, so the session runs in a
+        // child.
+        const auto pid = ::fork();
+        if (pid == 0) {
+            std::atomic<pid_t> tid{0};
+            std::atomic<bool> done{false};
+            std::thread worker{[&] {
+                tid = ::gettid();
+                while (!done) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+                }
+            }};
+
+            while (tid == 0) {
+                std::this_thread::yield();
+            }
+
+            auto session = pools.join("alice");
+
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            const bool pinned = ::sched_getaffinity(tid, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) == 1 && CPU_ISSET(0, &cpus);
+            const bool niced = ::getpriority(PRIO_PROCESS, tid) == 5;
+
+            done = true;
+            worker.join();
+
+            ::_exit(session && pinned && niced ? 0 : 1);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "existing thread joined the class");
+        pools.on_exit(pid);
+    } // test_apply_to_threads
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_tenant_pools.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_classify(dir);
+    test_max_sessions(dir);
+    test_peak(dir);
+    test_schedstat(dir);
+    test_apply_to_threads(dir);
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
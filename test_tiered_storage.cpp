@@ -0,0 +1,143 @@
+#include "tiered_storage.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    void create(const fs::path& _path, std::size_t _size)
+    {
+        fs::create_directories(_path.parent_path());
+
+        const std::vector<char> data(_size, 'x');
+        const int fd = ::open(_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        check(::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()), "create object");
+        ::close(fd);
+    } // create
+
+    tier_config make_config(const fs::path& _dir)
+    {
+        tier_config config;
+        config.fast_root = _dir / "fast";
+        config.slow_root = _dir / "slow";
+        config.fast_capacity = 1024 * 1024;
+        config.promote_threshold = 2.0;
+        config.migration_bytes_per_second = 1000;
+        return config;
+    } // make_config
+
+    // Reads counted in a child count towards promotion in the parent, and an
+    // object far larger than the per-second budget still migrates.
+    void test_promotion_from_child(const fs::path& _dir)
+    {
+        const auto config = make_config(_dir / "promote");
+        create(config.slow_root / "hot", 100000);
+        fs::create_directories(config.slow_root / "a");
+        create(config.slow_root / "a/b.migrating", 10);
+
+        tiered_storage storage{config};
+        check(!fs::exists(config.slow_root / "a/b.migrating"), "leftover staging file removed");
+        check(storage.fast_usage() == 0, "staging file not counted");
+
+        if (const auto pid = ::fork(); pid == 0) {
+            for (int i = 0; i < 5; ++i) {
+                storage.record_read("hot");
+            }
+            ::_exit(0);
+        }
+        else {
+            ::waitpid(pid, nullptr, 0);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+
+        check(storage.run_migrations() == 100000, "large object promoted");
+        check(fs::exists(config.fast_root / "hot") && !fs::exists(config.slow_root / "hot"), "object on fast tier");
+        check(storage.fast_usage() == 100000, "fast usage");
+        check(storage.run_migrations() == 0, "budget overdrawn");
+    } // test_promotion_from_child
+
+    // An object open in another process is never moved.
+    void test_pinned_in_child(const fs::path& _dir)
+    {
+        auto config = make_config(_dir / "pinned");
+        config.fast_capacity = 1000;
+        create(config.fast_root / "cold", 2000);
+
+        tiered_storage storage{config};
+
+        int ready[2];
+        int done[2];
+        check(::pipe(ready) == 0 && ::pipe(done) == 0, "pipes");
+
+        const auto pid = ::fork();
+        if (pid == 0) {
+            const int fd = storage.open("cold", O_RDWR);
+            char c = 1;
+            ::write(ready[1], &c, 1);
+            ::read(done[0], &c, 1);
+            ::pwrite(fd, "y", 1, 0);
+            storage.close(fd);
+            ::_exit(0);
+        }
+
+        char c;
+        ::read(ready[0], &c, 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+
+        check(storage.run_migrations() == 0, "pinned object not moved");
+        check(fs::exists(config.fast_root / "cold"), "pinned object still on fast tier");
+
+        ::write(done[1], &c, 1);
+        ::waitpid(pid, nullptr, 0);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        check(storage.run_migrations() == 2000, "unpinned object demoted");
+
+        const int fd = storage.open("cold", O_RDONLY);
+        check(fd != -1 && ::pread(fd, &c, 1, 0) == 1 && c == 'y', "write through pinned descriptor kept");
+        storage.close(fd);
+    } // test_pinned_in_child
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_tiered_storage.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_promotion_from_child(dir);
+    test_pinned_in_child(dir);
+
+    fs::remove_all(dir);
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,231 @@
+#include "tls_context.hpp"
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    // Writes a self-signed certificate and its key.
+    tls_config make_certificate(const std::string& _dir)
+    {
+        tls_config config;
+        config.certificate_file = _dir + "/cert.pem";
+        config.private_key_file = _dir + "/key.pem";
+        config.enable_ktls = false;
+
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        X509_sign(cert, key, EVP_sha256());
+
+        std::FILE* file = std::fopen(config.certificate_file.c_str(), "w");
+        PEM_write_X509(file, cert);
+        std::fclose(file);
+
+        file = std::fopen(config.private_key_file.c_str(), "w");
+        PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+        std::fclose(file);
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        return config;
+    } // make_certificate
+
+    void set_blocking(int _fd, bool _blocking)
+    {
+        const auto flags = ::fcntl(_fd, F_GETFL);
+        ::fcntl(_fd, F_SETFL, _blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    } // set_blocking
+
+    // A client and a server connected over a non-blocking socket pair.
+    struct connection
+    {
+        explicit connection(const tls_context& _ctx)
+        {
+            ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+            set_blocking(sockets[0], false);
+            set_blocking(sockets[1], false);
+
+            client_ctx = SSL_CTX_new(TLS_client_method());
+            client = SSL_new(client_ctx);
+            SSL_set_fd(client, sockets[0]);
+
+            server = std::make_unique<tls_stream>(_ctx, sockets[1]);
+        } // connection (constructor)
+
+        ~connection()
+        {
+            server.reset();
+            SSL_free(client);
+            SSL_CTX_free(client_ctx);
+            ::close(sockets[0]);
+            ::close(sockets[1]);
+        } // destructor
+
+        // Runs both ends of the handshake in turns.
+        tls_io handshake()
+        {
+            auto result = tls_io::want_read;
+
+            for (int i = 0; i < 100 && (result == tls_io::want_read || result == tls_io::want_write); ++i) {
+                SSL_connect(client);
+                result = server->handshake_step();
+            }
+
+            return result;
+        } // handshake
+
+        int sockets[2];
+        SSL_CTX* client_ctx;
+        SSL* client;
+        std::unique_ptr<tls_stream> server;
+    }; // struct connection
+
+    // Every outcome of a non-blocking read maps to the right tls_io.
+    void test_handshake_and_read(const tls_context& _ctx)
+    {
+        connection c{_ctx};
+
+        check(c.server->handshake_step() == tls_io::want_read, "handshake waits for the client");
+        check(c.handshake() == tls_io::done, "handshake");
+        check(SSL_connect(c.client) == 1, "client handshake");
+        check(!c.server->session_reused() && !c.server->ktls_send(), "full handshake without kTLS");
+
+        char buffer[16];
+        std::size_t n = 0;
+        check(c.server->read_some(buffer, sizeof(buffer), n) == tls_io::want_read, "nothing to read");
+
+        SSL_write(c.client, "hello", 5);
+        check(c.server->read_some(buffer, sizeof(buffer), n) == tls_io::done && n == 5, "read");
+
+        std::size_t written = 0;
+        check(c.server->write_some("world", 5, written) == tls_io::done && written == 5, "write");
+        check(SSL_read(c.client, buffer, sizeof(buffer)) == 5, "client reads");
+
+        SSL_shutdown(c.client);
+        check(c.server->read_some(buffer, sizeof(buffer), n) == tls_io::closed, "closed by the client");
+    } // test_handshake_and_read
+
+    void test_handshake_failure(const tls_context& _ctx)
+    {
+        connection c{_ctx};
+
+        const char request[] = "GET / HTTP/1.0\r\n\r\n";
+        ::write(c.sockets[0], request, sizeof(request) - 1);
+        check(c.server->handshake_step() == tls_io::failed, "not TLS");
+    } // test_handshake_failure
+
+    // Without kTLS, sendfile() on a non-blocking socket stops when the socket
+    // is full and continues where it left off.
+    void test_sendfile_non_blocking(const tls_context& _ctx, const std::string& _dir)
+    {
+        connection c{_ctx};
+        check(c.handshake() == tls_io::done && SSL_connect(c.client) == 1, "handshake");
+
+        const auto path = _dir + "/file";
+        std::vector<char> contents(3 * 1024 * 1024 + 123);
+        for (std::size_t i = 0; i < contents.size(); ++i) {
+            contents[i] = static_cast<char>(i * 31 + i / 4096);
+        }
+
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        ::write(fd, contents.data(), contents.size());
+
+        auto sent = c.server->sendfile(fd, 0, contents.size());
+        check(sent > 0 && static_cast<std::size_t>(sent) < contents.size(), "short send once the socket is full");
+
+        std::size_t total = sent > 0 ? sent : 0;
+        std::vector<char> received;
+
+        set_blocking(c.sockets[0], true);
+        std::thread reader{[&] {
+            char buffer[16384];
+            while (received.size() < contents.size()) {
+                const auto n = SSL_read(c.client, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    break;
+                }
+                received.insert(std::end(received), buffer, buffer + n);
+            }
+        }};
+
+        while (total < contents.size()) {
+            sent = c.server->sendfile(fd, total, contents.size() - total);
+
+            if (sent > 0) {
+                total += sent;
+            }
+            else if (sent == -1 && errno == EAGAIN) {
+                pollfd pfd{c.sockets[1], POLLOUT, 0};
+                ::poll(&pfd, 1, 1000);
+            }
+            else {
+                break;
+            }
+        }
+
+        reader.join();
+        ::close(fd);
+
+        check(total == contents.size(), "everything sent");
+        check(received == contents, "everything received");
+    } // test_sendfile_non_blocking
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_tls_context.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    {
+        tls_context ctx{make_certificate(dir)};
+
+        test_handshake_and_read(ctx);
+        test_handshake_failure(ctx);
+        test_sendfile_non_blocking(ctx, dir);
+    }
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+#include "output_queue.hpp"
+#include "tls_write_stream.hpp"
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    using socket_type = boost::asio::local::stream_protocol::socket;
+
+    // Writes a self-signed certificate and its key.
+    tls_config make_certificate(const std::string& _dir)
+    {
+        tls_config config;
+        config.certificate_file = _dir + "/cert.pem";
+        config.private_key_file = _dir + "/key.pem";
+        config.enable_ktls = false;
+
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        X509_sign(cert, key, EVP_sha256());
+
+        std::FILE* file = std::fopen(config.certificate_file.c_str(), "w");
+        PEM_write_X509(file, cert);
+        std::fclose(file);
+
+        file = std::fopen(config.private_key_file.c_str(), "w");
+        PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+        std::fclose(file);
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        return config;
+    } // make_certificate
+
+    std::vector<char> make_response(std::size_t _size)
+    {
+        std::vector<char> data(_size);
+        for (std::size_t i = 0; i < _size; ++i) {
+            data[i] = static_cast<char>(i * 13 + i / 1000);
+        }
+        return data;
+    } // make_response
+
+    // Without TLS, the queue's output reaches the socket unchanged.
+    void test_plain()
+    {
+        boost::asio::io_service io_service;
+        int sockets[2];
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+
+        socket_type socket{io_service, boost::asio::local::stream_protocol{}, sockets[1]};
+        tls_write_stream<socket_type> stream{socket};
+        output_queue<tls_write_stream<socket_type>> output{io_service, stream};
+
+        output.push({'a', 'b', 'c'});
+        io_service.run();
+
+        char buffer[3];
+        check(::read(sockets[0], buffer, 3) == 3 && std::string(buffer, 3) == "abc", "plaintext passed through");
+        ::close(sockets[0]);
+    } // test_plain
+
+    // With TLS in user space, everything the queue writes is encrypted, also
+    // when the socket fills up and writes have to wait.
+    void test_tls(const tls_context& _ctx)
+    {
+        boost::asio::io_service io_service;
+        int sockets[2];
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+
+        socket_type socket{io_service, boost::asio::local::stream_protocol{}, sockets[1]};
+        socket.non_blocking(true);
+        ::fcntl(sockets[0], F_SETFL, ::fcntl(sockets[0], F_GETFL) | O_NONBLOCK);
+
+        SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+        SSL* client = SSL_new(client_ctx);
+        SSL_set_fd(client, sockets[0]);
+
+        tls_stream tls{_ctx, sockets[1]};
+        auto result = tls_io::want_read;
+        for (int i = 0; i < 100 && result != tls_io::done && result != tls_io::failed; ++i) {
+            SSL_connect(client);
+            result = tls.handshake_step();
+        }
+
+        check(result == tls_io::done && SSL_connect(client) == 1, "handshake");
+        ::fcntl(sockets[0], F_SETFL, ::fcntl(sockets[0], F_GETFL) & ~O_NONBLOCK);
+
+        tls_write_stream<socket_type> stream{socket};
+        stream.set_tls(&tls);
+
+        output_queue_config config;
+        config.max_bytes = 8 * 1024 * 1024;
+        output_queue<tls_write_stream<socket_type>> output{io_service, stream, config};
+
+        bool stalled = false;
+        output.on_stall([&stalled] { stalled = true; });
+
+        const auto first = make_response(3 * 1024 * 1024);
+        const auto second = make_response(1000);
+        output.push(first);
+        output.push(second);
+
+        // The socket buffer is much smaller than the response, so the queue
+        // has to wait for the reader.
+        std::vector<char> received;
+        std::thread reader{[&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+
+            char buffer[16384];
+            while (received.size() < first.size() + second.size()) {
+                const auto n = SSL_read(client, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    break;
+                }
+                received.insert(std::end(received), buffer, buffer + n);
+            }
+        }};
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+        while (output.queued_bytes() > 0 && !stalled && std::chrono::steady_clock::now() < deadline) {
+            io_service.restart();
+            io_service.run_for(std::chrono::milliseconds{10});
+        }
+
+        reader.join();
+
+        auto expected = first;
+        expected.insert(std::end(expected), std::begin(second), std::end(second));
+
+        check(!stalled && output.queued_bytes() == 0, "queue drained");
+        check(received == expected, "client decrypts the responses");
+
+        SSL_free(client);
+        SSL_CTX_free(client_ctx);
+        ::close(sockets[0]);
+    } // test_tls
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    char dir[] = "/tmp/test_tls_write_stream.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        fmt::print("Could not create temporary directory.\n");
+        return 1;
+    }
+
+    test_plain();
+
+    {
+        tls_context ctx{make_certificate(dir)};
+        test_tls(ctx);
+    }
+
+    std::system(fmt::format("rm -rf {}", dir).c_str());
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+#include "worker_pool.hpp"
+
+#include <boost/asio/io_service.hpp>
+
+#include <fmt/format.h>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace kdd::scpps
+{
+    int failures = 0;
+
+    void check(bool _ok, const char* _what)
+    {
+        if (!_ok) {
+            fmt::print("FAILED: {}\n", _what);
+            ++failures;
+        }
+    } // check
+
+    using namespace std::chrono_literals;
+
+    // Runs _io_service until _done is true or _timeout passed.
+    template <typename Predicate>
+    void run_until(boost::asio::io_service& _io_service, Predicate _done, std::chrono::milliseconds _timeout = 5s)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + _timeout;
+
+        while (!_done() && std::chrono::steady_clock::now() < deadline) {
+            _io_service.restart();
+            _io_service.run_for(10ms);
+        }
+    } // run_until
+
+    worker_pool_config make_config(unsigned _workers)
+    {
+        worker_pool_config config;
+        config.min_workers = _workers;
+        config.max_workers = 4;
+        config.tick = 20ms;
+        return config;
+    } // make_config
+
+    void serve_slowly(int _socket)
+    {
+        std::this_thread::sleep_for(300ms);
+        ::write(_socket, "ok", 2);
+    } // serve_slowly
+
+    // Reaps every worker process and returns whether all of them exited
+    // normally.
+    bool reap_all(worker_pool& _pool, boost::asio::io_service& _io_service)
+    {
+        bool clean = true;
+        const auto deadline = std::chrono::steady_clock::now() + 5s;
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            int status = 0;
+            const auto pid = ::waitpid(-1, &status, WNOHANG);
+
+            if (pid == -1) {
+                break;
+            }
+
+            if (pid > 0) {
+                clean = clean && WIFEXITED(status);
+                _pool.on_exit(pid);
+            }
+
+            _io_service.restart();
+            _io_service.run_for(10ms);
+        }
+
+        return clean && _pool.size() == 0;
+    } // reap_all
+
+    // Stopping the pool waits for busy workers: the completion handler runs
+    // after the connection was served, and the worker exits normally.
+    void test_stop_while_busy()
+    {
+        boost::asio::io_service io_service;
+        int completed = 0;
+        std::chrono::steady_clock::time_point completed_at;
+
+        worker_pool pool{io_service, make_config(1), [] {}, serve_slowly, [&](auto&) {
+            ++completed;
+            completed_at = std::chrono::steady_clock::now();
+        }};
+        pool.start();
+
+        int client[2];
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, client);
+
+        const auto started = std::chrono::steady_clock::now();
+        check(pool.dispatch(client[1], {}), "dispatch");
+        pool.stop();
+
+        run_until(io_service, [&] { return completed > 0; });
+
+        char reply[2];
+        check(::read(client[0], reply, 2) == 2, "connection served");
+        check(completed == 1 && completed_at - started >= 250ms, "completion after the connection was served");
+        check(reap_all(pool, io_service), "worker exited normally");
+
+        ::close(client[0]);
+    } // test_stop_while_busy
+
+    // A connection that cannot be passed to a dead worker goes to the next one.
+    void test_dead_worker()
+    {
+        boost::asio::io_service io_service;
+        int pids[2];
+        ::pipe(pids);
+
+        int completed = 0;
+
+        worker_pool pool{io_service, make_config(1), [&] { const auto pid = ::getpid(); ::write(pids[1], &pid, sizeof(pid)); },
+                         [](int _socket) { ::write(_socket, "ok", 2); }, [&](auto&) { ++completed; }};
+        pool.start();
+
+        pid_t first;
+        check(::read(pids[0], &first, sizeof(first)) == sizeof(first), "worker started");
+
+        ::kill(first, SIGKILL);
+        ::waitpid(first, nullptr, 0);
+
+        int client[2];
+        ::socketpair(AF_UNIX, SOCK_STREAM, 0, client);
+        check(pool.dispatch(client[1], {}), "dispatch");
+
+        run_until(io_service, [&] { return completed > 0; });
+
+        char reply[2];
+        check(::read(client[0], reply, 2) == 2, "connection served by another worker");
+
+        pool.stop();
+        reap_all(pool, io_service);
+
+        ::close(client[0]);
+        ::close(pids[0]);
+        ::close(pids[1]);
+    } // test_dead_worker
+
+    // Lowering the maximum retires the surplus workers once they have served
+    // their connections.
+    void test_lower_max_workers()
+    {
+        boost::asio::io_service io_service;
+        int completed = 0;
+
+        worker_pool pool{io_service, make_config(1), [] {}, serve_slowly, [&](auto&) { ++completed; }};
+        pool.start();
+
+        int clients[3][2];
+        for (auto& client : clients) {
+            ::socketpair(AF_UNIX, SOCK_STREAM, 0, client);
+            check(pool.dispatch(client[1], {}), "dispatch");
+        }
+
+        check(pool.size() == 3, "a worker per connection");
+
+        pool.set_max_workers(1);
+        run_until(io_service, [&] { return completed == 3; });
+        check(completed == 3, "busy workers finish their connections");
+
+        const auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (pool.size() > 1 && std::chrono::steady_clock::now() < deadline) {
+            if (const auto pid = ::waitpid(-1, nullptr, WNOHANG); pid > 0) {
+                pool.on_exit(pid);
+            }
+
+            io_service.restart();
+            io_service.run_for(10ms);
+        }
+
+        check(pool.size() == 1, "surplus workers retired");
+
+        pool.stop();
+        check(reap_all(pool, io_service), "remaining worker exited normally");
+
+        for (auto& client : clients) {
+            ::close(client[0]);
+        }
+    } // test_lower_max_workers
+} // namespace kdd::scpps
+
+int main()
+{
+    using namespace kdd::scpps;
+
+    test_stop_while_busy();
+    test_dead_worker();
+    test_lower_max_workers();
+
+    fmt::print("{}\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
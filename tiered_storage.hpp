@@ -0,0 +1,632 @@
+#ifndef KDD_SCPPS_TIERED_STORAGE_HPP
+#define KDD_SCPPS_TIERED_STORAGE_HPP
+
+#include "lock_profiler.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace kdd::scpps
+{
+    enum class tier
+    {
+        fast,
+        slow
+    }; // enum class tier
+
+    struct tier_config
+    {
+        boost::filesystem::path fast_root;
+        boost::filesystem::path slow_root;
+
+        // Bytes the fast tier may hold. Demotion starts above the high watermark
+        // and stops once usage drops below the low watermark.
+        std::uint64_t fast_capacity = 0;
+        double high_watermark = 0.90;
+        double low_watermark = 0.80;
+
+        // Access scores halve every half_life. An object on the slow tier whose
+        // score reaches promote_threshold is moved to the fast tier.
+        std::chrono::seconds half_life{3600};
+        double promote_threshold = 4.0;
+
+        // Upper bound on the bytes copied between tiers per second.
+        std::uint64_t migration_bytes_per_second = 64 * 1024 * 1024;
+
+        // How often run_migrations() rescans both roots to pick up objects that
+        // other processes created, resized or removed.
+        std::chrono::seconds rescan_interval{60};
+
+        // Number of shared access counters. Objects whose names hash to the same
+        // counter share their accesses.
+        std::uint32_t access_counters = 65536;
+    }; // struct tier_config
+
+    // Places objects on a fast (SSD) or slow (HDD) directory tree.
+    //
+    // New objects are always created on the fast tier. Every access bumps an
+    // exponentially decayed score for the object, so a burst of reads long ago
+    // counts for less than a few reads just now. run_migrations() should be
+    // called periodically. It promotes hot objects off the slow tier and demotes
+    // the coldest objects once the fast tier fills up, copying no more than the
+    // configured number of bytes per second on average.
+    //
+    // The server forks a child per connection, so everything the children
+    // contribute goes through the file system or shared memory. The instance
+    // must therefore be created by the parent before it forks, and
+    // run_migrations() is meant to be called by the parent only:
+    //
+    //   - Accesses are counted in a shared array of counters, which
+    //     run_migrations() folds into the scores.
+    //   - Objects are opened with open(), which takes a shared flock() on the
+    //     file for as long as it is open. A migration only moves an object whose
+    //     exclusive lock it can take, so an object open in any process is never
+    //     moved, and a write through an open descriptor is never lost.
+    //   - The catalogue is refreshed from disk every rescan_interval.
+    //
+    // A migrated object is fully copied and synced before it is renamed into
+    // place, so a reader never observes a partial copy. The copy runs without
+    // holding the catalogue's mutex.
+    class tiered_storage
+    {
+    public:
+        explicit tiered_storage(tier_config _config)
+            : config_{std::move(_config)}
+            , last_refill_{clock::now()}
+            , last_scan_{clock::now()}
+        {
+            namespace fs = boost::filesystem;
+
+            config_.access_counters = std::max<std::uint32_t>(1, config_.access_counters);
+            mapping_size_ = sizeof(shared_counters) + config_.access_counters * sizeof(std::atomic<std::uint64_t>);
+
+            auto* p = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category(), "Could not map access counters"};
+            }
+
+            // Anonymous mappings are zero-filled, which is the initial state of
+            // every counter.
+            shared_ = static_cast<shared_counters*>(p);
+            accesses_ = reinterpret_cast<std::atomic<std::uint64_t>*>(shared_ + 1);
+
+            fs::create_directories(config_.fast_root);
+            fs::create_directories(config_.slow_root);
+
+            rescan(true);
+        } // tiered_storage (constructor)
+
+        tiered_storage(const tiered_storage&) = delete;
+        auto operator=(const tiered_storage&) -> tiered_storage& = delete;
+
+        ~tiered_storage()
+        {
+            ::munmap(shared_, mapping_size_);
+        } // destructor
+
+        // Returns the path at which a new object should be created.
+        boost::filesystem::path path_for_new(const std::string& _name)
+        {
+            std::lock_guard lock{mutex_};
+            auto& obj = objects_[_name];
+            obj.location = tier::fast;
+            return config_.fast_root / _name;
+        } // path_for_new
+
+        // Returns the current path of an existing object.
+        std::optional<boost::filesystem::path> locate(const std::string& _name) const
+        {
+            if (const auto location = find(_name)) {
+                return root(*location) / _name;
+            }
+
+            return std::nullopt;
+        } // locate
+
+        // Opens the object like ::open() and pins it to its tier until close().
+        // Returns the file descriptor, or -1 with errno set.
+        int open(const std::string& _name, int _flags, mode_t _mode = S_IRUSR | S_IWUSR)
+        {
+            // A migration holds the exclusive lock while it copies. Once it is
+            // released, the descriptor may refer to the unlinked original, in
+            // which case the object is opened again at its new location.
+            for (int attempt = 0; attempt < 3; ++attempt) {
+                auto location = find(_name);
+                if (!location) {
+                    if (!(_flags & O_CREAT)) {
+                        errno = ENOENT;
+                        return -1;
+                    }
+
+                    location = tier::fast;
+                }
+
+                const auto path = root(*location) / _name;
+                const int fd = ::open(path.c_str(), _flags, _mode);
+                if (fd == -1) {
+                    return -1;
+                }
+
+                struct stat st;
+                if (::flock(fd, LOCK_SH) == -1 || ::fstat(fd, &st) == -1) {
+                    const auto saved_errno = errno;
+                    ::close(fd);
+                    errno = saved_errno;
+                    return -1;
+                }
+
+                if (st.st_nlink > 0) {
+                    std::lock_guard lock{mutex_};
+                    objects_[_name].location = *location;
+                    return fd;
+                }
+
+                ::close(fd);
+            }
+
+            errno = EAGAIN;
+            return -1;
+        } // open
+
+        // Closes a descriptor returned by open(), which unpins the object.
+        int close(int _fd)
+        {
+            return ::close(_fd);
+        } // close
+
+        // Records a read of _name. Reads are what drive promotion.
+        void record_read(const std::string& _name)
+        {
+            count_access(_name);
+
+            bool fast = true;
+
+            {
+                std::lock_guard lock{mutex_};
+
+                if (const auto iter = objects_.find(_name); iter != std::end(objects_)) {
+                    fast = iter->second.location == tier::fast;
+                }
+            }
+
+            (fast ? shared_->fast_reads : shared_->slow_reads).fetch_add(1, std::memory_order_relaxed);
+        } // record_read
+
+        // Records a write to _name, which may have changed its size.
+        void record_write(const std::string& _name, std::uint64_t _new_size)
+        {
+            count_access(_name);
+
+            std::lock_guard lock{mutex_};
+
+            if (const auto iter = objects_.find(_name); iter != std::end(objects_)) {
+                auto& obj = iter->second;
+
+                if (obj.location == tier::fast) {
+                    fast_usage_ = fast_usage_ - obj.size + _new_size;
+                }
+
+                obj.size = _new_size;
+            }
+        } // record_write
+
+        void record_unlink(const std::string& _name)
+        {
+            std::lock_guard lock{mutex_};
+
+            if (const auto iter = objects_.find(_name); iter != std::end(objects_)) {
+                if (iter->second.location == tier::fast) {
+                    fast_usage_ -= iter->second.size;
+                }
+
+                objects_.erase(iter);
+            }
+        } // record_unlink
+
+        // Moves objects between tiers within the migration budget. Returns the
+        // number of bytes copied.
+        std::uint64_t run_migrations()
+        {
+            std::vector<std::string> plan;
+            std::vector<tier> targets;
+
+            {
+                std::lock_guard lock{mutex_};
+
+                const auto now = clock::now();
+
+                if (now - last_scan_ >= config_.rescan_interval) {
+                    rescan(false);
+                    last_scan_ = now;
+                }
+
+                refill_budget();
+                fold_accesses(now);
+
+                std::vector<std::pair<double, std::string>> promotions;
+                std::vector<std::pair<double, std::string>> demotions;
+
+                for (const auto& [name, obj] : objects_) {
+                    const auto s = score(obj, now);
+
+                    if (obj.location == tier::slow && s >= config_.promote_threshold) {
+                        promotions.emplace_back(s, name);
+                    }
+                    else if (obj.location == tier::fast) {
+                        demotions.emplace_back(s, name);
+                    }
+                }
+
+                // Hottest objects are promoted first, coldest objects demoted first.
+                std::sort(std::begin(promotions), std::end(promotions), std::greater<>{});
+                std::sort(std::begin(demotions), std::end(demotions));
+
+                const auto high = static_cast<std::uint64_t>(config_.fast_capacity * config_.high_watermark);
+                const auto low = static_cast<std::uint64_t>(config_.fast_capacity * config_.low_watermark);
+
+                // The plan works on projected usage and budget. Every copy, also a
+                // demotion that makes room, is paid from the budget. As long as the
+                // budget is positive, a copy may overdraw it: an object larger than
+                // a second's worth of budget still moves, and the debt delays the
+                // following migrations.
+                auto usage = fast_usage_;
+                auto budget = budget_;
+                auto demotion = std::begin(demotions);
+
+                const auto add = [&](const std::string& _name, tier _to) {
+                    const auto size = objects_[_name].size;
+                    plan.push_back(_name);
+                    targets.push_back(_to);
+                    budget -= static_cast<std::int64_t>(size);
+                    usage = _to == tier::fast ? usage + size : usage - std::min(usage, size);
+                };
+
+                for (const auto& [s, name] : promotions) {
+                    const auto size = objects_[name].size;
+
+                    // Make room by demoting objects colder than the candidate.
+                    while (budget > 0 && usage + size > low && demotion != std::end(demotions) && demotion->first < s) {
+                        add(demotion++->second, tier::slow);
+                    }
+
+                    if (budget <= 0) {
+                        break;
+                    }
+
+                    // Does not fit even after demoting everything colder. A
+                    // smaller, less hot candidate may still fit.
+                    if (usage + size > low) {
+                        continue;
+                    }
+
+                    add(name, tier::fast);
+                }
+
+                if (usage > high) {
+                    while (budget > 0 && usage > low && demotion != std::end(demotions)) {
+                        add(demotion++->second, tier::slow);
+                    }
+                }
+            }
+
+            std::uint64_t moved = 0;
+
+            for (std::size_t i = 0; i < plan.size(); ++i) {
+                moved += move(plan[i], targets[i]);
+            }
+
+            return moved;
+        } // run_migrations
+
+        std::uint64_t fast_usage() const
+        {
+            std::lock_guard lock{mutex_};
+            return fast_usage_;
+        } // fast_usage
+
+        // Fraction of reads served from the fast tier, over all processes.
+        double fast_hit_ratio() const
+        {
+            const auto fast = shared_->fast_reads.load(std::memory_order_relaxed);
+            const auto total = fast + shared_->slow_reads.load(std::memory_order_relaxed);
+            return total > 0 ? static_cast<double>(fast) / total : 1.0;
+        } // fast_hit_ratio
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct object_info
+        {
+            tier location = tier::fast;
+            std::uint64_t size = 0;
+            double score = 0;
+            clock::time_point last_access{};
+            std::uint64_t accesses_seen = 0; // Value of the shared counter last folded in.
+            bool seen = false;               // Found by the current rescan.
+        }; // struct object_info
+
+        struct alignas(64) shared_counters
+        {
+            std::atomic<std::uint64_t> fast_reads;
+            std::atomic<std::uint64_t> slow_reads;
+        }; // struct shared_counters
+
+        static constexpr const char* staging_suffix = ".migrating";
+
+        static tier other(tier _tier) noexcept
+        {
+            return _tier == tier::fast ? tier::slow : tier::fast;
+        } // other
+
+        const boost::filesystem::path& root(tier _tier) const noexcept
+        {
+            return _tier == tier::fast ? config_.fast_root : config_.slow_root;
+        } // root
+
+        // Returns the tier _name is stored on. Another process may have moved
+        // it, so the tier this process knows of is only tried first.
+        std::optional<tier> find(const std::string& _name) const
+        {
+            tier first = tier::fast;
+
+            {
+                std::lock_guard lock{mutex_};
+
+                if (const auto iter = objects_.find(_name); iter != std::end(objects_)) {
+                    first = iter->second.location;
+                }
+            }
+
+            for (const auto t : {first, other(first)}) {
+                if (boost::filesystem::exists(root(t) / _name)) {
+                    return t;
+                }
+            }
+
+            return std::nullopt;
+        } // find
+
+        std::atomic<std::uint64_t>& access_counter(const std::string& _name) const noexcept
+        {
+            return accesses_[std::hash<std::string>{}(_name) % config_.access_counters];
+        } // access_counter
+
+        void count_access(const std::string& _name) noexcept
+        {
+            access_counter(_name).fetch_add(1, std::memory_order_relaxed);
+        } // count_access
+
+        double score(const object_info& _obj, clock::time_point _now) const
+        {
+            const auto elapsed = std::chrono::duration<double>(_now - _obj.last_access).count();
+            const auto half_life = std::chrono::duration<double>(config_.half_life).count();
+            return _obj.score * std::exp2(-elapsed / half_life);
+        } // score
+
+        // Adds the accesses counted (by any process) since the last call to the
+        // scores.
+        void fold_accesses(clock::time_point _now)
+        {
+            for (auto& [name, obj] : objects_) {
+                const auto count = access_counter(name).load(std::memory_order_relaxed);
+
+                if (count != obj.accesses_seen) {
+                    obj.score = score(obj, _now) + static_cast<double>(count - obj.accesses_seen);
+                    obj.last_access = _now;
+                    obj.accesses_seen = count;
+                }
+            }
+        } // fold_accesses
+
+        void refill_budget()
+        {
+            const auto now = clock::now();
+            const auto elapsed = std::chrono::duration<double>(now - last_refill_).count();
+            last_refill_ = now;
+
+            // Allow at most one second worth of burst.
+            const auto rate = static_cast<std::int64_t>(config_.migration_bytes_per_second);
+            budget_ = std::min<std::int64_t>(rate, budget_ + static_cast<std::int64_t>(elapsed * rate));
+        } // refill_budget
+
+        // Adds the objects found under the root of _tier to the catalogue. On
+        // the first scan, staging files left behind by an interrupted migration
+        // are removed.
+        void scan(tier _tier, bool _initial)
+        {
+            namespace fs = boost::filesystem;
+
+            const auto& base = root(_tier);
+            std::vector<fs::path> staging;
+            boost::system::error_code ec;
+
+            for (fs::recursive_directory_iterator iter{base, ec}, end; iter != end; iter.increment(ec)) {
+                if (ec || !fs::is_regular_file(iter->status())) {
+                    continue;
+                }
+
+                if (iter->path().extension() == staging_suffix) {
+                    staging.push_back(iter->path());
+                    continue;
+                }
+
+                const auto size = fs::file_size(iter->path(), ec);
+                if (ec) {
+                    continue;
+                }
+
+                const auto name = fs::relative(iter->path(), base).generic_string();
+                const auto [entry, inserted] = objects_.try_emplace(name);
+                auto& obj = entry->second;
+
+                if (inserted) {
+                    obj.accesses_seen = access_counter(name).load(std::memory_order_relaxed);
+                }
+
+                obj.location = _tier;
+                obj.size = size;
+                obj.seen = true;
+            }
+
+            if (_initial) {
+                for (const auto& path : staging) {
+                    syslog(LOG_ERR | LOG_USER, "Removing interrupted migration [%s]", path.c_str());
+                    fs::remove(path, ec);
+                }
+            }
+        } // scan
+
+        // Brings the catalogue in line with the files on disk.
+        void rescan(bool _initial)
+        {
+            for (auto& [name, obj] : objects_) {
+                obj.seen = false;
+            }
+
+            scan(tier::slow, _initial);
+            scan(tier::fast, _initial);
+
+            fast_usage_ = 0;
+
+            for (auto iter = std::begin(objects_); iter != std::end(objects_);) {
+                if (!iter->second.seen) {
+                    iter = objects_.erase(iter);
+                    continue;
+                }
+
+                if (iter->second.location == tier::fast) {
+                    fast_usage_ += iter->second.size;
+                }
+
+                ++iter;
+            }
+        } // rescan
+
+        // Copies the object to the other tier, syncs it, renames it into place
+        // and then removes the original. Returns the bytes copied. Called
+        // without holding mutex_.
+        std::uint64_t move(const std::string& _name, tier _to)
+        {
+            namespace fs = boost::filesystem;
+
+            const auto from = root(other(_to)) / _name;
+            const auto to = root(_to) / _name;
+            const auto staging = fs::path{to.string() + staging_suffix};
+
+            // The exclusive lock keeps every other process from opening the object
+            // until the original is gone. If it is open anywhere, it stays put.
+            const int fd = ::open(from.c_str(), O_RDONLY);
+            if (fd == -1) {
+                return 0;
+            }
+
+            struct stat st;
+            if (::flock(fd, LOCK_EX | LOCK_NB) == -1 || ::fstat(fd, &st) == -1 || st.st_nlink == 0) {
+                ::close(fd);
+                return 0;
+            }
+
+            boost::system::error_code ec;
+            fs::create_directories(to.parent_path(), ec);
+            fs::copy_file(from, staging, fs::copy_option::overwrite_if_exists, ec);
+
+            if (ec || sync_file(staging) == -1) {
+                syslog(LOG_ERR | LOG_USER, "Could not migrate object [%s]: %s", _name.c_str(), ec.message().c_str());
+                fs::remove(staging, ec);
+                ::close(fd);
+                return 0;
+            }
+
+            // Don't resurrect an object that was unlinked during the copy.
+            if (::fstat(fd, &st) == -1 || st.st_nlink == 0) {
+                fs::remove(staging, ec);
+                ::close(fd);
+                return 0;
+            }
+
+            fs::rename(staging, to, ec);
+            if (ec) {
+                syslog(LOG_ERR | LOG_USER, "Could not migrate object [%s]: %s", _name.c_str(), ec.message().c_str());
+                fs::remove(staging, ec);
+                ::close(fd);
+                return 0;
+            }
+
+            fs::remove(from, ec);
+            ::close(fd);
+
+            const auto size = static_cast<std::uint64_t>(st.st_size);
+
+            std::lock_guard lock{mutex_};
+
+            budget_ -= static_cast<std::int64_t>(size);
+
+            // The object may have been unlinked while it was copied.
+            const auto iter = objects_.find(_name);
+            if (iter == std::end(objects_)) {
+                return size;
+            }
+
+            auto& obj = iter->second;
+
+            if (obj.location == tier::fast) {
+                fast_usage_ -= std::min(fast_usage_, obj.size);
+            }
+
+            obj.location = _to;
+            obj.size = size;
+
+            if (_to == tier::fast) {
+                fast_usage_ += obj.size;
+            }
+
+            return size;
+        } // move
+
+        static int sync_file(const boost::filesystem::path& _path)
+        {
+            const auto fd = ::open(_path.c_str(), O_RDONLY);
+            if (fd == -1) {
+                return -1;
+            }
+
+            const auto ec = ::fsync(fd);
+            ::close(fd);
+
+            return ec;
+        } // sync_file
+
+        tier_config config_;
+        mutable profiled_mutex mutex_{"tiered_storage"};
+        std::unordered_map<std::string, object_info> objects_;
+        std::uint64_t fast_usage_ = 0;
+        std::int64_t budget_ = 0; // Negative after a copy larger than the budget.
+        clock::time_point last_refill_;
+        clock::time_point last_scan_;
+        std::size_t mapping_size_ = 0;
+        shared_counters* shared_ = nullptr;
+        std::atomic<std::uint64_t>* accesses_ = nullptr;
+    }; // class tiered_storage
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_TIERED_STORAGE_HPP
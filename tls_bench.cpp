@@ -0,0 +1,213 @@
+#include "tls_context.hpp"
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Compares the throughput of sending a file over loopback in plaintext, with
+// userspace TLS and with kernel TLS. The server side uses sendfile() in every
+// mode, which is the path kTLS is meant to preserve.
+
+namespace
+{
+    enum class mode
+    {
+        plaintext,
+        userspace_tls,
+        kernel_tls
+    };
+
+    SSL_CTX* make_server_context(bool _ktls)
+    {
+        // A throwaway self-signed certificate is good enough for loopback.
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* cert = X509_new();
+
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+
+        auto* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509_sign(cert, key, EVP_sha256());
+
+        SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+        SSL_CTX_use_certificate(ctx, cert);
+        SSL_CTX_use_PrivateKey(ctx, key);
+
+        if (_ktls) {
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        }
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        return ctx;
+    }
+
+    void run_client(int _port, bool _tls)
+    {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            _exit(1);
+        }
+
+        std::vector<char> buffer(256 * 1024);
+
+        if (!_tls) {
+            while (read(fd, buffer.data(), buffer.size()) > 0) {}
+            _exit(0);
+        }
+
+        SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+        SSL* ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+
+        if (SSL_connect(ssl) != 1) {
+            _exit(1);
+        }
+
+        std::size_t n = 0;
+        while (SSL_read_ex(ssl, buffer.data(), buffer.size(), &n) == 1) {}
+
+        _exit(0);
+    }
+
+    double cpu_seconds()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    int run(mode _mode, int _file_fd, std::size_t _bytes)
+    {
+        const int listener = socket(AF_INET, SOCK_STREAM, 0);
+        const int enable = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+            listen(listener, 1) == -1 ||
+            getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length) == -1)
+        {
+            fmt::print(stderr, "Could not set up listener.\n");
+            return 1;
+        }
+
+        const bool tls = _mode != mode::plaintext;
+
+        if (fork() == 0) {
+            close(listener);
+            run_client(ntohs(addr.sin_port), tls);
+        }
+
+        const int fd = accept(listener, nullptr, nullptr);
+        close(listener);
+
+        kdd::scpps::tls_context ctx{make_server_context(_mode == mode::kernel_tls)};
+        std::unique_ptr<kdd::scpps::tls_stream> stream;
+
+        if (tls) {
+            stream = std::make_unique<kdd::scpps::tls_stream>(ctx, fd);
+            if (stream->handshake() == -1) {
+                fmt::print(stderr, "TLS handshake failed.\n");
+                return 1;
+            }
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto cpu_start = cpu_seconds();
+
+        for (std::size_t sent = 0; sent < _bytes;) {
+            const auto n = stream
+                ? stream->sendfile(_file_fd, sent, _bytes - sent)
+                : sendfile(fd, _file_fd, nullptr, _bytes - sent);
+
+            if (n <= 0) {
+                fmt::print(stderr, "Send failed.\n");
+                return 1;
+            }
+
+            sent += n;
+        }
+
+        if (stream) {
+            stream->shutdown();
+        }
+
+        close(fd);
+        wait(nullptr);
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto cpu = cpu_seconds() - cpu_start;
+
+        const char* name = "plaintext";
+        if (_mode == mode::userspace_tls) {
+            name = "userspace TLS";
+        }
+        else if (_mode == mode::kernel_tls) {
+            name = stream->ktls_send() ? "kernel TLS" : "kernel TLS (unavailable, userspace fallback)";
+        }
+
+        fmt::print("{:<46} {:>10.1f} MB/s {:>8.3f} s server CPU\n", name, _bytes / seconds / 1e6, cpu);
+
+        return 0;
+    }
+} // anonymous namespace
+
+int main(int _argc, char** _argv)
+{
+    const std::size_t megabytes = _argc > 1 ? std::stoul(_argv[1]) : 1024;
+    const std::size_t bytes = megabytes * 1024 * 1024;
+
+    // The payload is a sparse temporary file, so it is served from the page
+    // cache and the disk does not influence the result.
+    char path[] = "/tmp/tls_bench.XXXXXX";
+    const int file_fd = mkstemp(path);
+    if (file_fd == -1 || ftruncate(file_fd, bytes) == -1) {
+        fmt::print(stderr, "Could not create payload file.\n");
+        return 1;
+    }
+    unlink(path);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (const auto m : {mode::plaintext, mode::userspace_tls, mode::kernel_tls}) {
+        if (run(m, file_fd, bytes) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
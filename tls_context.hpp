@@ -0,0 +1,303 @@
+#ifndef KDD_SCPPS_TLS_CONTEXT_HPP
+#define KDD_SCPPS_TLS_CONTEXT_HPP
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kdd::scpps
+{
+    struct tls_config
+    {
+        std::string certificate_file;
+        std::string private_key_file;
+
+        // Let the kernel encrypt and decrypt records once the handshake is done.
+        // This keeps sendfile()/splice() usable on TLS connections.
+        bool enable_ktls = true;
+
+        // Number of TLS 1.3 session tickets issued after a full handshake.
+        // Clients present a ticket on reconnect to skip the full handshake.
+        int session_tickets = 2;
+    }; // struct tls_config
+
+    inline std::string last_tls_error()
+    {
+        char buffer[256];
+        ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+        return buffer;
+    } // last_tls_error
+
+    // Server-side TLS 1.3 configuration.
+    //
+    // The context must be created in the parent before it forks. Session ticket
+    // keys are generated when the context is created, so every child inherits
+    // the same keys and can resume sessions started by any other child.
+    class tls_context
+    {
+    public:
+        explicit tls_context(const tls_config& _config)
+            : ctx_{SSL_CTX_new(TLS_server_method())}
+        {
+            if (!ctx_) {
+                throw std::runtime_error{"Could not create TLS context: " + last_tls_error()};
+            }
+
+            SSL_CTX_set_min_proto_version(ctx_, TLS1_3_VERSION);
+
+            if (_config.enable_ktls) {
+                SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+            }
+
+            SSL_CTX_set_num_tickets(ctx_, _config.session_tickets);
+            SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+
+            if (SSL_CTX_use_certificate_chain_file(ctx_, _config.certificate_file.c_str()) != 1 ||
+                SSL_CTX_use_PrivateKey_file(ctx_, _config.private_key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+                SSL_CTX_check_private_key(ctx_) != 1)
+            {
+                const auto msg = last_tls_error();
+                SSL_CTX_free(ctx_);
+                throw std::runtime_error{"Could not load TLS certificate: " + msg};
+            }
+        } // tls_context (constructor)
+
+        // Takes ownership of an already configured context.
+        explicit tls_context(SSL_CTX* _ctx) noexcept
+            : ctx_{_ctx}
+        {
+        } // tls_context (constructor)
+
+        tls_context(const tls_context&) = delete;
+        auto operator=(const tls_context&) -> tls_context& = delete;
+
+        ~tls_context()
+        {
+            SSL_CTX_free(ctx_);
+        } // destructor
+
+        SSL_CTX* native_handle() const noexcept
+        {
+            return ctx_;
+        } // native_handle
+
+    private:
+        SSL_CTX* ctx_;
+    }; // class tls_context
+
+    // Outcome of a TLS operation on a non-blocking socket. want_read and
+    // want_write ask the caller to retry once the socket is ready.
+    enum class tls_io
+    {
+        done,
+        want_read,
+        want_write,
+        closed,
+        failed
+    }; // enum class tls_io
+
+    // A TLS connection over a connected socket.
+    //
+    // handshake(), read() and write() need a blocking socket. On a
+    // non-blocking socket, use handshake_step(), read_some() and write_some(),
+    // which report when the socket has to become ready first. sendfile()
+    // works on both.
+    //
+    // After the handshake, check ktls_send() and ktls_recv(). If both are true,
+    // the kernel handles all record processing and the socket can be used for
+    // plain reads and writes (including sendfile) as if TLS were not there.
+    // Otherwise, data must go through this class.
+    class tls_stream
+    {
+    public:
+        tls_stream(const tls_context& _ctx, int _socket)
+            : ssl_{SSL_new(_ctx.native_handle())}
+        {
+            if (!ssl_ || SSL_set_fd(ssl_, _socket) != 1) {
+                SSL_free(ssl_);
+                throw std::runtime_error{"Could not create TLS stream: " + last_tls_error()};
+            }
+
+            // Writes may complete partially, and a write that has to be retried
+            // may come from a different buffer holding the same bytes.
+            SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        } // tls_stream (constructor)
+
+        tls_stream(const tls_stream&) = delete;
+        auto operator=(const tls_stream&) -> tls_stream& = delete;
+
+        ~tls_stream()
+        {
+            SSL_free(ssl_);
+        } // destructor
+
+        int handshake()
+        {
+            if (SSL_accept(ssl_) != 1) {
+                syslog(LOG_ERR | LOG_USER, "TLS handshake failed: %s", last_tls_error().c_str());
+                return -1;
+            }
+
+            syslog(LOG_INFO | LOG_USER, "TLS handshake complete [resumed:%d, ktls_send:%d, ktls_recv:%d]",
+                   session_reused(), ktls_send(), ktls_recv());
+
+            return 0;
+        } // handshake
+
+        // One step of the handshake on a non-blocking socket.
+        tls_io handshake_step()
+        {
+            const auto result = status(SSL_accept(ssl_));
+
+            if (result == tls_io::done) {
+                syslog(LOG_INFO | LOG_USER, "TLS handshake complete [resumed:%d, ktls_send:%d, ktls_recv:%d]",
+                       session_reused(), ktls_send(), ktls_recv());
+            }
+            else if (result == tls_io::failed) {
+                syslog(LOG_ERR | LOG_USER, "TLS handshake failed: %s", last_tls_error().c_str());
+            }
+
+            return result;
+        } // handshake_step
+
+        // Reads up to _count bytes on a non-blocking socket. _read receives the
+        // number of bytes read when the result is done.
+        tls_io read_some(void* _buffer, std::size_t _count, std::size_t& _read)
+        {
+            return status(SSL_read_ex(ssl_, _buffer, _count, &_read));
+        } // read_some
+
+        // Writes up to _count bytes on a non-blocking socket. _written receives
+        // the number of bytes written when the result is done. After want_read
+        // or want_write, the same bytes must be written again.
+        tls_io write_some(const void* _buffer, std::size_t _count, std::size_t& _written)
+        {
+            return status(SSL_write_ex(ssl_, _buffer, _count, &_written));
+        } // write_some
+
+        bool session_reused() const noexcept
+        {
+            return SSL_session_reused(ssl_) == 1;
+        } // session_reused
+
+        bool ktls_send() const noexcept
+        {
+            return BIO_get_ktls_send(SSL_get_wbio(ssl_)) == 1;
+        } // ktls_send
+
+        bool ktls_recv() const noexcept
+        {
+            return BIO_get_ktls_recv(SSL_get_rbio(ssl_)) == 1;
+        } // ktls_recv
+
+        ssize_t read(void* _buffer, std::size_t _count)
+        {
+            std::size_t n = 0;
+            return SSL_read_ex(ssl_, _buffer, _count, &n) == 1 ? static_cast<ssize_t>(n) : -1;
+        } // read
+
+        ssize_t write(const void* _buffer, std::size_t _count)
+        {
+            std::size_t n = 0;
+            return SSL_write_ex(ssl_, _buffer, _count, &n) == 1 ? static_cast<ssize_t>(n) : -1;
+        } // write
+
+        // Sends up to _count bytes of _file_fd starting at _offset. Returns the
+        // number of bytes sent, or -1 with errno set. With kTLS the data never
+        // enters user space. Otherwise it is read in chunks and encrypted by
+        // OpenSSL.
+        //
+        // On a non-blocking socket, the result is short once the socket is
+        // full, and -1 with errno EAGAIN if nothing could be sent. The caller
+        // waits until the socket is writable and calls again for the rest. That
+        // call then starts with the bytes that were refused, as OpenSSL
+        // requires.
+        ssize_t sendfile(int _file_fd, off_t _offset, std::size_t _count)
+        {
+            if (ktls_send()) {
+                return SSL_sendfile(ssl_, _file_fd, _offset, _count, 0);
+            }
+
+            std::vector<char> buffer(std::min<std::size_t>(_count, 256 * 1024));
+            std::size_t total = 0;
+
+            while (total < _count) {
+                const auto n = ::pread(_file_fd, buffer.data(), std::min(buffer.size(), _count - total), _offset + total);
+                if (n <= 0) {
+                    break;
+                }
+
+                std::size_t written = 0;
+
+                switch (write_some(buffer.data(), n, written)) {
+                    case tls_io::done:
+                        total += written;
+
+                        if (written < static_cast<std::size_t>(n)) {
+                            return static_cast<ssize_t>(total);
+                        }
+
+                        break;
+
+                    case tls_io::want_read:
+                    case tls_io::want_write:
+                        if (total == 0) {
+                            errno = EAGAIN;
+                            return -1;
+                        }
+
+                        return static_cast<ssize_t>(total);
+
+                    default:
+                        if (total == 0) {
+                            errno = EIO;
+                            return -1;
+                        }
+
+                        return static_cast<ssize_t>(total);
+                }
+            }
+
+            return static_cast<ssize_t>(total);
+        } // sendfile
+
+        void shutdown() noexcept
+        {
+            SSL_shutdown(ssl_);
+        } // shutdown
+
+        SSL* native_handle() const noexcept
+        {
+            return ssl_;
+        } // native_handle
+
+    private:
+        tls_io status(int _ret) const
+        {
+            if (_ret == 1) {
+                return tls_io::done;
+            }
+
+            switch (SSL_get_error(ssl_, _ret)) {
+                case SSL_ERROR_WANT_READ:   return tls_io::want_read;
+                case SSL_ERROR_WANT_WRITE:  return tls_io::want_write;
+                case SSL_ERROR_ZERO_RETURN: return tls_io::closed;
+                default:                    return tls_io::failed;
+            }
+        } // status
+
+        SSL* ssl_;
+    }; // class tls_stream
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_TLS_CONTEXT_HPP
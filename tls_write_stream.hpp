@@ -0,0 +1,96 @@
+#ifndef KDD_SCPPS_TLS_WRITE_STREAM_HPP
+#define KDD_SCPPS_TLS_WRITE_STREAM_HPP
+
+#include "tls_context.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <cstddef>
+
+namespace kdd::scpps
+{
+    // The write side of a session socket, for output_queue.
+    //
+    // Without TLS, or with kTLS send offload, writes go to the socket as they
+    // are. Once set_tls() was called for a connection that encrypts in user
+    // space, they go through the tls_stream instead, so the client never sees
+    // plaintext. The socket must be non-blocking then. A write that OpenSSL
+    // cannot complete waits for the socket and is retried with the same bytes,
+    // which output_queue guarantees by keeping its buffer until the write
+    // completes.
+    template <typename Socket>
+    class tls_write_stream
+    {
+    public:
+        explicit tls_write_stream(Socket& _socket)
+            : socket_{_socket}
+        {
+        } // tls_write_stream (constructor)
+
+        tls_write_stream(const tls_write_stream&) = delete;
+        auto operator=(const tls_write_stream&) -> tls_write_stream& = delete;
+
+        // Routes writes through _tls, unless it is null or the kernel encrypts.
+        void set_tls(tls_stream* _tls) noexcept
+        {
+            tls_ = _tls && !_tls->ktls_send() ? _tls : nullptr;
+        } // set_tls
+
+        template <typename ConstBuffer, typename Handler>
+        void async_write_some(const ConstBuffer& _buffer, Handler _handler)
+        {
+            if (!tls_) {
+                socket_.async_write_some(_buffer, std::move(_handler));
+                return;
+            }
+
+            std::size_t written = 0;
+
+            switch (const auto result = tls_->write_some(_buffer.data(), _buffer.size(), written); result) {
+                case tls_io::done:
+                    boost::asio::post(socket_.get_executor(), [_handler = std::move(_handler), written]() mutable {
+                        _handler(boost::system::error_code{}, written);
+                    });
+                    return;
+
+                case tls_io::want_read:
+                case tls_io::want_write:
+                    socket_.async_wait(result == tls_io::want_read ? Socket::wait_read : Socket::wait_write,
+                        [this, _buffer, _handler = std::move(_handler)](auto _ec) mutable {
+                            if (_ec) {
+                                _handler(_ec, 0);
+                                return;
+                            }
+
+                            async_write_some(_buffer, std::move(_handler));
+                        });
+                    return;
+
+                case tls_io::closed:
+                    complete(std::move(_handler), boost::asio::error::eof);
+                    return;
+
+                default:
+                    complete(std::move(_handler), boost::asio::error::connection_reset);
+                    return;
+            }
+        } // async_write_some
+
+    private:
+        template <typename Handler>
+        void complete(Handler _handler, boost::system::error_code _ec)
+        {
+            boost::asio::post(socket_.get_executor(), [_handler = std::move(_handler), _ec]() mutable {
+                _handler(_ec, 0);
+            });
+        } // complete
+
+        Socket& socket_;
+        tls_stream* tls_ = nullptr;
+    }; // class tls_write_stream
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_TLS_WRITE_STREAM_HPP
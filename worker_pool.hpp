@@ -0,0 +1,528 @@
+#ifndef KDD_SCPPS_WORKER_POOL_HPP
+#define KDD_SCPPS_WORKER_POOL_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <fmt/format.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <string>
+
+namespace kdd::scpps
+{
+    struct worker_pool_config
+    {
+        unsigned min_workers = 2;   // Kept warm even when there is no load.
+        unsigned max_workers = 64;
+        std::size_t max_queue = 128; // Connections waiting for a worker. More are turned away.
+
+        // Hysteresis: grow while more than spawn_utilization of the workers are
+        // busy, shrink only while less than retire_utilization are busy.
+        double spawn_utilization = 0.75;
+        double retire_utilization = 0.25;
+
+        // Workers idle for this long are retired when utilization is low.
+        std::chrono::seconds idle_timeout{60};
+
+        std::chrono::milliseconds tick{500};
+    }; // struct worker_pool_config
+
+    // A pool of pre-forked worker processes that grows and shrinks with load.
+    //
+    // The parent keeps accepting connections (so limits and load shedding stay
+    // in one place) and passes each connection to an idle worker over a Unix
+    // socket (SCM_RIGHTS). The worker serves it, closes it and reports back with
+    // a single byte, after which it is idle again. Connections that arrive while
+    // all workers are busy wait in a queue.
+    //
+    // Every tick the pool looks at the queue and at utilization:
+    // - It never drops below min_workers.
+    // - While connections are queued or utilization is above spawn_utilization,
+    //   it spawns workers, doubling the batch on every consecutive tick (1, 2,
+    //   4, ...) so that a sharp rise is met quickly.
+    // - While utilization is below retire_utilization, it retires one worker per
+    //   tick that has been idle for idle_timeout.
+    //
+    // Retiring is graceful. The parent closes its end of the worker's channel,
+    // and the worker exits once it notices, which is never in the middle of a
+    // connection. A busy worker is only sent away after it has reported the
+    // connection done.
+    class worker_pool
+    {
+    public:
+        using address = boost::asio::ip::address;
+
+        // Runs in a freshly forked worker before it starts waiting for
+        // connections. Used to release parent-only resources (the acceptor, signal
+        // handlers, ...).
+        using child_setup = std::function<void()>;
+
+        // Serves one connection in a worker. The function must not close _socket.
+        using connection_handler = std::function<void(int _socket)>;
+
+        // Runs in the parent once a connection has been served (or its worker
+        // died).
+        using completion_handler = std::function<void(const address&)>;
+
+        worker_pool(boost::asio::io_service& _io_service,
+                    worker_pool_config _config,
+                    child_setup _child_setup,
+                    connection_handler _serve,
+                    completion_handler _on_complete)
+            : io_service_{_io_service}
+            , config_{_config}
+            , child_setup_{std::move(_child_setup)}
+            , serve_{std::move(_serve)}
+            , on_complete_{std::move(_on_complete)}
+            , timer_{_io_service}
+        {
+        } // worker_pool (constructor)
+
+        worker_pool(const worker_pool&) = delete;
+        auto operator=(const worker_pool&) -> worker_pool& = delete;
+
+        // Spawns the minimum number of workers and starts the scaling loop.
+        void start()
+        {
+            spawn(min_workers());
+            schedule_tick();
+        } // start
+
+        // Stops scaling, drops queued connections and retires all workers. Workers
+        // finish the connection they are serving before they exit, and the
+        // completion handler runs for it once they have.
+        void stop()
+        {
+            timer_.cancel();
+
+            for (const auto& p : queue_) {
+                ::close(p.socket);
+                on_complete_(p.source);
+            }
+
+            queue_.clear();
+
+            for (auto& w : workers_) {
+                if (!w.retiring) {
+                    retire(w);
+                }
+            }
+        } // stop
+
+        // Hands _socket to a worker, or queues it if all workers are busy. Returns
+        // false if the queue is full. The pool owns _socket once this returns true.
+        bool dispatch(int _socket, const address& _source)
+        {
+            if (queue_.size() >= config_.max_queue) {
+                ++rejected_;
+                return false;
+            }
+
+            queue_.push_back({_socket, _source});
+            peak_queue_ = std::max(peak_queue_, queue_.size());
+
+            // Don't wait for the next tick if nobody is free to take it.
+            if (idle_workers() == 0 && workers_.size() < config_.max_workers) {
+                spawn(1);
+            }
+
+            drain_queue();
+
+            return true;
+        } // dispatch
+
+        // Called by the parent's SIGCHLD handler for every reaped process.
+        void on_exit(pid_t _pid)
+        {
+            for (auto iter = std::begin(workers_); iter != std::end(workers_); ++iter) {
+                if (iter->pid == _pid) {
+                    remove(iter, "exited");
+                    return;
+                }
+            }
+        } // on_exit
+
+        // Changes the maximum number of workers, e.g. after the container was
+        // resized. Surplus workers are retired, idle ones first. Busy ones finish
+        // their connection before they leave.
+        void set_max_workers(unsigned _max_workers)
+        {
+            config_.max_workers = std::max(_max_workers, 1u);
+
+            auto active = static_cast<std::size_t>(std::count_if(std::begin(workers_), std::end(workers_), [](const worker& w) {
+                return !w.retiring;
+            }));
+
+            for (const bool busy : {false, true}) {
+                for (auto& w : workers_) {
+                    if (active > config_.max_workers && !w.retiring && w.busy == busy) {
+                        retire(w);
+                        --active;
+                    }
+                }
+            }
+        } // set_max_workers
+
+        std::size_t size() const noexcept
+        {
+            return workers_.size();
+        } // size
+
+        std::string report() const
+        {
+            return fmt::format("workers={} busy={} queued={} peak_queue={} spawned={} retired={} died={} served={} rejected={}",
+                               workers_.size(), workers_.size() - idle_workers(), queue_.size(), peak_queue_,
+                               spawned_, retired_, died_, served_, rejected_);
+        } // report
+
+    private:
+        using clock = std::chrono::steady_clock;
+        using channel_type = boost::asio::local::stream_protocol::socket;
+
+        struct pending
+        {
+            int socket;
+            address source;
+        }; // struct pending
+
+        struct worker
+        {
+            explicit worker(boost::asio::io_service& _io_service)
+                : channel{_io_service}
+            {
+            }
+
+            pid_t pid = -1;
+            channel_type channel;
+            bool busy = false;
+            bool retiring = false;
+            address source;
+            clock::time_point idle_since = clock::now();
+            char reply = 0;
+        }; // struct worker
+
+        using worker_list = std::list<worker>;
+
+        std::size_t idle_workers() const
+        {
+            return std::count_if(std::begin(workers_), std::end(workers_), [](const worker& w) {
+                return !w.busy && !w.retiring;
+            });
+        } // idle_workers
+
+        // The maximum wins when it was lowered below the minimum.
+        std::size_t min_workers() const noexcept
+        {
+            return std::min(config_.min_workers, config_.max_workers);
+        } // min_workers
+
+        void schedule_tick()
+        {
+            timer_.expires_after(config_.tick);
+            timer_.async_wait([this](auto _ec) {
+                if (!_ec) {
+                    tick();
+                    schedule_tick();
+                }
+            });
+        } // schedule_tick
+
+        void tick()
+        {
+            const auto total = workers_.size();
+            const auto busy = total - idle_workers();
+            const double utilization = total > 0 ? static_cast<double>(busy) / total : 1.0;
+
+            if (total < min_workers()) {
+                spawn(min_workers() - total);
+            }
+
+            if (!queue_.empty() || utilization > config_.spawn_utilization) {
+                spawn(std::max(spawn_batch_, queue_.size()));
+                spawn_batch_ = std::min<std::size_t>(spawn_batch_ * 2, 32);
+                return;
+            }
+
+            spawn_batch_ = 1;
+
+            if (utilization >= config_.retire_utilization || total <= min_workers()) {
+                return;
+            }
+
+            // Retire the worker that has been idle the longest, if long enough.
+            auto oldest = std::end(workers_);
+
+            for (auto iter = std::begin(workers_); iter != std::end(workers_); ++iter) {
+                if (!iter->busy && !iter->retiring && (oldest == std::end(workers_) || iter->idle_since < oldest->idle_since)) {
+                    oldest = iter;
+                }
+            }
+
+            if (oldest != std::end(workers_) && clock::now() - oldest->idle_since >= config_.idle_timeout) {
+                retire(*oldest);
+            }
+        } // tick
+
+        void spawn(std::size_t _count)
+        {
+            for (std::size_t i = 0; i < _count && workers_.size() < config_.max_workers; ++i) {
+                int fds[2];
+                if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not create worker channel: %m");
+                    return;
+                }
+
+                io_service_.notify_fork(boost::asio::io_service::fork_prepare);
+
+                const auto pid = fork();
+
+                if (pid == 0) {
+                    io_service_.notify_fork(boost::asio::io_service::fork_child);
+
+                    // The parent's ends of the other workers' channels must not stay
+                    // open here, or those workers would never see their channel close
+                    // when they are retired. Queued connections belong to the parent.
+                    ::close(fds[0]);
+                    for (auto& w : workers_) {
+                        ::close(w.channel.native_handle());
+                    }
+
+                    for (const auto& p : queue_) {
+                        ::close(p.socket);
+                    }
+
+                    child_setup_();
+                    run_worker(fds[1]);
+
+                    exit(0);
+                }
+
+                io_service_.notify_fork(boost::asio::io_service::fork_parent);
+                ::close(fds[1]);
+
+                if (pid == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not fork worker: %m");
+                    ::close(fds[0]);
+                    return;
+                }
+
+                auto& w = workers_.emplace_back(io_service_);
+                w.pid = pid;
+                w.channel.assign(boost::asio::local::stream_protocol{}, fds[0]);
+                ++spawned_;
+
+                syslog(LOG_INFO | LOG_USER, "Spawned worker [pid:%d, workers:%zu]", pid, workers_.size());
+
+                wait_for_reply(w);
+            }
+
+            // New workers take queued connections right away.
+            drain_queue();
+        } // spawn
+
+        void retire(worker& _worker)
+        {
+            _worker.retiring = true;
+            ++retired_;
+
+            syslog(LOG_INFO | LOG_USER, "Retiring %s worker [pid:%d, workers:%zu]",
+                   _worker.busy ? "busy" : "idle", _worker.pid, workers_.size() - 1);
+
+            // A busy worker still has to report its connection done. It is sent
+            // away once it has (see wait_for_reply()).
+            if (!_worker.busy) {
+                dismiss(_worker);
+            }
+        } // retire
+
+        // The worker is blocked waiting for its next connection and exits when
+        // the channel closes. The pending read completes with an error, which
+        // removes the worker from the list.
+        static void dismiss(worker& _worker)
+        {
+            boost::system::error_code ec;
+            _worker.channel.shutdown(channel_type::shutdown_both, ec);
+        } // dismiss
+
+        void remove(worker_list::iterator _worker, const char* _reason)
+        {
+            if (_worker->busy) {
+                on_complete_(_worker->source);
+            }
+
+            if (!_worker->retiring) {
+                ++died_;
+                syslog(LOG_ERR | LOG_USER, "Worker %s unexpectedly [pid:%d]", _reason, _worker->pid);
+            }
+
+            boost::system::error_code ec;
+            _worker->channel.close(ec);
+            workers_.erase(_worker);
+        } // remove
+
+        void wait_for_reply(worker& _worker)
+        {
+            boost::asio::async_read(_worker.channel, boost::asio::buffer(&_worker.reply, 1),
+                [this, pid = _worker.pid](auto _ec, auto) {
+                    // The worker may have been reaped (and removed) while this
+                    // completion was queued.
+                    const auto iter = std::find_if(std::begin(workers_), std::end(workers_), [pid](const worker& w) {
+                        return w.pid == pid;
+                    });
+
+                    if (_ec == boost::asio::error::operation_aborted || iter == std::end(workers_)) {
+                        return;
+                    }
+
+                    if (_ec) {
+                        remove(iter, "closed its channel");
+                        return;
+                    }
+
+                    iter->busy = false;
+                    iter->idle_since = clock::now();
+                    ++served_;
+                    on_complete_(iter->source);
+
+                    if (iter->retiring) {
+                        dismiss(*iter);
+                    }
+                    else {
+                        drain_queue();
+                    }
+
+                    wait_for_reply(*iter);
+                });
+        } // wait_for_reply
+
+        void drain_queue()
+        {
+            for (auto& w : workers_) {
+                if (queue_.empty()) {
+                    return;
+                }
+
+                if (w.busy || w.retiring) {
+                    continue;
+                }
+
+                // A worker that cannot take the connection is broken. It is sent
+                // away and the connection goes to the next one, or waits in the
+                // queue for a new worker.
+                if (send_socket(w.channel.native_handle(), queue_.front().socket) == -1) {
+                    syslog(LOG_ERR | LOG_USER, "Could not pass connection to worker [pid:%d]: %m", w.pid);
+                    w.retiring = true;
+                    ++died_;
+                    dismiss(w);
+                    continue;
+                }
+
+                w.busy = true;
+                w.source = queue_.front().source;
+
+                ::close(queue_.front().socket);
+                queue_.pop_front();
+            }
+        } // drain_queue
+
+        static int send_socket(int _channel, int _socket)
+        {
+            char byte = 'C';
+            iovec iov{&byte, 1};
+            char control[CMSG_SPACE(sizeof(int))]{};
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            auto* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &_socket, sizeof(int));
+
+            return ::sendmsg(_channel, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+        } // send_socket
+
+        // The worker's main loop. Blocks until the parent sends a connection,
+        // serves it and reports back. Returns when the channel is closed.
+        void run_worker(int _channel)
+        {
+            syslog(LOG_INFO | LOG_USER, "Worker started [pid:%d]", getpid());
+
+            for (;;) {
+                char byte;
+                iovec iov{&byte, 1};
+                char control[CMSG_SPACE(sizeof(int))]{};
+
+                msghdr msg{};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                const auto n = ::recvmsg(_channel, &msg, 0);
+
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                const auto* cmsg = CMSG_FIRSTHDR(&msg);
+                if (n <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+                    break;
+                }
+
+                int socket;
+                std::memcpy(&socket, CMSG_DATA(cmsg), sizeof(int));
+
+                serve_(socket);
+                ::close(socket);
+
+                // The parent may be gone. That must not kill the worker with
+                // SIGPIPE before it logs its exit.
+                const char done = 'D';
+                if (::send(_channel, &done, 1, MSG_NOSIGNAL) != 1) {
+                    break;
+                }
+            }
+
+            syslog(LOG_INFO | LOG_USER, "Worker exiting [pid:%d]", getpid());
+            ::close(_channel);
+        } // run_worker
+
+        boost::asio::io_service& io_service_;
+        worker_pool_config config_;
+        child_setup child_setup_;
+        connection_handler serve_;
+        completion_handler on_complete_;
+        boost::asio::steady_timer timer_;
+        worker_list workers_;
+        std::deque<pending> queue_;
+        std::size_t spawn_batch_ = 1;
+        std::size_t peak_queue_ = 0;
+        std::uint64_t spawned_ = 0;
+        std::uint64_t retired_ = 0;
+        std::uint64_t died_ = 0;
+        std::uint64_t served_ = 0;
+        std::uint64_t rejected_ = 0;
+    }; // class worker_pool
+} // namespace kdd::scpps
+
+#endif // KDD_SCPPS_WORKER_POOL_HPP